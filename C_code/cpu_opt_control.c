@@ -2,6 +2,10 @@
  * Main C code for the CPU side of the Red Pitaya STEMLAB
  * *********************************************************************
  * COMMENTS:
+ * Keyboard interface of the feedback control. Everything it does goes
+ * through the library API (rp_feedback.h), whose core is rp_feedback.c.
+ * Compile with
+ *     gcc cpu_opt_control.c rp_feedback.c -o cpu_opt_control.o -lm -lpthread
  * *********************************************************************
  * VERSION:
  * 0.4
@@ -14,12 +18,13 @@
 #include <stdlib.h>      // general functions and variable types
 #include <stdio.h>       // standard input/output
 #include <stdint.h>      // more integer lengths
-#include <unistd.h>      // symbolic constants/types
-#include <sys/mman.h>    // memory management 
-#include <fcntl.h>       // file control (open...)
 #include <string.h>      // strings package
 #include <math.h>        // math functions
-#include <unistd.h>      // for the sleep function
+#include <time.h>        // clock_gettime, clock_nanosleep
+#include <errno.h>       // error codes
+#include "rp_regs.h"     // FPGA register layout (simulated register file)
+#include "rp_tuning.h"   // ML secant step
+#include "rp_feedback.h" // library API
 
 ////////////////////////////////////////////////////////////////////////
 // Color code
@@ -31,92 +36,121 @@
 #define ANSI_COLOR_CYAN    "\x1b[96m"
 #define ANSI_COLOR_RESET   "\x1b[0m"
 
+////////////////////////////////////////////////////////////////////////
+// Real-time mode settings
+#define RT_DEFAULT_PRIORITY   80        // SCHED_FIFO priority of the sampler
+#define RT_DEFAULT_CPU        1         // core for the control and sampler threads
+
+////////////////////////////////////////////////////////////////////////
+// Profile cache settings
+#define PROFILE_FILE          "rp_profiles.bin" // default profile store
+
+////////////////////////////////////////////////////////////////////////
+// Daemon settings
+#define DAEMON_SOCKET         "/tmp/rp_feedback.sock"  // default control socket
+
+////////////////////////////////////////////////////////////////////////
+// Metrics settings
+#define METRICS_DEFAULT_PERIOD 1.0      // metrics file rewrite period (s)
+
+////////////////////////////////////////////////////////////////////////
+// Keyboard interface settings
+#define FINAL_ENERGY_MS       1         // window of the final energy of 'ml' (ms)
+
 ////////////////////////////////////////////////////////////////////////
 // Functions
 
+// Current CLOCK_MONOTONIC time in ns
+//
+uint64_t repl_now_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec*1000000000ULL + (uint64_t) ts.tv_nsec;
+}
 
-// Matrix transpose function
+// Sleep until an absolute CLOCK_MONOTONIC time (ns)
 //
-int matrix_transpose(double matrix[2][2], double m_transpose[2][2]){
-    // swap matrix[0][1] and matrix[1][0]
-    // set values on inverse matrix
-    m_transpose[0][0] = matrix[0][0];
-    m_transpose[0][1] = matrix[1][0];
-    m_transpose[1][0] = matrix[0][1];
-    m_transpose[1][1] = matrix[1][1];
-    
+int repl_sleep_until(uint64_t t_ns){
+    struct timespec deadline;
+    deadline.tv_sec = t_ns/1000000000ULL;
+    deadline.tv_nsec = t_ns%1000000000ULL;
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR);
     // end function normally
     return 0;
 }
 
-
-// Matrix inverse function
+// Keep a typed value within the range of the gain fields (rpf_set
+// saturates it to the register range)
 //
-int matrix_inverse(double matrix[2][2], double m_inverse[2][2]){
-    
-    // calculate determinant
-    double det = matrix[0][0]*matrix[1][1] - matrix[0][1]*matrix[1][0];
-    
-    // set values on inverse matrix
-    m_inverse[0][0] = matrix[1][1]/det;
-    m_inverse[0][1] = -matrix[0][1]/det;
-    m_inverse[1][0] = -matrix[1][0]/det;
-    m_inverse[1][1] = matrix[0][0]/det;
-    
-    // end function normally
-    return 0;
+int32_t repl_clamp(long int value){
+    if(value > INT32_MAX){
+        return INT32_MAX;
+    } else if(value < INT32_MIN){
+        return INT32_MIN;
+    }
+    return (int32_t) value;
 }
 
-// Matrix product function
+// Write gains of channel 0 from the keyboard interface
 //
-// Multiply mat1 by mat2 and put result in m_prod
+// On failure prints the reason and reads the gains back, so gains
+// holds what the registers have rather than what was typed.
 //
- int matrix_product(int m, int n, double mat1[m][n], int p, int q, double mat2[p][q], double m_prod[m][q]) {
-    int i, j, k;
-    if(n != p){
-        printf("Matrix dimension mismatch\n");
-        // error exit
-        return 1;        
-    } else {
-        for(i = 0; i < q; i++){
-            for(j = 0; j < m; j++){
-                m_prod[j][i] = 0;
-                for(k = 0; k < n; k++){
-                    m_prod[j][i] = m_prod[j][i] + (mat1[j][k]*mat2[k][i]);
-                }
-            }
+int repl_set(rpf_device *dev, struct rpf_gains *gains, unsigned int mask){
+    int err = rpf_set(dev, 0, gains, mask);
+
+    if(err != RPF_OK){
+        printf(ANSI_COLOR_RED "Write failed: %s\n" ANSI_COLOR_RESET, rpf_strerror(err));
+        rpf_get(dev, 0, gains);
+    }
+    return err;
+}
+
+// 1 if a REPL command writes the registers (refused while extremum
+// seeking or gain scheduling runs)
+//
+int repl_writes_registers(const char *cmd){
+    const char *cmds[] = {"delay", "f", "ml", "mlauto", "spsa", "bo", "calibrate-delay", "sweep", "solve", "arm", "watchdog",
+                          "profile"};
+
+    for(size_t i = 0; i < sizeof(cmds)/sizeof(cmds[0]); i++){
+        if(0 == strcmp(cmd, cmds[i])){
+            return 1;
         }
-        // end function normally
-        return 0;
     }
+    return 0;
 }
 
-// Matrix addition function
+// Run a tuner on channel 0 to completion
 //
-// Add mat1 and mat2 and put result in m_add
+// Its progress goes to the log (print_message). Returns RPF_OK once it
+// has written its result, else the reason it stopped.
 //
-int matrix_addition(double mat1[2][2], double mat2[2][2], double m_add[2][2]){
-    // add matrices and put result in m_add
-    m_add[0][0] = mat1[0][0] + mat2[0][0];
-    m_add[0][1] = mat1[0][1] + mat2[0][1];
-    m_add[1][0] = mat1[1][0] + mat2[1][0];
-    m_add[1][1] = mat1[1][1] + mat2[1][1];
-    
+int repl_tune(rpf_device *dev, int tuner){
+    uint64_t next_ns;
+    int err = rpf_tune_start(dev, 0, tuner);
+
+    if(err != RPF_OK){
+        printf(ANSI_COLOR_RED "Could not start the tuner: %s\n" ANSI_COLOR_RESET, rpf_strerror(err));
+        return err;
+    }
+    while((err = rpf_tune_step(dev, 0, &next_ns)) == 0){
+        repl_sleep_until(next_ns);
+    }
+    if(err < 0){
+        printf(ANSI_COLOR_RED "Tuner stopped: %s\n" ANSI_COLOR_RESET, rpf_strerror(err));
+        return err;
+    }
     // end function normally
-    return 0;
+    return RPF_OK;
 }
 
-// Matrix multiply scalar
+// Messages of the channels and tuners (library log callback): printed
+// as they come
 //
-int m_mult_scalar(double matrix[2][2], double scalar){
-    // Matrix multiply by scalar
-    matrix[0][0] = matrix[0][0]*scalar;
-    matrix[0][1] = matrix[0][1]*scalar;
-    matrix[1][0] = matrix[1][0]*scalar;
-    matrix[1][1] = matrix[1][1]*scalar;
-    
-    // end function normally
-    return 0;
+void print_message(void *ctx, const char *line){
+    (void) ctx;
+    fputs(line, stdout);
 }
 
 // Print matrix function
@@ -132,180 +166,523 @@ int print_matrix(int rows, int columns, double matrix[rows][columns]){
     return 0;
 }
 
-// Saturate gain
+// Print dwell measurement summary
 //
-int sat_gain(long int k, short int *k_short){
-    long int max_gain = 8191;
-    if(k > max_gain){
-        *k_short = max_gain;
-    } else if(k < -max_gain){
-        *k_short = -max_gain;
+int print_measurement(struct rpf_measurement *res){
+    if(res->predicted){
+        printf("Samples: %ld, dwell: %.2f s (steady state predicted, tau %.0f ms)\n", res->samples, res->dwell_s, res->tau_s*1e3);
     } else {
-        *k_short = (short int) k;
+        printf("Samples: %ld, dwell: %.2f s%s\n", res->samples, res->dwell_s, res->resolved ? "" : " (max dwell)");
     }
-    // end normally
+    // end function normally
     return 0;
 }
 
-// Saturate delay
+// Print one profile, and its distance to the current conditions
 //
-int sat_delay(long int delay, short int *delay_short){
-    long int max_delay = 500;
-    if(delay > max_delay){
-        *delay_short = max_delay;
-    } else if(delay < 0){
-        *delay_short = 0;
-    } else {
-        *delay_short = (short int) delay;
-    }
-    // end normally
+int print_profile(struct rpf_profile *p, double dist){
+    char when[32];
+    time_t t = (time_t) p->t_saved;
+
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M", localtime(&t));
+    printf("%s%sk_p = %d, k_d = %d, delay = %d, energy %.1f (f0 %.6g Hz, %.3g mbar, %.3g mW; %s, distance %.2f)\n",
+           p->channel, p->channel[0] ? ": " : "", p->gains.k_p, p->gains.k_d, p->gains.delay, p->energy,
+           p->conditions[0], p->conditions[1], p->conditions[2], when, dist);
+    // end function normally
     return 0;
 }
 
+// Print a jitter histogram (rpf_sampler_jitter)
+//
+int print_jitter(uint64_t count[RPF_JITTER_BINS], uint64_t max_ns){
+    uint64_t total = 0;
 
-// floating point to fxp
-/*
-int float_to_fxp(double input, short int *output){
-    double tmp = input*65534;
-    output = (short int) round(tmp);
-    // end normally
+    for(int b = 0; b < RPF_JITTER_BINS; b++){
+        total += count[b];
+    }
+    printf("------------------------\n");
+    printf("Wake-up latency after deadline (%llu samples):\n", (unsigned long long) total);
+    for(int b = 0; b < RPF_JITTER_BINS; b++){
+        if(count[b] > 0){
+            printf("  %9.3f - %9.3f us: %10llu (%5.1f%%)\n", (b > 0) ? (1ULL << (b - 1))/1e3 : 0.0, (1ULL << b)/1e3,
+                   (unsigned long long) count[b], 100.0*count[b]/total);
+        }
+    }
+    printf("Max latency: %.3f us\n", max_ns/1e3);
+    printf("------------------------\n");
+    // end function normally
     return 0;
-}*/
+}
 
 ////////////////////////////////////////////////////////////////////////
 // Main loop
 //
 int main(int argc, char **argv){
-    
+
     ////////////////////////////////////////////////////////////////////
     // Program variables
     char input_data[256]; // keyboard input
-    void *cfg_delay; // pointer to delay register in virtual memory
-    void *cfg_pid; // pointer to pid register in virtual memory
-    void *data_energy; // pointer to particle energy in virtual memory
-    int fd; // file identifier
-    
+    rpf_device *dev; // registers, samplers and watchdogs of every channel (library)
+    struct rpf_options dev_opt = {sizeof(struct rpf_options), NULL, NULL, 0, NULL, 0, 0, 0, NULL, 0, NULL, NULL, NULL, {0, 0, 0}}; // device options
+    struct rpf_gains gains; // gains and delay of channel 0 (register values)
+    struct rpf_gains gains_start; // gains before a tuner ran
+    struct rpf_status status = {.size = sizeof(struct rpf_status)}; // state of channel 0
+    struct rpf_settings settings = {.size = sizeof(struct rpf_settings)}; // tuner settings
+    struct rpf_settings settings_new; // new tuner settings
+    int err; // library error code
+    const char *map_file = NULL; // register map file (NULL: one channel, default addresses)
+    const char *sim_file = NULL; // simulated register file (NULL: /dev/mem)
+    int verify = 0; // read back registers after writes
+    int rt_enabled = 0; // real-time mode
+    int rt_priority = RT_DEFAULT_PRIORITY; // SCHED_FIFO priority of the samplers
+    int rt_cpu = RT_DEFAULT_CPU; // core to pin the threads to
+    const char *socket_path = NULL; // control socket (NULL: interactive)
+    const char *record_path = NULL; // telemetry file (NULL: no recording)
+    long int record_size = 0; // telemetry ring capacity (records, 0: library default)
+    struct rpf_watchdog wd_cfg; // watchdog limits
+    uint32_t wd_threshold = 0; // watchdog energy threshold (0: no watchdog)
+    double wd_slope = 0; // watchdog slope limit (1/s, 0: off)
+    const char *metrics_path = NULL; // Prometheus metrics file (NULL: none)
+    double metrics_period = METRICS_DEFAULT_PERIOD; // metrics file rewrite period (s)
+    char *metrics_text; // Prometheus metrics text
+    long int metrics_len; // its length
+
     ////////////////////////////////////////////////////////////////////
     // Feedback variables
-    uint32_t reg_delay; //delay register value
-    uint32_t reg_pid; //pid register value
-    uint32_t reg_energy; //register energy value
-    uint32_t reg_tmp1; //temporary parameter
-    uint32_t reg_tmp2; //temporary parameter
-    
     long int delay_long; // delay cycles
-    short int delay = 0; // delay cycles
-    long int k_p_long; // k_p in PID 
-    long int k_d_long; // k_d in PID    
-    short int k_p; // k_p in PID 
-    short int k_d; // k_d in PID
-    int energy_int; // current particle energy from out of loop detector.
-    float energy; // current particle energy from out of loop detector.
-    
+    long int k_p_long; // k_p in PID
+    long int k_d_long; // k_d in PID
+
+    ////////////////////////////////////////////////////////////////////
+    // Sampler variables
+    double filter_s[RPF_FILTER_STAGES]; // filter output periods (s)
+    int n_filter = 3; // filter outputs asked for
+    struct rpf_filtered filter_out; // latest filter output
+    long int rate_long; // sampler rate (Hz)
+    uint64_t jitter[RPF_JITTER_BINS]; // wake-up latency histogram
+    uint64_t jitter_max; // largest wake-up latency (ns)
+    long int window_ms; // statistics window (ms)
+    long int n_samples; // samples in statistics window
+    double energy_mean; // mean energy in window
+    double energy_var; // energy variance in window
+
+    ////////////////////////////////////////////////////////////////////
+    // Dwell engine variables
+    struct rpf_measurement dwell_prev; // measurement at previous k_d
+    struct rpf_measurement dwell_cur; // measurement at current k_d
+    double dwell_total; // total dwell time of a tuning run (s)
+    int n_steps; // tuning iterations
+
+    ////////////////////////////////////////////////////////////////////
+    // Tuner variables
+    struct rpf_trap_model lqr_model = {125e3, 10, 125e6, 0, 1e6, 1, 1, 1}; // trap model and weights
+    struct rpf_solution lqr_res; // LQR solution
+    uint64_t t_solve; // LQR solve time (ns)
+    char sched_path[256]; // gain-schedule table file
+    const char *profile_path = NULL; // profile store file (NULL: off)
+    double cond[RPF_CONDITIONS] = {0, 0, 0}; // trap conditions (0: unknown)
+    struct rpf_profile prof; // profile looked up
+    double prof_dist; // distance to the current conditions
+    struct rpf_replay_options replay = {sizeof(struct rpf_replay_options), NULL, 0, NULL, 0, 1, NULL, NULL}; // offline replay
+
+    ////////////////////////////////////////////////////////////////////
+    // Parse arguments
+    // --sim [file] uses the simulated registers instead of the FPGA
+    // --verify reads registers back after every write
+    // --rt [priority] locks memory and runs the control and sampler
+    // threads with SCHED_FIFO on one core (--cpu n, default 1)
+    // --daemon [socket] serves commands on a Unix-domain socket
+    // --record file [records] records every energy sample to a ring file
+    // --watchdog threshold [slope] kills the feedback on runaway energy
+    // --metrics file [period] rewrites a Prometheus metrics file every
+    // period seconds
+    // --map file runs one feedback channel per line of the register map
+    // --profiles [file] keeps tuned gains across sessions, looked up by
+    // --conditions f0 pressure power (0: unknown)
+    // --replay file [runs] compares the tuners offline on a recorded
+    // trace (--tuners list, --seed n, --channel n)
+    for(int i = 1; i < argc; i++){
+        if(0 == strcmp(argv[i], "--verify")){
+            verify = 1;
+        } else if(0 == strcmp(argv[i], "--rt")){
+            rt_enabled = 1;
+            if(i + 1 < argc && argv[i + 1][0] != '-'){
+                rt_priority = atoi(argv[++i]);
+            }
+        } else if(0 == strcmp(argv[i], "--cpu") && i + 1 < argc){
+            rt_cpu = atoi(argv[++i]);
+        } else if(0 == strcmp(argv[i], "--record") && i + 1 < argc){
+            record_path = argv[++i];
+            if(i + 1 < argc && argv[i + 1][0] != '-'){
+                record_size = atol(argv[++i]);
+                if(record_size < 1){
+                    printf("Could not start telemetry recorder\n");
+                    return 1;
+                }
+            }
+        } else if(0 == strcmp(argv[i], "--watchdog") && i + 1 < argc){
+            wd_threshold = (uint32_t) atol(argv[++i]);
+            if(i + 1 < argc && argv[i + 1][0] != '-'){
+                wd_slope = atof(argv[++i]);
+            }
+        } else if(0 == strcmp(argv[i], "--daemon")){
+            socket_path = DAEMON_SOCKET;
+            if(i + 1 < argc && argv[i + 1][0] != '-'){
+                socket_path = argv[++i];
+            }
+        } else if(0 == strcmp(argv[i], "--metrics") && i + 1 < argc){
+            metrics_path = argv[++i];
+            if(i + 1 < argc && argv[i + 1][0] != '-'){
+                metrics_period = atof(argv[++i]);
+            }
+        } else if(0 == strcmp(argv[i], "--map") && i + 1 < argc){
+            map_file = argv[++i];
+        } else if(0 == strcmp(argv[i], "--profiles")){
+            profile_path = PROFILE_FILE;
+            if(i + 1 < argc && argv[i + 1][0] != '-'){
+                profile_path = argv[++i];
+            }
+        } else if(0 == strcmp(argv[i], "--conditions") && i + RPF_CONDITIONS < argc){
+            for(int k = 0; k < RPF_CONDITIONS; k++){
+                cond[k] = atof(argv[++i]);
+            }
+        } else if(0 == strcmp(argv[i], "--replay") && i + 1 < argc){
+            replay.trace_file = argv[++i];
+            if(i + 1 < argc && argv[i + 1][0] != '-'){
+                replay.runs = atoi(argv[++i]);
+                if(replay.runs < 1){
+                    return 1;
+                }
+            }
+        } else if(0 == strcmp(argv[i], "--tuners") && i + 1 < argc){
+            replay.tuners = argv[++i];
+        } else if(0 == strcmp(argv[i], "--seed") && i + 1 < argc){
+            replay.seed = (unsigned int) atol(argv[++i]);
+        } else if(0 == strcmp(argv[i], "--channel") && i + 1 < argc){
+            replay.channel = atoi(argv[++i]);
+        } else if(0 == strcmp(argv[i], "--sim")){
+            sim_file = RP_SIM_FILE;
+            if(i + 1 < argc && argv[i + 1][0] != '-'){
+                sim_file = argv[++i];
+            }
+        } else {
+            printf("Usage: %s [--sim [file]] [--verify] [--rt [priority]] [--cpu n] [--daemon [socket]] [--record file [records]] [--watchdog threshold [slope]] [--metrics file [period]] [--map file] [--profiles [file]] [--conditions f0 pressure power]\n", argv[0]);
+            printf("       %s --replay file [runs] [--tuners list] [--seed n] [--channel n]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    ////////////////////////////////////////////////////////////////////
+    // Replay mode: compare the tuners offline on a recorded trace
+    if(replay.trace_file != NULL){
+        replay.log = print_message;
+        return (rpf_replay(&replay) != RPF_OK);
+    }
+
     ////////////////////////////////////////////////////////////////////
     // Open virtual memory
-    fd = open("/dev/mem", O_RDWR); // file identifier
-    if(fd < 0) {
-        perror("open");
-        return 1; // return error in opening
-    }    
-    // Let the program manipulate virtual memory
-    // 0x........ is the address of fpga gpio register
-    cfg_delay   = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0x41200000);
-    data_energy = cfg_delay + 8;
-    cfg_pid     = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0x42000000);
-            
+    // One channel at the default addresses, or every channel of the map,
+    // each with its sampler, filter bank and watchdog (--watchdog limits)
+    if(sim_file != NULL){
+        printf(ANSI_COLOR_YELLOW "Using simulated registers in %s\n" ANSI_COLOR_RESET, sim_file);
+    }
+    if(metrics_path != NULL && !(metrics_period > 0)){
+        printf("Invalid metrics period\n");
+        return 1;
+    }
+    dev_opt.sim_file = sim_file;
+    dev_opt.map_file = map_file;
+    dev_opt.verify = verify;
+    dev_opt.record_file = record_path;
+    dev_opt.record_size = record_size;
+    dev_opt.wd_threshold = wd_threshold;
+    dev_opt.wd_slope = wd_slope;
+    dev_opt.metrics_file = metrics_path;
+    dev_opt.metrics_period = metrics_period;
+    dev_opt.log = print_message;
+    // seed every channel's tuner from the profile nearest to the trap conditions
+    dev_opt.profile_file = profile_path;
+    memcpy(dev_opt.conditions, cond, sizeof(cond));
+    err = rpf_open(&dev_opt, &dev);
+    if(err != RPF_OK){
+        printf("Could not open the feedback channels: %s\n", rpf_strerror(err));
+        return 1;
+    }
+
+    if(record_path != NULL){
+        if(record_size > 0){
+            printf(ANSI_COLOR_YELLOW "Recording telemetry to %s (%ld records)\n" ANSI_COLOR_RESET, record_path, record_size);
+        } else {
+            printf(ANSI_COLOR_YELLOW "Recording telemetry to %s\n" ANSI_COLOR_RESET, record_path);
+        }
+    }
+    for(int c = 0; c < rpf_channels(dev); c++){
+        if(rpf_channels(dev) > 1){
+            printf("Channel %d: %s\n", c, rpf_channel_name(dev, c));
+        }
+    }
+    if(metrics_path != NULL){
+        printf(ANSI_COLOR_YELLOW "Writing metrics to %s every %.1f s\n" ANSI_COLOR_RESET, metrics_path, metrics_period);
+    }
+    if(wd_threshold > 0){
+        printf(ANSI_COLOR_YELLOW "Watchdog armed: energy %u, slope %.0f/s\n" ANSI_COLOR_RESET, wd_threshold, wd_slope);
+    }
+    if(profile_path != NULL){
+        printf(ANSI_COLOR_YELLOW "Profile store %s: %d profiles\n" ANSI_COLOR_RESET, profile_path, rpf_profile_count(dev));
+        for(int c = 0; c < rpf_channels(dev); c++){
+            if(rpf_profile_nearest(dev, c, &prof, &prof_dist) == RPF_OK){
+                printf("Seed: ");
+                print_profile(&prof, prof_dist);
+            }
+        }
+    }
+
+    // Real-time mode: no page faults from here on (the telemetry ring
+    // stays unlocked); samplers and control thread on one core,
+    // SCHED_FIFO (the watchdogs one priority above the samplers)
+    if(rt_enabled){
+        if(rpf_realtime(dev, rt_cpu, rt_priority) == RPF_OK){
+            printf(ANSI_COLOR_YELLOW "Real-time mode: CPU %d, SCHED_FIFO priority %d\n" ANSI_COLOR_RESET, rt_cpu, rt_priority);
+        } else {
+            printf(ANSI_COLOR_YELLOW "Real-time mode: running with default scheduling\n" ANSI_COLOR_RESET);
+        }
+    }
+    srand((unsigned int) repl_now_ns());
+
+    ////////////////////////////////////////////////////////////////////
+    // Daemon mode: serve the control socket instead of the keyboard
+    if(socket_path != NULL){
+        // one line per message, also when redirected to a log file
+        setvbuf(stdout, NULL, _IOLBF, 0);
+        err = rpf_serve(dev, socket_path);
+        rpf_close(dev);
+        return (err != RPF_OK);
+    }
+
     ////////////////////////////////////////////////////////////////////
     // Print welcome message
     printf("\n");
     printf(ANSI_COLOR_RED "##########################################################\n");
     printf("------------------------\n");
     printf("| LQG control software |\n");
-    printf("------------------------\n"); 
+    printf("------------------------\n");
     printf("\n");
     printf("Version: 0.1, 12.12.18, GP Conangla\n");
-    printf("\n");    
-    printf("------------------------\n"); 
+    printf("\n");
+    printf("------------------------\n");
     printf("LQG optimal control of an optically levitated particle.\n");
     printf("\n");
     printf("Steps of the digital signal processing:\n");
     printf("1. Read position data from a trapped particle\n");
     printf("2. Apply LQR (optimal feedback control)\n");
-    printf("------------------------\n"); 
+    printf("------------------------\n");
     printf("##########################################################\n" ANSI_COLOR_RESET);
-    
-    // get current delay values
-    reg_delay = *(uint32_t *)(cfg_delay);  // get register value
-    delay = reg_delay & 0x0000FFFF; // delay value
-    
-    // get current k_p, k_d values
-    reg_pid = *(uint32_t *)(cfg_pid);  // get register value
-    k_p = (reg_pid << 16)>>16; // 16 lowest bits: k_p
-    k_d = (reg_pid >> 16); // 16 highest bits: k_d
-        
-    printf("------------------------\n"); 
-    printf("Current settings:\n"); 
-    printf("------------------------\n"); 
-    printf("Current value of delay: %d\n", delay);
-    printf("------------------------\n"); 
-    printf("Current value of k_p:   %d\n", k_p);
-    printf("Current value of k_d:   %d\n", k_d);
+
+    // get current delay, k_p, k_d values (only register read-back)
+    rpf_get(dev, 0, &gains);
+
+    printf("------------------------\n");
+    printf("Current settings:\n");
     printf("------------------------\n");
-    printf("\n");    
-                               
+    printf("Current value of delay: %d\n", gains.delay);
+    printf("------------------------\n");
+    printf("Current value of k_p:   %d\n", gains.k_p);
+    printf("Current value of k_d:   %d\n", gains.k_d);
+    printf("------------------------\n");
+    printf("\n");
+
     ////////////////////////////////////////////////////////////////////
     // Enter loop
-    do{    
-        // what do you want to do next?    
+    do{
+        // report a watchdog trip and gain-schedule transitions since the last command
+        if(rpf_report(dev) > 0){
+            printf("\n");
+        }
+        rpf_get(dev, 0, &gains);
+        rpf_status(dev, 0, &status);
+
+        // what do you want to do next?
         printf("Type...\n");
         printf("    'p' to print current settings (k_p, k_d, delay)\n");
         printf("    'delay' to configure the total delay,\n");
         printf("    'f' to configure the feedback parameters,\n");
         printf("    'ml' to start a ML routine and optimize k_d step by step,\n");
         printf("    'mlauto' to start a ML routine and optimize kd automatically,\n");
+        printf("    'spsa' to optimize k_p, k_d and delay jointly (SPSA),\n");
+        printf("    'bo' to optimize k_p, k_d and delay with Bayesian optimization,\n");
+        printf("    'calibrate-delay' to find the optimum delay at the current k_p, k_d,\n");
+        printf("    'sweep' to map the energy over (k_p, k_d) to a CSV file,\n");
+        printf("    'es' to start/stop continuous extremum seeking (drift tracking),\n");
+        printf("    'schedule' to start/stop switching gains by energy regime,\n");
+        printf("    'profile' to load or save tuned gains for the trap conditions,\n");
+        printf("    'solve' to compute k_p, k_d and delay from a trap model (LQR),\n");
+        printf("    'dwell' to configure the ML dwell time,\n");
+        printf("    'e' to print energy statistics,\n");
+        printf("    'sampler' to configure the energy sampling rate,\n");
+        printf("    'filter' to print and configure the filtered energy outputs,\n");
+        printf("    'jitter' to print the sampler timing jitter,\n");
+        printf("    'metrics' to print the register and tuner counters (Prometheus format),\n");
+        printf("    'watchdog' to configure the runaway watchdog, 'arm' to re-arm it,\n");
         printf("    'k' to kill (i.e. stop) the feedback!,\n");
         printf("    'exit' to quit\n>> ");
-        
+
         // check if input works
         if (fgets(input_data, sizeof(input_data), stdin) != NULL) {
             // input has worked, do something with data
             printf("\n");
             input_data[strlen(input_data)-1]='\0'; // remove newline character from string
-            
+            rpf_settings_get(dev, &settings);
+
+            // extremum seeking and gain scheduling own the registers while they run
+            if(status.es_running && (repl_writes_registers(input_data) || 0 == strcmp(input_data, "schedule"))){
+                printf("Extremum seeking is running, type 'es' to stop it first\n\n");
+                continue;
+            }
+            if(status.sched_running && (repl_writes_registers(input_data) || 0 == strcmp(input_data, "es"))){
+                printf("Gain scheduling is running, type 'schedule' to stop it first\n\n");
+                continue;
+            }
+
             // "p" case -> print delay, kp, kd
-            if(0 == strcmp(input_data, "p")){                    
+            if(0 == strcmp(input_data, "p")){
                 // print current k_p, k_d values
-                printf("\n"); 
-                printf("------------------------\n"); 
-                printf("Current settings:\n"); 
-                printf("------------------------\n"); 
-                printf("Current value of delay: %d\n", delay);
-                printf("------------------------\n"); 
-                printf("Current value of k_p:   %d\n", k_p);
-                printf("Current value of k_d:   %d\n", k_d);
+                printf("\n");
+                printf("------------------------\n");
+                printf("Current settings:\n");
+                printf("------------------------\n");
+                printf("Current value of delay: %d\n", gains.delay);
                 printf("------------------------\n");
-                printf("\n"); 
-            }   
-            
+                printf("Current value of k_p:   %d\n", gains.k_p);
+                printf("Current value of k_d:   %d\n", gains.k_d);
+                printf("------------------------\n");
+                printf("Register writes: %llu (%llu coalesced, %llu read-back mismatches)\n", (unsigned long long) status.reg_writes,
+                       (unsigned long long) status.reg_coalesced, (unsigned long long) status.reg_mismatches);
+                printf("------------------------\n");
+                printf("\n");
+            }
+
             // "exit" case -> leave loop
             if(0 == strcmp(input_data, "exit")){
                 break;
             }
-            
+
             ////////////////////////////////////////////////////////////
             // "delay" case -> go to delay settings
             if(0 == strcmp(input_data, "delay")){
                 // Read number of delay cycles you want
-                printf("Write number of clock cycles to delay x(t)\n>> ");                
+                printf("Write number of clock cycles to delay x(t)\n>> ");
                 scanf("%ld", &delay_long);
                 getchar();
                 printf("\n");
-                sat_delay(delay_long, &delay);
-                reg_delay = (unsigned int) delay & 0x0000FFFF;
                 // change delay by changing register on FPGA
-                *((uint32_t *)(cfg_delay)) = (uint32_t) reg_delay; 
+                gains.delay = repl_clamp(delay_long);
+                repl_set(dev, &gains, RPF_DELAY);
+            }
+
+            ////////////////////////////////////////////////////////////
+            // "e" case -> print energy statistics from the sampler
+            if(0 == strcmp(input_data, "e")){
+                // Read length of averaging window
+                printf("Write averaging window in ms\n>> ");
+                scanf("%ld", &window_ms);
+                getchar();
+                printf("\n");
+                if(window_ms < 1){
+                    window_ms = 1;
+                }
+                if(rpf_energy_stats(dev, 0, window_ms, &energy_mean, &energy_var, &n_samples) != RPF_OK){
+                    n_samples = 0;
+                    energy_mean = 0;
+                    energy_var = 0;
+                }
+
+                // print energy statistics
+                printf("------------------------\n");
+                printf("Energy samples:     %ld\n", n_samples);
+                printf("Mean energy:        %.2f\n", energy_mean);
+                printf("Energy std. dev.:   %.2f\n", sqrt(energy_var));
+                printf("Std. error of mean: %.3f\n", (n_samples > 0) ? sqrt(energy_var/n_samples) : 0);
+                printf("------------------------\n");
+                printf("\n");
+            }
+
+            ////////////////////////////////////////////////////////////
+            // "sampler" case -> configure energy sampler
+            if(0 == strcmp(input_data, "sampler")){
+                // Read polling rate you want
+                printf("Current sampling rate: %u Hz (%llu deadlines missed)\n", status.rate_hz, (unsigned long long) status.missed);
+                printf("Write energy sampling rate in Hz\n>> ");
+                scanf("%ld", &rate_long);
+                getchar();
+                printf("\n");
+                rpf_sampler_rate(dev, 0, (rate_long < 1) ? 1 : (uint32_t) ((rate_long > UINT32_MAX) ? UINT32_MAX : rate_long));
+                // the filter decimations depend on the rate
+                rpf_status(dev, 0, &status);
+                if(status.filter_outputs < n_filter){
+                    printf("Filter outputs %d and above disabled, reconfigure them with 'filter'\n", status.filter_outputs + 1);
+                }
+            }
+
+            ////////////////////////////////////////////////////////////
+            // "filter" case -> print and configure filtered energy outputs
+            if(0 == strcmp(input_data, "filter")){
+                printf("------------------------\n");
+                for(int k = 0; k < status.filter_outputs; k++){
+                    if(rpf_filter_read(dev, 0, k, &filter_out) == RPF_OK){
+                        printf("Energy (%8.1f ms): %10.2f (%u saturated samples)\n", filter_out.period_s*1e3, filter_out.energy, filter_out.saturated);
+                    } else {
+                        printf("Energy (%8.1f ms): not available yet\n", filter_out.period_s*1e3);
+                    }
+                }
+                printf("------------------------\n");
+                printf("Write up to %d increasing output periods in ms (or 'd' for current settings)\n>> ", RPF_FILTER_STAGES);
+                if(fgets(input_data, sizeof(input_data), stdin) != NULL && input_data[0] != 'd'){
+                    double new_ms[RPF_FILTER_STAGES];
+                    int n_new = sscanf(input_data, "%lf %lf %lf %lf", &new_ms[0], &new_ms[1], &new_ms[2], &new_ms[3]);
+                    int valid = (n_new >= 1);
+                    for(int k = 0; k < n_new; k++){
+                        valid = valid && new_ms[k] > 0 && (k == 0 || new_ms[k] > new_ms[k - 1]);
+                    }
+                    if(valid){
+                        n_filter = n_new;
+                        for(int k = 0; k < n_filter; k++){
+                            filter_s[k] = new_ms[k]/1e3;
+                        }
+                        rpf_filter_config(dev, 0, n_filter, filter_s);
+                        rpf_status(dev, 0, &status);
+                        for(int k = 0; k < status.filter_outputs; k++){
+                            rpf_filter_read(dev, 0, k, &filter_out);
+                            printf("Output %d: every %.1f ms\n", k + 1, filter_out.period_s*1e3);
+                        }
+                    } else {
+                        printf("Invalid filter periods, keeping current ones\n");
+                    }
+                }
+                printf("\n");
+            }
+
+            ////////////////////////////////////////////////////////////
+            // "jitter" case -> print and reset wake-up latency histogram
+            if(0 == strcmp(input_data, "jitter")){
+                printf("Sampling rate: %u Hz, %llu deadlines missed\n", status.rate_hz, (unsigned long long) status.missed);
+                rpf_sampler_jitter(dev, 0, jitter, &jitter_max);
+                print_jitter(jitter, jitter_max);
+                printf("\n");
+            }
+
+            ////////////////////////////////////////////////////////////
+            // "metrics" case -> print counters and latency histograms
+            if(0 == strcmp(input_data, "metrics")){
+                metrics_len = rpf_metrics(NULL, 0);
+                metrics_text = (metrics_len >= 0) ? malloc(metrics_len + 1) : NULL;
+                if(metrics_text != NULL){
+                    rpf_metrics(metrics_text, metrics_len + 1);
+                    fputs(metrics_text, stdout);
+                    free(metrics_text);
+                }
+                printf("\n");
             }
-            
+
             ////////////////////////////////////////////////////////////
             // "feedback" case -> go to feedback settings
             if(0 == strcmp(input_data, "f")){
@@ -313,302 +690,579 @@ int main(int argc, char **argv){
                 // exit or change feedback gains?
                 printf("Type...\n");
                 printf("    'c' to change values of k_p, k_d,\n");
-                printf("    'exit' to end execution\n>> ");       
-                
-                // check if input works 
+                printf("    'exit' to end execution\n>> ");
+
+                // check if input works
                 if (fgets(input_data, sizeof(input_data), stdin) != NULL) {
                     // input has worked, do something with data
                     printf("\n");
                     input_data[strlen(input_data)-1]='\0'; // remove newline character from string
-                    
+
                     // "exit" case -> leave loop
                     if(0 == strcmp(input_data, "exit")){
                         break;
                     }
-                    
+
                     // "change" case -> change kp, kd
                     if(0 == strcmp(input_data, "c")){
                         printf("Type value of 'k_p'\n>> ");
                         scanf("%ld", &k_p_long);
                         getchar();
-                        sat_gain(k_p_long, &k_p);
                         printf("\n");
-                        printf("Type value of 'k_d'\n>> ");  
+                        printf("Type value of 'k_d'\n>> ");
                         scanf("%ld", &k_d_long);
                         getchar();
-                        sat_gain(k_d_long, &k_d);
                         printf("\n");
-                                        
+
                         ////////////////////////////////////////////////////////////////////
-                        // Manipulate/read values of registers
-                        reg_tmp1 = (unsigned int) k_d << 16;
-                        reg_tmp2 = (unsigned int) k_p & 0x0000FFFF;
-                        reg_tmp2 = reg_tmp1 + reg_tmp2;
-                        *((uint32_t *)(cfg_pid)) = (uint32_t) reg_tmp2;   // write reg_tmp2 on pid memory address
-                        
-                        // get current k_p, k_d values
-                        reg_pid = *(uint32_t *)(cfg_pid);  // get register value
-                        k_p = (int) (reg_pid << 16)>>16; // 16 lowest bits: k_p
-                        k_d = (int) (reg_pid >> 16); // 16 highest bits: k_d
-                        k_d = (signed int)(k_d);
-                            
+                        // Manipulate values of registers
+                        gains.k_p = repl_clamp(k_p_long);
+                        gains.k_d = repl_clamp(k_d_long);
+                        repl_set(dev, &gains, RPF_KP | RPF_KD);
+
                         // print current k_p, k_d values
                         printf("------------------------\n");
-                        printf("New value of k_p: %d\n", k_p);
-                        printf("New value of k_d: %d\n", k_d);
+                        printf("New value of k_p: %d\n", gains.k_p);
+                        printf("New value of k_d: %d\n", gains.k_d);
                         printf("------------------------\n");
-                        printf("\n");                             
+                        printf("\n");
                     }
                 }
             }
-            
+
             ////////////////////////////////////////////////////////////
             // "ml" case -> start machine learning routine to optimize kd
             if(0 == strcmp(input_data, "ml")){
-                // read energy register
-                reg_energy = *(uint32_t *)(data_energy);  // get register value
-                energy_int = (int) reg_energy & 0x0000FFFF;
-                energy = (float) energy_int;
-                
                 ////////////////////////////////////////////////////////////////////
-                // Machine learning routine
-                // tmp variable        
-                reg_tmp1 = (unsigned int) 0 << 16;
-                
-                float k0 = -1;
-                float k1 = -5;
-                float k_tmp;
-                
+                // Machine learning routine (k_d only, k_p is kept), from
+                // the k_d of the profile loaded or saved last
+                float k0, k1;
+                ml_start_kd(status.seeded ? (float) status.seed.k_d : ML_K0, &k0, &k1);
+
                 float energy0, energy1;
-            
+
                 // Modify k_d value with k0
-                int k0_int = (int) k0;
-                reg_tmp1 = (unsigned int) k0_int << 16;
-                *((uint32_t *)(cfg_pid)) = (uint32_t) reg_tmp1;                
-                printf("Initial kd = %.1f\n", k0); 
-                                
-                usleep(3000000);      
-                // read energy register
-                reg_energy = *(uint32_t *)(data_energy);  // get register value
-                energy_int = (int) reg_energy & 0x0000FFFF;
-                energy0 = (float) energy_int;
+                gains.k_d = (int) k0;
+                if(repl_set(dev, &gains, RPF_KD) != RPF_OK){
+                    printf(ANSI_COLOR_RED "Routine stopped\n\n" ANSI_COLOR_RESET);
+                    continue;
+                }
+                printf("Initial kd = %.1f\n", k0);
+
+                // measure energy with sequential early stopping
+                if(rpf_measure(dev, 0, NULL, &dwell_prev) != RPF_OK){
+                    printf(ANSI_COLOR_RED "Energy measurement failed, routine stopped\n\n" ANSI_COLOR_RESET);
+                    continue;
+                }
+                energy0 = (float) dwell_prev.energy;
                 energy1 = energy0 + 2;
-                
+
                 printf("------------------------\n");
-                printf("Initial energy value: %.1f\n", energy0); 
-                printf("------------------------\n\n");                      
-                printf(ANSI_COLOR_RED "##########################################################\n" ANSI_COLOR_RESET);               
+                printf("Initial energy value: %.1f\n", energy0);
+                print_measurement(&dwell_prev);
+                printf("------------------------\n\n");
+                printf(ANSI_COLOR_RED "##########################################################\n" ANSI_COLOR_RESET);
                 printf("------------------------\n");
                 printf("Next value of k_d: %d\n", (int) k1);
                 printf("------------------------\n");
-                
-                printf("Press any key to continue\n");  
-                getchar();    
-                
-                do{   
+
+                printf("Press any key to continue\n");
+                getchar();
+
+                do{
                     // Modify k_d value with k1
-                    int k1_int = (int) k1;
-                    reg_tmp1 = (unsigned int) k1_int << 16;
-                    *((uint32_t *)(cfg_pid)) = (uint32_t) reg_tmp1; 
-                    // get current k_d value
-                    reg_pid = *(uint32_t *)(cfg_pid);  // get register value
-                    k_d = (int) (reg_pid >> 16);       // 16 highest bits: k_d
-                    k_d = (signed int)(k_d);                    
-                                    
-                    usleep(3000000);      
-                    // get new energy from register
+                    gains.k_d = (int) k1;
+                    if(repl_set(dev, &gains, RPF_KD) != RPF_OK){
+                        printf(ANSI_COLOR_RED "Routine stopped\n" ANSI_COLOR_RESET);
+                        break;
+                    }
+
+                    // measure energy until the change with respect to the
+                    // previous k_d is resolved (or max dwell is reached)
+                    if(rpf_measure(dev, 0, &dwell_prev, &dwell_cur) != RPF_OK){
+                        printf(ANSI_COLOR_RED "Energy measurement failed, routine stopped\n" ANSI_COLOR_RESET);
+                        break;
+                    }
                     energy0 = energy1;
-                    reg_energy = *(uint32_t *)(data_energy);  // get register value
-                    energy_int = (int) reg_energy & 0x0000FFFF;
-                    energy1 = (float) energy_int;
-                    
+                    energy1 = (float) dwell_cur.energy;
+                    dwell_prev = dwell_cur;
+
+                    printf("------------------------\n");
+                    printf("Updated energy value: %.1f\n", energy1);
                     printf("------------------------\n");
-                    printf("Updated energy value: %.1f\n", energy1); 
-                    printf("------------------------\n"); 
-                    printf("Energy difference: %.1f\n", fabs(energy1 - energy0)); 
-                    printf("------------------------\n\n"); 
-                    
+                    printf("Energy difference: %.1f\n", fabs(energy1 - energy0));
+                    print_measurement(&dwell_cur);
+                    printf("------------------------\n\n");
+
                     // gradient descent
-                    k_tmp = k1;
-                    float dif_k = k1 - k0;
-                    if(dif_k == 0){
-                        dif_k = 1;
-                    }
-                    k1 = k1 - 0.2*(energy1 - energy0)/(dif_k);
-                    k0 = k_tmp;
-                                        
+                    ml_secant_step(&k0, &k1, energy0, energy1);
+
                     printf(ANSI_COLOR_RED "##########################################################\n" ANSI_COLOR_RESET);
                     printf("------------------------\n");
                     printf("Next value of k_d will be: %.1f\n", k1);
                     printf("------------------------\n");
-                    
+
                     // just in case k1 is too large
-                    if(k1 > 0){
-                        k1 = 0;
-                    } else if(k1 < -1000){
-                        k1 = -1000;
-                    }
-                    
-                    printf("Press any key to continue\n");  
-                    getchar();    
+                    ml_clamp_kd(&k1);
+
+                    printf("Press any key to continue\n");
+                    getchar();
                 } while(1);
-                
-                // get current k_d value
-                reg_pid = *(uint32_t *)(cfg_pid);  // get register value
-                k_d = (int) (reg_pid >> 16);       // 16 highest bits: k_d
-                k_d = (signed int)(k_d);
-                
-                // read energy register
-                reg_energy = *(uint32_t *)(data_energy);  // get register value
-                energy_int = (int) reg_energy & 0x0000FFFF;
-                energy = (float) energy_int;
-                
+
+                // get current k_d value, and the energy it gives now
+                rpf_get(dev, 0, &gains);
+                if(rpf_energy_stats(dev, 0, FINAL_ENERGY_MS, &energy_mean, &energy_var, &n_samples) != RPF_OK){
+                    energy_mean = 0;
+                }
+
                 // Print final energy and k_d
                 printf("------------------------\n");
-                printf("Final energy value: %.1f\n", energy); 
+                printf("Final energy value: %.1f\n", energy_mean);
                 printf("------------------------\n");
-                printf("Final value of k_d: %d\n", k_d);
+                printf("Final value of k_d: %d\n", gains.k_d);
                 printf("------------------------\n");
-                printf("\n");  
+                printf("\n");
             }
-            
+
             ////////////////////////////////////////////////////////////
             // "mlauto" case -> start machine learning routine to optimize kd
             if(0 == strcmp(input_data, "mlauto")){
-                // read energy register
-                reg_energy = *(uint32_t *)(data_energy);  // get register value
-                energy_int = (int) reg_energy & 0x0000FFFF;
-                energy = (float) energy_int;
-                
-                ////////////////////////////////////////////////////////////////////
-                // Machine learning routine
-                // tmp variable        
-                reg_tmp1 = (unsigned int) 0 << 16;
-                
-                float k0 = -1;
-                float k1 = -5;
-                float k_tmp;
-                
-                float energy0, energy1;
-            
-                // Modify k_d value with k0
-                int k0_int = (int) k0;
-                reg_tmp1 = (unsigned int) k0_int << 16;
-                *((uint32_t *)(cfg_pid)) = (uint32_t) reg_tmp1;                
-                printf("Initial kd = %.1f\n", k0); 
-                
-                usleep(3000000);                
-                // read energy register
-                reg_energy = *(uint32_t *)(data_energy);  // get register value
-                energy_int = (int) reg_energy & 0x0000FFFF;
-                energy0 = (float) energy_int;                
-                energy1 = energy0 + 2;
-                
+                // same secant iteration, run by the channel's tuner (k_p
+                // is kept; the result is saved to the profile store)
+                repl_tune(dev, RPF_TUNER_MLAUTO);
+                rpf_get(dev, 0, &gains);
+                rpf_status(dev, 0, &status);
+                n_steps = (status.evaluations > 0) ? (int) status.evaluations - 1 : 0;
+                dwell_total = status.tune_time_s;
+
+                // Print final energy and k_d
                 printf("------------------------\n");
-                printf("Initial energy value: %.1f\n", energy0); 
-                printf("------------------------\n\n"); 
-                printf(ANSI_COLOR_RED "##########################################################\n" ANSI_COLOR_RESET);        
+                printf("Final energy value: %.1f\n", status.measured ? status.last.energy : 0);
                 printf("------------------------\n");
-                printf("Next value of k_d: %d\n", (int) k1);
+                printf("Final value of k_d: %d\n", gains.k_d);
                 printf("------------------------\n");
-                
-                do{   
-                    // Modify k_d value with k1
-                    int k1_int = (int) k1;
-                    reg_tmp1 = (unsigned int) k1_int << 16;
-                    *((uint32_t *)(cfg_pid)) = (uint32_t) reg_tmp1; 
-                    // get current k_d value
-                    reg_pid = *(uint32_t *)(cfg_pid);  // get register value
-                    k_d = (int) (reg_pid >> 16);       // 16 highest bits: k_d
-                    k_d = (signed int)(k_d);       
-                    
-                    usleep(3000000);
-                    
-                    // get new energy from register
-                    energy0 = energy1;
-                    reg_energy = *(uint32_t *)(data_energy);  // get register value
-                    energy_int = (int) reg_energy & 0x0000FFFF;
-                    energy1 = (float) energy_int;
+                printf("Iterations: %d, total dwell: %.1f s (fixed dwell: %.1f s)\n", n_steps, dwell_total, 3.0 + 6.0*n_steps);
+                printf("------------------------\n");
+                printf("\n");
+            }
+
+            ////////////////////////////////////////////////////////////
+            // "spsa" case -> joint optimization of k_p, k_d and delay
+            if(0 == strcmp(input_data, "spsa")){
+                printf("Current settings: a %.3g (0 = auto), c %.3g, A %.3g, alpha %.3g, gamma %.3g, %d iterations\n",
+                       settings.spsa_a, settings.spsa_c, settings.spsa_A, settings.spsa_alpha, settings.spsa_gamma, settings.spsa_iter);
+                printf("Write a, c, A, alpha, gamma and number of iterations (or 'd' for current settings)\n>> ");
+                if(fgets(input_data, sizeof(input_data), stdin) != NULL && input_data[0] != 'd'){
+                    settings_new = settings;
+                    if(sscanf(input_data, "%lf %lf %lf %lf %lf %d", &settings_new.spsa_a, &settings_new.spsa_c, &settings_new.spsa_A,
+                              &settings_new.spsa_alpha, &settings_new.spsa_gamma, &settings_new.spsa_iter) != 6
+                       || rpf_settings_set(dev, &settings_new) != RPF_OK){
+                        printf("Invalid SPSA settings, keeping current ones\n");
+                    }
+                }
+                printf("\n");
+
+                // start from current register values; apply final
+                // parameters, or go back to the start ones on failure
+                gains_start = gains;
+                err = repl_tune(dev, RPF_TUNER_SPSA);
+                if(err != RPF_OK && err != RPF_ETRIPPED){
+                    repl_set(dev, &gains_start, RPF_ALL);
+                }
+                rpf_get(dev, 0, &gains);
+
+                printf("------------------------\n");
+                printf("Final value of k_p:   %d\n", gains.k_p);
+                printf("Final value of k_d:   %d\n", gains.k_d);
+                printf("Final value of delay: %d\n", gains.delay);
+                printf("------------------------\n");
+                printf("\n");
+            }
+
+            ////////////////////////////////////////////////////////////
+            // "bo" case -> Bayesian optimization of k_p, k_d and delay
+            if(0 == strcmp(input_data, "bo")){
+                printf("Current settings: length scale %.3g, noise %.3g, min EI %.3g, %d evaluations\n",
+                       settings.bo_length, settings.bo_noise, settings.bo_ei_min, settings.bo_eval);
+                printf("Bounds: k_p [%.0f, %.0f], k_d [%.0f, %.0f], delay [%.0f, %.0f]\n",
+                       settings.bo_lo[0], settings.bo_hi[0], settings.bo_lo[1], settings.bo_hi[1], settings.bo_lo[2], settings.bo_hi[2]);
+                printf("Write length scale, noise, min EI and max evaluations (or 'd' for current settings)\n>> ");
+                if(fgets(input_data, sizeof(input_data), stdin) != NULL && input_data[0] != 'd'){
+                    settings_new = settings;
+                    if(sscanf(input_data, "%lf %lf %lf %d", &settings_new.bo_length, &settings_new.bo_noise, &settings_new.bo_ei_min,
+                              &settings_new.bo_eval) != 4 || rpf_settings_set(dev, &settings_new) != RPF_OK){
+                        printf("Invalid BO settings, keeping current ones\n");
+                    }
+                }
+                printf("\n");
+
+                // start from current register values, apply best parameters
+                gains_start = gains;
+                err = repl_tune(dev, RPF_TUNER_BO);
+                if(err != RPF_OK && err != RPF_ETRIPPED){
+                    repl_set(dev, &gains_start, RPF_ALL);
+                }
+                rpf_get(dev, 0, &gains);
+
+                printf("------------------------\n");
+                printf("Final value of k_p:   %d\n", gains.k_p);
+                printf("Final value of k_d:   %d\n", gains.k_d);
+                printf("Final value of delay: %d\n", gains.delay);
+                printf("------------------------\n");
+                printf("\n");
+            }
+
+            ////////////////////////////////////////////////////////////
+            // "calibrate-delay" case -> delay scan at fixed k_p, k_d
+            if(0 == strcmp(input_data, "calibrate-delay")){
+                printf("Current settings: delay %.0f - %.0f, %d coarse points, tolerance %.0f cycles\n",
+                       settings.cal_lo, settings.cal_hi, settings.cal_points, settings.cal_tol);
+                printf("Write lowest and highest delay, coarse points and tolerance (or 'd' for current settings)\n>> ");
+                if(fgets(input_data, sizeof(input_data), stdin) != NULL && input_data[0] != 'd'){
+                    settings_new = settings;
+                    if(sscanf(input_data, "%lf %lf %d %lf", &settings_new.cal_lo, &settings_new.cal_hi, &settings_new.cal_points,
+                              &settings_new.cal_tol) != 4 || rpf_settings_set(dev, &settings_new) != RPF_OK){
+                        printf("Invalid calibration settings, keeping current ones\n");
+                    }
+                }
+                printf("\n");
+
+                // hold current gains
+                gains_start = gains;
+                err = repl_tune(dev, RPF_TUNER_DELAY);
+                if(err != RPF_OK && err != RPF_ETRIPPED){
+                    repl_set(dev, &gains_start, RPF_ALL);
+                }
+                rpf_get(dev, 0, &gains);
+
+                printf("------------------------\n");
+                printf("Final value of delay: %d\n", gains.delay);
+                printf("------------------------\n");
+                printf("\n");
+            }
+
+            ////////////////////////////////////////////////////////////
+            // "sweep" case -> energy landscape over (k_p, k_d)
+            if(0 == strcmp(input_data, "sweep")){
+                settings_new = settings;
+                printf("Current settings: k_p %.0f - %.0f, k_d %.0f - %.0f, %dx%d grid, %d levels, tolerance %.2f, max %d points\n",
+                       settings.sweep_kp[0], settings.sweep_kp[1], settings.sweep_kd[0], settings.sweep_kd[1], settings.sweep_grid,
+                       settings.sweep_grid, settings.sweep_levels, settings.sweep_tol, settings.sweep_points);
+                printf("Write k_p range, k_d range, grid points, levels, tolerance and max points (or 'd' for current settings)\n>> ");
+                if(fgets(input_data, sizeof(input_data), stdin) != NULL && input_data[0] != 'd'){
+                    if(sscanf(input_data, "%lf %lf %lf %lf %d %d %lf %d", &settings_new.sweep_kp[0], &settings_new.sweep_kp[1],
+                              &settings_new.sweep_kd[0], &settings_new.sweep_kd[1], &settings_new.sweep_grid, &settings_new.sweep_levels,
+                              &settings_new.sweep_tol, &settings_new.sweep_points) != 8
+                       || rpf_settings_set(dev, &settings_new) != RPF_OK){
+                        printf("Invalid sweep settings, keeping current ones\n");
+                        settings_new = settings;
+                    }
+                }
+                printf("Write delay slices (up to %d, or 'd' for the current delay)\n>> ", RPF_SWEEP_DELAYS);
+                if(fgets(input_data, sizeof(input_data), stdin) != NULL && input_data[0] != 'd'){
+                    int len;
+                    settings_new.sweep_delays = 0;
+                    for(char *s = input_data; settings_new.sweep_delays < RPF_SWEEP_DELAYS &&
+                        sscanf(s, "%lf%n", &settings_new.sweep_delay[settings_new.sweep_delays], &len) == 1; s += len){
+                        settings_new.sweep_delays++;
+                    }
+                } else {
+                    settings_new.sweep_delays = 0;
+                }
+                printf("Write output CSV file (or 'd' for %s)\n>> ", settings.sweep_file);
+                if(fgets(input_data, sizeof(input_data), stdin) != NULL && input_data[0] != 'd'){
+                    sscanf(input_data, "%255s", settings_new.sweep_file);
+                }
+                printf("\n");
+                if(rpf_settings_set(dev, &settings_new) != RPF_OK){
+                    rpf_settings_set(dev, &settings);
+                    printf("Invalid delay slices or too many points for the budget\n\n");
+                } else {
+                    // lattice points are register values already
+                    gains_start = gains;
+                    err = repl_tune(dev, RPF_TUNER_SWEEP);
+                    if(err != RPF_OK && err != RPF_ETRIPPED){
+                        repl_set(dev, &gains_start, RPF_ALL);
+                    }
+                    rpf_get(dev, 0, &gains);
+
+                    printf("Final values: k_p = %d, k_d = %d, delay = %d\n\n", gains.k_p, gains.k_d, gains.delay);
+                }
+            }
+
+            ////////////////////////////////////////////////////////////
+            // "solve" case -> model-based LQR gains
+            if(0 == strcmp(input_data, "solve")){
+                printf("Current model: f0 %.6g Hz, damping %.6g 1/s, sample rate %.6g Hz, loop delay %.6g cycles\n",
+                       lqr_model.f0, lqr_model.gamma, lqr_model.fs, lqr_model.loop_delay);
+                printf("               actuator gain %.6g, q_x %.6g, q_v %.6g, R %.6g\n",
+                       lqr_model.b, lqr_model.q_x, lqr_model.q_v, lqr_model.r);
+                printf("Write f0, damping, sample rate, loop delay, actuator gain, q_x, q_v and R (or 'd' for current model)\n>> ");
+                if(fgets(input_data, sizeof(input_data), stdin) != NULL && input_data[0] != 'd'){
+                    struct rpf_trap_model lqr_new;
+                    if(sscanf(input_data, "%lf %lf %lf %lf %lf %lf %lf %lf", &lqr_new.f0, &lqr_new.gamma, &lqr_new.fs, &lqr_new.loop_delay,
+                              &lqr_new.b, &lqr_new.q_x, &lqr_new.q_v, &lqr_new.r) == 8){
+                        lqr_model = lqr_new;
+                    } else {
+                        printf("Invalid model, keeping current one\n");
+                    }
+                }
+                printf("\n");
+
+                t_solve = repl_now_ns();
+                if(rpf_solve(dev, &lqr_model, &lqr_res) == RPF_OK){
+                    t_solve = repl_now_ns() - t_solve;
+                    gains = lqr_res.gains;
+                    repl_set(dev, &gains, RPF_ALL);
 
                     printf("------------------------\n");
-                    printf("Updated energy value: %.1f\n", energy1); 
-                    printf("------------------------\n"); 
-                    printf("Energy difference: %.1f\n", fabs(energy1 - energy0)); 
-                    printf("------------------------\n\n"); 
-                    // gradient descent
-                    k_tmp = k1;
-                    float dif_k = k1 - k0;
-                    if(dif_k == 0){
-                        dif_k = 1;
+                    printf("Riccati solution (%d iterations, %.1f us):\n", lqr_res.iterations, t_solve/1e3);
+                    print_matrix(2, 2, lqr_res.P);
+                    printf("K = [%.4e, %.4e], closed-loop spectral radius %.9f\n", lqr_res.K[0], lqr_res.K[1], lqr_res.rho);
+                    printf("Unquantized gains: k_p = %.2f, k_d = %.2f\n", lqr_res.kp, lqr_res.kd);
+                    if(lqr_res.saturated){
+                        printf(ANSI_COLOR_YELLOW "Warning: gains saturated at +-8191\n" ANSI_COLOR_RESET);
                     }
-                    k1 = k1 - 0.2*(energy1 - energy0)/(dif_k);
-                    k0 = k_tmp;
-                                        
-                    printf(ANSI_COLOR_RED "##########################################################\n" ANSI_COLOR_RESET);
                     printf("------------------------\n");
-                    printf("Next value of k_d will be: %.1f\n", k1);
+                    printf("New value of k_p:   %d\n", gains.k_p);
+                    printf("New value of k_d:   %d\n", gains.k_d);
+                    printf("New value of delay: %d\n", gains.delay);
                     printf("------------------------\n");
-                    
-                    // just in case k1 is too large
-                    if(k1 > 0){
-                        k1 = 0;
-                    } else if(k1 < -1000){
-                        k1 = -1000;
+                    printf("\n");
+                }
+            }
+
+            ////////////////////////////////////////////////////////////
+            // "dwell" case -> configure dwell engine
+            if(0 == strcmp(input_data, "dwell")){
+                printf("Current settings: settle %.2f s, min %.2f s, max %.2f s, z %.2f, resolution %.2f, predict %s\n",
+                       settings.settle_s, settings.min_dwell_s, settings.max_dwell_s, settings.z, settings.resolution,
+                       settings.predict ? "on" : "off");
+                printf("Write settle time, min dwell, max dwell (s), confidence z, energy resolution and predict (1 on, 0 off)\n>> ");
+                settings_new = settings;
+                if(scanf("%lf %lf %lf %lf %lf %d", &settings_new.settle_s, &settings_new.min_dwell_s, &settings_new.max_dwell_s,
+                         &settings_new.z, &settings_new.resolution, &settings_new.predict) != 6
+                   || rpf_settings_set(dev, &settings_new) != RPF_OK){
+                    printf("Invalid dwell settings, keeping current ones\n");
+                }
+                getchar();
+                printf("\n");
+            }
+
+            ////////////////////////////////////////////////////////////
+            // "watchdog" case -> configure and arm the runaway watchdog
+            if(0 == strcmp(input_data, "watchdog")){
+                if(!status.wd_running){
+                    printf("Watchdog off\n");
+                } else if(rpf_watchdog_report(dev, 0) != RPF_OK){
+                    printf("Watchdog armed\n");
+                }
+                rpf_watchdog_get(dev, 0, &wd_cfg);
+                printf("Current settings: threshold %u, max slope %.0f/s (0 = off), slope window %.3g s, %d samples, %u Hz\n",
+                       wd_cfg.threshold, wd_cfg.slope_max, wd_cfg.slope_window_s, wd_cfg.debounce, wd_cfg.rate_hz);
+                printf("Write threshold, max slope, slope window and debounce samples ('d' for current settings, 'off' to stop)\n>> ");
+                if(fgets(input_data, sizeof(input_data), stdin) != NULL){
+                    struct rpf_watchdog wd_new = wd_cfg;
+                    unsigned int threshold;
+                    if(0 == strncmp(input_data, "off", 3)){
+                        err = rpf_watchdog_stop(dev, 0);
+                        printf((err == RPF_OK) ? "Watchdog off\n" : "Could not stop the watchdog: %s\n", rpf_strerror(err));
+                    } else {
+                        if(input_data[0] != 'd'){
+                            if(sscanf(input_data, "%u %lf %lf %d", &threshold, &wd_new.slope_max, &wd_new.slope_window_s, &wd_new.debounce) == 4
+                               && wd_new.slope_max >= 0 && wd_new.slope_window_s > 0 && wd_new.debounce > 0){
+                                wd_new.threshold = threshold;
+                                wd_cfg = wd_new;
+                            } else {
+                                printf("Invalid watchdog settings, keeping current ones\n");
+                            }
+                        }
+                        err = rpf_watchdog_start(dev, 0, &wd_cfg);
+                        printf((err == RPF_OK) ? "Watchdog armed\n" : "Could not start the watchdog: %s\n", rpf_strerror(err));
                     }
-                    
-                    usleep(3000000);
-                } while(fabs(energy1 - energy0) > 1);
-                
-                // get current k_d value
-                reg_pid = *(uint32_t *)(cfg_pid);  // get register value
-                k_d = (int) (reg_pid >> 16);       // 16 highest bits: k_d
-                k_d = (signed int)(k_d);
-                
-                // read energy register
-                reg_energy = *(uint32_t *)(data_energy);  // get register value
-                energy_int = (int) reg_energy & 0x0000FFFF;
-                energy = (float) energy_int;
-                
-                // Print final energy and k_d
-                printf("------------------------\n");
-                printf("Final energy value: %.1f\n", energy); 
+                }
+                printf("\n");
+            }
+
+            ////////////////////////////////////////////////////////////
+            // "arm" case -> re-arm the watchdog after a trip
+            if(0 == strcmp(input_data, "arm")){
+                if(rpf_watchdog_arm(dev, 0) != RPF_OK){
+                    printf("Watchdog off, use 'watchdog' to start it\n");
+                } else {
+                    rpf_get(dev, 0, &gains);
+                    printf("Watchdog re-armed, feedback is off (k_p = %d, k_d = %d)\n", gains.k_p, gains.k_d);
+                }
+                printf("\n");
+            }
+
+            ////////////////////////////////////////////////////////////
+            // "es" case -> start or stop continuous extremum seeking
+            if(0 == strcmp(input_data, "es")){
+                if(status.es_running){
+                    rpf_es_stop(dev, 0);
+                    rpf_status(dev, 0, &status);
+                    rpf_get(dev, 0, &gains);
+                    printf("Extremum seeking stopped after %.0f s (%ld samples)\n", status.es_time_s, status.es_samples);
+                    printf("------------------------\n");
+                    printf("Final value of k_p:   %d\n", gains.k_p);
+                    printf("Final value of k_d:   %d\n", gains.k_d);
+                    printf("Final value of delay: %d\n", gains.delay);
+                    printf("------------------------\n");
+                } else {
+                    printf("Current settings: %.3g Hz, amplitudes k_p %.0f, k_d %.0f, delay %.0f, gain %.3g, max rate %.3g/s, phase %.0f deg\n",
+                           settings.es_freq_hz, settings.es_amp[0], settings.es_amp[1], settings.es_amp[2], settings.es_gain,
+                           settings.es_max_rate, settings.es_phase_deg);
+                    printf("Write frequency, amplitudes of k_p, k_d and delay (0 = fixed), gain, max rate and phase (or 'd' for current settings)\n>> ");
+                    if(fgets(input_data, sizeof(input_data), stdin) != NULL && input_data[0] != 'd'){
+                        settings_new = settings;
+                        if(sscanf(input_data, "%lf %lf %lf %lf %lf %lf %lf", &settings_new.es_freq_hz, &settings_new.es_amp[0],
+                                  &settings_new.es_amp[1], &settings_new.es_amp[2], &settings_new.es_gain, &settings_new.es_max_rate,
+                                  &settings_new.es_phase_deg) != 7 || rpf_settings_set(dev, &settings_new) != RPF_OK){
+                            printf("Invalid extremum-seeking settings, keeping current ones\n");
+                        }
+                    }
+                    err = rpf_es_start(dev, 0);
+                    if(err == RPF_ETRIPPED){
+                        printf("Watchdog tripped, re-arm it first ('arm')\n");
+                    } else if(err == RPF_OK){
+                        printf("Extremum seeking running in the background, type 'es' again to stop it\n");
+                    }
+                }
+                printf("\n");
+            }
+
+            ////////////////////////////////////////////////////////////
+            // "schedule" case -> start or stop gain scheduling
+            if(0 == strcmp(input_data, "schedule")){
+                if(status.sched_running){
+                    rpf_schedule_stop(dev, 0);
+                    rpf_get(dev, 0, &gains);
+                    printf("Gain scheduling stopped after %llu transitions\n", (unsigned long long) status.sched_transitions);
+                    printf("------------------------\n");
+                    printf("Final value of k_p:   %d\n", gains.k_p);
+                    printf("Final value of k_d:   %d\n", gains.k_d);
+                    printf("Final value of delay: %d\n", gains.delay);
+                    printf("------------------------\n");
+                } else {
+                    settings_new = settings;
+                    printf("Current settings: hysteresis %.0f%%, debounce %d polls at %u Hz\n",
+                           settings.sched_hysteresis*100, settings.sched_debounce, settings.sched_rate_hz);
+                    printf("Table lines: energy threshold, k_p, k_d, delay (thresholds increasing)\n");
+                    printf("Write table file, and optionally hysteresis (fraction) and debounce (polls)\n>> ");
+                    if(fgets(input_data, sizeof(input_data), stdin) == NULL
+                       || sscanf(input_data, "%255s %lf %d", sched_path, &settings_new.sched_hysteresis, &settings_new.sched_debounce) < 1){
+                        printf("No table file given\n");
+                    } else if(rpf_settings_set(dev, &settings_new) != RPF_OK){
+                        printf("Invalid gain-scheduling settings\n");
+                    } else {
+                        // the new settings only stay with a running schedule
+                        err = rpf_schedule_start(dev, 0, sched_path);
+                        if(err == RPF_OK){
+                            printf("Gain scheduling running in the background, type 'schedule' again to stop it\n");
+                        } else {
+                            rpf_settings_set(dev, &settings);
+                            if(err == RPF_ETRIPPED){
+                                printf("Watchdog tripped, re-arm it first ('arm')\n");
+                            }
+                        }
+                    }
+                }
+                printf("\n");
+            }
+
+            ////////////////////////////////////////////////////////////
+            // "profile" case -> tuned gains kept across sessions
+            if(0 == strcmp(input_data, "profile")){
+                if(profile_path == NULL){
+                    printf("No profile store, start the program with --profiles [file]\n\n");
+                    continue;
+                }
                 printf("------------------------\n");
-                printf("Final value of k_d: %d\n", k_d);
+                printf("Trap conditions: f0 %.6g Hz, pressure %.3g mbar, laser power %.3g mW (0: unknown)\n",
+                       cond[0], cond[1], cond[2]);
+                printf("Profiles in %s: %d\n", profile_path, rpf_profile_count(dev));
+                if(rpf_profile_nearest(dev, 0, &prof, &prof_dist) == RPF_OK){
+                    printf("Nearest: ");
+                    print_profile(&prof, prof_dist);
+                }
                 printf("------------------------\n");
-                printf("\n");  
+                printf("Type...\n");
+                printf("    'c' to set the trap conditions,\n");
+                printf("    'l' to load the nearest profile,\n");
+                printf("    's' to save the current settings,\n");
+                printf("    'exit' to go back\n>> ");
+                if(fgets(input_data, sizeof(input_data), stdin) == NULL){
+                    continue;
+                }
+                printf("\n");
+                input_data[strcspn(input_data, "\n")] = '\0';
+                if(0 == strcmp(input_data, "c")){
+                    double cond_new[RPF_CONDITIONS];
+                    printf("Write f0 (Hz), pressure (mbar) and laser power (mW), 0 if unknown\n>> ");
+                    if(fgets(input_data, sizeof(input_data), stdin) != NULL &&
+                       sscanf(input_data, "%lf %lf %lf", &cond_new[0], &cond_new[1], &cond_new[2]) == RPF_CONDITIONS &&
+                       rpf_profile_conditions(dev, cond_new) == RPF_OK){
+                        memcpy(cond, cond_new, sizeof(cond));
+                        if(rpf_profile_nearest(dev, 0, &prof, &prof_dist) == RPF_OK){
+                            printf("Nearest: ");
+                            print_profile(&prof, prof_dist);
+                        }
+                    } else {
+                        printf("Invalid trap conditions, keeping current ones\n");
+                    }
+                } else if(0 == strcmp(input_data, "l")){
+                    err = rpf_profile_load(dev, 0, &prof);
+                    if(err == RPF_ENODATA){
+                        printf("No profile for this channel yet\n");
+                    } else if(err == RPF_ETRIPPED){
+                        printf("Watchdog tripped, re-arm it first ('arm')\n");
+                    } else if(err != RPF_OK){
+                        printf(ANSI_COLOR_RED "Write failed: %s\n" ANSI_COLOR_RESET, rpf_strerror(err));
+                    } else {
+                        printf("------------------------\n");
+                        printf("New value of k_p:   %d\n", prof.gains.k_p);
+                        printf("New value of k_d:   %d\n", prof.gains.k_d);
+                        printf("New value of delay: %d\n", prof.gains.delay);
+                        printf("------------------------\n");
+                        printf("'ml'/'mlauto' now start from k_d = %d\n", prof.gains.k_d);
+                    }
+                } else if(0 == strcmp(input_data, "s")){
+                    if(rpf_profile_save(dev, 0, &prof) == RPF_OK){
+                        printf("Saved: ");
+                        print_profile(&prof, 0);
+                    }
+                }
+                printf("\n");
             }
-            
+
             ////////////////////////////////////////////////////////////
             // "kill" case -> set kp, kd to zero
             if(0 == strcmp(input_data, "k")){
+                rpf_es_stop(dev, 0);
+                rpf_schedule_stop(dev, 0);
                 ////////////////////////////////////////////////////////////////////
-                // Manipulate/read values of registers
-                reg_tmp1 = (unsigned int) 0 << 16;
-                reg_tmp2 = (unsigned int) 0 & 0x0000FFFF;
-                reg_tmp2 = reg_tmp1 + reg_tmp2;
-                *((uint32_t *)(cfg_pid)) = (uint32_t) reg_tmp2;   // write reg_tmp2 on pid memory address
-                
-                // get current k_p, k_d values
-                reg_pid = *(uint32_t *)(cfg_pid);  // get register value
-                k_p = (int) (reg_pid << 16)>>16; // 16 lowest bits: k_p
-                k_d = (int) (reg_pid >> 16); // 16 highest bits: k_d
-                k_d = (signed int)(k_d);
-                    
+                // Manipulate values of registers
+                gains.k_p = 0;
+                gains.k_d = 0;
+                repl_set(dev, &gains, RPF_KP | RPF_KD);
+
                 // print current k_p, k_d values
                 printf("------------------------\n");
-                printf("New value of k_p: %d\n", k_p);
-                printf("New value of k_d: %d\n", k_d);
+                printf("New value of k_p: %d\n", gains.k_p);
+                printf("New value of k_d: %d\n", gains.k_d);
                 printf("------------------------\n");
-                printf("\n");      
+                printf("\n");
             }
         }
-    } while(1);    
-    
+    } while(1);
+
     ////////////////////////////////////////////////////////////////////
-    // End routine    
-    // Stop the program from manipulating virtual memory
-    munmap(cfg_delay, sysconf(_SC_PAGESIZE));
-    munmap(cfg_pid, sysconf(_SC_PAGESIZE));
+    // End routine
+    // Stop extremum seeking, gain scheduling, the watchdogs and the energy
+    // samplers, flush the telemetry file and stop the program from
+    // manipulating virtual memory
+    rpf_close(dev);
     // End routine normally
     return 0;
 }
@@ -0,0 +1,479 @@
+/* *********************************************************************
+ * Monte Carlo simulator of the feedback-cooled particle
+ * *********************************************************************
+ * COMMENTS:
+ * Runs many independent particles, each tuned by its own copy of the
+ * 'mlauto' routine (same secant update, see rp_tuning.h), and reports
+ * the distribution of iterations/time to converge and final k_d/energy.
+ *
+ * Model, per particle, in ADC counts (time step dt = decim FPGA cycles):
+ *     xm  = quantize14(x + meas_noise)                 14-bit input
+ *     out = sat14((k_p xm(t - t1) + k_d xm(t - t2))/2^13)
+ *     v  += (-w0^2 x - gamma0 v - g out) dt + thermal noise
+ *     x  += v dt
+ *     e  += (x^2 - e) dt/tau                           energy IIR filter
+ *     energy word = sat16(e/2^shift)
+ * with t1 the loop delay and t2 = t1 + delay register (0-500 cycles,
+ * linearly interpolated between steps), gains saturated at +-8191 and
+ * g = c_fb 2^13 w0, so that at a quarter-period delay k_d = -1 adds a
+ * damping rate of about c_fb. Noise increments are variance-matched
+ * uniform variates (Gaussian after summing over many steps).
+ *
+ * Particles are stored as structure of arrays in chunks of MC_CHUNK so
+ * that the per-step loop vectorizes (NEON/SSE/AVX), and chunks are
+ * spread over one thread per core.
+ *
+ * Compile with
+ *     gcc -O3 -ffast-math mc_sim.c -o mc_sim.o -lm -lpthread
+ * (add -mfpu=neon on the Red Pitaya, -march=native on x86)
+ * *********************************************************************
+ */
+
+////////////////////////////////////////////////////////////////////////
+// Libraries
+#include <stdlib.h>      // general functions and variable types
+#include <stdio.h>       // standard input/output
+#include <stdint.h>      // more integer lengths
+#include <unistd.h>      // symbolic constants/types
+#include <string.h>      // strings package
+#include <math.h>        // math functions
+#include <time.h>        // clock_gettime
+#include <pthread.h>     // threads
+#include "rp_tuning.h"   // ML secant step
+
+////////////////////////////////////////////////////////////////////////
+// Settings
+#define FPGA_CLOCK_HZ       125e6       // FPGA clock (delay register unit)
+#define MC_CHUNK            256         // particles simulated together
+#define MC_MAX_HIST         512         // delay line length (steps)
+#define MC_MAX_THREADS      64          // max worker threads
+#define MAX_GAIN            8191        // gain saturation
+#define MAX_DELAY           500         // delay register saturation
+#define ADC_MAX             8191        // 14-bit input/output range
+#define ENERGY_MAX          65535       // 16-bit energy word
+
+////////////////////////////////////////////////////////////////////////
+// Types
+
+// Simulation parameters
+struct mc_params {
+    double f0;          // trap frequency (Hz)
+    double gamma0;      // natural damping rate (1/s)
+    double x_th;        // thermal rms amplitude without feedback (counts)
+    double meas_noise;  // rms measurement noise (counts)
+    double c_fb;        // feedback damping per gain count (1/s)
+    double loop_delay;  // loop delay, excluding the delay register (cycles)
+    int delay;          // delay register (cycles)
+    int decim;          // FPGA cycles per simulation step
+    double tau;         // energy filter time constant (s)
+    int shift;          // energy word = filtered x^2 >> shift
+    double dwell;       // simulated dwell per energy reading (s)
+    int max_iter;       // max 'mlauto' iterations
+    long int n;         // number of particles
+    int threads;        // worker threads
+    unsigned int seed;  // random seed
+};
+
+// Result for one particle
+struct mc_result {
+    int iterations;     // 'mlauto' iterations
+    int converged;      // 1 if the stop criterion was met
+    float k_d;          // final k_d
+    float energy;       // final energy reading
+};
+
+// One chunk of particles, structure of arrays
+struct mc_chunk {
+    float x[MC_CHUNK];                  // position (counts)
+    float v[MC_CHUNK];                  // velocity (counts/s)
+    float e[MC_CHUNK];                  // filtered x^2
+    float k_p[MC_CHUNK];                // gains (register counts)
+    float k_d[MC_CHUNK];
+    uint32_t rng[MC_CHUNK];             // xorshift32 states
+    float hist[MC_MAX_HIST][MC_CHUNK];  // delay line of quantized input
+    int slot;                           // newest delay line slot
+};
+
+// Worker thread arguments
+struct mc_worker {
+    pthread_t thread;
+    struct mc_params *p;
+    struct mc_result *res;  // results of all particles
+    long int first, last;   // particles [first, last)
+    double steps;           // particle-steps simulated
+};
+
+////////////////////////////////////////////////////////////////////////
+// Functions
+
+// Current CLOCK_MONOTONIC time in s
+//
+double monotonic_s(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+// Uniform variate in [-sqrt(3), sqrt(3)) (unit variance) from xorshift32
+//
+static inline float rand_unit(uint32_t *s){
+    uint32_t x = *s;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *s = x;
+    return (float) ((int32_t) x)*(1.7320508f/2147483648.0f);
+}
+
+// Saturate to [-max, max]
+//
+static inline float satf(float x, float max){
+    return fminf(fmaxf(x, -max), max);
+}
+
+// Initialize a chunk: thermal state, feedback off
+//
+int mc_chunk_init(struct mc_chunk *c, struct mc_params *p, unsigned int seed){
+    float w0 = 2*M_PI*p->f0;
+    for(int i = 0; i < MC_CHUNK; i++){
+        c->rng[i] = 2654435761u*(seed + i) | 1;
+        c->x[i] = p->x_th*rand_unit(&c->rng[i]);
+        c->v[i] = w0*p->x_th*rand_unit(&c->rng[i]);
+        c->e[i] = p->x_th*p->x_th;
+        c->k_p[i] = 0;
+        c->k_d[i] = 0;
+    }
+    memset(c->hist, 0, sizeof(c->hist));
+    c->slot = 0;
+    // end function normally
+    return 0;
+}
+
+// Advance a chunk by n_steps simulation steps
+//
+// The inner loop runs over particles with shared delay taps, so it has
+// no branches and vectorizes.
+//
+int mc_chunk_run(struct mc_chunk *c, struct mc_params *p, long int n_steps){
+    const float dt = p->decim/FPGA_CLOCK_HZ;
+    const float w0 = 2*M_PI*p->f0;
+    const float w02 = w0*w0;
+    const float g = p->c_fb*8192*w0;
+    const float sig_v = sqrtf(2*p->gamma0*w02*p->x_th*p->x_th*dt);
+    const float sig_m = p->meas_noise;
+    const float alpha = dt/p->tau;
+    const float gamma0 = p->gamma0;
+    // fractional delays in steps
+    const float d1 = p->loop_delay/p->decim;
+    const float d2 = (p->loop_delay + p->delay)/p->decim;
+    const int i1 = (int) d1, i2 = (int) d2;
+    const float f1 = d1 - i1, f2 = d2 - i2;
+    int s, s1a, s1b, s2a, s2b;
+
+    for(long int n = 0; n < n_steps; n++){
+        s = c->slot = (c->slot + 1) % MC_MAX_HIST;
+        s1a = (s - i1 + MC_MAX_HIST) % MC_MAX_HIST;
+        s1b = (s1a - 1 + MC_MAX_HIST) % MC_MAX_HIST;
+        s2a = (s - i2 + MC_MAX_HIST) % MC_MAX_HIST;
+        s2b = (s2a - 1 + MC_MAX_HIST) % MC_MAX_HIST;
+        // taps may point at the slot being written (zero delay)
+        float *h = c->hist[s];
+        const float *h1a = c->hist[s1a], *h1b = c->hist[s1b];
+        const float *h2a = c->hist[s2a], *h2b = c->hist[s2b];
+
+        for(int i = 0; i < MC_CHUNK; i++){
+            // 14-bit quantized measurement into the delay line
+            float xm = c->x[i] + sig_m*rand_unit(&c->rng[i]);
+            h[i] = satf(floorf(xm + 0.5f), ADC_MAX);
+            // delayed taps and 14-bit saturated output
+            float x1 = (1 - f1)*h1a[i] + f1*h1b[i];
+            float x2 = (1 - f2)*h2a[i] + f2*h2b[i];
+            float out = satf((c->k_p[i]*x1 + c->k_d[i]*x2)*(1.0f/8192), ADC_MAX);
+            // Langevin step (semi-implicit Euler)
+            float a = -w02*c->x[i] - gamma0*c->v[i] - g*out;
+            c->v[i] += a*dt + sig_v*rand_unit(&c->rng[i]);
+            c->x[i] += c->v[i]*dt;
+            // energy filter
+            c->e[i] += alpha*(c->x[i]*c->x[i] - c->e[i]);
+        }
+    }
+    // end function normally
+    return 0;
+}
+
+// Energy word of a particle (16 bits, saturated)
+//
+static inline float mc_energy(struct mc_chunk *c, struct mc_params *p, int i){
+    float e = floorf(ldexpf(c->e[i], -p->shift));
+    return fminf(e, ENERGY_MAX);
+}
+
+// Set k_d of a particle as the register would hold it
+//
+static inline int mc_set_kd(struct mc_chunk *c, int i, float k){
+    int k_int = (int) k;
+    c->k_d[i] = satf(k_int, MAX_GAIN);
+    // end function normally
+    return 0;
+}
+
+// Run 'mlauto' on every particle of a chunk
+//
+// Mirrors the control program: k_p = 0, k_d = k0, one dwell, then
+// secant steps with one dwell per k_d until |energy1 - energy0| <= tol.
+// All particles dwell together; converged ones keep their gains.
+//
+int mc_chunk_mlauto(struct mc_chunk *c, struct mc_params *p, struct mc_result *res, int count, double *steps){
+    long int dwell_steps = (long int) (p->dwell*FPGA_CLOCK_HZ/p->decim);
+    float k0[MC_CHUNK], k1[MC_CHUNK], energy0[MC_CHUNK], energy1[MC_CHUNK];
+    int done[MC_CHUNK], active;
+
+    // thermalize with feedback off, then initial k_d
+    mc_chunk_run(c, p, dwell_steps);
+    for(int i = 0; i < MC_CHUNK; i++){
+        k0[i] = ML_K0;
+        k1[i] = ML_K1;
+        done[i] = 0;
+        mc_set_kd(c, i, k0[i]);
+    }
+    mc_chunk_run(c, p, dwell_steps);
+    for(int i = 0; i < MC_CHUNK; i++){
+        energy0[i] = mc_energy(c, p, i);
+        energy1[i] = energy0[i] + 2;
+    }
+    *steps += 2.0*dwell_steps*MC_CHUNK;
+
+    for(int it = 1; it <= p->max_iter; it++){
+        for(int i = 0; i < MC_CHUNK; i++){
+            if(!done[i]){
+                mc_set_kd(c, i, k1[i]);
+            }
+        }
+        mc_chunk_run(c, p, dwell_steps);
+        *steps += (double) dwell_steps*MC_CHUNK;
+
+        active = 0;
+        for(int i = 0; i < MC_CHUNK; i++){
+            if(done[i]){
+                continue;
+            }
+            energy0[i] = energy1[i];
+            energy1[i] = mc_energy(c, p, i);
+            ml_secant_step(&k0[i], &k1[i], energy0[i], energy1[i]);
+            ml_clamp_kd(&k1[i]);
+            if(ml_converged(energy0[i], energy1[i])){
+                done[i] = 1;
+            }
+            if(i < count){
+                res[i].iterations = it;
+                res[i].converged = done[i];
+                res[i].k_d = c->k_d[i];
+                res[i].energy = energy1[i];
+            }
+            active += !done[i];
+        }
+        if(active == 0){
+            break;
+        }
+    }
+    // end function normally
+    return 0;
+}
+
+// Worker thread: simulate particles [first, last) chunk by chunk
+//
+void *mc_worker_thread(void *arg){
+    struct mc_worker *w = (struct mc_worker *) arg;
+    struct mc_chunk *c = aligned_alloc(64, sizeof(struct mc_chunk));
+    int count;
+
+    w->steps = 0;
+    if(c == NULL){
+        return NULL;
+    }
+    for(long int first = w->first; first < w->last; first += MC_CHUNK){
+        count = (w->last - first < MC_CHUNK) ? (int) (w->last - first) : MC_CHUNK;
+        mc_chunk_init(c, w->p, w->p->seed + (unsigned int) first);
+        mc_chunk_mlauto(c, w->p, &w->res[first], count, &w->steps);
+    }
+    free(c);
+    return NULL;
+}
+
+// Compare floats (qsort)
+//
+int cmp_float(const void *a, const void *b){
+    float fa = *(const float *) a, fb = *(const float *) b;
+    return (fa > fb) - (fa < fb);
+}
+
+// Print min, median, p90 and max of n values (sorts them)
+//
+int print_distribution(const char *name, float *values, long int n){
+    if(n == 0){
+        printf("%-24s -\n", name);
+        return 0;
+    }
+    qsort(values, n, sizeof(float), cmp_float);
+    printf("%-24s min %9.2f  median %9.2f  p90 %9.2f  max %9.2f\n",
+           name, values[0], values[n/2], values[(9*n)/10], values[n - 1]);
+    // end function normally
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////
+// Main loop
+//
+int main(int argc, char **argv){
+
+    ////////////////////////////////////////////////////////////////////
+    // Program variables
+    struct mc_params p = {
+        125e3,      // f0
+        10,         // gamma0
+        1000,       // x_th
+        20,         // measurement noise
+        1.0,        // c_fb
+        0,          // loop delay
+        250,        // delay register (quarter period)
+        25,         // decimation
+        1e-3,       // energy filter time constant
+        5,          // energy shift
+        0.05,       // dwell
+        50,         // max iterations
+        1024,       // particles
+        0,          // threads (0: one per core)
+        1           // seed
+    };
+    struct mc_worker workers[MC_MAX_THREADS];
+    struct mc_result *res;
+    float *values;
+    long int per_thread, n_conv = 0, n_val;
+    double t_start, t_wall, steps = 0;
+    const char *csv_file = NULL;
+    FILE *csv;
+
+    ////////////////////////////////////////////////////////////////////
+    // Parse arguments
+    for(int i = 1; i < argc; i++){
+        if(0 == strcmp(argv[i], "--particles") && i + 1 < argc){
+            p.n = atol(argv[++i]);
+        } else if(0 == strcmp(argv[i], "--threads") && i + 1 < argc){
+            p.threads = atoi(argv[++i]);
+        } else if(0 == strcmp(argv[i], "--f0") && i + 1 < argc){
+            p.f0 = atof(argv[++i]);
+        } else if(0 == strcmp(argv[i], "--gamma0") && i + 1 < argc){
+            p.gamma0 = atof(argv[++i]);
+        } else if(0 == strcmp(argv[i], "--noise") && i + 1 < argc){
+            p.meas_noise = atof(argv[++i]);
+        } else if(0 == strcmp(argv[i], "--delay") && i + 1 < argc){
+            p.delay = atoi(argv[++i]);
+        } else if(0 == strcmp(argv[i], "--loop-delay") && i + 1 < argc){
+            p.loop_delay = atof(argv[++i]);
+        } else if(0 == strcmp(argv[i], "--decim") && i + 1 < argc){
+            p.decim = atoi(argv[++i]);
+        } else if(0 == strcmp(argv[i], "--dwell") && i + 1 < argc){
+            p.dwell = atof(argv[++i]);
+        } else if(0 == strcmp(argv[i], "--max-iter") && i + 1 < argc){
+            p.max_iter = atoi(argv[++i]);
+        } else if(0 == strcmp(argv[i], "--seed") && i + 1 < argc){
+            p.seed = (unsigned int) atol(argv[++i]);
+        } else if(0 == strcmp(argv[i], "--csv") && i + 1 < argc){
+            csv_file = argv[++i];
+        } else {
+            printf("Usage: %s [--particles n] [--threads n] [--f0 Hz] [--gamma0 1/s] [--noise counts]\n"
+                   "          [--delay cycles] [--loop-delay cycles] [--decim cycles] [--dwell s]\n"
+                   "          [--max-iter n] [--seed s] [--csv file]\n", argv[0]);
+            return 1;
+        }
+    }
+    p.delay = (p.delay < 0) ? 0 : (p.delay > MAX_DELAY) ? MAX_DELAY : p.delay;
+    if(p.n < 1 || p.decim < 1 || (p.loop_delay + p.delay)/p.decim + 2 >= MC_MAX_HIST){
+        printf("Invalid number of particles, decimation or delay\n");
+        return 1;
+    }
+    if(p.threads < 1){
+        p.threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if(p.threads > MC_MAX_THREADS){
+        p.threads = MC_MAX_THREADS;
+    }
+    res = calloc(p.n, sizeof(struct mc_result));
+    values = calloc(p.n, sizeof(float));
+    if(res == NULL || values == NULL){
+        printf("Out of memory\n");
+        return 1;
+    }
+
+    ////////////////////////////////////////////////////////////////////
+    // Run workers, whole chunks per thread
+    per_thread = ((p.n + p.threads - 1)/p.threads + MC_CHUNK - 1)/MC_CHUNK*MC_CHUNK;
+    t_start = monotonic_s();
+    for(int t = 0; t < p.threads; t++){
+        workers[t].p = &p;
+        workers[t].res = res;
+        workers[t].first = (t*per_thread < p.n) ? t*per_thread : p.n;
+        workers[t].last = ((t + 1)*per_thread < p.n) ? (t + 1)*per_thread : p.n;
+        pthread_create(&workers[t].thread, NULL, mc_worker_thread, &workers[t]);
+    }
+    for(int t = 0; t < p.threads; t++){
+        pthread_join(workers[t].thread, NULL);
+        steps += workers[t].steps;
+    }
+    t_wall = monotonic_s() - t_start;
+
+    ////////////////////////////////////////////////////////////////////
+    // Report
+    printf("------------------------\n");
+    printf("Monte Carlo 'mlauto': %ld particles, %d threads, dwell %.3g s, delay %d\n", p.n, p.threads, p.dwell, p.delay);
+    printf("Simulated %.3g particle-steps in %.2f s (%.3g steps/s)\n", steps, t_wall, steps/t_wall);
+    printf("------------------------\n");
+    for(long int i = 0; i < p.n; i++){
+        n_conv += res[i].converged;
+    }
+    printf("Converged: %ld/%ld (%.1f%%)\n", n_conv, p.n, 100.0*n_conv/p.n);
+    n_val = 0;
+    for(long int i = 0; i < p.n; i++){
+        if(res[i].converged){
+            values[n_val++] = res[i].iterations;
+        }
+    }
+    print_distribution("Iterations to converge", values, n_val);
+    n_val = 0;
+    for(long int i = 0; i < p.n; i++){
+        if(res[i].converged){
+            values[n_val++] = (res[i].iterations + 1)*p.dwell;
+        }
+    }
+    print_distribution("Time to converge (s)", values, n_val);
+    for(long int i = 0; i < p.n; i++){
+        values[i] = res[i].k_d;
+    }
+    print_distribution("Final k_d", values, p.n);
+    for(long int i = 0; i < p.n; i++){
+        values[i] = res[i].energy;
+    }
+    print_distribution("Final energy", values, p.n);
+    printf("------------------------\n");
+
+    // per-particle results
+    if(csv_file != NULL){
+        csv = fopen(csv_file, "w");
+        if(csv == NULL){
+            perror("fopen");
+            return 1;
+        }
+        fprintf(csv, "particle,iterations,converged,k_d,energy\n");
+        for(long int i = 0; i < p.n; i++){
+            fprintf(csv, "%ld,%d,%d,%.0f,%.0f\n", i, res[i].iterations, res[i].converged, res[i].k_d, res[i].energy);
+        }
+        fclose(csv);
+    }
+
+    ////////////////////////////////////////////////////////////////////
+    // End routine
+    free(res);
+    free(values);
+    // End routine normally
+    return 0;
+}
@@ -0,0 +1,251 @@
+/* *********************************************************************
+ * Plant simulator for the simulated register backend
+ * *********************************************************************
+ * COMMENTS:
+ * Maps the shared-memory register file used by
+ *     ./cpu_opt_control.o --sim [file]
+ * reads the delay and k_p/k_d words written by the control program and
+ * updates the energy word from a model of the feedback-cooled particle:
+ *
+ *     dE/dt = -G (E - E_ss),  G = gamma0 + G_fb,
+ *     G_fb  = -c_fb (k_p sin(w t1) + k_d sin(w t2)),
+ *     E_ss  = (gamma0 E_th + c_noise (k_p^2 + k_d^2))/G,
+ *
+ * with t1 the loop delay and t2 = t1 + delay register. Negative k_d
+ * cools at a quarter-period delay, feedback noise heats as k^2, and a
+ * negative G makes the particle heat up until the energy saturates.
+ * The readout adds relative noise and is quantized to 16 bits.
+ *
+ * Simulated time runs speedup times faster than wall-clock time. With
+ * --map, every channel of the register map is an independent particle
+ * with the same parameters.
+ *
+ * Compile with
+ *     gcc plant_sim.c -o plant_sim.o -lm
+ * *********************************************************************
+ */
+
+////////////////////////////////////////////////////////////////////////
+// Libraries
+#include <stdlib.h>      // general functions and variable types
+#include <stdio.h>       // standard input/output
+#include <stdint.h>      // more integer lengths
+#include <unistd.h>      // symbolic constants/types
+#include <sys/mman.h>    // memory management
+#include <sys/stat.h>    // file modes
+#include <fcntl.h>       // file control (open...)
+#include <string.h>      // strings package
+#include <math.h>        // math functions
+#include <time.h>        // clock_gettime, clock_nanosleep
+#include <signal.h>      // stop on Ctrl-C
+#include "rp_regs.h"     // FPGA register layout
+
+////////////////////////////////////////////////////////////////////////
+// Settings
+#define FPGA_CLOCK_HZ       125e6       // FPGA clock (delay register unit)
+#define ENERGY_MAX          65535       // 16-bit energy word
+#define NSEC_PER_SEC        1000000000ULL
+
+////////////////////////////////////////////////////////////////////////
+// Types
+
+// Plant model parameters
+struct plant_params {
+    double f0;          // trap frequency (Hz)
+    double loop_delay;  // loop delay, excluding the delay register (FPGA cycles)
+    double gamma0;      // natural damping rate (1/s)
+    double e_th;        // energy without feedback (counts)
+    double c_fb;        // feedback damping per gain count (1/s)
+    double c_noise;     // feedback heating per gain count^2 (counts/s)
+    double readout;     // relative readout noise
+    double speedup;     // simulated time per wall-clock time
+    double period_us;   // wall-clock update period (us)
+};
+
+////////////////////////////////////////////////////////////////////////
+// Functions
+
+static volatile sig_atomic_t running = 1;
+
+// Stop main loop on signal
+//
+void stop_handler(int sig){
+    (void) sig;
+    running = 0;
+}
+
+// Standard normal random number (Box-Muller)
+//
+double randn(void){
+    double u1 = (rand() + 1.0)/(RAND_MAX + 2.0);
+    double u2 = (rand() + 1.0)/(RAND_MAX + 2.0);
+    return sqrt(-2*log(u1))*cos(2*M_PI*u2);
+}
+
+// Total damping rate and steady-state energy for the current registers
+//
+int plant_rates(struct plant_params *p, int16_t k_p, int16_t k_d, uint16_t delay, double *rate, double *e_ss){
+    double w0 = 2*M_PI*p->f0;
+    double t1 = p->loop_delay/FPGA_CLOCK_HZ;
+    double t2 = (p->loop_delay + delay)/FPGA_CLOCK_HZ;
+    double heat = p->gamma0*p->e_th + p->c_noise*((double) k_p*k_p + (double) k_d*k_d);
+
+    *rate = p->gamma0 - p->c_fb*(k_p*sin(w0*t1) + k_d*sin(w0*t2));
+    *e_ss = (*rate > 0) ? heat/(*rate) : ENERGY_MAX;
+    // end function normally
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////
+// Main loop
+//
+int main(int argc, char **argv){
+
+    ////////////////////////////////////////////////////////////////////
+    // Program variables
+    const char *sim_file = RP_SIM_FILE; // simulated register file
+    struct plant_params p = {
+        125e3,      // f0
+        0,          // loop delay
+        1.0,        // gamma0
+        20000,      // E_th
+        1.0,        // c_fb
+        0.22,       // c_noise (optimum near k_d = -300 at a quarter period)
+        0.05,       // readout noise
+        1.0,        // speedup
+        100         // update period (us)
+    };
+    const char *map_file = NULL; // register map (NULL: one channel, default addresses)
+    struct rp_map map;
+    struct rp_channel *ch;
+    int fd; // file identifier
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t size; // register file size
+    void *regs; // register pages
+    volatile uint32_t *cfg_delay[RP_MAX_CHANNELS], *cfg_pid[RP_MAX_CHANNELS], *data_energy[RP_MAX_CHANNELS];
+    struct stat st;
+    struct timespec deadline;
+
+    uint32_t reg_pid, reg_energy;
+    uint16_t field[RP_MAX_CHANNELS]; // energy readouts
+    double energy[RP_MAX_CHANNELS], rate, e_ss, dt, readout;
+
+    ////////////////////////////////////////////////////////////////////
+    // Parse arguments
+    for(int i = 1; i < argc; i++){
+        if(0 == strcmp(argv[i], "--file") && i + 1 < argc){
+            sim_file = argv[++i];
+        } else if(0 == strcmp(argv[i], "--speedup") && i + 1 < argc){
+            p.speedup = atof(argv[++i]);
+        } else if(0 == strcmp(argv[i], "--f0") && i + 1 < argc){
+            p.f0 = atof(argv[++i]);
+        } else if(0 == strcmp(argv[i], "--loop-delay") && i + 1 < argc){
+            p.loop_delay = atof(argv[++i]);
+        } else if(0 == strcmp(argv[i], "--noise") && i + 1 < argc){
+            p.readout = atof(argv[++i]);
+        } else if(0 == strcmp(argv[i], "--map") && i + 1 < argc){
+            map_file = argv[++i];
+        } else {
+            printf("Usage: %s [--file f] [--speedup s] [--f0 Hz] [--loop-delay cycles] [--noise rel] [--map file]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    ////////////////////////////////////////////////////////////////////
+    // Map simulated registers
+    // one page per distinct register page of the map, as in the control program
+    if(map_file == NULL){
+        rp_map_default(&map);
+    } else if(rp_map_load(&map, map_file, stdout) != 0){
+        return 1;
+    }
+    size = rp_map_pages(&map, page)*page;
+    fd = open(sim_file, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    if(fd < 0 || fstat(fd, &st) != 0){
+        perror("open");
+        return 1;
+    }
+    if(ftruncate(fd, size) != 0){
+        perror("ftruncate");
+        return 1;
+    }
+    regs = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if(regs == MAP_FAILED){
+        perror("mmap");
+        return 1;
+    }
+    for(int c = 0; c < map.n; c++){
+        ch = &map.ch[c];
+        cfg_delay[c]   = (volatile uint32_t *) (regs + rp_map_page(&map, ch->delay_addr, page)*page + ch->delay_addr % page);
+        data_energy[c] = (volatile uint32_t *) (regs + rp_map_page(&map, ch->energy_addr, page)*page + ch->energy_addr % page);
+        cfg_pid[c]     = (volatile uint32_t *) (regs + rp_map_page(&map, ch->pid_addr, page)*page + ch->pid_addr % page);
+
+        // new file (or grown by the map): quarter-period delay, feedback off
+        if((size_t) st.st_size < size){
+            *cfg_delay[c] = (uint32_t) lround(FPGA_CLOCK_HZ/(4*p.f0) - p.loop_delay) & 0x0000FFFF;
+            *cfg_pid[c] = 0;
+        }
+        energy[c] = p.e_th;
+    }
+
+    printf("Plant simulator on %s: f0 %.6g Hz, speedup %.3g, %d channel%s\n", sim_file, p.f0, p.speedup,
+           map.n, (map.n > 1) ? "s" : "");
+    signal(SIGINT, stop_handler);
+    signal(SIGTERM, stop_handler);
+    srand((unsigned int) time(NULL));
+
+    ////////////////////////////////////////////////////////////////////
+    // Simulation loop
+    dt = p.speedup*p.period_us*1e-6;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    while(running){
+        for(int c = 0; c < map.n; c++){
+            // current registers
+            ch = &map.ch[c];
+            reg_pid = *cfg_pid[c];
+            plant_rates(&p, (int16_t) rp_field(reg_pid, ch->kp_shift), (int16_t) rp_field(reg_pid, ch->kd_shift),
+                        *cfg_delay[c] & 0x0000FFFF, &rate, &e_ss);
+
+            // exact relaxation step towards E_ss (growth if rate < 0)
+            if(rate > 0){
+                energy[c] = e_ss + (energy[c] - e_ss)*exp(-rate*dt);
+            } else {
+                energy[c] = energy[c]*exp(-rate*dt) + (p.gamma0*p.e_th)*dt;
+            }
+            if(energy[c] > ENERGY_MAX){
+                energy[c] = ENERGY_MAX;
+            }
+
+            // noisy, quantized readout
+            readout = energy[c]*(1 + p.readout*randn());
+            readout = (readout < 0) ? 0 : (readout > ENERGY_MAX) ? ENERGY_MAX : readout;
+            field[c] = (uint16_t) lround(readout);
+        }
+
+        // energy words, with the fields of every channel sharing them
+        for(int c = 0; c < map.n; c++){
+            reg_energy = 0;
+            for(int o = 0; o < map.n; o++){
+                if(data_energy[o] == data_energy[c]){
+                    reg_energy |= (uint32_t) field[o] << map.ch[o].energy_shift;
+                }
+            }
+            *data_energy[c] = reg_energy;
+        }
+
+        // next update
+        deadline.tv_nsec += (long) (p.period_us*1000);
+        while(deadline.tv_nsec >= (long) NSEC_PER_SEC){
+            deadline.tv_nsec -= NSEC_PER_SEC;
+            deadline.tv_sec++;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL);
+    }
+
+    ////////////////////////////////////////////////////////////////////
+    // End routine
+    munmap(regs, size);
+    close(fd);
+    // End routine normally
+    return 0;
+}
@@ -0,0 +1,393 @@
+/* *********************************************************************
+ * Register access and control-loop micro-benchmark
+ * *********************************************************************
+ * COMMENTS:
+ * Measures what the control program pays for every register access on
+ * the AXI GPIO path, and how fast the CPU could close a software loop
+ * around the registers. Tests, on the registers of one channel:
+ *     read        energy word read (uncached load)
+ *     write       PID word write (posted store)
+ *     write-read  PID word write followed by its read-back (the cost
+ *                 of --verify in the control program)
+ *     rmw         read-modify-write of the k_d field of the PID word
+ *     loop        one 'mlauto' update without the dwell: energy read,
+ *                 secant step and k_d clamp (rp_tuning.h), PID word
+ *                 packing and write
+ * Each test reports the latency distribution of single operations
+ * (min, median, 99th percentile, max, mean; the clock_gettime overhead
+ * is measured first and subtracted) and the sustained rate of a
+ * back-to-back burst of the same operation.
+ *
+ * Only the read test runs by default. The other tests write the PID
+ * word and only run with --write: they rewrite it with the value it
+ * held at the start (the loop test computes its word but stores the
+ * original), and the delay word is not touched. A store of that stale
+ * value would undo a watchdog trip or a tuner's change, so --write
+ * takes an exclusive lock on the register file and is refused while
+ * the control program (or the library) holds it; the control program
+ * does not start while the benchmark holds it.
+ *
+ * Runs against /dev/mem (default) or the simulated register file
+ * (--sim [file], see rp_regs.h), so it works on any Linux machine.
+ * --csv file appends one line per test with the kernel release, machine
+ * and a free-text tag (e.g. the bitstream version), to track
+ * regressions across firmware and kernel versions.
+ *
+ * Compile with
+ *     gcc -O2 rp_bench.c -o rp_bench.o -lm
+ * *********************************************************************
+ */
+
+////////////////////////////////////////////////////////////////////////
+// Libraries
+#define _GNU_SOURCE              // CPU affinity
+#include <stdlib.h>      // general functions and variable types
+#include <stdio.h>       // standard input/output
+#include <stdint.h>      // more integer lengths
+#include <unistd.h>      // symbolic constants/types
+#include <sys/mman.h>    // memory management
+#include <sys/stat.h>    // file modes
+#include <sys/utsname.h> // kernel release (CSV output)
+#include <fcntl.h>       // file control (open...)
+#include <string.h>      // strings package
+#include <math.h>        // math functions
+#include <time.h>        // clock_gettime
+#include <sched.h>       // SCHED_FIFO, CPU affinity
+#include <sys/file.h>    // flock (exclusive register access)
+#include <errno.h>       // error codes
+#include "rp_regs.h"     // FPGA register layout
+#include "rp_tuning.h"   // ML secant step
+
+////////////////////////////////////////////////////////////////////////
+// Settings
+#define BENCH_SAMPLES       100000      // timed operations per test
+#define BENCH_BURST         1000000     // operations of the throughput burst
+#define BENCH_WARMUP        1000        // untimed operations before each test
+#define BENCH_TESTS         5           // tests in the suite
+#define BENCH_READ_TESTS    1           // leading tests that do not write (run without --write)
+#define NSEC_PER_SEC        1000000000ULL
+
+////////////////////////////////////////////////////////////////////////
+// Types
+
+// Registers of the channel under test
+struct bench_regs {
+    volatile uint32_t *cfg_pid;     // packed k_p/k_d word
+    volatile uint32_t *data_energy; // energy word
+    struct rp_channel ch;           // field positions
+    uint32_t pid0;                  // PID word at the start (only value written)
+    float k0, k1;                   // secant state of the loop test
+    float energy0;                  // energy of the previous loop iteration
+    uint32_t sink;                  // results kept from the optimizer
+};
+
+// Result of one test
+struct bench_result {
+    const char *name;
+    long int n;                     // timed operations
+    double min, median, p99, max, mean; // latency (ns, timer overhead subtracted)
+    double rate;                    // sustained operations per second
+};
+
+////////////////////////////////////////////////////////////////////////
+// Functions
+
+// Monotonic clock in nanoseconds
+//
+static inline uint64_t monotonic_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec*NSEC_PER_SEC + ts.tv_nsec;
+}
+
+// Map the page of a register (physical address, or its page in the
+// simulated file) and return the register's address in it
+//
+volatile uint32_t *bench_map(int fd, int sim, struct rp_map *map, uint32_t addr, size_t page){
+    off_t offset = sim ? (off_t) (rp_map_page(map, addr, page)*page) : (off_t) (addr - addr % page);
+    void *p = mmap(NULL, page, PROT_READ|PROT_WRITE, MAP_SHARED, fd, offset);
+
+    return (p == MAP_FAILED) ? NULL : (volatile uint32_t *) ((char *) p + addr % page);
+}
+
+// One operation of each test
+//
+static void op_read(struct bench_regs *r){
+    r->sink += *r->data_energy;
+}
+
+static void op_write(struct bench_regs *r){
+    *r->cfg_pid = r->pid0;
+}
+
+static void op_write_read(struct bench_regs *r){
+    *r->cfg_pid = r->pid0;
+    r->sink += *r->cfg_pid;
+}
+
+static void op_rmw(struct bench_regs *r){
+    uint32_t word = *r->cfg_pid;
+    uint32_t mask = (uint32_t) 0xFFFF << r->ch.kd_shift;
+
+    // same k_d field back in: the cost of a k_d update, not its effect
+    *r->cfg_pid = (word & ~mask) | (r->pid0 & mask);
+}
+
+static void op_loop(struct bench_regs *r){
+    float energy1 = (float) rp_field(*r->data_energy, r->ch.energy_shift);
+
+    ml_secant_step(&r->k0, &r->k1, r->energy0, energy1);
+    ml_clamp_kd(&r->k1);
+    r->energy0 = energy1;
+    r->sink += rp_channel_pack(&r->ch, rp_field(r->pid0, r->ch.kp_shift), (int16_t) r->k1);
+    *r->cfg_pid = r->pid0;
+}
+
+// Sort comparison of latencies
+//
+static int cmp_u32(const void *a, const void *b){
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+    return (x > y) - (x < y);
+}
+
+// Latency of an empty timed region (ns), subtracted from every sample
+//
+double timer_overhead(uint32_t *lat, long int n){
+    uint64_t t0;
+
+    for(long int i = 0; i < n; i++){
+        t0 = monotonic_ns();
+        lat[i] = (uint32_t) (monotonic_ns() - t0);
+    }
+    qsort(lat, n, sizeof(uint32_t), cmp_u32);
+    return lat[0];
+}
+
+// Run one test: n timed single operations, then a timed burst
+//
+int bench_run(struct bench_regs *r, void (*op)(struct bench_regs *), long int n, long int burst,
+              double overhead, uint32_t *lat, struct bench_result *res){
+    uint64_t t0, t1;
+    double sum = 0, x;
+
+    for(long int i = 0; i < BENCH_WARMUP; i++){
+        op(r);
+    }
+    for(long int i = 0; i < n; i++){
+        t0 = monotonic_ns();
+        op(r);
+        t1 = monotonic_ns();
+        x = (double) (t1 - t0) - overhead;
+        lat[i] = (x > 0) ? (uint32_t) x : 0;
+        sum += lat[i];
+    }
+    qsort(lat, n, sizeof(uint32_t), cmp_u32);
+    res->n = n;
+    res->min = lat[0];
+    res->median = lat[n/2];
+    res->p99 = lat[(long int) (0.99*(n - 1))];
+    res->max = lat[n - 1];
+    res->mean = sum/n;
+
+    // sustained rate: back-to-back operations, one clock read
+    t0 = monotonic_ns();
+    for(long int i = 0; i < burst; i++){
+        op(r);
+    }
+    t1 = monotonic_ns();
+    res->rate = burst/((t1 - t0)*1e-9);
+    // end function normally
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////
+// Main loop
+//
+int main(int argc, char **argv){
+
+    ////////////////////////////////////////////////////////////////////
+    // Program variables
+    const char *sim_file = NULL; // simulated register file (NULL: /dev/mem)
+    const char *map_file = NULL; // register map (NULL: default addresses)
+    const char *channel = NULL; // channel of the map (NULL: the first)
+    const char *csv_file = NULL; // CSV output (appended)
+    const char *tag = ""; // free-text label of the run (CSV)
+    long int n = BENCH_SAMPLES; // timed operations per test
+    long int burst = BENCH_BURST; // operations of the throughput burst
+    int cpu = -1; // core to pin to (-1: any)
+    int rt_priority = 0; // SCHED_FIFO priority (0: default scheduling)
+    int write_tests = 0; // 1: also run the tests that write the PID word
+    int n_tests; // tests run
+    struct rp_map map;
+    struct bench_regs r;
+    int fd, c = 0;
+    size_t page = sysconf(_SC_PAGESIZE);
+    uint32_t *lat;
+    double overhead;
+    struct bench_result res[BENCH_TESTS];
+    const char *names[BENCH_TESTS] = {"read", "write", "write-read", "rmw", "loop"};
+    void (*ops[BENCH_TESTS])(struct bench_regs *) = {op_read, op_write, op_write_read, op_rmw, op_loop};
+    struct utsname un;
+    char date[32];
+    time_t now;
+    FILE *csv;
+
+    ////////////////////////////////////////////////////////////////////
+    // Parse arguments
+    for(int i = 1; i < argc; i++){
+        if(0 == strcmp(argv[i], "--sim")){
+            sim_file = RP_SIM_FILE;
+            if(i + 1 < argc && argv[i + 1][0] != '-'){
+                sim_file = argv[++i];
+            }
+        } else if(0 == strcmp(argv[i], "--map") && i + 1 < argc){
+            map_file = argv[++i];
+            if(i + 1 < argc && argv[i + 1][0] != '-'){
+                channel = argv[++i];
+            }
+        } else if(0 == strcmp(argv[i], "--samples") && i + 1 < argc){
+            n = atol(argv[++i]);
+        } else if(0 == strcmp(argv[i], "--burst") && i + 1 < argc){
+            burst = atol(argv[++i]);
+        } else if(0 == strcmp(argv[i], "--cpu") && i + 1 < argc){
+            cpu = atoi(argv[++i]);
+        } else if(0 == strcmp(argv[i], "--rt")){
+            rt_priority = 80;
+            if(i + 1 < argc && argv[i + 1][0] != '-'){
+                rt_priority = atoi(argv[++i]);
+            }
+        } else if(0 == strcmp(argv[i], "--csv") && i + 1 < argc){
+            csv_file = argv[++i];
+        } else if(0 == strcmp(argv[i], "--tag") && i + 1 < argc){
+            tag = argv[++i];
+        } else if(0 == strcmp(argv[i], "--write")){
+            write_tests = 1;
+        } else {
+            n = 0;
+            break;
+        }
+    }
+    if(n < 100 || burst < 1){
+        printf("Usage: %s [--sim [file]] [--map file [channel]] [--samples n] [--burst n] [--cpu n] [--rt [priority]]\n"
+               "          [--csv file] [--tag label] [--write]\n", argv[0]);
+        return 1;
+    }
+
+    ////////////////////////////////////////////////////////////////////
+    // Map registers
+    if(map_file == NULL){
+        rp_map_default(&map);
+    } else if(rp_map_load(&map, map_file, stdout) != 0){
+        return 1;
+    }
+    for(int i = 0; i < map.n && channel != NULL; i++){
+        c = (0 == strcmp(map.ch[i].name, channel)) ? i : c;
+    }
+    if(channel != NULL && 0 != strcmp(map.ch[c].name, channel)){
+        printf("No channel %s in %s\n", channel, map_file);
+        return 1;
+    }
+    fd = (sim_file != NULL) ? open(sim_file, O_RDWR) : open("/dev/mem", O_RDWR | O_SYNC);
+    if(fd < 0){
+        perror("open");
+        return 1;
+    }
+    // nobody else may write the PID word while it is rewritten with its old value
+    if(write_tests && flock(fd, LOCK_EX | LOCK_NB) != 0){
+        if(errno == EWOULDBLOCK){
+            printf("The control program has the registers open, write tests refused (run without --write)\n");
+        } else {
+            perror("flock");
+        }
+        return 1;
+    }
+    n_tests = write_tests ? BENCH_TESTS : BENCH_READ_TESTS;
+    if(sim_file != NULL){
+        struct stat st;
+        if(fstat(fd, &st) != 0 || (size_t) st.st_size < rp_map_pages(&map, page)*page){
+            printf("%s is smaller than the register map, start the control program or plant_sim first\n", sim_file);
+            return 1;
+        }
+    }
+    r.ch = map.ch[c];
+    r.cfg_pid = bench_map(fd, sim_file != NULL, &map, r.ch.pid_addr, page);
+    r.data_energy = bench_map(fd, sim_file != NULL, &map, r.ch.energy_addr, page);
+    if(r.cfg_pid == NULL || r.data_energy == NULL){
+        perror("mmap");
+        return 1;
+    }
+    r.pid0 = *r.cfg_pid;
+    r.k0 = ML_K0;
+    r.k1 = ML_K1;
+    r.energy0 = 0;
+    r.sink = 0;
+
+    // pin and lock, as the control program in real-time mode
+    if(cpu >= 0 || rt_priority > 0){
+        cpu_set_t cpus;
+        struct sched_param param = {rt_priority};
+        CPU_ZERO(&cpus);
+        CPU_SET((cpu >= 0) ? cpu : sched_getcpu(), &cpus);
+        if(sched_setaffinity(0, sizeof(cpus), &cpus) != 0){
+            perror("sched_setaffinity");
+        }
+        if(rt_priority > 0 && (mlockall(MCL_CURRENT | MCL_FUTURE) != 0 || sched_setscheduler(0, SCHED_FIFO, &param) != 0)){
+            perror("real-time mode");
+        }
+    }
+    lat = malloc(n*sizeof(uint32_t));
+    if(lat == NULL){
+        return 1;
+    }
+
+    ////////////////////////////////////////////////////////////////////
+    // Run tests
+    overhead = timer_overhead(lat, n);
+    for(int k = 0; k < n_tests; k++){
+        res[k].name = names[k];
+        bench_run(&r, ops[k], n, burst, overhead, lat, &res[k]);
+    }
+    if(write_tests){
+        *r.cfg_pid = r.pid0;
+    }
+
+    uname(&un);
+    printf("------------------------\n");
+    printf("Registers: %s%s%s, kernel %s (%s), timer overhead %.0f ns\n", (sim_file != NULL) ? sim_file : "/dev/mem",
+           r.ch.name[0] ? ", channel " : "", r.ch.name, un.release, un.machine, overhead);
+    printf("------------------------\n");
+    printf("%-10s %10s %10s %10s %10s %10s %14s\n", "test", "min ns", "median ns", "p99 ns", "max ns", "mean ns", "ops/s");
+    for(int k = 0; k < n_tests; k++){
+        printf("%-10s %10.0f %10.0f %10.0f %10.0f %10.1f %14.0f\n", res[k].name, res[k].min, res[k].median,
+               res[k].p99, res[k].max, res[k].mean, res[k].rate);
+    }
+    printf("------------------------\n");
+
+    ////////////////////////////////////////////////////////////////////
+    // Machine-readable output, one line per test
+    if(csv_file != NULL){
+        csv = fopen(csv_file, "a");
+        if(csv == NULL){
+            perror("fopen");
+            return 1;
+        }
+        if(ftell(csv) == 0){
+            fprintf(csv, "date,tag,kernel,machine,backend,channel,test,samples,min_ns,median_ns,p99_ns,max_ns,mean_ns,ops_per_s,timer_ns\n");
+        }
+        now = time(NULL);
+        strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", localtime(&now));
+        for(int k = 0; k < n_tests; k++){
+            fprintf(csv, "%s,%s,%s,%s,%s,%s,%s,%ld,%.0f,%.0f,%.0f,%.0f,%.1f,%.0f,%.0f\n", date, tag, un.release, un.machine,
+                    (sim_file != NULL) ? "sim" : "devmem", r.ch.name, res[k].name, res[k].n, res[k].min, res[k].median,
+                    res[k].p99, res[k].max, res[k].mean, res[k].rate, overhead);
+        }
+        fclose(csv);
+    }
+
+    ////////////////////////////////////////////////////////////////////
+    // End routine
+    free(lat);
+    close(fd);
+    // End routine normally
+    return 0;
+}
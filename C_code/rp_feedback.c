@@ -0,0 +1,6824 @@
+/* *********************************************************************
+ * Feedback control core of the CPU side of the Red Pitaya STEMLAB
+ * *********************************************************************
+ * COMMENTS:
+ * Registers, energy samplers, filter banks, watchdogs, the dwell
+ * engine, the tuners, extremum seeking, gain scheduling, the profile
+ * store, the LQR solver, trace replay and the daemon, behind the API of
+ * rp_feedback.h. The keyboard interface (cpu_opt_control.c) and
+ * library hosts only use that API.
+ *
+ * Compile the library with
+ *     gcc -O2 -shared -fPIC -fvisibility=hidden rp_feedback.c
+ *         -o librpfeedback.so -lm -lpthread
+ * or link it into the program (see cpu_opt_control.c).
+ * *********************************************************************
+ */
+////////////////////////////////////////////////////////////////////////
+// Libraries
+#define _GNU_SOURCE              // CPU affinity (real-time mode)
+#include <stdlib.h>      // general functions and variable types
+#include <stdio.h>       // standard input/output
+#include <stdint.h>      // more integer lengths
+#include <unistd.h>      // symbolic constants/types
+#include <sys/mman.h>    // memory management 
+#include <fcntl.h>       // file control (open...)
+#include <string.h>      // strings package
+#include <ctype.h>       // isspace (control socket commands)
+#include <math.h>        // math functions
+#include <unistd.h>      // for the sleep function
+#include <time.h>        // clock_gettime, clock_nanosleep
+#include <errno.h>       // error codes
+#include <stdarg.h>      // variable arguments (log messages)
+#include <pthread.h>     // threads (energy sampler)
+#include <stdatomic.h>   // lock-free ring buffer
+#include <sys/stat.h>    // file modes (simulated registers)
+#include <sched.h>       // SCHED_FIFO, CPU affinity
+#include <poll.h>        // daemon event loop
+#include <signal.h>      // daemon shutdown on SIGINT/SIGTERM
+#include <sys/socket.h>  // daemon control socket
+#include <sys/un.h>      // Unix-domain sockets
+#include <limits.h>      // PATH_MAX (profile store)
+#include <sys/file.h>    // flock (register file shared with rp_bench)
+#include <sys/vfs.h>     // fstatfs (telemetry file system, real-time mode)
+#include <linux/magic.h> // TMPFS_MAGIC
+#include "rp_regs.h"     // FPGA register layout
+#include "rp_tuning.h"   // ML secant step
+#include "rp_telemetry.h" // telemetry file layout
+#include "rp_feedback.h" // library API
+
+////////////////////////////////////////////////////////////////////////
+// Energy sampler settings
+#define ENERGY_RING_SIZE      65536     // samples kept in ring (power of 2)
+#define ENERGY_RING_MASK      (ENERGY_RING_SIZE - 1)
+#define SAMPLER_DEFAULT_RATE  1000      // default polling rate (Hz)
+#define SAMPLER_MAX_RATE      100000    // max polling rate (Hz)
+#define NSEC_PER_SEC          1000000000ULL
+#define JITTER_BINS           32        // wake-up latency histogram bins (powers of 2 ns)
+
+////////////////////////////////////////////////////////////////////////
+// Decimation filter bank settings
+#define FILTER_STAGES         4         // max outputs (cascaded decimation stages)
+#define CIC_ORDER             3         // CIC order (fixed: compensator designed for 3)
+#define CIC_MAX_R             1024      // max decimation per stage (64-bit accumulator headroom)
+#define FILTER_Q              8         // fractional bits of the fixed-point energy
+#define ENERGY_RAIL           0xFFFF    // energy word at saturation
+
+////////////////////////////////////////////////////////////////////////
+// Real-time mode settings
+#define RT_STACK_PREFAULT     (64*1024) // stack bytes touched after mlockall
+
+////////////////////////////////////////////////////////////////////////
+// Watchdog settings
+#define WD_DEFAULT_RATE       20000     // energy polling rate of the watchdog (Hz)
+#define WD_SNAPSHOT           512       // samples kept for the post-mortem snapshot
+#define WD_REASON_ENERGY      1         // tripped on the energy threshold
+#define WD_REASON_SLOPE       2         // tripped on the energy slope
+
+////////////////////////////////////////////////////////////////////////
+// Dwell engine settings
+#define DWELL_POLL_US         10000     // interval between sequential tests (us)
+#define TRANSIENT_TAUS        32        // candidate relaxation times of the transient fit
+#define TRANSIENT_TAU_MIN     0.01      // shortest candidate relaxation time (s)
+#define TRANSIENT_TAU_MAX     10.0      // longest candidate relaxation time (s)
+#define TRANSIENT_MIN_SAMPLES 20        // samples before the first prediction
+#define TRANSIENT_MIN_TAUS    1.5       // transient observed for at least this many tau
+#define TRANSIENT_REL_TOL     0.02      // confidence half-width of a prediction, relative to it
+
+////////////////////////////////////////////////////////////////////////
+// Tuner settings
+#define N_PARAMS              3         // tuned parameters: k_p, k_d, delay
+#define P_KP                  0         // index of k_p
+#define P_KD                  1         // index of k_d
+#define P_DELAY               2         // index of delay
+
+////////////////////////////////////////////////////////////////////////
+// Bayesian optimization settings
+#define GP_MAX_POINTS         64        // max energy evaluations kept by the GP
+#define BO_CANDIDATES         512       // random candidates per EI maximization
+#define BO_INITIAL_POINTS     5         // evaluations before the first EI step
+
+////////////////////////////////////////////////////////////////////////
+// Delay calibration settings
+#define CAL_MAX_POINTS        64        // max energy measurements per calibration
+#define CAL_GOLDEN            0.6180339887 // golden-section ratio
+#define CAL_Z                 1.96      // confidence interval of the optimum (95%)
+
+////////////////////////////////////////////////////////////////////////
+// Energy-landscape sweep settings
+#define SWEEP_MAX_POINTS      1024      // max measurements per sweep (all delay slices)
+#define SWEEP_MAX_DELAYS      8         // max delay slices
+#define SWEEP_MAX_DEPTH       6         // max refinement levels
+#define SWEEP_2OPT_PASSES     4         // 2-opt passes over each batch of points
+
+////////////////////////////////////////////////////////////////////////
+// Extremum-seeking settings
+#define ES_FREQ_RATIO         {1.31, 1.0, 0.77}  // dither frequencies of k_p, k_d, delay (x freq)
+#define ES_WARMUP_PERIODS     3         // dither periods before the gains start moving
+
+////////////////////////////////////////////////////////////////////////
+// Gain-scheduling settings
+#define SCHED_MAX_ENTRIES     16        // max regimes in a schedule table
+#define SCHED_DEFAULT_RATE    20000     // energy polling rate of the scheduler (Hz)
+#define SCHED_LOG             64        // transitions kept until reported
+
+////////////////////////////////////////////////////////////////////////
+// Profile cache settings
+#define PROFILE_MAGIC         "RPPROF01" // 8 bytes, no terminator stored
+#define PROFILE_VERSION       1
+#define PROFILE_MAX           256       // profiles kept (the oldest is replaced when full)
+#define PROFILE_CONDITIONS    3         // trap conditions: f0, pressure, laser power
+#define PROFILE_SCALES        {0.05, 0.7, 0.1} // log-ratio of each condition counted as distance 1
+#define PROFILE_MISSING       1.0       // distance of a condition the profile does not have
+#define PROFILE_ENERGY_MS     100       // energy window stored with a profile (ms)
+
+////////////////////////////////////////////////////////////////////////
+// LQR solver settings
+#define FPGA_CLOCK_HZ         125e6     // FPGA clock (delay register unit)
+#define LQR_MAX_ITER          64        // max doubling iterations
+#define LQR_TOL               1e-12     // relative convergence tolerance
+
+////////////////////////////////////////////////////////////////////////
+// Telemetry recorder settings
+#define TEL_DEFAULT_RECORDS   (1 << 22) // ring capacity (32-byte records, 70 min at 1 kHz)
+
+////////////////////////////////////////////////////////////////////////
+// Trace replay settings
+#define REPLAY_MAX_POINTS     4096      // distinct settings kept from a trace
+#define REPLAY_MIN_SAMPLES    10        // settled samples for a setting to enter the model
+#define REPLAY_NEIGHBOURS     4         // recorded settings interpolated between
+#define REPLAY_DEFAULT_RUNS   20        // runs per tuner
+#define REPLAY_DEFAULT_TUNERS "mlauto,spsa,bo,delay"
+
+////////////////////////////////////////////////////////////////////////
+// Daemon settings
+#define DAEMON_MAX_CLIENTS    8         // simultaneous socket clients
+#define DAEMON_LINE_MAX       256       // max command line length (bytes)
+
+////////////////////////////////////////////////////////////////////////
+// Metrics settings
+#define METRICS_SLOTS         (4*RP_MAX_CHANNELS + 1)  // threads with their own slot (4 per channel, main)
+#define METRICS_BUCKETS       16        // latency buckets: up to 64 ns * 4^b, the last one +Inf
+#define METRICS_DEFAULT_PERIOD 1.0      // metrics file rewrite period (s)
+
+////////////////////////////////////////////////////////////////////////
+// Library settings
+#define RPF_LOG_LINE          256       // longest message line passed to the host's callback
+
+////////////////////////////////////////////////////////////////////////
+// Types
+
+// One timestamped read of the energy register
+struct energy_sample {
+    uint64_t t_ns;      // CLOCK_MONOTONIC time of the read (ns)
+    uint32_t energy;    // raw 16-bit energy word
+};
+
+// Single-producer/multi-consumer lock-free ring of energy samples.
+// The producer publishes slot i by writing seq = i + 1 after the data;
+// readers check seq before and after copying the data, so a slot that
+// is overwritten while being read is detected and reported as lost.
+struct energy_ring {
+    _Atomic uint64_t head;                      // number of samples ever pushed
+    _Atomic uint64_t seq[ENERGY_RING_SIZE];     // index + 1 of sample in slot
+    struct energy_sample slot[ENERGY_RING_SIZE];
+};
+
+// Running mean/variance (Welford)
+struct welford {
+    long int n;     // number of samples
+    double mean;    // running mean
+    double m2;      // sum of squared deviations from the mean
+};
+
+// One decimation stage: CIC of order 3 and decimation R, followed by a
+// 3-tap compensation FIR at the output rate. The CIC is evaluated in its
+// non-recursive form, a dot product of the last L = 3 (R - 1) + 1
+// inputs with the integer kernel box*box*box, once every R inputs: the
+// same 3 multiply-adds per input as the integrator/comb form, but
+// vectorizable and with no state to wrap.
+struct cic_stage {
+    int R;                  // decimation
+    int L;                  // kernel length
+    int64_t gain;           // kernel sum, R^3
+    int32_t *h;             // kernel
+    int32_t *x;             // input history (fixed point)
+    int cap;                // history capacity
+    int count;              // inputs in history
+    int phase;              // inputs since the last output
+    int32_t y[3];           // last CIC outputs (compensator taps)
+    int n_y;                // CIC outputs so far (up to 3)
+    uint32_t n_sat;         // saturated inputs in the current window
+};
+
+// Filtered energy published by a stage (seqlock: odd seq while writing)
+struct filter_output {
+    _Atomic uint32_t seq;
+    double energy;          // filtered energy
+    uint64_t t_ns;          // time of the last input sample (ns)
+    uint32_t saturated;     // saturated or wrapped raw samples in the window
+    uint64_t count;         // outputs so far
+};
+
+// Multi-rate decimation filter bank fed by the sampler thread
+// Stage k decimates the output of stage k - 1, so stage k outputs every
+// period_s[k]. Reconfiguring takes the lock; the sampler only try-locks
+// it, so it never waits (and skips filtering while reconfiguring).
+struct filterbank {
+    pthread_mutex_t lock;
+    int n_stages;                           // configured stages (0: off)
+    double period_s[FILTER_STAGES];         // realized output periods (s)
+    struct cic_stage stage[FILTER_STAGES];
+    struct filter_output out[FILTER_STAGES];
+    uint32_t last_raw;                      // previous raw sample (wrap detection)
+    int have_last;                          // 1 if last_raw is valid
+};
+
+// Dwell engine configuration
+struct dwell_config {
+    double settle_s;      // wait after a gain change before sampling (s)
+    double min_dwell_s;   // minimum sampling time (s)
+    double max_dwell_s;   // hard maximum sampling time (s)
+    double z;             // two-sided confidence bound (e.g. 2.58 for 99%)
+    double resolution;    // energy difference treated as zero
+    int predict;          // 1: predict the steady state from the transient
+};
+
+// Result of one dwell measurement
+struct dwell_result {
+    double mean;          // mean energy
+    double var;           // energy variance, inflated so that var/n is the squared standard error
+    long int n;           // samples used
+    double dwell_s;       // total time spent, settling included (s)
+    int resolved;         // 1 if stopped by the sequential test
+    int predicted;        // 1 if mean is the steady state predicted from the transient
+    double tau;           // fitted relaxation time if predicted (s)
+};
+
+// Online fit of the relaxation after a gain change
+// E(t) = E_inf + A exp(-t/tau) is linear in (E_inf, A) for a fixed tau,
+// so a recursive least-squares accumulator (sums of u = exp(-t/tau),
+// u^2 and u*y) is kept for each candidate tau on a log grid
+struct transient_fit {
+    double tau[TRANSIENT_TAUS];   // candidate relaxation times (s)
+    double su[TRANSIENT_TAUS];    // sum of u
+    double suu[TRANSIENT_TAUS];   // sum of u^2
+    double suy[TRANSIENT_TAUS];   // sum of u*y
+    long int n;                   // samples
+    double sy, syy;               // sums of y and y^2
+    double sdd;                   // sum of squared differences of consecutive y
+    double y0;                    // first sample, subtracted from y
+    double y_prev;                // previous y
+    uint64_t t0;                  // time origin: the gain change (ns)
+    uint64_t t_last;              // time of the last sample (ns)
+};
+
+// Dwell measurement in progress (non-blocking)
+struct dwell_state {
+    struct energy_sampler *sampler;   // energy source
+    struct dwell_config cfg;          // settings
+    struct dwell_result prev;         // previous measurement
+    int have_prev;                    // 1 if prev is valid
+    struct welford w;                 // samples so far
+    double sdd;                       // sum of squared differences of consecutive samples
+    double x_prev;                    // previous sample
+    struct transient_fit fit;         // transient since t_begin (if cfg.predict)
+    uint64_t t_begin;                 // start of the measurement (ns)
+    uint64_t t_start;                 // end of settling (ns)
+    uint64_t deadline;                // next time to poll (ns)
+    uint64_t cursor;                  // next ring index to consume
+    int sampling;                     // 1 once settling is over
+};
+
+// Energy evaluation at a given (k_p, k_d, delay)
+// eval() applies the parameters and measures the resulting energy; prev
+// is the previous measurement for the sequential test (may be NULL)
+struct energy_eval {
+    int (*eval)(void *ctx, double param[N_PARAMS], struct dwell_result *prev, struct dwell_result *res);
+    void *ctx;
+};
+
+// SPSA tuner configuration
+// gain schedules: a_k = a/(k + 1 + A)^alpha, c_k = c/(k + 1)^gamma,
+// in units of scale[] (a <= 0 calibrates a from the first gradient)
+struct spsa_config {
+    double a, c, A, alpha, gamma;
+    double scale[N_PARAMS];     // parameter units per normalized unit
+    double lo[N_PARAMS];        // lower parameter bounds
+    double hi[N_PARAMS];        // upper parameter bounds
+    double max_step;            // max normalized step per iteration
+    int max_iter;               // number of iterations
+};
+
+// SPSA tuner state (ask/tell)
+struct spsa_state {
+    struct spsa_config cfg;
+    double x[N_PARAMS];         // current point, normalized
+    double delta[N_PARAMS];     // current perturbation direction
+    double x_pm[2][N_PARAMS];   // theta + ck delta and theta - ck delta within the bounds, normalized
+    double theta[N_PARAMS];     // current point, register units
+    double a;                   // step gain (calibrated if cfg.a <= 0)
+    double ck;                  // current perturbation size
+    int k;                      // iteration
+    int phase;                  // 0: measuring theta + ck delta, 1: theta - ck delta
+    struct dwell_result y_plus; // energy at theta + ck delta
+    long int n_total;           // samples used
+    double dwell_total;         // total dwell (s)
+    FILE *log;                  // progress messages (NULL: quiet)
+};
+
+// Gaussian-process surrogate of energy vs. normalized (k_p, k_d, delay)
+// Squared-exponential kernel with unit amplitude on standardized
+// energies, so the Cholesky factor L of K + noise*I only depends on the
+// inputs and is extended by one row per new point.
+struct gp {
+    int n;                                      // number of points
+    double x[GP_MAX_POINTS][N_PARAMS];          // inputs, normalized to [0, 1]
+    double y[GP_MAX_POINTS];                    // measured energies
+    double L[GP_MAX_POINTS][GP_MAX_POINTS];     // lower Cholesky factor
+    double alpha[GP_MAX_POINTS];                // (K + noise*I)^-1 (y - mean)/std
+    double length;                              // kernel length scale
+    double noise;                               // relative noise variance
+    double y_mean;                              // energy mean
+    double y_std;                               // energy standard deviation
+};
+
+// Bayesian optimization configuration
+struct bo_config {
+    double lo[N_PARAMS];        // lower parameter bounds
+    double hi[N_PARAMS];        // upper parameter bounds
+    double length;              // kernel length scale (normalized units)
+    double noise;               // relative noise variance
+    double ei_min;              // stop when expected improvement is below (energy units)
+    int max_eval;               // max energy evaluations (<= GP_MAX_POINTS)
+};
+
+// Bayesian optimization state (ask/tell)
+struct bo_state {
+    struct bo_config cfg;
+    struct gp *gp;              // surrogate (caller-provided storage)
+    double x[N_PARAMS];         // point being evaluated, normalized
+    double range[N_PARAMS];     // hi - lo
+    double best;                // best energy so far
+    double ei;                  // expected improvement of the current point (-1: not from EI)
+    double ask_ms;              // time spent choosing the current point (ms)
+    int i_best;                 // GP index of the best point
+    int n;                      // evaluations done
+    int max_eval;               // evaluation budget
+    int done;                   // 1 when finished
+    long int n_total;           // samples used
+    double dwell_total;         // total dwell (s)
+    FILE *log;                  // progress messages (NULL: quiet)
+};
+
+// Delay calibration configuration
+struct caldelay_config {
+    double lo;                  // lowest delay scanned (cycles)
+    double hi;                  // highest delay scanned (cycles)
+    int n_coarse;               // points of the coarse scan
+    double tol;                 // golden-section stops at this bracket width (cycles)
+};
+
+// One delay calibration measurement
+struct caldelay_point {
+    double delay;               // delay (cycles)
+    double mean;                // mean energy
+    double var;                 // energy variance
+    long int n;                 // samples
+};
+
+// Delay calibration state (ask/tell)
+struct caldelay_state {
+    struct caldelay_config cfg;
+    double k_p, k_d;            // gains held during the calibration
+    struct caldelay_point pt[CAL_MAX_POINTS];   // measurements so far
+    int n_pt;                   // number of measurements
+    int phase;                  // 0: coarse scan, 1: golden section, 2: done
+    double a, b;                // golden-section bracket
+    double step;                // coarse scan step (cycles)
+    double dwell_total;         // total dwell (s)
+    FILE *log;                  // progress messages (NULL: quiet)
+};
+
+// Delay calibration result
+struct caldelay_result {
+    double delay;               // optimum delay (cycles)
+    double ci_lo, ci_hi;        // confidence interval of the optimum
+    double energy;              // fitted energy at the optimum
+    int fitted;                 // 1 if from the quadratic fit, 0 if best measured point
+    short int delay_reg;        // optimum as a register value
+};
+
+// Energy-landscape sweep configuration
+// The (k_p, k_d) region is covered by a coarse n_grid x n_grid grid,
+// then cells are split in four (up to depth times) while the log of
+// the energy changes by more than tol across them
+struct sweep_config {
+    double lo[2], hi[2];        // k_p, k_d region
+    int n_grid;                 // coarse grid points per axis
+    int depth;                  // refinement levels
+    double tol;                 // log-energy change across a cell that refines it
+    int max_points;             // measurement budget (all slices)
+    int n_delay;                // delay slices (0: current delay)
+    double delay[SWEEP_MAX_DELAYS];
+    char path[256];             // CSV surface ("": not written)
+};
+
+// One sweep measurement, on a lattice of the finest cell size
+struct sweep_point {
+    int i, j;                   // lattice coordinates (k_p, k_d)
+    int slice;                  // delay slice
+    int level;                  // refinement level that added the point
+    short int k_p, k_d, delay;  // register values
+    double mean;                // mean energy
+    double var;                 // energy variance
+    long int n;                 // samples
+};
+
+// Quadtree cell: corners (i, j) to (i + size, j + size)
+struct sweep_cell {
+    int i, j, size;
+};
+
+// Energy-landscape sweep state (ask/tell)
+struct sweep_state {
+    struct sweep_config cfg;
+    struct sweep_point pt[SWEEP_MAX_POINTS];    // measurements so far
+    int n_pt;
+    struct sweep_cell cell[SWEEP_MAX_POINTS];   // cells of the current level
+    int n_cell;
+    int pending[SWEEP_MAX_POINTS];              // points of the current batch, in visiting order
+    int n_pending;
+    int next;                   // next pending point
+    int n_done;                 // points measured
+    int n_axis;                 // lattice points per axis
+    int slice;                  // current delay slice
+    int level;                  // current refinement level
+    double delay0;              // delay without slices
+    double pos[2];              // current (k_p, k_d), for the visiting order
+    double travel;              // gain changes so far (region widths)
+    double dwell_total;         // total dwell (s)
+    FILE *log;                  // progress messages (NULL: quiet)
+};
+
+// 'mlauto' routine state (ask/tell)
+struct mlauto_state {
+    float k0, k1;               // previous and current k_d
+    float energy0, energy1;     // energies at k0 and k1
+    double k_p;                 // kept k_p
+    double delay;               // kept delay
+    int phase;                  // 0: measuring the initial k_d, 1: iterating
+    int iter;                   // iterations done
+    int done;                   // 1 when converged
+    FILE *log;                  // progress messages (NULL: quiet)
+};
+
+// Tuned settings of one channel at given trap conditions
+// Stored as is in the profile file (64 bytes, no padding)
+struct profile {
+    char channel[RP_NAME_MAX];            // channel name ("" with the default map)
+    double cond[PROFILE_CONDITIONS];      // f0 (Hz), pressure (mbar), laser power (mW); 0 unknown
+    double energy;                        // mean energy at these settings (counts)
+    int64_t t_saved;                      // time saved (s since the epoch)
+    int16_t k_p, k_d, delay;              // register values
+    int16_t reserved;
+};
+
+// Profile file header, followed by n profiles
+struct profile_header {
+    char magic[8];                        // PROFILE_MAGIC
+    uint32_t version;                     // PROFILE_VERSION
+    uint32_t record_size;                 // sizeof(struct profile)
+    uint32_t n;                           // profiles in the file
+    uint32_t checksum;                    // FNV-1a of the profiles
+};
+
+// Profile store: the whole file, kept in memory
+struct profile_store {
+    const char *path;                     // file (NULL: no store)
+    int n;                                // profiles
+    struct profile p[PROFILE_MAX];
+    double cond[PROFILE_CONDITIONS];      // current trap conditions (0 unknown)
+    FILE *log;                            // messages (NULL: quiet)
+};
+
+// Tuner kinds run by the daemon
+enum tuner_kind {TUNER_NONE, TUNER_MLAUTO, TUNER_SPSA, TUNER_BO, TUNER_DELAY, TUNER_ES, TUNER_SCHED, TUNER_SWEEP};
+
+// Non-blocking tuner: one of the ask/tell tuners plus a dwell in progress
+struct tuner {
+    enum tuner_kind kind;             // tuner running (or last run)
+    int active;                       // 1 while tuning
+    int saving;                       // 1 while measuring the result for the profile store
+    double param[N_PARAMS];           // point being measured
+    struct dwell_state dwell;         // measurement in progress
+    struct dwell_result last;         // previous measurement
+    int have_last;                    // 1 if last is valid
+    uint32_t n_eval;                  // points measured so far
+    double dwell_total;               // time of all measurements (s)
+    struct rp_regs *regs;             // register backend
+    struct energy_sampler *sampler;   // energy sampler
+    struct dwell_config *dwell_cfg;   // dwell engine settings
+    struct spsa_config *spsa_cfg;     // SPSA settings
+    struct bo_config *bo_cfg;         // BO settings
+    struct caldelay_config *cal_cfg;  // delay calibration settings
+    struct sweep_config *sweep_cfg;   // energy-landscape sweep settings
+    struct gp *gp;                    // BO surrogate storage
+    struct mlauto_state ml;
+    struct spsa_state spsa;
+    struct bo_state bo;
+    struct caldelay_state cal;
+    struct sweep_state sweep;
+    struct es_state *es;              // extremum seeking (daemon)
+    struct es_config *es_cfg;         // extremum-seeking settings
+    struct schedule *sched;           // gain scheduling (daemon)
+    struct sched_config *sched_cfg;   // gain-scheduling settings
+    struct profile_store *profiles;   // profile cache (NULL: off)
+    struct profile seed;              // profile 'mlauto' starts from
+    int seeded;                       // 1 if seed is valid
+    FILE *log;                        // progress messages (NULL: quiet)
+};
+
+// Settled energy of one setting of a replay trace
+// Sums are pooled over every time the setting was held
+struct replay_point {
+    double x[N_PARAMS];         // k_p, k_d, delay
+    double n, s, s2;            // samples, sum and sum of squares of energy
+    double n_lag, s_a, s_b, s_ab; // consecutive pairs: sums of first, second and products
+    double mean, var, rho;      // mean, variance and lag-1 correlation
+};
+
+// Energy response recorded in a telemetry trace, replayed offline
+// eval() interpolates the recorded settings and emulates the dwell
+// engine on AR(1) noise from a seeded generator, in virtual time
+struct replay_model {
+    struct replay_point pt[REPLAY_MAX_POINTS];
+    int n_pt;
+    double rate_hz;             // sample rate of the trace
+    struct dwell_config *dwell; // dwell engine settings emulated
+    uint64_t rng;               // xorshift64* state
+    double z;                   // AR(1) noise state (standard deviations)
+    long int n_eval;            // evaluations of the current run
+    double dwell_total;         // virtual dwell time of the current run (s)
+};
+
+// Extremum-seeking configuration
+// Steps are scaled by the dither amplitude of each parameter, so one
+// gain and rate limit serve gains (counts) and delay (cycles) alike.
+struct es_config {
+    double freq_hz;             // dither frequency of k_d (others: ES_FREQ_RATIO)
+    double phase_deg;           // demodulation phase lag (deg)
+    double amp[N_PARAMS];       // dither amplitudes (0: parameter not dithered)
+    double gain;                // adaptation gain (amplitudes/s per relative energy change)
+    double max_rate;            // max drift of the center (amplitudes/s)
+    double lo[N_PARAMS];        // lower bounds (dither included)
+    double hi[N_PARAMS];        // upper bounds (dither included)
+    double period_s;            // register update period (s)
+};
+
+// Extremum-seeking controller state
+// Runs on its own thread (rpf_es_start) or from the daemon event loop; either
+// way it is the only one changing the gains while running (the control
+// thread still reads the shadows and handles watchdog trips, under the
+// register lock).
+struct es_state {
+    struct es_config cfg;
+    struct rp_regs *regs;             // register backend
+    struct energy_sampler *sampler;   // energy source
+    double theta[N_PARAMS];           // dither center
+    double demod[N_PARAMS];           // demodulated energy (low-passed)
+    double e_mean;                    // slow mean energy (high-pass reference)
+    double w[N_PARAMS];               // dither angular frequencies (rad/s)
+    uint64_t t0;                      // start time (ns)
+    uint64_t t_last;                  // time of the last sample used (ns)
+    uint64_t cursor;                  // next ring index to consume
+    uint64_t deadline;                // next register update (ns)
+    long int n_samples;               // samples used
+    pthread_t thread;
+    int threaded;                     // 1 if running on its own thread
+    _Atomic int running;              // 1 while active
+};
+
+// One regime of a gain schedule, validated and packed at load
+// Applies from its energy threshold up to the next entry's threshold
+struct sched_entry {
+    uint32_t threshold;         // lowest energy of the regime (counts)
+    short int k_p, k_d, delay;  // saturated register values
+    uint32_t pid;               // packed k_p/k_d word
+};
+
+// Gain-scheduling configuration
+struct sched_config {
+    double hysteresis;          // leave a regime below threshold*(1 - hysteresis)
+    int debounce;               // consecutive polls in the new regime before switching
+    uint32_t rate_hz;           // energy polling rate (Hz)
+};
+
+// One regime change of the gain schedule
+struct sched_transition {
+    uint64_t t_ns;              // time of the switch (ns)
+    uint32_t energy;            // energy that triggered it
+    int from, to;               // regimes (from = -1: initial)
+};
+
+// Gain scheduler
+// Polls the energy register on its own thread and is the only one
+// changing the gains while running. Transitions are logged into a ring
+// by the scheduler and printed later by the control thread.
+struct schedule {
+    pthread_t thread;
+    struct rp_regs *regs;                     // register backend
+    struct sched_entry entry[SCHED_MAX_ENTRIES];
+    int n;                                    // entries in the table
+    struct sched_config cfg;                  // settings (only changed while stopped)
+    _Atomic int regime;                       // regime in force (-1 before the first)
+    struct sched_transition log[SCHED_LOG];   // latest transitions
+    _Atomic uint64_t n_log;                   // transitions ever logged
+    uint64_t reported;                        // transitions printed by the control thread
+    _Atomic int running;                      // 1 while thread should run
+};
+
+// Control socket client
+struct daemon_client {
+    int fd;                           // socket (-1 if slot unused)
+    char buf[DAEMON_LINE_MAX];        // partial command line
+    size_t len;                       // bytes in buf
+};
+
+// Trap model and LQR weights
+// Plant: x'' + gamma x' + (2 pi f0)^2 x = b u, where u is in register
+// gain counts times x, so the LQR gains come out in register counts
+struct lqr_model {
+    double f0;          // trap frequency (Hz)
+    double gamma;       // damping rate (1/s)
+    double fs;          // controller sample rate (Hz)
+    double loop_delay;  // loop delay, excluding the delay register (FPGA cycles)
+    double b;           // acceleration per register count and unit x (1/s^2)
+    double q_x, q_v;    // state weights (position, velocity)
+    double r;           // input weight
+};
+
+// LQR solution
+struct lqr_result {
+    double P[2][2];     // Riccati solution
+    double K[2];        // optimal state feedback u = -K [x, v]
+    double kp, kd;      // unquantized register gains
+    short int k_p;      // quantized k_p
+    short int k_d;      // quantized k_d
+    short int delay;    // delay register value
+    double rho;         // closed-loop spectral radius
+    int iterations;     // doubling iterations
+    int saturated;      // 1 if a gain hit +-8191
+};
+
+// Telemetry recorder: preallocated, memory-mapped ring file
+// The sampler threads (one per channel) claim records with an atomic
+// increment of the head; the control thread publishes the register
+// words and tuner state each channel runs with.
+struct telemetry_file {
+    int fd;                           // file identifier
+    size_t size;                      // mapped bytes
+    void *map;                        // file mapping
+    struct rp_tel_header *hdr;        // header page
+    struct rp_tel_record *rec;        // record ring
+    uint64_t capacity;                // records in the ring
+};
+
+// Telemetry recorder of one channel: the settings stamped on its samples
+struct telemetry {
+    struct telemetry_file *file;      // shared recorder file
+    uint16_t channel;                 // channel index in the register map
+    _Atomic uint32_t pid;             // current k_p/k_d word (single-channel packing)
+    _Atomic uint32_t delay;           // current delay word
+    _Atomic uint32_t tuner;           // current tuner word
+    _Atomic uint32_t iter;            // current tuner evaluation index
+};
+
+// Watchdog configuration
+struct watchdog_config {
+    uint32_t threshold;     // trip when the energy exceeds this (counts)
+    double slope_max;       // trip when the energy rises faster (counts/s, 0: off)
+    double slope_window_s;  // time constant of the slope estimate (s)
+    int debounce;           // consecutive samples over a limit needed to trip
+    uint32_t rate_hz;       // polling rate
+};
+
+// Post-mortem snapshot taken when the watchdog trips
+struct watchdog_snapshot {
+    uint64_t t_trip_ns;     // CLOCK_MONOTONIC time of the trip (ns)
+    uint64_t latency_ns;    // from reading the tripping sample to zeroing the PID word
+    int reason;             // WD_REASON_ENERGY or WD_REASON_SLOPE
+    uint32_t energy;        // tripping sample
+    double slope;           // slope estimate at the trip (counts/s)
+    uint32_t pid;           // PID word that was zeroed
+    uint32_t delay;         // delay word at the trip
+    int n;                  // samples in sample[], oldest first
+    struct energy_sample sample[WD_SNAPSHOT];
+};
+
+// Runaway watchdog: polls the energy register on its own thread and
+// zeroes the PID word directly (bypassing the shadows) when the energy
+// or its slope exceed the limits. While tripped, gain writes through
+// regs_commit are refused until the watchdog is re-armed.
+struct watchdog {
+    pthread_t thread;
+    volatile uint32_t *data_energy;   // energy register
+    int energy_shift;                 // bit position of the energy field
+    volatile uint32_t *cfg_pid;       // pid register
+    volatile uint32_t *cfg_delay;     // delay register
+    struct rp_regs *regs;             // channel (control thread: names and packing)
+    struct watchdog_config cfg;       // limits (only changed while stopped)
+    struct telemetry *tel;            // recorder to publish the trip to (may be NULL)
+    _Atomic int running;              // 1 while thread should run
+    _Atomic int tripped;              // 1 once tripped, until re-armed
+    _Atomic int snap_ready;           // 1 once the snapshot is complete
+    int reported;                     // 1 once the control thread reported the trip
+    struct watchdog_snapshot snap;    // post-mortem snapshot
+    struct energy_sample hist[WD_SNAPSHOT];   // latest samples (watchdog thread only)
+};
+
+// FPGA register backend
+// Real: /dev/mem at the FPGA addresses; simulated: shared-memory file
+// with the same layout, updated by plant_sim. The shadows, staged words
+// and counters are shared by the control thread and the extremum-seeking
+// and gain-scheduler threads, so they are only touched under lock.
+struct rp_regs {
+    pthread_mutex_t lock;       // guards everything below the mapping
+    int fd;             // file identifier
+    int sim;            // 1 if simulated backend
+    size_t page;        // page size
+    void *map_delay;    // page mapping of the delay register
+    void *map_energy;   // page mapping of the energy register
+    void *map_pid;      // page mapping of the pid register
+    void *cfg_delay;    // delay register
+    void *cfg_pid;      // pid register
+    void *data_energy;  // energy register
+    struct rp_channel ch;       // channel addresses, packing and name
+    int index;                  // channel index in the map
+    uint32_t shadow_delay;      // delay word as last written to the FPGA
+    uint32_t shadow_pid;        // pid word as last written to the FPGA
+    uint32_t next_delay;        // staged delay word
+    uint32_t next_pid;          // staged pid word
+    int staged_delay;           // 1 if the delay word was staged since the last commit
+    int staged_pid;             // 1 if the pid word was staged since the last commit
+    int verify;                 // 1: read back and compare after writes
+    unsigned long writes;       // register writes issued
+    unsigned long coalesced;    // staged words skipped (word unchanged)
+    unsigned long mismatches;   // read-back verification failures
+    struct telemetry *tel;      // recorder to publish writes to (may be NULL)
+    struct watchdog *wd;        // watchdog that may lock the gains (may be NULL)
+    FILE *log;                  // messages (NULL: quiet)
+};
+
+// Wake-up latency histogram: bin b counts latencies in [2^(b-1), 2^b) ns
+struct jitter_hist {
+    _Atomic uint64_t count[JITTER_BINS];
+    _Atomic uint64_t max_ns;
+};
+
+// Real-time mode configuration
+struct rt_config {
+    int enabled;        // 1 once real-time mode is set up
+    int priority;       // SCHED_FIFO priority of the sampler (control thread: one less)
+    int cpu;            // core to pin the threads to
+};
+
+// Background thread polling the energy register
+struct energy_sampler {
+    pthread_t thread;
+    volatile uint32_t *data_energy;   // energy register
+    int energy_shift;                 // bit position of the energy field
+    int channel;                      // channel index in the map (metrics)
+    _Atomic int running;              // 1 while thread should run
+    _Atomic uint32_t rate_hz;         // polling rate
+    _Atomic uint64_t missed;          // deadlines missed (overruns)
+    struct jitter_hist jitter;        // wake-up latency after each deadline
+    struct telemetry *tel;            // recorder (may be NULL)
+    struct filterbank *fb;            // decimation filter bank (may be NULL)
+    struct energy_ring ring;
+};
+
+// Hot-path counters of a metrics slot
+enum metric_counter {MC_REG_WRITES, MC_REG_COALESCED, MC_REG_READS, MC_ENERGY_READS, MC_TUNER_EVALS, MC_KD_CLAMPS,
+                     MC_GAIN_SATURATIONS, MC_DELAY_SATURATIONS, MC_SAMPLER_OVERRUNS, MC_WD_TRIPS, MC_COUNTERS};
+
+// Latency histograms of a metrics slot
+enum metric_hist {MH_MMIO_READ, MH_MMIO_WRITE, MH_WAKEUP, MH_DWELL, MH_TUNER_STEP, MH_HISTS};
+
+// Counters and latency histograms of one thread
+// Each slot starts on its own cache line and is only written by the
+// thread that claimed it, with relaxed atomic adds: no locks and no
+// line bouncing on the hot path. Bucket b counts latencies up to
+// 64 ns * 4^b (not cumulative).
+struct metrics_slot {
+    _Alignas(64) _Atomic uint64_t count[MC_COUNTERS];
+    _Atomic uint64_t bucket[MH_HISTS][METRICS_BUCKETS];
+    _Atomic uint64_t sum_ns[MH_HISTS];
+    char role[16];                    // thread role ("main", "sampler", ...)
+    int channel;                      // channel index in the map (-1: none)
+};
+
+// Metrics of every thread
+// Slot 0 belongs to the main thread and to threads without a slot of
+// their own (such as the threads of a library caller).
+struct metrics {
+    struct metrics_slot slot[METRICS_SLOTS];
+    _Atomic int n;                    // slots claimed
+    pthread_mutex_t lock;             // serializes claiming slots
+};
+
+// Metrics file, rewritten periodically by its own thread
+struct metrics_file {
+    pthread_t thread;
+    char path[PATH_MAX];              // file (written through path.tmp)
+    double period_s;                  // rewrite period
+    _Atomic int running;              // 1 while thread should run
+};
+
+// Everything one feedback channel owns
+// Each channel has its own registers, sampler and watchdog threads, so
+// channels only share the CPU; tuners of all channels are polled from
+// the daemon event loop.
+struct channel {
+    struct rp_regs regs;              // register backend
+    struct energy_sampler sampler;    // background energy sampler
+    struct filterbank fb;             // decimation filter bank on the sampler stream
+    int n_filter;                     // filter outputs asked for
+    double filter_s[FILTER_STAGES];   // their periods (kept across sampling rate changes)
+    struct watchdog wd;               // runaway watchdog
+    struct telemetry tel;             // telemetry of this channel
+    struct es_state es;               // extremum-seeking controller
+    struct schedule sched;            // gain scheduler
+    struct gp gp;                     // Gaussian-process surrogate (BO)
+    struct tuner tuner;               // non-blocking tuner (daemon mode)
+};
+
+// Host's log callback behind a line-buffered stream
+struct rpf_log {
+    void (*fn)(void *ctx, const char *line);   // called once per line
+    void *ctx;                        // first argument of fn
+    char line[RPF_LOG_LINE];          // line being assembled
+    size_t len;                       // characters in line
+};
+
+// Everything the library hands out as an rpf_device
+struct rpf_device {
+    struct rp_map map;                // register map of the channels
+    struct channel *ch;               // one per channel of the map
+    struct telemetry_file tel;        // recorder shared by the channels
+    int recording;                    // 1 if tel is open
+    uint64_t cursor[RP_MAX_CHANNELS]; // next sample rpf_energy_read returns
+    struct dwell_config dwell;        // tuner settings (defaults below)
+    struct spsa_config spsa;
+    struct bo_config bo;
+    struct caldelay_config cal;
+    struct sweep_config sweep;
+    struct es_config es;
+    struct sched_config sched;
+    struct profile_store profiles;    // tuned-gain profiles (path NULL: off)
+    char profile_path[PATH_MAX];      // file of the profile store
+    struct rt_config rt;              // real-time mode (gain schedulers started later)
+    struct metrics_file metrics;      // metrics file writer
+    int exporting;                    // 1 if the metrics writer runs
+    FILE *log;                        // messages of the channels and tuners (NULL: none)
+    struct rpf_log sink;              // host's callback behind log
+};
+
+////////////////////////////////////////////////////////////////////////
+// Metrics (every thread)
+static struct metrics metrics = {.slot[0] = {.role = "main", .channel = -1}, .n = 1, .lock = PTHREAD_MUTEX_INITIALIZER};
+static _Thread_local struct metrics_slot *metrics_self; // slot of the calling thread (NULL: slot 0)
+
+// Names and help of the counters and histograms (Prometheus)
+static const char *metric_counter_names[MC_COUNTERS][2] = {
+    {"rpf_register_writes_total", "Register words stored to the FPGA."},
+    {"rpf_register_writes_coalesced_total", "Register writes skipped because the word was unchanged."},
+    {"rpf_register_reads_total", "Config register words read back from the FPGA."},
+    {"rpf_energy_reads_total", "Energy register reads."},
+    {"rpf_tuner_evaluations_total", "Energy measurements completed by the dwell engine."},
+    {"rpf_kd_clamps_total", "ML k_d steps clamped to the k_d range."},
+    {"rpf_gain_saturations_total", "Gains saturated to the register range."},
+    {"rpf_delay_saturations_total", "Delays saturated to the register range."},
+    {"rpf_sampler_overruns_total", "Energy sampler deadlines missed."},
+    {"rpf_watchdog_trips_total", "Watchdog trips."}
+};
+static const char *metric_hist_names[MH_HISTS][2] = {
+    {"rpf_mmio_read_seconds", "Register read latency."},
+    {"rpf_mmio_write_seconds", "Register write latency."},
+    {"rpf_sampler_wakeup_seconds", "Energy sampler wake-up latency after its deadline."},
+    {"rpf_dwell_seconds", "Energy measurement time, from the gain change to the result."},
+    {"rpf_tuner_step_seconds", "Tuner computation between two measurements."}
+};
+
+////////////////////////////////////////////////////////////////////////
+// Default settings (keyboard, daemon and library)
+
+// 1 s settling, then up to 2 s of sampling at 99% confidence
+static const struct dwell_config dwell_default = {1.0, 0.1, 2.0, 2.58, 1.0, 0};
+
+static const struct spsa_config spsa_default = {
+    0, 0.1, 5, 0.602, 0.101,  // a (auto), c, A, alpha, gamma
+    {100, 100, 50},           // scale of k_p, k_d, delay
+    {-1000, -1000, 0},        // lower bounds
+    {1000, 0, 500},           // upper bounds
+    0.5,                      // max normalized step
+    30                        // iterations
+};
+
+static const struct bo_config bo_default = {
+    {-1000, -1000, 0},        // lower bounds
+    {1000, 0, 500},           // upper bounds
+    0.2,                      // kernel length scale
+    0.01,                     // relative noise variance
+    1.0,                      // min expected improvement
+    40                        // max evaluations
+};
+
+// delay calibration: full range, 11 coarse points, 2 cycles
+static const struct caldelay_config cal_default = {0, 500, 11, 2};
+
+static const struct sweep_config sweep_default = {
+    {-200, -600}, {200, 0},   // k_p, k_d region
+    5, 3, 0.3,                // coarse grid points per axis, refinement levels, log-energy tolerance
+    200, 0, {0},              // max points, delay slices (0: current delay)
+    "sweep.csv"               // output file
+};
+
+static const struct es_config es_default = {
+    1.0, 0,                   // dither frequency (Hz), demodulation phase (deg)
+    {0, 20, 0},               // dither amplitudes of k_p, k_d, delay
+    20, 1,                    // adaptation gain, max rate (amplitudes/s)
+    {-1000, -1000, 0},        // lower bounds
+    {1000, 0, 500},           // upper bounds
+    0.01                      // register update period (s)
+};
+
+// 10% hysteresis, 1 ms debounce
+static const struct sched_config sched_default = {0.1, 20, SCHED_DEFAULT_RATE};
+
+// trip above 60000 counts, slope limit off, 3 samples at 20 kHz
+static const struct watchdog_config wd_default = {60000, 0, 0.05, 3, WD_DEFAULT_RATE};
+
+// filter output periods (ms)
+static const double filter_default_ms[] = {1, 100, 3000};
+
+////////////////////////////////////////////////////////////////////////
+// Functions
+
+
+// Matrix transpose function
+//
+// All 2x2 kernels below are fixed-size and safe to call with the output
+// aliasing an input (e.g. matrix_product(a, b, a))
+//
+static inline int matrix_transpose(double matrix[2][2], double m_transpose[2][2]){
+    // swap matrix[0][1] and matrix[1][0]
+    double tmp = matrix[0][1];
+    // set values on transpose matrix
+    m_transpose[0][0] = matrix[0][0];
+    m_transpose[0][1] = matrix[1][0];
+    m_transpose[1][0] = tmp;
+    m_transpose[1][1] = matrix[1][1];
+    
+    // end function normally
+    return 0;
+}
+
+
+// Matrix inverse function
+//
+static inline int matrix_inverse(double matrix[2][2], double m_inverse[2][2]){
+    
+    // calculate determinant
+    double det = matrix[0][0]*matrix[1][1] - matrix[0][1]*matrix[1][0];
+    double a = matrix[0][0];
+    if(det == 0){
+        // error exit: singular matrix
+        return 1;
+    }
+    
+    // set values on inverse matrix
+    m_inverse[0][0] = matrix[1][1]/det;
+    m_inverse[0][1] = -matrix[0][1]/det;
+    m_inverse[1][0] = -matrix[1][0]/det;
+    m_inverse[1][1] = a/det;
+    
+    // end function normally
+    return 0;
+}
+
+// 3x3 matrix inverse function
+//
+// Cofactor expansion; returns 1 if the matrix is singular
+//
+static inline int matrix_inverse3(double matrix[3][3], double m_inverse[3][3]){
+    double c[3][3], det;
+    
+    // cofactors
+    for(int i = 0; i < 3; i++){
+        for(int j = 0; j < 3; j++){
+            int i1 = (i + 1) % 3, i2 = (i + 2) % 3, j1 = (j + 1) % 3, j2 = (j + 2) % 3;
+            c[i][j] = matrix[i1][j1]*matrix[i2][j2] - matrix[i1][j2]*matrix[i2][j1];
+        }
+    }
+    det = matrix[0][0]*c[0][0] + matrix[0][1]*c[0][1] + matrix[0][2]*c[0][2];
+    if(det == 0){
+        // error exit: singular matrix
+        return 1;
+    }
+    
+    // inverse is the transposed cofactor matrix over the determinant
+    for(int i = 0; i < 3; i++){
+        for(int j = 0; j < 3; j++){
+            m_inverse[i][j] = c[j][i]/det;
+        }
+    }
+    // end function normally
+    return 0;
+}
+
+// Matrix product function
+//
+// Multiply mat1 by mat2 and put result in m_prod
+//
+static inline int matrix_product(double mat1[2][2], double mat2[2][2], double m_prod[2][2]){
+    double p00 = mat1[0][0]*mat2[0][0] + mat1[0][1]*mat2[1][0];
+    double p01 = mat1[0][0]*mat2[0][1] + mat1[0][1]*mat2[1][1];
+    double p10 = mat1[1][0]*mat2[0][0] + mat1[1][1]*mat2[1][0];
+    double p11 = mat1[1][0]*mat2[0][1] + mat1[1][1]*mat2[1][1];
+    
+    m_prod[0][0] = p00;
+    m_prod[0][1] = p01;
+    m_prod[1][0] = p10;
+    m_prod[1][1] = p11;
+    
+    // end function normally
+    return 0;
+}
+
+// Matrix addition function
+//
+// Add mat1 and mat2 and put result in m_add
+//
+static inline int matrix_addition(double mat1[2][2], double mat2[2][2], double m_add[2][2]){
+    // add matrices and put result in m_add
+    m_add[0][0] = mat1[0][0] + mat2[0][0];
+    m_add[0][1] = mat1[0][1] + mat2[0][1];
+    m_add[1][0] = mat1[1][0] + mat2[1][0];
+    m_add[1][1] = mat1[1][1] + mat2[1][1];
+    
+    // end function normally
+    return 0;
+}
+
+// Matrix multiply scalar
+//
+static inline int m_mult_scalar(double matrix[2][2], double scalar){
+    // Matrix multiply by scalar
+    matrix[0][0] = matrix[0][0]*scalar;
+    matrix[0][1] = matrix[0][1]*scalar;
+    matrix[1][0] = matrix[1][0]*scalar;
+    matrix[1][1] = matrix[1][1]*scalar;
+    
+    // end function normally
+    return 0;
+}
+
+// Give the calling thread its own metrics slot
+//
+// Slots are keyed by role and channel, so a thread restarted in the same
+// role keeps counting where the previous one stopped. With every slot
+// taken the thread shares slot 0. Returns 1 in that case.
+//
+int metrics_thread(const char *role, int channel){
+    struct metrics_slot *slot = NULL;
+    int n;
+    
+    pthread_mutex_lock(&metrics.lock);
+    n = atomic_load_explicit(&metrics.n, memory_order_relaxed);
+    for(int i = 0; i < n && slot == NULL; i++){
+        if(metrics.slot[i].channel == channel && 0 == strcmp(metrics.slot[i].role, role)){
+            slot = &metrics.slot[i];
+        }
+    }
+    if(slot == NULL && n < METRICS_SLOTS){
+        slot = &metrics.slot[n];
+        snprintf(slot->role, sizeof(slot->role), "%s", role);
+        slot->channel = channel;
+        // readers see the name before the slot
+        atomic_store_explicit(&metrics.n, n + 1, memory_order_release);
+    }
+    pthread_mutex_unlock(&metrics.lock);
+    metrics_self = slot;
+    return (slot == NULL);
+}
+
+// Add n to a counter of the calling thread
+//
+int metrics_count(enum metric_counter c, uint64_t n){
+    struct metrics_slot *slot = (metrics_self != NULL) ? metrics_self : &metrics.slot[0];
+    
+    atomic_fetch_add_explicit(&slot->count[c], n, memory_order_relaxed);
+    // end function normally
+    return 0;
+}
+
+// Add a latency to a histogram of the calling thread
+//
+int metrics_time(enum metric_hist h, uint64_t latency_ns){
+    struct metrics_slot *slot = (metrics_self != NULL) ? metrics_self : &metrics.slot[0];
+    int b = 0;
+    
+    while(b < METRICS_BUCKETS - 1 && latency_ns > (64ULL << 2*b)){
+        b++;
+    }
+    atomic_fetch_add_explicit(&slot->bucket[h][b], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&slot->sum_ns[h], latency_ns, memory_order_relaxed);
+    // end function normally
+    return 0;
+}
+
+// Saturate gain
+//
+int sat_gain(long int k, short int *k_short){
+    long int max_gain = 8191;
+    if(k > max_gain){
+        *k_short = max_gain;
+        metrics_count(MC_GAIN_SATURATIONS, 1);
+    } else if(k < -max_gain){
+        *k_short = -max_gain;
+        metrics_count(MC_GAIN_SATURATIONS, 1);
+    } else {
+        *k_short = (short int) k;
+    }
+    // end normally
+    return 0;
+}
+
+// Saturate delay
+//
+int sat_delay(long int delay, short int *delay_short){
+    long int max_delay = 500;
+    if(delay > max_delay){
+        *delay_short = max_delay;
+        metrics_count(MC_DELAY_SATURATIONS, 1);
+    } else if(delay < 0){
+        *delay_short = 0;
+        metrics_count(MC_DELAY_SATURATIONS, 1);
+    } else {
+        *delay_short = (short int) delay;
+    }
+    // end normally
+    return 0;
+}
+
+
+// Message to a log stream
+//
+// Formatted as by printf, written to log unless log is NULL (quiet).
+// Tuners and channels hold their stream: standard output in the
+// program, the host's callback in the library.
+//
+__attribute__((format(printf, 2, 3)))
+int msg_printf(FILE *log, const char *fmt, ...){
+    va_list ap;
+    
+    if(log == NULL){
+        return 0;
+    }
+    va_start(ap, fmt);
+    vfprintf(log, fmt, ap);
+    va_end(ap);
+    // end function normally
+    return 0;
+}
+
+// Current CLOCK_MONOTONIC time in ns
+//
+uint64_t monotonic_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec*NSEC_PER_SEC + (uint64_t) ts.tv_nsec;
+}
+
+// Read a register word, counting and timing the access
+//
+uint32_t mmio_read(volatile uint32_t *reg, enum metric_counter c){
+    uint64_t t0 = monotonic_ns();
+    uint32_t word = *reg;
+    
+    metrics_time(MH_MMIO_READ, monotonic_ns() - t0);
+    metrics_count(c, 1);
+    return word;
+}
+
+// Write a register word, counting and timing the access
+//
+int mmio_write(volatile uint32_t *reg, uint32_t word){
+    uint64_t t0 = monotonic_ns();
+    
+    *reg = word;
+    metrics_time(MH_MMIO_WRITE, monotonic_ns() - t0);
+    metrics_count(MC_REG_WRITES, 1);
+    // end function normally
+    return 0;
+}
+
+// Initialize energy ring
+//
+int energy_ring_init(struct energy_ring *ring){
+    atomic_store_explicit(&ring->head, 0, memory_order_relaxed);
+    for(int i = 0; i < ENERGY_RING_SIZE; i++){
+        atomic_store_explicit(&ring->seq[i], 0, memory_order_relaxed);
+    }
+    // end function normally
+    return 0;
+}
+
+// Push a sample into the energy ring (single producer only)
+//
+int energy_ring_push(struct energy_ring *ring, uint64_t t_ns, uint32_t energy){
+    uint64_t i = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint64_t k = i & ENERGY_RING_MASK;
+    
+    // invalidate slot, then write data, then publish it
+    atomic_store_explicit(&ring->seq[k], 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    ring->slot[k].t_ns = t_ns;
+    ring->slot[k].energy = energy;
+    atomic_store_explicit(&ring->seq[k], i + 1, memory_order_release);
+    atomic_store_explicit(&ring->head, i + 1, memory_order_release);
+    // end function normally
+    return 0;
+}
+
+// Read sample with absolute index i from the energy ring
+//
+// Returns 0 on success, 1 if the sample is not available (not yet
+// written or already overwritten by the producer)
+//
+int energy_ring_read(struct energy_ring *ring, uint64_t i, struct energy_sample *sample){
+    uint64_t k = i & ENERGY_RING_MASK;
+    
+    if(atomic_load_explicit(&ring->seq[k], memory_order_acquire) != i + 1){
+        return 1;
+    }
+    sample->t_ns = ring->slot[k].t_ns;
+    sample->energy = ring->slot[k].energy;
+    atomic_thread_fence(memory_order_acquire);
+    if(atomic_load_explicit(&ring->seq[k], memory_order_relaxed) != i + 1){
+        return 1;
+    }
+    // end function normally
+    return 0;
+}
+
+// Fixed-point dot product of a CIC kernel with the input history
+//
+// Plain loop over contiguous arrays with 64-bit accumulation, so the
+// compiler vectorizes it at -O3 (NEON vmlal with -mfpu=neon on the Zynq,
+// SSE4.1/AVX2 with -march=native on x86)
+//
+static inline int64_t cic_dot(const int32_t *restrict h, const int32_t *restrict x, int n){
+    int64_t acc = 0;
+    for(int i = 0; i < n; i++){
+        acc += (int64_t) h[i]*x[i];
+    }
+    return acc;
+}
+
+// Configure a decimation stage
+//
+int cic_init(struct cic_stage *st, int R){
+    int32_t *tmp;
+    
+    st->R = R;
+    st->L = CIC_ORDER*(R - 1) + 1;
+    st->gain = (int64_t) R*R*R;
+    st->cap = 2*st->L + R;
+    st->count = 0;
+    st->phase = 0;
+    st->n_y = 0;
+    st->n_sat = 0;
+    st->h = aligned_alloc(64, ((st->L*sizeof(int32_t) + 63)/64)*64);
+    st->x = aligned_alloc(64, ((st->cap*sizeof(int32_t) + 63)/64)*64);
+    tmp = calloc(st->L, sizeof(int32_t));
+    if(st->h == NULL || st->x == NULL || tmp == NULL){
+        free(st->h);
+        free(st->x);
+        free(tmp);
+        return 1; // return error in allocating
+    }
+    
+    // kernel: box of length R convolved with itself CIC_ORDER times
+    for(int i = 0; i < st->L; i++){
+        st->h[i] = (i < R) ? 1 : 0;
+    }
+    for(int k = 1; k < CIC_ORDER; k++){
+        for(int i = 0; i < st->L; i++){
+            tmp[i] = 0;
+            for(int j = 0; j < R && j <= i; j++){
+                tmp[i] += st->h[i - j];
+            }
+        }
+        memcpy(st->h, tmp, st->L*sizeof(int32_t));
+    }
+    free(tmp);
+    // end function normally
+    return 0;
+}
+
+// Free a decimation stage
+//
+int cic_free(struct cic_stage *st){
+    free(st->h);
+    free(st->x);
+    st->h = st->x = NULL;
+    // end function normally
+    return 0;
+}
+
+// Feed one fixed-point input to a stage
+//
+// Returns 1 when the stage produced an output (y, with the saturated
+// inputs of its window in n_sat), 0 otherwise
+//
+int cic_push(struct cic_stage *st, int32_t x, uint32_t sat, int32_t *y, uint32_t *n_sat){
+    int64_t acc;
+    int32_t c;
+    
+    st->x[st->count++] = x;
+    st->n_sat += sat;
+    if(++st->phase < st->R){
+        return 0;
+    }
+    st->phase = 0;
+    if(st->count < st->L){
+        // history not full yet: no output, keep counting saturation
+        return 0;
+    }
+    
+    // CIC output, rounded, normalized to unit DC gain
+    acc = cic_dot(st->h, st->x + st->count - st->L, st->L);
+    c = (int32_t) ((acc + st->gain/2)/st->gain);
+    
+    // compensation FIR (-1, 10, -1)/8 flattens the sinc^3 droop to second
+    // order; it delays by one output, and is skipped without decimation
+    st->y[2] = st->y[1];
+    st->y[1] = st->y[0];
+    st->y[0] = c;
+    if(st->n_y < 3){
+        st->n_y++;
+    }
+    *y = (st->R > 1 && st->n_y == 3) ? (int32_t) ((-(int64_t) st->y[0] + 10*(int64_t) st->y[1] - st->y[2])/8) : c;
+    *n_sat = st->n_sat;
+    st->n_sat = 0;
+    
+    // keep the last L - 1 inputs
+    if(st->count + st->R > st->cap){
+        memmove(st->x, st->x + st->count - (st->L - 1), (st->L - 1)*sizeof(int32_t));
+        st->count = st->L - 1;
+    }
+    return 1;
+}
+
+// Configure the filter bank for output periods period_s[0..n-1] (s)
+//
+// Periods must increase; each one is rounded to a whole number of the
+// previous (or of the sampling period). n = 0 turns the bank off.
+// Problems are reported to log (NULL: quiet).
+//
+int filterbank_config(struct filterbank *fb, uint32_t rate_hz, int n, double period_s[], FILE *log){
+    double t_prev = 1.0/rate_hz;
+    long int R;
+    int err = 0;
+    
+    pthread_mutex_lock(&fb->lock);
+    for(int k = 0; k < fb->n_stages; k++){
+        cic_free(&fb->stage[k]);
+    }
+    fb->n_stages = 0;
+    fb->have_last = 0;
+    for(int k = 0; k < n && k < FILTER_STAGES; k++){
+        R = lround(period_s[k]/t_prev);
+        if(R < 1 || R > CIC_MAX_R){
+            msg_printf(log, "Filter output %d: decimation %ld out of range (1-%d)\n", k + 1, R, CIC_MAX_R);
+            err = 1;
+            break;
+        }
+        if(cic_init(&fb->stage[k], (int) R) != 0){
+            err = 1;
+            break;
+        }
+        t_prev *= R;
+        fb->period_s[k] = t_prev;
+        atomic_store(&fb->out[k].seq, 0);
+        fb->out[k].energy = 0;
+        fb->out[k].t_ns = 0;
+        fb->out[k].saturated = 0;
+        fb->out[k].count = 0;
+        fb->n_stages = k + 1;
+    }
+    pthread_mutex_unlock(&fb->lock);
+    return err;
+}
+
+// Feed one raw energy sample to the filter bank (sampler thread only)
+//
+// A sample is flagged as saturated when it sits at the rail, or as
+// wrapped when it jumps by more than half the 16-bit range
+//
+int filterbank_push(struct filterbank *fb, uint64_t t_ns, uint32_t energy){
+    int32_t x, y;
+    uint32_t sat, n_sat;
+    struct filter_output *out;
+    
+    if(pthread_mutex_trylock(&fb->lock) != 0){
+        return 1; // return busy: being reconfigured
+    }
+    sat = (energy >= ENERGY_RAIL) || (fb->have_last && abs((int) energy - (int) fb->last_raw) > 0x8000);
+    fb->last_raw = energy;
+    fb->have_last = 1;
+    x = (int32_t) (energy << FILTER_Q);
+    for(int k = 0; k < fb->n_stages; k++){
+        if(!cic_push(&fb->stage[k], x, sat, &y, &n_sat)){
+            break;
+        }
+        // publish
+        out = &fb->out[k];
+        atomic_fetch_add_explicit(&out->seq, 1, memory_order_acq_rel);
+        out->energy = (double) y/(1 << FILTER_Q);
+        out->t_ns = t_ns;
+        out->saturated = n_sat;
+        out->count++;
+        atomic_fetch_add_explicit(&out->seq, 1, memory_order_release);
+        // next stage
+        x = y;
+        sat = n_sat;
+    }
+    pthread_mutex_unlock(&fb->lock);
+    // end function normally
+    return 0;
+}
+
+// Latest output of stage k; returns 1 if there is none yet
+//
+int filterbank_read(struct filterbank *fb, int k, struct filter_output *res){
+    struct filter_output *out = &fb->out[k];
+    uint32_t seq;
+    
+    do{
+        seq = atomic_load_explicit(&out->seq, memory_order_acquire);
+        res->energy = out->energy;
+        res->t_ns = out->t_ns;
+        res->saturated = out->saturated;
+        res->count = out->count;
+        atomic_thread_fence(memory_order_acquire);
+    } while((seq & 1) || seq != atomic_load_explicit(&out->seq, memory_order_relaxed));
+    return (res->count == 0);
+}
+
+// Sleep until an absolute CLOCK_MONOTONIC time (ns)
+//
+int sleep_until_ns(uint64_t t_ns){
+    struct timespec deadline;
+    deadline.tv_sec = t_ns/NSEC_PER_SEC;
+    deadline.tv_nsec = t_ns%NSEC_PER_SEC;
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR);
+    // end function normally
+    return 0;
+}
+
+// Add a wake-up latency to the jitter histogram
+//
+int jitter_add(struct jitter_hist *hist, uint64_t latency_ns){
+    int bin = 0;
+    uint64_t max = atomic_load_explicit(&hist->max_ns, memory_order_relaxed);
+    
+    while(bin < JITTER_BINS - 1 && (latency_ns >> bin) != 0){
+        bin++;
+    }
+    atomic_fetch_add_explicit(&hist->count[bin], 1, memory_order_relaxed);
+    if(latency_ns > max){
+        atomic_store_explicit(&hist->max_ns, latency_ns, memory_order_relaxed);
+    }
+    // end function normally
+    return 0;
+}
+
+// Prometheus labels of a metrics slot
+//
+int metrics_labels(struct metrics_slot *slot, char *labels, size_t size){
+    if(slot->channel >= 0){
+        snprintf(labels, size, "thread=\"%s\",channel=\"%d\"", slot->role, slot->channel);
+    } else {
+        snprintf(labels, size, "thread=\"%s\"", slot->role);
+    }
+    // end function normally
+    return 0;
+}
+
+// Write the metrics of every thread in the Prometheus text format
+//
+// Counters are written for every thread; histograms only for the
+// threads that recorded into them. Slots are read while their threads
+// keep counting, so a histogram's sum may run one event ahead of its
+// buckets.
+//
+int metrics_write(FILE *out){
+    int n = atomic_load_explicit(&metrics.n, memory_order_acquire);
+    struct metrics_slot *slot;
+    char labels[64];
+    uint64_t count[METRICS_BUCKETS], total, cum;
+    
+    for(int c = 0; c < MC_COUNTERS; c++){
+        fprintf(out, "# HELP %s %s\n", metric_counter_names[c][0], metric_counter_names[c][1]);
+        fprintf(out, "# TYPE %s counter\n", metric_counter_names[c][0]);
+        for(int i = 0; i < n; i++){
+            slot = &metrics.slot[i];
+            metrics_labels(slot, labels, sizeof(labels));
+            fprintf(out, "%s{%s} %llu\n", metric_counter_names[c][0], labels,
+                    (unsigned long long) atomic_load_explicit(&slot->count[c], memory_order_relaxed));
+        }
+    }
+    for(int h = 0; h < MH_HISTS; h++){
+        fprintf(out, "# HELP %s %s\n", metric_hist_names[h][0], metric_hist_names[h][1]);
+        fprintf(out, "# TYPE %s histogram\n", metric_hist_names[h][0]);
+        for(int i = 0; i < n; i++){
+            slot = &metrics.slot[i];
+            total = 0;
+            for(int b = 0; b < METRICS_BUCKETS; b++){
+                count[b] = atomic_load_explicit(&slot->bucket[h][b], memory_order_relaxed);
+                total += count[b];
+            }
+            if(total == 0){
+                continue;
+            }
+            metrics_labels(slot, labels, sizeof(labels));
+            cum = 0;
+            for(int b = 0; b < METRICS_BUCKETS - 1; b++){
+                cum += count[b];
+                fprintf(out, "%s_bucket{%s,le=\"%.12g\"} %llu\n", metric_hist_names[h][0], labels,
+                        (64ULL << 2*b)*1e-9, (unsigned long long) cum);
+            }
+            fprintf(out, "%s_bucket{%s,le=\"+Inf\"} %llu\n", metric_hist_names[h][0], labels, (unsigned long long) total);
+            fprintf(out, "%s_sum{%s} %.9f\n", metric_hist_names[h][0], labels,
+                    atomic_load_explicit(&slot->sum_ns[h], memory_order_relaxed)*1e-9);
+            fprintf(out, "%s_count{%s} %llu\n", metric_hist_names[h][0], labels, (unsigned long long) total);
+        }
+    }
+    // end function normally
+    return 0;
+}
+
+// Write the metrics file
+//
+// The metrics go to path.tmp, which is renamed over the file, so a
+// scraper (such as the node_exporter textfile collector) never reads a
+// partial file
+//
+int metrics_file_write(struct metrics_file *mf){
+    char tmp[PATH_MAX];
+    FILE *out;
+    int err;
+    
+    if(snprintf(tmp, sizeof(tmp), "%s.tmp", mf->path) >= (int) sizeof(tmp)){
+        return 1; // return error in path
+    }
+    out = fopen(tmp, "w");
+    if(out == NULL){
+        return 1; // return error in opening
+    }
+    metrics_write(out);
+    err = (fclose(out) != 0);
+    if(err || rename(tmp, mf->path) != 0){
+        unlink(tmp);
+        return 1; // return error in writing
+    }
+    // end function normally
+    return 0;
+}
+
+// Metrics file thread
+//
+// Rewrites the file every period_s, checking for a stop request every
+// 100 ms, and once more when stopped
+//
+void *metrics_file_thread(void *arg){
+    struct metrics_file *mf = (struct metrics_file *) arg;
+    uint64_t deadline, t_ns;
+    
+    deadline = monotonic_ns();
+    while(atomic_load_explicit(&mf->running, memory_order_relaxed)){
+        t_ns = monotonic_ns();
+        if(t_ns >= deadline){
+            metrics_file_write(mf);
+            deadline += (uint64_t) (mf->period_s*NSEC_PER_SEC);
+            if(deadline < t_ns){
+                deadline = t_ns;
+            }
+            continue;
+        }
+        sleep_until_ns((deadline - t_ns < 100000000ULL) ? deadline : t_ns + 100000000ULL);
+    }
+    metrics_file_write(mf);
+    return NULL;
+}
+
+// Start rewriting a metrics file every period_s
+//
+// Problems are reported to log (NULL: quiet)
+//
+int metrics_file_start(struct metrics_file *mf, const char *path, double period_s, FILE *log){
+    if(snprintf(mf->path, sizeof(mf->path), "%s", path) >= (int) sizeof(mf->path) || !(period_s > 0)){
+        msg_printf(log, "Invalid metrics file or period\n");
+        // error exit
+        return 1;
+    }
+    mf->period_s = period_s;
+    if(metrics_file_write(mf) != 0){
+        msg_printf(log, "Could not write %s: %s\n", mf->path, strerror(errno));
+        // error exit
+        return 1;
+    }
+    atomic_store(&mf->running, 1);
+    if(pthread_create(&mf->thread, NULL, metrics_file_thread, mf) != 0){
+        atomic_store(&mf->running, 0);
+        msg_printf(log, "Could not start metrics writer\n");
+        // error exit
+        return 1;
+    }
+    // end function normally
+    return 0;
+}
+
+// Stop the metrics file writer (after a last rewrite)
+//
+int metrics_file_stop(struct metrics_file *mf){
+    if(atomic_exchange(&mf->running, 0)){
+        pthread_join(mf->thread, NULL);
+    }
+    // end function normally
+    return 0;
+}
+
+// Open telemetry recorder
+//
+// Creates (or truncates) path, preallocates the header page and
+// capacity records and maps the whole file, prefaulted, so that
+// recording never waits on block allocation or page faults. Problems
+// are reported to log (NULL: quiet).
+//
+int telemetry_open(struct telemetry_file *tel, const char *path, uint64_t capacity, FILE *log){
+    int err;
+    
+    tel->capacity = capacity;
+    tel->size = RP_TEL_HEADER_SIZE + capacity*sizeof(struct rp_tel_record);
+    tel->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if(tel->fd < 0){
+        msg_printf(log, "Could not open %s: %s\n", path, strerror(errno));
+        return 1; // return error in opening
+    }
+    err = posix_fallocate(tel->fd, 0, tel->size);
+    if(err != 0){
+        msg_printf(log, "Could not preallocate %s: %s\n", path, strerror(err));
+        close(tel->fd);
+        return 1; // return error in preallocating
+    }
+    tel->map = mmap(NULL, tel->size, PROT_READ|PROT_WRITE, MAP_SHARED | MAP_POPULATE, tel->fd, 0);
+    if(tel->map == MAP_FAILED){
+        msg_printf(log, "Could not map %s: %s\n", path, strerror(errno));
+        close(tel->fd);
+        return 1; // return error in mapping
+    }
+    tel->hdr = (struct rp_tel_header *) tel->map;
+    tel->rec = (struct rp_tel_record *) ((char *) tel->map + RP_TEL_HEADER_SIZE);
+    memcpy(tel->hdr->magic, RP_TEL_MAGIC, sizeof(tel->hdr->magic));
+    tel->hdr->version = RP_TEL_VERSION;
+    tel->hdr->record_size = sizeof(struct rp_tel_record);
+    tel->hdr->capacity = capacity;
+    tel->hdr->t_start_ns = monotonic_ns();
+    atomic_store(&tel->hdr->head, 0);
+    // end function normally
+    return 0;
+}
+
+// Record the samples of one channel into an open recorder file
+//
+int telemetry_attach(struct telemetry *tel, struct telemetry_file *file, int channel){
+    tel->file = file;
+    tel->channel = (uint16_t) channel;
+    atomic_store(&tel->pid, 0);
+    atomic_store(&tel->delay, 0);
+    atomic_store(&tel->tuner, 0);
+    atomic_store(&tel->iter, 0);
+    // end function normally
+    return 0;
+}
+
+// Close telemetry recorder (flushes the file)
+//
+int telemetry_close(struct telemetry_file *tel){
+    msync(tel->map, tel->size, MS_SYNC);
+    munmap(tel->map, tel->size);
+    close(tel->fd);
+    // end function normally
+    return 0;
+}
+
+// Append one record (from the sampler thread of the channel)
+//
+// Only stores to the mapping: the kernel writes the dirty pages back
+// in the background, so the sampler never blocks on the file. The slot
+// is claimed first; readers skip it until its seq is published.
+//
+int telemetry_push(struct telemetry *tel, uint64_t t_ns, uint32_t energy){
+    uint64_t i = atomic_fetch_add_explicit(&tel->file->hdr->head, 1, memory_order_relaxed);
+    struct rp_tel_record *r = &tel->file->rec[i % tel->file->capacity];
+    uint32_t tuner = atomic_load_explicit(&tel->tuner, memory_order_relaxed);
+    
+    r->seq = 0;
+    atomic_thread_fence(memory_order_release);
+    r->t_ns = t_ns;
+    r->energy = energy;
+    r->pid = atomic_load_explicit(&tel->pid, memory_order_relaxed);
+    r->delay = atomic_load_explicit(&tel->delay, memory_order_relaxed);
+    r->iter = atomic_load_explicit(&tel->iter, memory_order_relaxed);
+    r->tuner = (uint16_t) tuner;
+    r->channel = tel->channel;
+    atomic_thread_fence(memory_order_release);
+    r->seq = (uint32_t) (i + 1);
+    // end function normally
+    return 0;
+}
+
+// Publish the register words in use
+//
+int telemetry_regs(struct telemetry *tel, uint32_t pid, uint32_t delay){
+    if(tel == NULL){
+        return 0;
+    }
+    atomic_store_explicit(&tel->pid, pid, memory_order_relaxed);
+    atomic_store_explicit(&tel->delay, delay, memory_order_relaxed);
+    // end function normally
+    return 0;
+}
+
+// Publish the tuner state (kind, evaluation index, running or not)
+//
+int telemetry_tuner(struct telemetry *tel, int kind, uint32_t iter, int active){
+    if(tel == NULL){
+        return 0;
+    }
+    atomic_store_explicit(&tel->iter, iter, memory_order_relaxed);
+    atomic_store_explicit(&tel->tuner, (kind & RP_TEL_TUNER_KIND) | (active ? RP_TEL_TUNER_ACTIVE : 0), memory_order_relaxed);
+    // end function normally
+    return 0;
+}
+
+// Energy sampler thread
+//
+// Polls the energy register at rate_hz on absolute CLOCK_MONOTONIC
+// deadlines, publishes every read into the ring and records how late
+// each wake-up was
+//
+void *energy_sampler_thread(void *arg){
+    struct energy_sampler *sampler = (struct energy_sampler *) arg;
+    uint64_t t_ns, deadline;
+    uint32_t energy;
+    
+    metrics_thread("sampler", sampler->channel);
+    deadline = monotonic_ns();
+    while(atomic_load_explicit(&sampler->running, memory_order_relaxed)){
+        // read and publish energy (timed from the wake-up, so only one
+        // more clock read per sample)
+        t_ns = monotonic_ns();
+        jitter_add(&sampler->jitter, t_ns - deadline);
+        metrics_time(MH_WAKEUP, t_ns - deadline);
+        energy = rp_field(*(sampler->data_energy), sampler->energy_shift);
+        metrics_time(MH_MMIO_READ, monotonic_ns() - t_ns);
+        metrics_count(MC_ENERGY_READS, 1);
+        energy_ring_push(&sampler->ring, t_ns, energy);
+        if(sampler->tel != NULL){
+            telemetry_push(sampler->tel, t_ns, energy);
+        }
+        if(sampler->fb != NULL){
+            filterbank_push(sampler->fb, t_ns, energy);
+        }
+        
+        // next deadline
+        deadline += NSEC_PER_SEC/atomic_load_explicit(&sampler->rate_hz, memory_order_relaxed);
+        // overrun: skip missed deadlines instead of bursting
+        t_ns = monotonic_ns();
+        if(deadline < t_ns){
+            atomic_fetch_add_explicit(&sampler->missed, 1, memory_order_relaxed);
+            metrics_count(MC_SAMPLER_OVERRUNS, 1);
+            deadline = t_ns;
+            continue;
+        }
+        sleep_until_ns(deadline);
+    }
+    return NULL;
+}
+
+// Lock memory and prefault the stack (real-time mode)
+//
+// The telemetry ring (tel, may be NULL), mapped before, is unlocked
+// again so that its hundreds of MB are not pinned. On a file system
+// with writeback, stores to a page being written back can still stall,
+// so the ring should be on tmpfs with --rt. Problems are reported to
+// log (NULL: quiet).
+//
+int rt_setup_process(struct telemetry_file *tel, FILE *log){
+    volatile char stack[RT_STACK_PREFAULT];
+    struct statfs fs;
+    
+    if(mlockall(MCL_CURRENT | MCL_FUTURE) != 0){
+        msg_printf(log, "Real-time mode: could not lock memory: %s\n", strerror(errno));
+        return 1;
+    }
+    if(tel != NULL){
+        munlock(tel->map, tel->size);
+        if(fstatfs(tel->fd, &fs) == 0 && fs.f_type != TMPFS_MAGIC){
+            msg_printf(log, "Real-time mode: telemetry file is not on tmpfs, writeback may delay the sampler\n");
+        }
+    }
+    for(int i = 0; i < RT_STACK_PREFAULT; i += 4096){
+        stack[i] = 0;
+    }
+    (void) stack[0];
+    // end function normally
+    return 0;
+}
+
+// Pin a thread to a core and make it SCHED_FIFO (real-time mode)
+//
+// Problems are reported to log (NULL: quiet)
+//
+int rt_setup_thread(pthread_t thread, int cpu, int priority, FILE *log){
+    cpu_set_t cpus;
+    struct sched_param param;
+    int err;
+    
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    err = pthread_setaffinity_np(thread, sizeof(cpus), &cpus);
+    if(err != 0){
+        msg_printf(log, "Could not pin thread to CPU %d: %s\n", cpu, strerror(err));
+        return 1;
+    }
+    param.sched_priority = priority;
+    err = pthread_setschedparam(thread, SCHED_FIFO, &param);
+    if(err != 0){
+        msg_printf(log, "Could not set SCHED_FIFO priority %d: %s\n", priority, strerror(err));
+        return 1;
+    }
+    // end function normally
+    return 0;
+}
+
+// Start energy sampler on the energy register of a channel
+//
+int energy_sampler_start(struct energy_sampler *sampler, struct rp_regs *regs, uint32_t rate_hz){
+    sampler->data_energy = (volatile uint32_t *) regs->data_energy;
+    sampler->energy_shift = regs->ch.energy_shift;
+    sampler->channel = regs->index;
+    atomic_store(&sampler->rate_hz, rate_hz);
+    atomic_store(&sampler->missed, 0);
+    atomic_store(&sampler->running, 1);
+    for(int b = 0; b < JITTER_BINS; b++){
+        atomic_store(&sampler->jitter.count[b], 0);
+    }
+    atomic_store(&sampler->jitter.max_ns, 0);
+    energy_ring_init(&sampler->ring);
+    if(pthread_create(&sampler->thread, NULL, energy_sampler_thread, sampler) != 0){
+        atomic_store(&sampler->running, 0);
+        msg_printf(regs->log, "Could not start energy sampler\n");
+        // error exit
+        return 1;
+    }
+    // end function normally
+    return 0;
+}
+
+// Stop energy sampler
+//
+int energy_sampler_stop(struct energy_sampler *sampler){
+    if(atomic_exchange(&sampler->running, 0)){
+        pthread_join(sampler->thread, NULL);
+    }
+    // end function normally
+    return 0;
+}
+
+// Add a sample to a running mean/variance
+//
+int welford_update(struct welford *w, double x){
+    double delta = x - w->mean;
+    w->n++;
+    w->mean += delta/w->n;
+    w->m2 += delta*(x - w->mean);
+    // end function normally
+    return 0;
+}
+
+// Sample variance of a running mean/variance
+//
+double welford_var(struct welford *w){
+    return (w->n > 1) ? w->m2/(w->n - 1) : 0;
+}
+
+// Variance inflation of the mean of n lag-1 correlated samples
+//
+// The lag-1 correlation rho follows from Var(x_i - x_i-1) = 2 var (1 - rho),
+// with sdd the sum of squared consecutive differences; the standard
+// error squared of the mean is then var/n (1 + rho)/(1 - rho), at most
+// var (n correlated samples count as one)
+//
+double lag1_inflation(double var, double sdd, long int n){
+    double rho;
+    
+    if(n < 2 || var <= 0){
+        return 1;
+    }
+    rho = fmin(fmax(1 - sdd/(n - 1)/(2*var), 0), (double) (n - 1)/(n + 1));
+    return (1 + rho)/(1 - rho);
+}
+
+// Start a transient fit at time t0_ns (the gain change)
+//
+int transient_init(struct transient_fit *fit, uint64_t t0_ns){
+    for(int k = 0; k < TRANSIENT_TAUS; k++){
+        fit->tau[k] = TRANSIENT_TAU_MIN*pow(TRANSIENT_TAU_MAX/TRANSIENT_TAU_MIN, (double) k/(TRANSIENT_TAUS - 1));
+        fit->su[k] = 0;
+        fit->suu[k] = 0;
+        fit->suy[k] = 0;
+    }
+    fit->n = 0;
+    fit->sy = 0;
+    fit->syy = 0;
+    fit->sdd = 0;
+    fit->y0 = 0;
+    fit->y_prev = 0;
+    fit->t0 = t0_ns;
+    fit->t_last = t0_ns;
+    // end function normally
+    return 0;
+}
+
+// Add an energy sample to a transient fit
+//
+int transient_update(struct transient_fit *fit, uint64_t t_ns, double energy){
+    double t = (double) (int64_t) (t_ns - fit->t0)/NSEC_PER_SEC, u, y;
+    
+    // center on the first sample to keep the sums well conditioned
+    if(fit->n == 0){
+        fit->y0 = energy;
+    }
+    y = energy - fit->y0;
+    for(int k = 0; k < TRANSIENT_TAUS; k++){
+        u = exp(-t/fit->tau[k]);
+        fit->su[k] += u;
+        fit->suu[k] += u*u;
+        fit->suy[k] += u*y;
+    }
+    if(fit->n > 0){
+        fit->sdd += (y - fit->y_prev)*(y - fit->y_prev);
+    }
+    fit->n++;
+    fit->sy += y;
+    fit->syy += y*y;
+    fit->y_prev = y;
+    fit->t_last = t_ns;
+    // end function normally
+    return 0;
+}
+
+// Steady-state energy predicted by a transient fit
+//
+// Picks the candidate tau with the smallest residual. Energy fluctuations
+// stay correlated over about one relaxation time, so the standard error
+// of E_inf is inflated by (1 + rho)/(1 - rho), with the lag-1 correlation
+// rho of the residuals estimated from the consecutive differences. It is
+// then widened by the spread of E_inf over all tau the data cannot
+// reject at confidence z. Returns
+// 1 (no prediction) with too few samples, a transient observed for less
+// than TRANSIENT_MIN_TAUS relaxation times, or a relaxation possibly
+// slower than TRANSIENT_TAU_MAX.
+//
+int transient_predict(struct transient_fit *fit, double z, double *mean, double *se2, double *tau){
+    double det[TRANSIENT_TAUS], e_inf[TRANSIENT_TAUS], rss[TRANSIENT_TAUS];
+    double n = fit->n, a, s2, inflation, dt, spread = 0, se;
+    int best = -1;
+    
+    if(fit->n < TRANSIENT_MIN_SAMPLES){
+        return 1;
+    }
+    // least squares for each tau: y = c + a u
+    for(int k = 0; k < TRANSIENT_TAUS; k++){
+        det[k] = n*fit->suu[k] - fit->su[k]*fit->su[k];
+        if(det[k] <= 1e-12*n*fit->suu[k]){
+            continue;
+        }
+        a = (n*fit->suy[k] - fit->su[k]*fit->sy)/det[k];
+        e_inf[k] = (fit->suu[k]*fit->sy - fit->su[k]*fit->suy[k])/det[k];
+        rss[k] = fit->syy - e_inf[k]*fit->sy - a*fit->suy[k];
+        if(best < 0 || rss[k] < rss[best]){
+            best = k;
+        }
+    }
+    dt = (double) (fit->t_last - fit->t0)/NSEC_PER_SEC;
+    if(best < 0 || best == TRANSIENT_TAUS - 1 || dt < TRANSIENT_MIN_TAUS*fit->tau[best]){
+        return 1;
+    }
+    s2 = rss[best]/(n - 2);
+    if(s2 <= 0){
+        return 1;
+    }
+    inflation = lag1_inflation(s2, fit->sdd, fit->n);
+    // profile over tau: candidates within z^2 (effective) noise units
+    for(int k = 0; k < TRANSIENT_TAUS; k++){
+        if(det[k] > 1e-12*n*fit->suu[k] && rss[k] <= rss[best] + z*z*s2*inflation){
+            if(k == TRANSIENT_TAUS - 1){
+                return 1;
+            }
+            spread = fmax(spread, fabs(e_inf[k] - e_inf[best]));
+        }
+    }
+    se = sqrt(s2*fit->suu[best]/det[best]*inflation) + spread/z;
+    *mean = e_inf[best] + fit->y0;
+    *se2 = se*se;
+    *tau = fit->tau[best];
+    // end function normally
+    return 0;
+}
+
+// Mean and variance of the energy samples taken at or after t_start_ns
+//
+// Walks the ring backwards from the newest sample. Returns 1 if no
+// sample is available in the window.
+//
+int energy_ring_stats(struct energy_ring *ring, uint64_t t_start_ns, long int *n, double *mean, double *var){
+    struct energy_sample sample;
+    struct welford w = {0, 0, 0};
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    uint64_t i = head;
+    
+    // newest to oldest
+    while(i > 0 && head - i < ENERGY_RING_SIZE){
+        i--;
+        if(energy_ring_read(ring, i, &sample) != 0 || sample.t_ns < t_start_ns){
+            break;
+        }
+        welford_update(&w, (double) sample.energy);
+    }
+    *n = w.n;
+    *mean = w.mean;
+    *var = welford_var(&w);
+    if(w.n == 0){
+        return 1;
+    }
+    // end function normally
+    return 0;
+}
+
+// Sequential test on the energy difference
+//
+// The difference between the current mean (standard error squared se2,
+// autocorrelation included)
+// and the previous mean is resolved when its confidence interval
+// excludes zero, or when the interval is narrower than the resolution
+// (difference is zero for our purposes). Without a previous
+// measurement, the mean itself must be known to within the resolution.
+//
+int dwell_resolved(struct dwell_config *cfg, double mean, double se2, struct dwell_result *prev){
+    double diff;
+    
+    if(prev == NULL || prev->n < 2){
+        return cfg->z*sqrt(se2) < 0.5*cfg->resolution;
+    }
+    se2 += prev->var/prev->n;
+    diff = fabs(mean - prev->mean);
+    return (diff > cfg->z*sqrt(se2)) || (cfg->z*sqrt(se2) < 0.5*cfg->resolution);
+}
+
+// Start a dwell measurement
+//
+// Settles for settle_s from now, then accumulates sampler readings
+// until the sequential test resolves the difference with the previous
+// measurement (prev, may be NULL) or max_dwell_s is reached. With
+// cfg->predict, the readings taken while settling are also fitted with
+// an exponential relaxation, and the measurement ends as soon as the
+// predicted steady state is known to within TRANSIENT_REL_TOL and passes
+// the same test.
+//
+int dwell_start(struct dwell_state *st, struct energy_sampler *sampler, struct dwell_config *cfg, struct dwell_result *prev){
+    st->sampler = sampler;
+    st->cfg = *cfg;
+    st->have_prev = (prev != NULL);
+    if(prev != NULL){
+        st->prev = *prev;
+    }
+    st->w.n = 0;
+    st->w.mean = 0;
+    st->w.m2 = 0;
+    st->sdd = 0;
+    st->x_prev = 0;
+    st->t_begin = monotonic_ns();
+    st->t_start = st->t_begin + (uint64_t) (cfg->settle_s*NSEC_PER_SEC);
+    st->deadline = st->t_start;
+    st->sampling = 0;
+    if(cfg->predict){
+        // the fit needs the transient from the gain change on
+        transient_init(&st->fit, st->t_begin);
+        st->cursor = atomic_load_explicit(&sampler->ring.head, memory_order_acquire);
+        st->deadline = st->t_begin + DWELL_POLL_US*1000ULL;
+        st->sampling = 1;
+    }
+    // end function normally
+    return 0;
+}
+
+// Advance a dwell measurement without blocking
+//
+// Returns 1 when the measurement is finished (res is filled), 0 if it
+// must be polled again at st->deadline
+//
+int dwell_poll(struct dwell_state *st, struct dwell_result *res){
+    struct energy_sample sample;
+    struct energy_ring *ring = &st->sampler->ring;
+    uint64_t t_now = monotonic_ns(), head;
+    double elapsed_s, mean, se2, tau, var;
+    int done = 0;
+    
+    if(!st->sampling && t_now < st->t_start){
+        st->deadline = st->t_start;
+        return 0;
+    }
+    // first poll after settling: skip samples taken while settling
+    head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if(!st->sampling){
+        st->sampling = 1;
+        st->cursor = head;
+        st->deadline = t_now + DWELL_POLL_US*1000ULL;
+        return 0;
+    }
+    
+    // consume new samples
+    if(head - st->cursor > ENERGY_RING_SIZE){
+        st->cursor = head - ENERGY_RING_SIZE;
+    }
+    for(; st->cursor < head; st->cursor++){
+        if(energy_ring_read(ring, st->cursor, &sample) != 0){
+            continue;
+        }
+        if(st->cfg.predict && sample.t_ns >= st->t_begin){
+            transient_update(&st->fit, sample.t_ns, (double) sample.energy);
+        }
+        if(sample.t_ns >= st->t_start){
+            if(st->w.n > 0){
+                st->sdd += ((double) sample.energy - st->x_prev)*((double) sample.energy - st->x_prev);
+            }
+            st->x_prev = (double) sample.energy;
+            welford_update(&st->w, (double) sample.energy);
+        }
+    }
+    elapsed_s = (double) (int64_t) (t_now - st->t_start)/NSEC_PER_SEC;
+    var = welford_var(&st->w)*lag1_inflation(welford_var(&st->w), st->sdd, st->w.n);
+    res->resolved = 0;
+    res->predicted = 0;
+    res->tau = 0;
+    if(elapsed_s >= st->cfg.min_dwell_s && st->w.n >= 2
+       && dwell_resolved(&st->cfg, st->w.mean, var/st->w.n, st->have_prev ? &st->prev : NULL)){
+        res->resolved = 1;
+        done = 1;
+    } else if(st->cfg.predict && (double) (t_now - st->t_begin)/NSEC_PER_SEC >= st->cfg.min_dwell_s
+              && transient_predict(&st->fit, st->cfg.z, &mean, &se2, &tau) == 0
+              && st->cfg.z*sqrt(se2) <= fmax(0.5*st->cfg.resolution, TRANSIENT_REL_TOL*fabs(mean))
+              && dwell_resolved(&st->cfg, mean, se2, st->have_prev ? &st->prev : NULL)){
+        res->resolved = 1;
+        res->predicted = 1;
+        res->tau = tau;
+        done = 1;
+    } else if(elapsed_s >= st->cfg.max_dwell_s){
+        done = 1;
+    }
+    if(!done){
+        // early polls (other events of the caller) keep the schedule
+        if(t_now >= st->deadline){
+            st->deadline += DWELL_POLL_US*1000ULL;
+        }
+        return 0;
+    }
+    res->dwell_s = (double) (t_now - st->t_begin)/NSEC_PER_SEC;
+    metrics_time(MH_DWELL, t_now - st->t_begin);
+    metrics_count(MC_TUNER_EVALS, 1);
+    if(res->predicted){
+        // variance such that var/n is the standard error of the prediction
+        res->n = st->fit.n;
+        res->mean = mean;
+        res->var = se2*res->n;
+        return 1;
+    }
+    res->mean = st->w.mean;
+    res->var = var;
+    res->n = st->w.n;
+    return 1;
+}
+
+// Measure energy with sequential early stopping (blocking)
+//
+// A measurement without samples is reported to log (NULL: quiet)
+//
+int dwell_measure(struct energy_sampler *sampler, struct dwell_config *cfg, struct dwell_result *prev, struct dwell_result *res,
+                  FILE *log){
+    struct dwell_state st;
+    
+    dwell_start(&st, sampler, cfg, prev);
+    do{
+        sleep_until_ns(st.deadline);
+    } while(!dwell_poll(&st, res));
+    if(res->n == 0){
+        msg_printf(log, "No energy samples received\n");
+        // error exit
+        return 1;
+    }
+    // end function normally
+    return 0;
+}
+
+// Set sampler polling rate
+//
+int sat_rate(long int rate, uint32_t *rate_hz){
+    if(rate > SAMPLER_MAX_RATE){
+        *rate_hz = SAMPLER_MAX_RATE;
+    } else if(rate < 1){
+        *rate_hz = 1;
+    } else {
+        *rate_hz = (uint32_t) rate;
+    }
+    // end normally
+    return 0;
+}
+
+// 1 if the watchdog has tripped and not been re-armed
+//
+int watchdog_tripped(struct watchdog *wd){
+    return (wd != NULL) && atomic_load(&wd->tripped);
+}
+
+// Map the page holding a register (physical address, or its page in
+// the simulated file) and return the register's address in it
+//
+void *regs_map_word(struct rp_regs *regs, struct rp_map *map, uint32_t addr, void **page_map){
+    off_t offset = regs->sim ? (off_t) (rp_map_page(map, addr, regs->page)*regs->page) : (off_t) (addr - addr % regs->page);
+    
+    *page_map = mmap(NULL, regs->page, PROT_READ|PROT_WRITE, MAP_SHARED, regs->fd, offset);
+    return (*page_map == MAP_FAILED) ? NULL : (char *) *page_map + addr % regs->page;
+}
+
+// Open register backend of channel c of the map
+//
+// sim_file == NULL maps the FPGA registers through /dev/mem; otherwise
+// the simulated register file is mapped (and created if needed)
+//
+int regs_open(struct rp_regs *regs, const char *sim_file, struct rp_map *map, int c){
+    regs->page = sysconf(_SC_PAGESIZE);
+    regs->sim = (sim_file != NULL);
+    regs->ch = map->ch[c];
+    regs->index = c;
+    if(regs->sim){
+        regs->fd = open(sim_file, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+        if(regs->fd < 0 || ftruncate(regs->fd, rp_map_pages(map, regs->page)*regs->page) != 0){
+            msg_printf(regs->log, "Could not open %s: %s\n", sim_file, strerror(errno));
+            if(regs->fd >= 0){
+                close(regs->fd);
+            }
+            return 1; // return error in opening
+        }
+    } else {
+        regs->fd = open("/dev/mem", O_RDWR);
+        if(regs->fd < 0){
+            msg_printf(regs->log, "Could not open /dev/mem: %s\n", strerror(errno));
+            return 1; // return error in opening
+        }
+    }
+    // rp_bench --write rewrites the PID word with a stale value: it takes
+    // the lock exclusively, and neither side runs while the other holds it
+    if(flock(regs->fd, LOCK_SH | LOCK_NB) != 0){
+        msg_printf(regs->log, "Registers locked by rp_bench --write\n");
+        close(regs->fd);
+        return 1; // return error in locking
+    }
+    regs->cfg_delay   = regs_map_word(regs, map, regs->ch.delay_addr, &regs->map_delay);
+    regs->data_energy = regs_map_word(regs, map, regs->ch.energy_addr, &regs->map_energy);
+    regs->cfg_pid     = regs_map_word(regs, map, regs->ch.pid_addr, &regs->map_pid);
+    if(regs->cfg_delay == NULL || regs->data_energy == NULL || regs->cfg_pid == NULL){
+        msg_printf(regs->log, "Could not map the registers: %s\n", strerror(errno));
+        // unmap the pages mapped before the failure
+        if(regs->map_delay != MAP_FAILED){
+            munmap(regs->map_delay, regs->page);
+        }
+        if(regs->map_energy != MAP_FAILED){
+            munmap(regs->map_energy, regs->page);
+        }
+        if(regs->map_pid != MAP_FAILED){
+            munmap(regs->map_pid, regs->page);
+        }
+        close(regs->fd);
+        return 1; // return error in mapping
+    }
+    pthread_mutex_init(&regs->lock, NULL);
+    // end function normally
+    return 0;
+}
+
+// Close register backend
+//
+int regs_close(struct rp_regs *regs){
+    munmap(regs->map_delay, regs->page);
+    munmap(regs->map_energy, regs->page);
+    munmap(regs->map_pid, regs->page);
+    close(regs->fd);
+    pthread_mutex_destroy(&regs->lock);
+    // end function normally
+    return 0;
+}
+
+// k_p, k_d of a PID word of the channel
+//
+int regs_unpack_pid(struct rp_regs *regs, uint32_t word, short int *k_p, short int *k_d){
+    *k_p = (int16_t) rp_field(word, regs->ch.kp_shift);
+    *k_d = (int16_t) rp_field(word, regs->ch.kd_shift);
+    // end function normally
+    return 0;
+}
+
+// Current energy register value of the channel
+//
+uint32_t regs_energy(struct rp_regs *regs){
+    return rp_field(mmio_read((volatile uint32_t *) regs->data_energy, MC_ENERGY_READS), regs->ch.energy_shift);
+}
+
+// Publish the shadows to the telemetry recorder (in the single-channel
+// packing, whatever the channel's)
+//
+int regs_publish(struct rp_regs *regs){
+    short int k_p, k_d;
+    
+    regs_unpack_pid(regs, regs->shadow_pid, &k_p, &k_d);
+    return telemetry_regs(regs->tel, rp_pack_pid(k_p, k_d), regs->shadow_delay);
+}
+
+// Read the config registers into the shadow copies
+//
+// Only needed once at start-up: afterwards the shadows are the
+// reference and the registers are never read back on the write path.
+//
+int regs_sync(struct rp_regs *regs){
+    pthread_mutex_lock(&regs->lock);
+    regs->shadow_delay = mmio_read((volatile uint32_t *) regs->cfg_delay, MC_REG_READS) & 0x0000FFFF;
+    regs->shadow_pid   = mmio_read((volatile uint32_t *) regs->cfg_pid, MC_REG_READS);
+    regs->next_delay = regs->shadow_delay;
+    regs->next_pid   = regs->shadow_pid;
+    regs->staged_delay = regs->staged_pid = 0;
+    regs_publish(regs);
+    pthread_mutex_unlock(&regs->lock);
+    // end function normally
+    return 0;
+}
+
+// Stage k_p, k_d (written on the next regs_commit, lock held)
+//
+int regs_stage_pid(struct rp_regs *regs, short int k_p, short int k_d){
+    regs->next_pid = rp_channel_pack(&regs->ch, k_p, k_d);
+    regs->staged_pid = 1;
+    // end function normally
+    return 0;
+}
+
+// Stage delay (written on the next regs_commit, lock held)
+//
+int regs_stage_delay(struct rp_regs *regs, short int delay){
+    regs->next_delay = (uint32_t) delay & 0x0000FFFF;
+    regs->staged_delay = 1;
+    // end function normally
+    return 0;
+}
+
+// Write staged words that differ from the shadows
+//
+// k_p and k_d share one 32-bit word, so a gain pair is always applied
+// by a single store. When the delay also changes it is written first,
+// with a barrier in between, so the new gains are never issued before
+// the new delay. The barriers only order the stores: they do not wait
+// for the FPGA to receive them (that takes a DSB or a read-back, which
+// verify does). With verify set, the words are read back and compared.
+// A staged word equal to its shadow counts as coalesced. Called with
+// regs->lock held.
+//
+int regs_commit(struct rp_regs *regs){
+    int err = 0;
+    
+    if(regs->next_delay != regs->shadow_delay){
+        mmio_write((volatile uint32_t *) regs->cfg_delay, regs->next_delay);
+        regs->shadow_delay = regs->next_delay;
+        regs->writes++;
+        atomic_thread_fence(memory_order_seq_cst);
+    } else if(regs->staged_delay){
+        regs->coalesced++;
+        metrics_count(MC_REG_COALESCED, 1);
+    }
+    if(regs->next_pid != regs->shadow_pid && regs->next_pid != 0 && watchdog_tripped(regs->wd)){
+        // feedback was killed by the watchdog: keep it off
+        regs->next_pid = regs->shadow_pid = 0;
+        msg_printf(regs->log, "Watchdog tripped: gain write refused, type 'arm' to re-arm\n");
+        err = 1;
+    } else if(regs->next_pid != regs->shadow_pid){
+        mmio_write((volatile uint32_t *) regs->cfg_pid, regs->next_pid);
+        regs->shadow_pid = regs->next_pid;
+        regs->writes++;
+        atomic_thread_fence(memory_order_seq_cst);
+        // tripped while writing: the watchdog may have zeroed the word
+        // before this store, so zero it again
+        if(watchdog_tripped(regs->wd)){
+            mmio_write((volatile uint32_t *) regs->cfg_pid, 0);
+            err = (regs->next_pid != 0);
+            regs->next_pid = regs->shadow_pid = 0;
+        }
+    } else if(regs->staged_pid){
+        regs->coalesced++;
+        metrics_count(MC_REG_COALESCED, 1);
+    }
+    regs->staged_delay = regs->staged_pid = 0;
+    regs_publish(regs);
+    
+    // optional read-back verification
+    if(regs->verify){
+        if((mmio_read((volatile uint32_t *) regs->cfg_delay, MC_REG_READS) & 0x0000FFFF) != regs->shadow_delay ||
+           mmio_read((volatile uint32_t *) regs->cfg_pid, MC_REG_READS) != regs->shadow_pid){
+            regs->mismatches++;
+            msg_printf(regs->log, "Register read-back does not match written value\n");
+            err = 1;
+        }
+    }
+    return err;
+}
+
+// Write k_p, k_d
+//
+int regs_set_pid(struct rp_regs *regs, short int k_p, short int k_d){
+    int err;
+    
+    pthread_mutex_lock(&regs->lock);
+    regs_stage_pid(regs, k_p, k_d);
+    err = regs_commit(regs);
+    pthread_mutex_unlock(&regs->lock);
+    return err;
+}
+
+// Write delay
+//
+int regs_set_delay(struct rp_regs *regs, short int delay){
+    int err;
+    
+    pthread_mutex_lock(&regs->lock);
+    regs_stage_delay(regs, delay);
+    err = regs_commit(regs);
+    pthread_mutex_unlock(&regs->lock);
+    return err;
+}
+
+// Write k_p, k_d and delay in as few writes as possible
+//
+int regs_set_all(struct rp_regs *regs, short int k_p, short int k_d, short int delay){
+    int err;
+    
+    pthread_mutex_lock(&regs->lock);
+    regs_stage_delay(regs, delay);
+    regs_stage_pid(regs, k_p, k_d);
+    err = regs_commit(regs);
+    pthread_mutex_unlock(&regs->lock);
+    return err;
+}
+
+// Current k_p, k_d and delay from the shadows
+//
+int regs_get(struct rp_regs *regs, short int *k_p, short int *k_d, short int *delay){
+    pthread_mutex_lock(&regs->lock);
+    regs_unpack_pid(regs, regs->shadow_pid, k_p, k_d);
+    *delay = (short int) regs->shadow_delay;
+    pthread_mutex_unlock(&regs->lock);
+    // end function normally
+    return 0;
+}
+
+// Watchdog thread
+//
+// Polls the energy register at rate_hz. The slope is estimated from two
+// exponential filters of the energy with time constants window/4 and
+// window: for a linear rise they lag by window/4 and window, so their
+// difference over 3 window/4 is the slope. On a trip the PID word is
+// zeroed first, then the snapshot is filled; while tripped the PID word
+// is kept at zero.
+//
+void *watchdog_thread(void *arg){
+    struct watchdog *wd = (struct watchdog *) arg;
+    struct watchdog_config *cfg = &wd->cfg;
+    uint64_t t_ns, deadline, period, n = 0, n_warm;
+    uint32_t energy, pid;
+    double fast = 0, slow = 0, a_fast, a_slow, slope = 0;
+    int n_energy = 0, n_slope = 0, reason;
+    
+    period = NSEC_PER_SEC/cfg->rate_hz;
+    a_fast = 1 - exp(-4.0/(cfg->slope_window_s*cfg->rate_hz));
+    a_slow = 1 - exp(-1.0/(cfg->slope_window_s*cfg->rate_hz));
+    n_warm = (uint64_t) (cfg->slope_window_s*cfg->rate_hz);
+    metrics_thread("watchdog", wd->regs->index);
+    deadline = monotonic_ns();
+    while(atomic_load_explicit(&wd->running, memory_order_relaxed)){
+        t_ns = monotonic_ns();
+        energy = rp_field(*(wd->data_energy), wd->energy_shift);
+        metrics_time(MH_MMIO_READ, monotonic_ns() - t_ns);
+        metrics_count(MC_ENERGY_READS, 1);
+        
+        if(atomic_load_explicit(&wd->tripped, memory_order_relaxed)){
+            // keep the feedback off until re-armed
+            if(mmio_read(wd->cfg_pid, MC_REG_READS) != 0){
+                mmio_write(wd->cfg_pid, 0);
+            }
+        } else {
+            // limits
+            if(n == 0){
+                fast = slow = energy;
+            }
+            fast += a_fast*(energy - fast);
+            slow += a_slow*(energy - slow);
+            slope = (fast - slow)/(0.75*cfg->slope_window_s);
+            n_energy = (energy > cfg->threshold) ? n_energy + 1 : 0;
+            n_slope = (cfg->slope_max > 0 && n > n_warm && slope > cfg->slope_max) ? n_slope + 1 : 0;
+            reason = (n_energy >= cfg->debounce) ? WD_REASON_ENERGY : (n_slope >= cfg->debounce) ? WD_REASON_SLOPE : 0;
+            
+            if(reason){
+                // trip: feedback off first, bookkeeping after
+                atomic_store(&wd->tripped, 1);
+                *(wd->cfg_pid) = 0;
+                atomic_thread_fence(memory_order_seq_cst);
+                wd->snap.latency_ns = monotonic_ns() - t_ns;
+                // words that were running, from the shadows (no register
+                // read before the kill); a commit in progress finishes
+                // first and zeroes the word again itself
+                pthread_mutex_lock(&wd->regs->lock);
+                pid = wd->regs->shadow_pid;
+                wd->snap.delay = wd->regs->shadow_delay;
+                pthread_mutex_unlock(&wd->regs->lock);
+                wd->snap.t_trip_ns = t_ns;
+                wd->snap.reason = reason;
+                wd->snap.energy = energy;
+                wd->snap.slope = slope;
+                wd->snap.pid = pid;
+                wd->snap.n = (n < WD_SNAPSHOT) ? (int) n : WD_SNAPSHOT;
+                for(int i = 0; i < wd->snap.n; i++){
+                    wd->snap.sample[i] = wd->hist[(n - wd->snap.n + i) % WD_SNAPSHOT];
+                }
+                telemetry_regs(wd->tel, 0, wd->snap.delay);
+                // (the trip write is counted, not timed, to keep the trip fast)
+                metrics_count(MC_WD_TRIPS, 1);
+                metrics_count(MC_REG_WRITES, 1);
+                atomic_store_explicit(&wd->snap_ready, 1, memory_order_release);
+            }
+        }
+        wd->hist[n % WD_SNAPSHOT].t_ns = t_ns;
+        wd->hist[n % WD_SNAPSHOT].energy = energy;
+        n++;
+        
+        // next deadline, skipping missed ones
+        deadline += period;
+        t_ns = monotonic_ns();
+        if(deadline < t_ns){
+            deadline = t_ns;
+            continue;
+        }
+        sleep_until_ns(deadline);
+    }
+    return NULL;
+}
+
+// Start (and arm) the watchdog
+//
+int watchdog_start(struct watchdog *wd, struct rp_regs *regs, struct watchdog_config *cfg){
+    wd->data_energy = (volatile uint32_t *) regs->data_energy;
+    wd->energy_shift = regs->ch.energy_shift;
+    wd->regs = regs;
+    wd->cfg_pid = (volatile uint32_t *) regs->cfg_pid;
+    wd->cfg_delay = (volatile uint32_t *) regs->cfg_delay;
+    wd->tel = regs->tel;
+    wd->cfg = *cfg;
+    wd->reported = 0;
+    atomic_store(&wd->tripped, 0);
+    atomic_store(&wd->snap_ready, 0);
+    atomic_store(&wd->running, 1);
+    if(pthread_create(&wd->thread, NULL, watchdog_thread, wd) != 0){
+        atomic_store(&wd->running, 0);
+        msg_printf(regs->log, "Could not start watchdog\n");
+        // error exit
+        return 1;
+    }
+    // end function normally
+    return 0;
+}
+
+// Stop the watchdog (a trip stays latched)
+//
+int watchdog_stop(struct watchdog *wd){
+    if(atomic_load(&wd->running)){
+        atomic_store(&wd->running, 0);
+        pthread_join(wd->thread, NULL);
+    }
+    // end function normally
+    return 0;
+}
+
+// Re-arm the watchdog after a trip
+//
+// The registers are read back once, since the watchdog wrote the PID
+// word behind the shadows. Feedback stays off until gains are written.
+//
+int watchdog_arm(struct watchdog *wd, struct rp_regs *regs){
+    watchdog_stop(wd);
+    regs_sync(regs);
+    return watchdog_start(wd, regs, &wd->cfg);
+}
+
+// Report the post-mortem snapshot of a trip to the channel's log
+//
+int watchdog_print(struct watchdog *wd){
+    struct watchdog_snapshot *snap = &wd->snap;
+    FILE *log = wd->regs->log;
+    short int k_p, k_d;
+    int step;
+    
+    if(!atomic_load_explicit(&wd->snap_ready, memory_order_acquire)){
+        return 1; // return error: no snapshot
+    }
+    msg_printf(log, "------------------------\n");
+    regs_unpack_pid(wd->regs, snap->pid, &k_p, &k_d);
+    msg_printf(log, "Watchdog tripped%s%s: %s\n", wd->regs->ch.name[0] ? " on " : "", wd->regs->ch.name,
+           (snap->reason == WD_REASON_ENERGY) ? "energy above threshold" : "energy rising too fast");
+    msg_printf(log, "Energy %u (threshold %u), slope %.0f/s (max %.0f/s)\n", snap->energy, wd->cfg.threshold, snap->slope, wd->cfg.slope_max);
+    msg_printf(log, "Zeroed k_p = %d, k_d = %d (delay %u) %.1f us after the sample\n",
+           k_p, k_d, snap->delay, snap->latency_ns/1e3);
+    msg_printf(log, "Energy before the trip:\n");
+    step = (snap->n > 16) ? snap->n/16 : 1;
+    for(int i = (snap->n - 1) % step; i < snap->n; i += step){
+        msg_printf(log, "    %8.2f ms: %u\n", -((double) (snap->t_trip_ns - snap->sample[i].t_ns))/1e6, snap->sample[i].energy);
+    }
+    msg_printf(log, "Gain writes are refused until the watchdog is re-armed ('arm')\n");
+    msg_printf(log, "------------------------\n");
+    // end function normally
+    return 0;
+}
+
+// Check for a watchdog trip from the control thread
+//
+// Returns 1 (once per trip) when the watchdog has tripped, after
+// reporting the snapshot and setting the PID shadow to the zeroed word
+//
+int watchdog_check(struct watchdog *wd, struct rp_regs *regs){
+    if(wd->reported || !atomic_load_explicit(&wd->snap_ready, memory_order_acquire)){
+        return 0;
+    }
+    wd->reported = 1;
+    pthread_mutex_lock(&regs->lock);
+    regs->shadow_pid = regs->next_pid = 0;
+    pthread_mutex_unlock(&regs->lock);
+    watchdog_print(wd);
+    return 1;
+}
+
+// Clamp parameters to bounds and register ranges, rounding to integers
+//
+int clamp_params(double param[N_PARAMS], double lo[N_PARAMS], double hi[N_PARAMS], short int reg[N_PARAMS]){
+    for(int i = 0; i < N_PARAMS; i++){
+        if(param[i] < lo[i]){
+            param[i] = lo[i];
+        } else if(param[i] > hi[i]){
+            param[i] = hi[i];
+        }
+    }
+    sat_gain(lround(param[P_KP]), &reg[P_KP]);
+    sat_gain(lround(param[P_KD]), &reg[P_KD]);
+    sat_delay(lround(param[P_DELAY]), &reg[P_DELAY]);
+    // end function normally
+    return 0;
+}
+
+// Simultaneous-perturbation stochastic approximation (SPSA) tuner
+//
+// Minimizes energy over (k_p, k_d, delay) jointly. Every iteration
+// perturbs all parameters at once along a random +-1 direction and
+// estimates the gradient from two energy measurements, independently
+// of the number of parameters. The tuner is driven ask/tell style:
+// spsa_ask gives the next point to measure, spsa_tell its energy.
+//
+int spsa_init(struct spsa_state *st, struct spsa_config *cfg, double theta[N_PARAMS]){
+    st->cfg = *cfg;
+    st->a = cfg->a;
+    st->k = 0;
+    st->phase = 0;
+    st->n_total = 0;
+    st->dwell_total = 0;
+    st->log = NULL;
+    // work in normalized units
+    for(int i = 0; i < N_PARAMS; i++){
+        st->theta[i] = theta[i];
+        st->x[i] = theta[i]/cfg->scale[i];
+    }
+    // end function normally
+    return 0;
+}
+
+// Next point to measure; returns 1 when the tuner is finished
+//
+int spsa_ask(struct spsa_state *st, double param[N_PARAMS]){
+    if(st->k >= st->cfg.max_iter){
+        return 1;
+    }
+    if(st->phase == 0){
+        // random Bernoulli +-1 perturbation, clamped to the bounds so
+        // that no measurement leaves the allowed region (e.g. k_d > 0)
+        st->ck = st->cfg.c/pow(st->k + 1, st->cfg.gamma);
+        for(int i = 0; i < N_PARAMS; i++){
+            st->delta[i] = (rand() & 1) ? 1.0 : -1.0;
+            st->x_pm[0][i] = fmin(fmax(st->x[i] + st->ck*st->delta[i], st->cfg.lo[i]/st->cfg.scale[i]), st->cfg.hi[i]/st->cfg.scale[i]);
+            st->x_pm[1][i] = fmin(fmax(st->x[i] - st->ck*st->delta[i], st->cfg.lo[i]/st->cfg.scale[i]), st->cfg.hi[i]/st->cfg.scale[i]);
+        }
+    }
+    for(int i = 0; i < N_PARAMS; i++){
+        param[i] = st->x_pm[st->phase][i]*st->cfg.scale[i];
+    }
+    return 0;
+}
+
+// Energy measured at the last point asked
+//
+int spsa_tell(struct spsa_state *st, struct dwell_result *res){
+    struct spsa_config *cfg = &st->cfg;
+    double ak, g, step;
+    short int reg[N_PARAMS];
+    
+    st->n_total += res->n;
+    st->dwell_total += res->dwell_s;
+    if(st->phase == 0){
+        st->y_plus = *res;
+        st->phase = 1;
+        return 0;
+    }
+    
+    // calibrate a so that the first step has size max_step
+    if(st->a <= 0){
+        g = fabs(st->y_plus.mean - res->mean)/(2*st->ck);
+        st->a = (g > 0) ? cfg->max_step*pow(1 + cfg->A, cfg->alpha)/g : 1;
+    }
+    ak = st->a/pow(st->k + 1 + cfg->A, cfg->alpha);
+    
+    // gradient step, limited to max_step per coordinate; the difference
+    // is taken over the perturbation actually measured (shorter at a
+    // bound), and a coordinate with no room to move (lo = hi) stays
+    for(int i = 0; i < N_PARAMS; i++){
+        if(st->x_pm[0][i] == st->x_pm[1][i]){
+            continue;
+        }
+        g = (st->y_plus.mean - res->mean)/(st->x_pm[0][i] - st->x_pm[1][i]);
+        step = ak*g;
+        if(step > cfg->max_step){
+            step = cfg->max_step;
+        } else if(step < -cfg->max_step){
+            step = -cfg->max_step;
+        }
+        st->x[i] -= step;
+        st->theta[i] = st->x[i]*cfg->scale[i];
+    }
+    clamp_params(st->theta, cfg->lo, cfg->hi, reg);
+    for(int i = 0; i < N_PARAMS; i++){
+        st->x[i] = st->theta[i]/cfg->scale[i];
+    }
+    
+    msg_printf(st->log, "SPSA %3d: E+ = %.1f, E- = %.1f (%ld samples) -> k_p = %d, k_d = %d, delay = %d\n",
+           st->k, st->y_plus.mean, res->mean, st->y_plus.n + res->n, reg[P_KP], reg[P_KD], reg[P_DELAY]);
+    st->k++;
+    st->phase = 0;
+    // end function normally
+    return 0;
+}
+
+// Squared-exponential kernel between two normalized points
+//
+static inline double gp_kernel(struct gp *gp, double *x1, double *x2){
+    double d2 = 0, d;
+    for(int i = 0; i < N_PARAMS; i++){
+        d = x1[i] - x2[i];
+        d2 += d*d;
+    }
+    return exp(-0.5*d2/(gp->length*gp->length));
+}
+
+// Solve L v = k by forward substitution (first n rows of L)
+//
+static inline int gp_forward(struct gp *gp, int n, double *k, double *v){
+    double sum;
+    for(int i = 0; i < n; i++){
+        sum = k[i];
+        for(int j = 0; j < i; j++){
+            sum -= gp->L[i][j]*v[j];
+        }
+        v[i] = sum/gp->L[i][i];
+    }
+    // end function normally
+    return 0;
+}
+
+// Initialize an empty GP
+//
+int gp_init(struct gp *gp, double length, double noise){
+    gp->n = 0;
+    gp->length = length;
+    gp->noise = noise;
+    gp->y_mean = 0;
+    gp->y_std = 1;
+    // end function normally
+    return 0;
+}
+
+// Add a point to the GP
+//
+// Extends the Cholesky factor by one row (O(n^2)) and recomputes the
+// weights alpha for the restandardized energies. Returns 1 if the GP is
+// full or the point is numerically a duplicate of an existing one.
+//
+int gp_add(struct gp *gp, double x[N_PARAMS], double y){
+    double k[GP_MAX_POINTS], v[GP_MAX_POINTS], d2, sum;
+    int n = gp->n;
+    
+    if(n >= GP_MAX_POINTS){
+        return 1;
+    }
+    // new row of L
+    for(int i = 0; i < n; i++){
+        k[i] = gp_kernel(gp, gp->x[i], x);
+    }
+    gp_forward(gp, n, k, v);
+    d2 = 1 + gp->noise;
+    for(int i = 0; i < n; i++){
+        d2 -= v[i]*v[i];
+    }
+    if(d2 <= 1e-12){
+        return 1;
+    }
+    for(int i = 0; i < n; i++){
+        gp->L[n][i] = v[i];
+    }
+    gp->L[n][n] = sqrt(d2);
+    for(int i = 0; i < N_PARAMS; i++){
+        gp->x[n][i] = x[i];
+    }
+    gp->y[n] = y;
+    gp->n = ++n;
+    
+    // standardize energies
+    sum = 0;
+    for(int i = 0; i < n; i++){
+        sum += gp->y[i];
+    }
+    gp->y_mean = sum/n;
+    sum = 0;
+    for(int i = 0; i < n; i++){
+        sum += (gp->y[i] - gp->y_mean)*(gp->y[i] - gp->y_mean);
+    }
+    gp->y_std = (n > 1 && sum > 0) ? sqrt(sum/(n - 1)) : 1;
+    
+    // alpha = L^-T L^-1 (y - mean)/std
+    for(int i = 0; i < n; i++){
+        k[i] = (gp->y[i] - gp->y_mean)/gp->y_std;
+    }
+    gp_forward(gp, n, k, v);
+    for(int i = n - 1; i >= 0; i--){
+        sum = v[i];
+        for(int j = i + 1; j < n; j++){
+            sum -= gp->L[j][i]*gp->alpha[j];
+        }
+        gp->alpha[i] = sum/gp->L[i][i];
+    }
+    // end function normally
+    return 0;
+}
+
+// 1 if x is already a point of the GP
+//
+int gp_known(struct gp *gp, double x[N_PARAMS]){
+    for(int j = 0; j < gp->n; j++){
+        int same = 1;
+        for(int i = 0; i < N_PARAMS; i++){
+            same = same && (gp->x[j][i] == x[i]);
+        }
+        if(same){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// GP posterior mean and standard deviation of the energy at x
+//
+int gp_predict(struct gp *gp, double x[N_PARAMS], double *mu, double *sigma){
+    double k[GP_MAX_POINTS], v[GP_MAX_POINTS], m = 0, var = 1;
+    
+    for(int i = 0; i < gp->n; i++){
+        k[i] = gp_kernel(gp, gp->x[i], x);
+        m += k[i]*gp->alpha[i];
+    }
+    gp_forward(gp, gp->n, k, v);
+    for(int i = 0; i < gp->n; i++){
+        var -= v[i]*v[i];
+    }
+    *mu = gp->y_mean + gp->y_std*m;
+    *sigma = gp->y_std*sqrt(var > 0 ? var : 0);
+    // end function normally
+    return 0;
+}
+
+// Expected improvement (minimization) over the best energy so far
+//
+double expected_improvement(double mu, double sigma, double best){
+    double z;
+    if(sigma <= 0){
+        return 0;
+    }
+    z = (best - mu)/sigma;
+    return (best - mu)*0.5*erfc(-z/sqrt(2)) + sigma*exp(-0.5*z*z)/sqrt(2*M_PI);
+}
+
+// Bayesian optimization of k_p, k_d and delay
+//
+// Fits a GP to every energy measurement taken so far and evaluates next
+// the candidate with maximum expected improvement, until the expected
+// improvement drops below ei_min or max_eval evaluations are used.
+// Driven ask/tell style like the SPSA tuner; theta is the start point.
+//
+int bo_init(struct bo_state *st, struct bo_config *cfg, struct gp *gp, double theta[N_PARAMS]){
+    st->cfg = *cfg;
+    st->gp = gp;
+    st->max_eval = (cfg->max_eval > GP_MAX_POINTS) ? GP_MAX_POINTS : cfg->max_eval;
+    st->best = 0;
+    st->i_best = 0;
+    st->n = 0;
+    st->done = 0;
+    st->n_total = 0;
+    st->dwell_total = 0;
+    st->log = NULL;
+    gp_init(gp, cfg->length, cfg->noise);
+    for(int i = 0; i < N_PARAMS; i++){
+        st->range[i] = cfg->hi[i] - cfg->lo[i];
+        st->x[i] = (st->range[i] > 0) ? (theta[i] - cfg->lo[i])/st->range[i] : 0;
+    }
+    // end function normally
+    return 0;
+}
+
+// Move a normalized point onto the register values closest to it
+//
+int bo_round(struct bo_state *st, double x[N_PARAMS], short int reg[N_PARAMS]){
+    double param[N_PARAMS];
+    
+    for(int i = 0; i < N_PARAMS; i++){
+        param[i] = st->cfg.lo[i] + x[i]*st->range[i];
+    }
+    clamp_params(param, st->cfg.lo, st->cfg.hi, reg);
+    for(int i = 0; i < N_PARAMS; i++){
+        x[i] = (st->range[i] > 0) ? (reg[i] - st->cfg.lo[i])/st->range[i] : 0;
+    }
+    // end function normally
+    return 0;
+}
+
+// Next point to measure; returns 1 when the tuner is finished
+//
+// Candidates are rounded to register values before they are scored, and
+// register points already measured are skipped: measuring one again
+// would add a duplicate row to the GP.
+//
+int bo_ask(struct bo_state *st, double param[N_PARAMS]){
+    struct gp *gp = st->gp;
+    double cand[N_PARAMS], mu, sigma, ei;
+    short int reg[N_PARAMS], cand_reg[N_PARAMS];
+    int found;
+    uint64_t t0 = monotonic_ns();
+    
+    if(st->done || st->n >= st->max_eval){
+        st->done = 1;
+        return 1;
+    }
+    
+    // next point: start point, random initial design, then max EI
+    st->ei = -1;
+    found = (st->n == 0);
+    if(found){
+        bo_round(st, st->x, reg);
+    } else if(st->n < BO_INITIAL_POINTS){
+        for(int c = 0; c < BO_CANDIDATES && !found; c++){
+            for(int i = 0; i < N_PARAMS; i++){
+                st->x[i] = rand()/(double) RAND_MAX;
+            }
+            bo_round(st, st->x, reg);
+            found = !gp_known(gp, st->x);
+        }
+    } else {
+        st->ei = 0;
+        for(int c = 0; c < BO_CANDIDATES; c++){
+            // half global candidates, half local around the best point
+            for(int i = 0; i < N_PARAMS; i++){
+                if(c & 1){
+                    cand[i] = rand()/(double) RAND_MAX;
+                } else {
+                    cand[i] = gp->x[st->i_best][i] + st->cfg.length*(rand()/(double) RAND_MAX - 0.5);
+                    cand[i] = (cand[i] < 0) ? 0 : (cand[i] > 1) ? 1 : cand[i];
+                }
+            }
+            bo_round(st, cand, cand_reg);
+            if(gp_known(gp, cand)){
+                continue;
+            }
+            gp_predict(gp, cand, &mu, &sigma);
+            ei = expected_improvement(mu, sigma, st->best);
+            if(!found || ei > st->ei){
+                found = 1;
+                st->ei = ei;
+                for(int i = 0; i < N_PARAMS; i++){
+                    st->x[i] = cand[i];
+                    reg[i] = cand_reg[i];
+                }
+            }
+        }
+        if(found && st->ei < st->cfg.ei_min){
+            msg_printf(st->log, "BO: expected improvement %.3g below threshold\n", st->ei);
+            st->done = 1;
+            return 1;
+        }
+    }
+    if(!found){
+        msg_printf(st->log, "BO: no unmeasured register point found, stopping\n");
+        st->done = 1;
+        return 1;
+    }
+    for(int i = 0; i < N_PARAMS; i++){
+        param[i] = reg[i];
+    }
+    st->ask_ms = (monotonic_ns() - t0)/1e6;
+    return 0;
+}
+
+// Energy measured at the last point asked
+//
+int bo_tell(struct bo_state *st, struct dwell_result *res){
+    st->n_total += res->n;
+    st->dwell_total += res->dwell_s;
+    if(gp_add(st->gp, st->x, res->mean) != 0){
+        msg_printf(st->log, "BO: point already known, stopping\n");
+        st->done = 1;
+        return 0;
+    }
+    if(st->n == 0 || res->mean < st->best){
+        st->best = res->mean;
+        st->i_best = st->gp->n - 1;
+    }
+    msg_printf(st->log, "BO %3d: k_p = %.0f, k_d = %.0f, delay = %.0f -> E = %.1f (%ld samples, EI %.3g, %.1f ms)\n", st->n,
+           st->cfg.lo[P_KP] + st->x[P_KP]*st->range[P_KP], st->cfg.lo[P_KD] + st->x[P_KD]*st->range[P_KD],
+           st->cfg.lo[P_DELAY] + st->x[P_DELAY]*st->range[P_DELAY], res->mean, res->n, st->ei, st->ask_ms);
+    st->n++;
+    // end function normally
+    return 0;
+}
+
+// Best point measured so far
+//
+int bo_best(struct bo_state *st, double theta[N_PARAMS]){
+    for(int i = 0; i < N_PARAMS; i++){
+        theta[i] = st->cfg.lo[i] + st->gp->x[st->i_best][i]*st->range[i];
+    }
+    // end function normally
+    return 0;
+}
+
+// Delay calibration: coarse scan, then golden-section search
+//
+// Holds k_p, k_d and measures the energy on n_coarse evenly spaced
+// delays in [lo, hi], then narrows the bracket around the best of them
+// with golden-section steps on integer delays until it is tol wide.
+// Measurements are never repeated at the same delay. Driven ask/tell
+// style like the other tuners.
+//
+int caldelay_init(struct caldelay_state *st, struct caldelay_config *cfg, double theta[N_PARAMS]){
+    st->cfg = *cfg;
+    st->k_p = theta[P_KP];
+    st->k_d = theta[P_KD];
+    st->n_pt = 0;
+    st->phase = 0;
+    st->step = (cfg->n_coarse > 1) ? (cfg->hi - cfg->lo)/(cfg->n_coarse - 1) : cfg->hi - cfg->lo;
+    st->dwell_total = 0;
+    st->log = NULL;
+    // end function normally
+    return 0;
+}
+
+// Index of the measurement at delay d, -1 if not measured
+//
+int caldelay_find(struct caldelay_state *st, double d){
+    for(int i = 0; i < st->n_pt; i++){
+        if(st->pt[i].delay == d){
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Index of the lowest-energy measurement
+//
+int caldelay_best(struct caldelay_state *st){
+    int best = 0;
+    for(int i = 1; i < st->n_pt; i++){
+        if(st->pt[i].mean < st->pt[best].mean){
+            best = i;
+        }
+    }
+    return best;
+}
+
+// Next point to measure; returns 1 when the calibration is finished
+//
+int caldelay_ask(struct caldelay_state *st, double param[N_PARAMS]){
+    double d, x1, x2;
+    int i1, i2, best;
+    
+    param[P_KP] = st->k_p;
+    param[P_KD] = st->k_d;
+    if(st->n_pt >= CAL_MAX_POINTS){
+        st->phase = 2;
+    }
+    
+    // coarse scan
+    if(st->phase == 0){
+        for(int i = 0; i < st->cfg.n_coarse; i++){
+            d = round(st->cfg.lo + i*st->step);
+            if(caldelay_find(st, d) < 0){
+                param[P_DELAY] = d;
+                return 0;
+            }
+        }
+        // bracket around the best coarse point
+        best = caldelay_best(st);
+        st->a = fmax(st->cfg.lo, st->pt[best].delay - st->step);
+        st->b = fmin(st->cfg.hi, st->pt[best].delay + st->step);
+        st->phase = 1;
+    }
+    
+    // golden section on integer delays
+    while(st->phase == 1){
+        if(st->b - st->a <= fmax(st->cfg.tol, 2)){
+            st->phase = 2;
+            break;
+        }
+        x1 = round(st->b - CAL_GOLDEN*(st->b - st->a));
+        x2 = round(st->a + CAL_GOLDEN*(st->b - st->a));
+        if(x2 <= x1){
+            x2 = x1 + 1;
+        }
+        i1 = caldelay_find(st, x1);
+        i2 = caldelay_find(st, x2);
+        if(i1 < 0 || i2 < 0){
+            param[P_DELAY] = (i1 < 0) ? x1 : x2;
+            return 0;
+        }
+        if(st->pt[i1].mean < st->pt[i2].mean){
+            st->b = x2;
+        } else {
+            st->a = x1;
+        }
+    }
+    return 1;
+}
+
+// Energy measured at the last point asked
+//
+int caldelay_tell(struct caldelay_state *st, double param[N_PARAMS], struct dwell_result *res){
+    struct caldelay_point *pt = &st->pt[st->n_pt];
+    
+    if(st->n_pt >= CAL_MAX_POINTS){
+        return 1; // return error: no room
+    }
+    pt->delay = param[P_DELAY];
+    pt->mean = res->mean;
+    pt->var = res->var;
+    pt->n = res->n;
+    st->n_pt++;
+    st->dwell_total += res->dwell_s;
+    msg_printf(st->log, "Delay %3.0f: E = %.1f +- %.1f (%ld samples)%s\n", pt->delay, pt->mean,
+           (pt->n > 0) ? sqrt(pt->var/pt->n) : 0, pt->n, (st->phase == 0) ? "" : " [golden]");
+    // end function normally
+    return 0;
+}
+
+// Optimum delay and its confidence interval
+//
+// Fits E = c0 + c1 x + c2 x^2 (x = delay - best, in coarse steps) by
+// weighted least squares to the measurements within one coarse step of
+// the best one, with weights n/var, scaled up by the reduced chi-square
+// when the scatter exceeds the measurement errors. The optimum is the
+// vertex of the parabola and its standard error follows from the fit
+// covariance (delta method). Without positive curvature the best
+// measured delay is returned with the final bracket as interval.
+//
+int caldelay_result(struct caldelay_state *st, struct caldelay_result *res){
+    double A[3][3] = {{0}}, Ainv[3][3], v[3] = {0}, c[3] = {0}, g[3];
+    double x, w, chi2 = 0, e, var_x = 0, d_best;
+    int best, n = 0;
+    
+    if(st->n_pt == 0){
+        return 1; // return error: no measurements
+    }
+    best = caldelay_best(st);
+    d_best = st->pt[best].delay;
+    
+    // normal equations
+    for(int i = 0; i < st->n_pt; i++){
+        x = (st->pt[i].delay - d_best)/st->step;
+        if(fabs(x) > 1 + 1e-9 || st->pt[i].n < 2){
+            continue;
+        }
+        w = (st->pt[i].var > 0) ? st->pt[i].n/st->pt[i].var : 1;
+        double f[3] = {1, x, x*x};
+        for(int j = 0; j < 3; j++){
+            for(int k = 0; k < 3; k++){
+                A[j][k] += w*f[j]*f[k];
+            }
+            v[j] += w*f[j]*st->pt[i].mean;
+        }
+        n++;
+    }
+    res->fitted = 0;
+    if(n >= 3 && matrix_inverse3(A, Ainv) == 0){
+        for(int j = 0; j < 3; j++){
+            c[j] = Ainv[j][0]*v[0] + Ainv[j][1]*v[1] + Ainv[j][2]*v[2];
+        }
+        if(c[2] > 0){
+            // reduced chi-square
+            for(int i = 0; i < st->n_pt; i++){
+                x = (st->pt[i].delay - d_best)/st->step;
+                if(fabs(x) > 1 + 1e-9 || st->pt[i].n < 2){
+                    continue;
+                }
+                w = (st->pt[i].var > 0) ? st->pt[i].n/st->pt[i].var : 1;
+                e = st->pt[i].mean - (c[0] + c[1]*x + c[2]*x*x);
+                chi2 += w*e*e;
+            }
+            chi2 = (n > 3) ? fmax(1, chi2/(n - 3)) : 1;
+            
+            // vertex and its variance
+            x = -c[1]/(2*c[2]);
+            g[0] = 0;
+            g[1] = -1/(2*c[2]);
+            g[2] = c[1]/(2*c[2]*c[2]);
+            for(int j = 0; j < 3; j++){
+                for(int k = 0; k < 3; k++){
+                    var_x += g[j]*Ainv[j][k]*g[k]*chi2;
+                }
+            }
+            // trust the vertex only inside the fitted range
+            if(fabs(x) <= 1){
+                res->delay = d_best + x*st->step;
+                res->ci_lo = res->delay - CAL_Z*sqrt(var_x)*st->step;
+                res->ci_hi = res->delay + CAL_Z*sqrt(var_x)*st->step;
+                res->energy = c[0] + c[1]*x + c[2]*x*x;
+                res->fitted = 1;
+            }
+        }
+    }
+    if(!res->fitted){
+        res->delay = d_best;
+        res->ci_lo = st->a;
+        res->ci_hi = st->b;
+        res->energy = st->pt[best].mean;
+    }
+    res->ci_lo = fmax(res->ci_lo, st->cfg.lo);
+    res->ci_hi = fmin(res->ci_hi, st->cfg.hi);
+    sat_delay(lround(res->delay), &res->delay_reg);
+    // end function normally
+    return 0;
+}
+
+// Energy-landscape sweep over (k_p, k_d)
+//
+// Measures the energy on a coarse grid of the region, then refines the
+// quadtree cells where it changes most: a cell is split in four when
+// the log-energy range of its corners, or its twist
+// |l00 - l10 - l01 + l11| (the curvature a bilinear cell cannot
+// follow), exceeds tol. Points live on the lattice of the finest cells,
+// so shared corners are measured once. Every batch (the grid, then each
+// refinement level) is visited in nearest-neighbour order improved by
+// 2-opt, starting where the previous batch ended, so the gains move
+// little between points and settling stays short. Delay slices repeat
+// the sweep at each delay. Driven ask/tell style like the other tuners.
+//
+int sweep_check(struct sweep_config *cfg){
+    int n_slices = (cfg->n_delay > 0) ? cfg->n_delay : 1;
+    
+    if(cfg->lo[0] >= cfg->hi[0] || cfg->lo[1] >= cfg->hi[1] || cfg->n_grid < 2 || cfg->depth < 0 ||
+       cfg->depth > SWEEP_MAX_DEPTH || cfg->tol <= 0 || cfg->max_points > SWEEP_MAX_POINTS ||
+       cfg->n_delay < 0 || cfg->n_delay > SWEEP_MAX_DELAYS || cfg->n_grid*cfg->n_grid*n_slices > cfg->max_points){
+        return 1; // return error: invalid settings
+    }
+    for(int k = 0; k < cfg->n_delay; k++){
+        if(cfg->delay[k] < 0 || cfg->delay[k] > 500){
+            return 1; // return error: invalid delay
+        }
+    }
+    // end function normally
+    return 0;
+}
+
+// Distance between two points of the sweep (-1: current position), in
+// region widths
+//
+double sweep_dist(struct sweep_state *st, int a, int b){
+    double xa = (a < 0) ? st->pos[0] : st->pt[a].k_p, ya = (a < 0) ? st->pos[1] : st->pt[a].k_d;
+    double xb = (b < 0) ? st->pos[0] : st->pt[b].k_p, yb = (b < 0) ? st->pos[1] : st->pt[b].k_d;
+    
+    return hypot((xa - xb)/(st->cfg.hi[0] - st->cfg.lo[0]), (ya - yb)/(st->cfg.hi[1] - st->cfg.lo[1]));
+}
+
+// Index of the point at lattice (i, j) of the current slice, -1 if none
+//
+int sweep_find(struct sweep_state *st, int i, int j){
+    for(int k = st->n_pt - 1; k >= 0 && st->pt[k].slice == st->slice; k--){
+        if(st->pt[k].i == i && st->pt[k].j == j){
+            return k;
+        }
+    }
+    return -1;
+}
+
+// Add lattice point (i, j) to the current batch, unless it is known
+//
+// Returns its index, -1 when the budget is spent (split evenly between
+// the delay slices)
+//
+int sweep_add(struct sweep_state *st, int i, int j){
+    struct sweep_point *pt;
+    int k = sweep_find(st, i, j);
+    int n_slices = (st->cfg.n_delay > 0) ? st->cfg.n_delay : 1;
+    
+    if(k >= 0){
+        return k;
+    }
+    if(st->n_pt >= (st->slice + 1)*st->cfg.max_points/n_slices){
+        return -1; // return error: budget spent
+    }
+    pt = &st->pt[st->n_pt];
+    pt->i = i;
+    pt->j = j;
+    pt->slice = st->slice;
+    pt->level = st->level;
+    sat_gain(lround(st->cfg.lo[0] + i*(st->cfg.hi[0] - st->cfg.lo[0])/(st->n_axis - 1)), &pt->k_p);
+    sat_gain(lround(st->cfg.lo[1] + j*(st->cfg.hi[1] - st->cfg.lo[1])/(st->n_axis - 1)), &pt->k_d);
+    sat_delay(lround((st->cfg.n_delay > 0) ? st->cfg.delay[st->slice] : st->delay0), &pt->delay);
+    pt->n = 0;
+    st->pending[st->n_pending++] = st->n_pt;
+    return st->n_pt++;
+}
+
+// Order the current batch to keep the gain changes short
+//
+// Nearest neighbour from the current position, then 2-opt: reversing
+// pending[a..b] replaces edges (a-1, a) and (b, b+1) by (a-1, b) and
+// (a, b+1); the start is fixed and the end free.
+//
+int sweep_order(struct sweep_state *st){
+    int *p = st->pending, n = st->n_pending, best, tmp, prev, improved;
+    double d, d_best, delta;
+    
+    prev = -1;
+    for(int k = 0; k < n; k++){
+        best = k;
+        d_best = INFINITY;
+        for(int m = k; m < n; m++){
+            d = sweep_dist(st, prev, p[m]);
+            if(d < d_best){
+                best = m;
+                d_best = d;
+            }
+        }
+        tmp = p[k];
+        p[k] = p[best];
+        p[best] = tmp;
+        prev = p[k];
+    }
+    for(int pass = 0; pass < SWEEP_2OPT_PASSES; pass++){
+        improved = 0;
+        for(int a = 0; a < n - 1; a++){
+            prev = (a > 0) ? p[a - 1] : -1;
+            for(int b = a + 1; b < n; b++){
+                delta = sweep_dist(st, prev, p[b]) - sweep_dist(st, prev, p[a]);
+                if(b + 1 < n){
+                    delta += sweep_dist(st, p[a], p[b + 1]) - sweep_dist(st, p[b], p[b + 1]);
+                }
+                if(delta < -1e-9){
+                    for(int x = a, y = b; x < y; x++, y--){
+                        tmp = p[x];
+                        p[x] = p[y];
+                        p[y] = tmp;
+                    }
+                    improved = 1;
+                }
+            }
+        }
+        if(!improved){
+            break;
+        }
+    }
+    // end function normally
+    return 0;
+}
+
+// Start a delay slice with the coarse grid
+//
+int sweep_grid(struct sweep_state *st){
+    int step = 1 << st->cfg.depth;
+    
+    st->level = 0;
+    st->n_cell = 0;
+    for(int a = 0; a < st->cfg.n_grid; a++){
+        for(int b = 0; b < st->cfg.n_grid; b++){
+            sweep_add(st, a*step, b*step);
+            if(a + 1 < st->cfg.n_grid && b + 1 < st->cfg.n_grid){
+                st->cell[st->n_cell++] = (struct sweep_cell) {a*step, b*step, step};
+            }
+        }
+    }
+    return sweep_order(st);
+}
+
+// Split the cells whose energy changes by more than tol
+//
+// Returns the number of new points to measure
+//
+int sweep_refine(struct sweep_state *st){
+    struct sweep_cell child[SWEEP_MAX_POINTS];
+    int n_child = 0, c[4], h;
+    double l[4], l_min, l_max;
+    
+    st->level++;
+    for(int k = 0; k < st->n_cell; k++){
+        struct sweep_cell *cl = &st->cell[k];
+        if(cl->size < 2){
+            continue;
+        }
+        c[0] = sweep_find(st, cl->i, cl->j);
+        c[1] = sweep_find(st, cl->i + cl->size, cl->j);
+        c[2] = sweep_find(st, cl->i, cl->j + cl->size);
+        c[3] = sweep_find(st, cl->i + cl->size, cl->j + cl->size);
+        if(c[0] < 0 || c[1] < 0 || c[2] < 0 || c[3] < 0 ||
+           st->pt[c[0]].n == 0 || st->pt[c[1]].n == 0 || st->pt[c[2]].n == 0 || st->pt[c[3]].n == 0){
+            continue;
+        }
+        l_min = INFINITY;
+        l_max = -INFINITY;
+        for(int m = 0; m < 4; m++){
+            l[m] = log(fmax(st->pt[c[m]].mean, 1));
+            l_min = fmin(l_min, l[m]);
+            l_max = fmax(l_max, l[m]);
+        }
+        if(l_max - l_min <= st->cfg.tol && fabs(l[0] - l[1] - l[2] + l[3]) <= st->cfg.tol){
+            continue;
+        }
+        // four children and their five new corners
+        h = cl->size/2;
+        for(int m = 0; m < 4 && n_child < SWEEP_MAX_POINTS; m++){
+            child[n_child++] = (struct sweep_cell) {cl->i + (m & 1)*h, cl->j + (m >> 1)*h, h};
+        }
+        sweep_add(st, cl->i + h, cl->j);
+        sweep_add(st, cl->i, cl->j + h);
+        sweep_add(st, cl->i + h, cl->j + h);
+        sweep_add(st, cl->i + 2*h, cl->j + h);
+        sweep_add(st, cl->i + h, cl->j + 2*h);
+    }
+    memcpy(st->cell, child, n_child*sizeof(struct sweep_cell));
+    st->n_cell = n_child;
+    sweep_order(st);
+    return st->n_pending;
+}
+
+// Start a sweep from theta (its delay is used without delay slices)
+//
+// Writes the CSV header when an output file is set; st->log (set by
+// the caller) gets the messages
+//
+int sweep_init(struct sweep_state *st, struct sweep_config *cfg, double theta[N_PARAMS]){
+    FILE *f;
+    
+    if(sweep_check(cfg) != 0){
+        return 1; // return error: invalid settings
+    }
+    st->cfg = *cfg;
+    st->n_axis = (cfg->n_grid - 1)*(1 << cfg->depth) + 1;
+    st->n_pt = 0;
+    st->n_pending = 0;
+    st->next = 0;
+    st->n_done = 0;
+    st->slice = 0;
+    st->delay0 = theta[P_DELAY];
+    st->pos[0] = theta[P_KP];
+    st->pos[1] = theta[P_KD];
+    st->travel = 0;
+    st->dwell_total = 0;
+    if(cfg->path[0] != '\0'){
+        f = fopen(cfg->path, "w");
+        if(f == NULL){
+            msg_printf(st->log, "Could not open %s: %s\n", cfg->path, strerror(errno));
+            return 1; // return error in opening
+        }
+        fprintf(f, "k_p,k_d,delay,energy,stderr,samples,level\n");
+        fclose(f);
+    }
+    return sweep_grid(st);
+}
+
+// Next point to measure; returns 1 when the sweep is finished
+//
+int sweep_ask(struct sweep_state *st, double param[N_PARAMS]){
+    struct sweep_point *pt;
+    
+    while(st->next >= st->n_pending){
+        // batch done: next refinement level, else next delay slice
+        st->n_pending = 0;
+        st->next = 0;
+        if(st->level < st->cfg.depth && sweep_refine(st) > 0){
+            continue;
+        }
+        st->slice++;
+        if(st->slice >= st->cfg.n_delay || sweep_grid(st) != 0 || st->n_pending == 0){
+            return 1;
+        }
+    }
+    pt = &st->pt[st->pending[st->next]];
+    param[P_KP] = pt->k_p;
+    param[P_KD] = pt->k_d;
+    param[P_DELAY] = pt->delay;
+    return 0;
+}
+
+// Energy measured at the last point asked
+//
+// Also appended to the CSV file, so an interrupted sweep keeps its points
+//
+int sweep_tell(struct sweep_state *st, struct dwell_result *res){
+    int k = st->pending[st->next];
+    struct sweep_point *pt = &st->pt[k];
+    FILE *f;
+    
+    pt->mean = res->mean;
+    pt->var = res->var;
+    pt->n = res->n;
+    st->travel += sweep_dist(st, -1, k);
+    st->pos[0] = pt->k_p;
+    st->pos[1] = pt->k_d;
+    st->dwell_total += res->dwell_s;
+    st->next++;
+    st->n_done++;
+    msg_printf(st->log, "Sweep %3d: k_p = %d, k_d = %d, delay = %d -> E = %.1f (%ld samples, level %d)\n", st->n_done,
+           pt->k_p, pt->k_d, pt->delay, pt->mean, pt->n, pt->level);
+    if(st->cfg.path[0] != '\0' && (f = fopen(st->cfg.path, "a")) != NULL){
+        fprintf(f, "%d,%d,%d,%.3f,%.3f,%ld,%d\n", pt->k_p, pt->k_d, pt->delay, pt->mean,
+                (pt->n > 0) ? sqrt(pt->var/pt->n) : 0, pt->n, pt->level);
+        fclose(f);
+    }
+    // end function normally
+    return 0;
+}
+
+// Lowest-energy point of the sweep into theta, and a summary
+//
+int sweep_result(struct sweep_state *st, double theta[N_PARAMS]){
+    int best = -1;
+    int n_slices = (st->cfg.n_delay > 0) ? st->cfg.n_delay : 1;
+    
+    for(int k = 0; k < st->n_pt; k++){
+        if(st->pt[k].n > 0 && (best < 0 || st->pt[k].mean < st->pt[best].mean)){
+            best = k;
+        }
+    }
+    if(best < 0){
+        return 1; // return error: no measurements
+    }
+    theta[P_KP] = st->pt[best].k_p;
+    theta[P_KD] = st->pt[best].k_d;
+    theta[P_DELAY] = st->pt[best].delay;
+    msg_printf(st->log, "------------------------\n");
+    msg_printf(st->log, "Sweep: %d points in %d slice%s (uniform grid at the finest cells: %d), travel %.1f region widths, total dwell %.1f s\n",
+           st->n_done, n_slices, (n_slices > 1) ? "s" : "", st->n_axis*st->n_axis*n_slices, st->travel, st->dwell_total);
+    msg_printf(st->log, "Lowest energy %.1f at k_p = %d, k_d = %d, delay = %d\n", st->pt[best].mean,
+           st->pt[best].k_p, st->pt[best].k_d, st->pt[best].delay);
+    if(st->cfg.path[0] != '\0'){
+        msg_printf(st->log, "Surface written to %s\n", st->cfg.path);
+    }
+    msg_printf(st->log, "------------------------\n");
+    // end function normally
+    return 0;
+}
+
+// FNV-1a hash of a buffer (profile file checksum)
+//
+uint32_t fnv1a(const void *buf, size_t size){
+    const unsigned char *b = buf;
+    uint32_t h = 2166136261u;
+    
+    for(size_t i = 0; i < size; i++){
+        h = (h ^ b[i])*16777619u;
+    }
+    return h;
+}
+
+// Load the profile store from its file
+//
+// A missing file is an empty store. A damaged file is reported to log
+// (NULL: quiet) and the store starts empty (returns 1); it is replaced
+// at the next save.
+//
+int profile_load(struct profile_store *ps, const char *path, FILE *log){
+    struct profile_header hdr;
+    FILE *f;
+    int err = 0;
+    
+    ps->path = path;
+    ps->log = log;
+    ps->n = 0;
+    f = fopen(path, "rb");
+    if(f == NULL){
+        return (errno == ENOENT) ? 0 : 1;
+    }
+    if(fread(&hdr, sizeof(hdr), 1, f) != 1 || memcmp(hdr.magic, PROFILE_MAGIC, sizeof(hdr.magic)) != 0 ||
+       hdr.version != PROFILE_VERSION || hdr.record_size != sizeof(struct profile) || hdr.n > PROFILE_MAX ||
+       fread(ps->p, sizeof(struct profile), hdr.n, f) != hdr.n || fnv1a(ps->p, hdr.n*sizeof(struct profile)) != hdr.checksum){
+        msg_printf(log, "%s is damaged or has another version, starting with no profiles\n", path);
+        err = 1;
+    } else {
+        ps->n = (int) hdr.n;
+    }
+    fclose(f);
+    return err;
+}
+
+// Write the profile store to its file
+//
+// The store goes to path.tmp, is synced and renamed over the file, so a
+// crash leaves either the old or the new store, never a partial one.
+// Problems are reported to the store's log.
+//
+int profile_write(struct profile_store *ps){
+    struct profile_header hdr;
+    char tmp[PATH_MAX], *slash;
+    int fd, err;
+    
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, PROFILE_MAGIC, sizeof(hdr.magic));
+    hdr.version = PROFILE_VERSION;
+    hdr.record_size = sizeof(struct profile);
+    hdr.n = (uint32_t) ps->n;
+    hdr.checksum = fnv1a(ps->p, ps->n*sizeof(struct profile));
+    if(snprintf(tmp, sizeof(tmp), "%s.tmp", ps->path) >= (int) sizeof(tmp)){
+        return 1; // return error in path
+    }
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if(fd < 0){
+        msg_printf(ps->log, "Could not open %s: %s\n", tmp, strerror(errno));
+        return 1; // return error in opening
+    }
+    err = write(fd, &hdr, sizeof(hdr)) != (ssize_t) sizeof(hdr) ||
+          write(fd, ps->p, ps->n*sizeof(struct profile)) != (ssize_t) (ps->n*sizeof(struct profile)) ||
+          fsync(fd) != 0;
+    close(fd);
+    if(err || rename(tmp, ps->path) != 0){
+        msg_printf(ps->log, "Could not write %s: %s\n", ps->path, strerror(errno));
+        unlink(tmp);
+        return 1; // return error in writing
+    }
+    // sync the directory, so the rename itself survives a power loss
+    strcpy(tmp, ps->path);
+    slash = strrchr(tmp, '/');
+    if(slash == NULL){
+        strcpy(tmp, ".");
+    } else {
+        slash[(slash == tmp) ? 1 : 0] = '\0';
+    }
+    fd = open(tmp, O_RDONLY | O_DIRECTORY);
+    if(fd < 0 || fsync(fd) != 0){
+        msg_printf(ps->log, "Could not sync the directory of %s: %s\n", ps->path, strerror(errno));
+        err = 1;
+    }
+    if(fd >= 0){
+        close(fd);
+    }
+    // return 1 if the rename may not be on disk
+    return err;
+}
+
+// Distance between the current trap conditions and a profile's
+//
+// Sum of squared log-ratios, each in units of PROFILE_SCALES. Unknown
+// current conditions are ignored; known ones the profile lacks add
+// PROFILE_MISSING.
+//
+double profile_distance(const double query[PROFILE_CONDITIONS], const double cond[PROFILE_CONDITIONS]){
+    double scale[PROFILE_CONDITIONS] = PROFILE_SCALES;
+    double d2 = 0, r;
+    
+    for(int k = 0; k < PROFILE_CONDITIONS; k++){
+        if(query[k] <= 0){
+            continue;
+        }
+        if(cond[k] <= 0){
+            d2 += PROFILE_MISSING*PROFILE_MISSING;
+        } else {
+            r = log(query[k]/cond[k])/scale[k];
+            d2 += r*r;
+        }
+    }
+    return sqrt(d2);
+}
+
+// Profile of a channel nearest to the current trap conditions
+//
+// Returns its index (-1: the channel has none); ties go to the most
+// recent profile, so without known conditions this is the last saved.
+//
+int profile_nearest(struct profile_store *ps, const char *channel, double *dist){
+    int best = -1;
+    double d;
+    
+    for(int i = 0; i < ps->n; i++){
+        if(0 != strcmp(ps->p[i].channel, channel)){
+            continue;
+        }
+        d = profile_distance(ps->cond, ps->p[i].cond);
+        if(best < 0 || d < *dist || (d == *dist && ps->p[i].t_saved >= ps->p[best].t_saved)){
+            best = i;
+            *dist = d;
+        }
+    }
+    return best;
+}
+
+// Save the current settings of a channel at the current trap conditions
+//
+// Replaces the channel's profile at the same conditions, or the oldest
+// profile when the store is full, and rewrites the file. energy is the
+// mean energy measured at these settings (after they were applied).
+// saved (may be NULL) gets a copy. Returns 1 without a store.
+//
+int profile_save(struct profile_store *ps, struct rp_regs *regs, double energy, struct profile *saved){
+    struct profile *p = NULL;
+    short int k_p, k_d, delay;
+    
+    if(ps == NULL || ps->path == NULL){
+        return 1; // return error: no store
+    }
+    for(int i = 0; i < ps->n && p == NULL; i++){
+        if(0 == strcmp(ps->p[i].channel, regs->ch.name) && 0 == memcmp(ps->p[i].cond, ps->cond, sizeof(ps->cond))){
+            p = &ps->p[i];
+        }
+    }
+    if(p == NULL && ps->n < PROFILE_MAX){
+        p = &ps->p[ps->n++];
+    }
+    for(int i = 0; i < ps->n && p == NULL; i++){
+        if(i == 0 || ps->p[i].t_saved < p->t_saved){
+            p = &ps->p[i];
+        }
+    }
+    memset(p, 0, sizeof(*p));
+    strcpy(p->channel, regs->ch.name);
+    memcpy(p->cond, ps->cond, sizeof(ps->cond));
+    regs_get(regs, &k_p, &k_d, &delay);
+    p->k_p = k_p;
+    p->k_d = k_d;
+    p->delay = delay;
+    p->energy = energy;
+    p->t_saved = (int64_t) time(NULL);
+    if(saved != NULL){
+        *saved = *p;
+    }
+    return profile_write(ps);
+}
+
+// Save the current settings with the mean energy of the last PROFILE_ENERGY_MS
+//
+// For settings that have been held for a while (saved by hand)
+//
+int profile_save_recent(struct profile_store *ps, struct rp_regs *regs, struct energy_sampler *sampler, struct profile *saved){
+    long int n_samples;
+    double energy, energy_var;
+    
+    if(ps == NULL || ps->path == NULL){
+        return 1; // return error: no store
+    }
+    if(energy_ring_stats(&sampler->ring, monotonic_ns() - (uint64_t) PROFILE_ENERGY_MS*1000000, &n_samples, &energy, &energy_var) != 0){
+        return 1; // return error: no energy samples
+    }
+    return profile_save(ps, regs, energy, saved);
+}
+
+// Clamp k_d of the ML routines (ml_clamp_kd), counting the clamps
+//
+int ml_clamp_count(float *k1){
+    float k = *k1;
+    
+    ml_clamp_kd(k1);
+    if(*k1 != k){
+        metrics_count(MC_KD_CLAMPS, 1);
+    }
+    // end function normally
+    return 0;
+}
+
+// First two k_d of the ML routines
+//
+// ML_K0, ML_K1 from scratch, or the same step from the k_d of a profile
+// (seed NULL: none), so that a retune starts near the last optimum
+//
+int ml_start(const struct profile *seed, float *k0, float *k1){
+    float k_start = (seed != NULL) ? seed->k_d : ML_K0;
+    
+    ml_start_kd(k_start, k0, k1);
+    if(*k0 != k_start){
+        metrics_count(MC_KD_CLAMPS, 1);
+    }
+    // end function normally
+    return 0;
+}
+
+// 'mlauto' routine as an ask/tell tuner
+//
+// Same secant iteration on k_d as the 'mlauto' command, with k_p and
+// delay kept, for use by the daemon event loop. seed (may be NULL) is
+// the profile to start from.
+//
+int mlauto_init(struct mlauto_state *st, double theta[N_PARAMS], const struct profile *seed){
+    ml_start(seed, &st->k0, &st->k1);
+    st->k_p = theta[P_KP];
+    st->delay = theta[P_DELAY];
+    st->phase = 0;
+    st->iter = 0;
+    st->done = 0;
+    st->log = NULL;
+    // end function normally
+    return 0;
+}
+
+// Next point to measure; returns 1 when the routine has converged
+//
+int mlauto_ask(struct mlauto_state *st, double param[N_PARAMS]){
+    if(st->done){
+        return 1;
+    }
+    param[P_KP] = st->k_p;
+    param[P_KD] = (st->phase == 0) ? (int) st->k0 : (int) st->k1;
+    param[P_DELAY] = st->delay;
+    return 0;
+}
+
+// Energy measured at the last point asked
+//
+int mlauto_tell(struct mlauto_state *st, struct dwell_result *res){
+    if(st->phase == 0){
+        st->energy0 = (float) res->mean;
+        st->energy1 = st->energy0 + 2;
+        st->phase = 1;
+        return 0;
+    }
+    st->energy0 = st->energy1;
+    st->energy1 = (float) res->mean;
+    st->iter++;
+    msg_printf(st->log, "mlauto %3d: k_d = %d -> E = %.1f (%ld samples)\n", st->iter, (int) st->k1, st->energy1, res->n);
+    if(ml_converged(st->energy0, st->energy1)){
+        // keep the last k_d measured
+        st->done = 1;
+        return 0;
+    }
+    // gradient descent, just in case k1 is too large clamp it
+    ml_secant_step(&st->k0, &st->k1, st->energy0, st->energy1);
+    ml_clamp_count(&st->k1);
+    // end function normally
+    return 0;
+}
+
+// Next point of the running tuner; returns 1 when it is finished
+//
+int tuner_ask(struct tuner *t, double param[N_PARAMS]){
+    switch(t->kind){
+        case TUNER_MLAUTO: return mlauto_ask(&t->ml, param);
+        case TUNER_SPSA:   return spsa_ask(&t->spsa, param);
+        case TUNER_BO:     return bo_ask(&t->bo, param);
+        case TUNER_DELAY:  return caldelay_ask(&t->cal, param);
+        case TUNER_SWEEP:  return sweep_ask(&t->sweep, param);
+        default:           return 1;
+    }
+}
+
+// Hand a measurement to the running tuner
+//
+int tuner_tell(struct tuner *t, struct dwell_result *res){
+    switch(t->kind){
+        case TUNER_MLAUTO: return mlauto_tell(&t->ml, res);
+        case TUNER_SPSA:   return spsa_tell(&t->spsa, res);
+        case TUNER_BO:     return bo_tell(&t->bo, res);
+        case TUNER_DELAY:  return caldelay_tell(&t->cal, t->param, res);
+        case TUNER_SWEEP:  return sweep_tell(&t->sweep, res);
+        default:           return 1;
+    }
+}
+
+// Write t->param to the registers and start measuring it
+//
+int tuner_apply(struct tuner *t){
+    short int reg[N_PARAMS];
+    double lo[N_PARAMS] = {-8191, -8191, 0};
+    double hi[N_PARAMS] = {8191, 8191, 500};
+    
+    int err;
+    
+    clamp_params(t->param, lo, hi, reg);
+    telemetry_tuner(t->regs->tel, t->kind, t->n_eval++, 1);
+    err = regs_set_all(t->regs, reg[P_KP], reg[P_KD], reg[P_DELAY]);
+    dwell_start(&t->dwell, t->sampler, t->dwell_cfg, t->have_last ? &t->last : NULL);
+    // return 1 if the registers could not be written
+    return err;
+}
+
+// Set up a tuner from theta, without touching the registers
+//
+int tuner_init(struct tuner *t, enum tuner_kind kind, double theta[N_PARAMS]){
+    t->kind = kind;
+    t->have_last = 0;
+    t->n_eval = 0;
+    t->dwell_total = 0;
+    t->saving = 0;
+    switch(kind){
+        case TUNER_MLAUTO: mlauto_init(&t->ml, theta, t->seeded ? &t->seed : NULL); break;
+        case TUNER_SPSA:   spsa_init(&t->spsa, t->spsa_cfg, theta); break;
+        case TUNER_BO:     bo_init(&t->bo, t->bo_cfg, t->gp, theta); break;
+        case TUNER_DELAY:  caldelay_init(&t->cal, t->cal_cfg, theta); break;
+        case TUNER_SWEEP:
+            t->sweep.log = t->log;
+            if(sweep_init(&t->sweep, t->sweep_cfg, theta) != 0){
+                return 1; // return error: invalid settings
+            }
+            break;
+        default:           return 1; // return error: unknown tuner
+    }
+    t->ml.log = t->log;
+    t->spsa.log = t->log;
+    t->bo.log = t->log;
+    t->cal.log = t->log;
+    t->sweep.log = t->log;
+    // end function normally
+    return 0;
+}
+
+// Final parameters of a finished tuner
+//
+int tuner_result(struct tuner *t, double theta[N_PARAMS]){
+    struct caldelay_result cal_res;
+    
+    switch(t->kind){
+        case TUNER_MLAUTO:
+            theta[P_KP] = t->ml.k_p;
+            theta[P_KD] = (int) t->ml.k1;
+            theta[P_DELAY] = t->ml.delay;
+            break;
+        case TUNER_SPSA:
+            for(int i = 0; i < N_PARAMS; i++){
+                theta[i] = t->spsa.theta[i];
+            }
+            break;
+        case TUNER_BO:
+            if(t->gp->n == 0){
+                return 1;
+            }
+            bo_best(&t->bo, theta);
+            break;
+        case TUNER_DELAY:
+            if(caldelay_result(&t->cal, &cal_res) != 0){
+                return 1;
+            }
+            theta[P_KP] = t->cal.k_p;
+            theta[P_KD] = t->cal.k_d;
+            theta[P_DELAY] = cal_res.delay_reg;
+            msg_printf(t->log, "Optimum delay: %.1f (95%% interval %.1f - %.1f)\n", cal_res.delay, cal_res.ci_lo, cal_res.ci_hi);
+            break;
+        case TUNER_SWEEP:
+            return sweep_result(&t->sweep, theta);
+        default:
+            return 1;
+    }
+    // end function normally
+    return 0;
+}
+
+// Start a tuner from theta without blocking
+//
+int tuner_start(struct tuner *t, enum tuner_kind kind, double theta[N_PARAMS]){
+    uint64_t t_step = monotonic_ns();
+    int done;
+    
+    if(tuner_init(t, kind, theta) != 0){
+        return 1; // return error: unknown tuner or invalid settings
+    }
+    done = tuner_ask(t, t->param);
+    metrics_time(MH_TUNER_STEP, monotonic_ns() - t_step);
+    if(done){
+        t->active = 0;
+        // error exit
+        return 1;
+    }
+    t->active = 1;
+    if(tuner_apply(t) != 0){
+        t->active = 0;
+        telemetry_tuner(t->regs->tel, t->kind, t->n_eval, 0);
+        // error exit: first point not written
+        return 1;
+    }
+    // end function normally
+    return 0;
+}
+
+// Advance the running tuner without blocking
+//
+// Returns 1 when the tuner has just finished (the final parameters are
+// then applied and, with a profile store, measured and saved), 0
+// otherwise, -1 if it stopped without a result (watchdog trip, no
+// energy samples) and -2 if a point or the result could not be written
+// (read-back mismatch). The next call is due at t->dwell.deadline.
+//
+int tuner_poll(struct tuner *t){
+    struct dwell_result res;
+    double theta[N_PARAMS];
+    short int reg[N_PARAMS];
+    double lo[N_PARAMS] = {-8191, -8191, 0};
+    double hi[N_PARAMS] = {8191, 8191, 500};
+    uint64_t t_step;
+    int done;
+    
+    if(t->active && watchdog_tripped(t->regs->wd)){
+        msg_printf(t->log, "Watchdog tripped, stopping tuner\n");
+        t->active = 0;
+        t->saving = 0;
+        telemetry_tuner(t->regs->tel, t->kind, t->n_eval, 0);
+        return -1;
+    }
+    if(!t->active || !dwell_poll(&t->dwell, &res)){
+        return 0;
+    }
+    t->dwell_total += res.dwell_s;
+    if(res.n == 0){
+        msg_printf(t->log, "No energy samples received, stopping tuner\n");
+        t->active = 0;
+        telemetry_tuner(t->regs->tel, t->kind, t->n_eval, 0);
+        // the result is written already when measuring it for the store
+        done = t->saving ? 1 : -1;
+        t->saving = 0;
+        return done;
+    }
+    if(t->saving){
+        // result measured: remember it for the next session
+        t->active = 0;
+        t->saving = 0;
+        telemetry_tuner(t->regs->tel, t->kind, t->n_eval, 0);
+        t->last = res;
+        t->have_last = 1;
+        if(profile_save(t->profiles, t->regs, res.mean, &t->seed) == 0){
+            t->seeded = 1;
+            msg_printf(t->log, "Saved to the profile store\n");
+        }
+        return 1;
+    }
+    t_step = monotonic_ns();
+    tuner_tell(t, &res);
+    t->last = res;
+    t->have_last = 1;
+    done = tuner_ask(t, t->param);
+    metrics_time(MH_TUNER_STEP, monotonic_ns() - t_step);
+    if(!done){
+        if(tuner_apply(t) != 0){
+            // the point was not written: its energy must not be told
+            msg_printf(t->log, "Register write failed, stopping tuner\n");
+            t->active = 0;
+            telemetry_tuner(t->regs->tel, t->kind, t->n_eval, 0);
+            return watchdog_tripped(t->regs->wd) ? -1 : -2;
+        }
+        return 0;
+    }
+    
+    // finished: apply final parameters
+    t->active = 0;
+    telemetry_tuner(t->regs->tel, t->kind, t->n_eval, 0);
+    if(tuner_result(t, theta) != 0){
+        msg_printf(t->log, "Tuner stopped without a result\n");
+        return -1;
+    }
+    clamp_params(theta, lo, hi, reg);
+    if(regs_set_all(t->regs, reg[P_KP], reg[P_KD], reg[P_DELAY]) != 0){
+        return watchdog_tripped(t->regs->wd) ? -1 : -2;
+    }
+    msg_printf(t->log, "Tuner finished%s%s: k_p = %d, k_d = %d, delay = %d\n", t->regs->ch.name[0] ? " on " : "", t->regs->ch.name,
+           reg[P_KP], reg[P_KD], reg[P_DELAY]);
+    // remember the result for the next session (a sweep only maps the
+    // region): 'mlauto' ends on the k_d it measured last, the others are
+    // measured once more at their result, still owning the registers
+    if(t->kind == TUNER_MLAUTO){
+        if(profile_save(t->profiles, t->regs, res.mean, &t->seed) == 0){
+            t->seeded = 1;
+            msg_printf(t->log, "Saved to the profile store\n");
+        }
+    } else if(t->kind != TUNER_SWEEP && t->profiles != NULL && t->profiles->path != NULL){
+        t->active = 1;
+        t->saving = 1;
+        dwell_start(&t->dwell, t->sampler, t->dwell_cfg, NULL);
+        return 0;
+    }
+    return 1;
+}
+
+// Offline replay of recorded traces
+//
+// A telemetry file recorded while tuning (--record) holds every energy
+// sample with the k_p/k_d and delay words in use. Samples taken at
+// least settle_s after a setting was written are pooled per setting
+// into mean, variance and lag-1 correlation; settings with fewer than
+// REPLAY_MIN_SAMPLES are dropped. The first setting kept is the start
+// point of the replayed tuners. Problems are reported to log (NULL:
+// quiet).
+//
+int replay_load(struct replay_model *model, const char *path, int channel, struct dwell_config *dwell, FILE *log){
+    int fd;
+    struct stat st;
+    void *map;
+    struct rp_tel_header *hdr;
+    struct rp_tel_record *ring, rec;
+    struct replay_point *pt = NULL;
+    uint64_t head, first, t_run = 0, t_first = 0, t_last = 0, settle_ns;
+    uint32_t pid = 0, delay = 0;
+    double e_prev = 0, x[N_PARAMS];
+    long int n_rec = 0;
+    int have_prev = 0, k, n;
+    
+    fd = open(path, O_RDONLY);
+    if(fd < 0 || fstat(fd, &st) != 0){
+        msg_printf(log, "Could not open %s: %s\n", path, strerror(errno));
+        return 1; // return error in opening
+    }
+    if((size_t) st.st_size < RP_TEL_HEADER_SIZE){
+        msg_printf(log, "%s is not a telemetry file\n", path);
+        close(fd);
+        return 1;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED){
+        msg_printf(log, "Could not map %s: %s\n", path, strerror(errno));
+        return 1; // return error in mapping
+    }
+    hdr = (struct rp_tel_header *) map;
+    if(memcmp(hdr->magic, RP_TEL_MAGIC, sizeof(hdr->magic)) != 0 || hdr->version != RP_TEL_VERSION ||
+       hdr->record_size != sizeof(struct rp_tel_record) || hdr->capacity == 0 ||
+       RP_TEL_HEADER_SIZE + hdr->capacity*sizeof(struct rp_tel_record) > (uint64_t) st.st_size){
+        msg_printf(log, "%s is not a telemetry file (or has another version)\n", path);
+        munmap(map, st.st_size);
+        return 1;
+    }
+    ring = (struct rp_tel_record *) ((char *) map + RP_TEL_HEADER_SIZE);
+    head = atomic_load_explicit(&hdr->head, memory_order_acquire);
+    first = (head > hdr->capacity) ? head - hdr->capacity : 0;
+    settle_ns = (uint64_t) (dwell->settle_s*NSEC_PER_SEC);
+    
+    memset(model, 0, sizeof(*model));
+    model->dwell = dwell;
+    for(uint64_t i = first; i < head; i++){
+        rec = ring[i % hdr->capacity];
+        if(rec.seq != (uint32_t) (i + 1) || rec.channel != channel){
+            continue;
+        }
+        if(n_rec++ == 0){
+            t_first = rec.t_ns;
+        }
+        t_last = rec.t_ns;
+        if(n_rec == 1 || rec.pid != pid || rec.delay != delay){
+            // new setting: find or add its point
+            pid = rec.pid;
+            delay = rec.delay;
+            t_run = rec.t_ns;
+            have_prev = 0;
+            x[P_KP] = rp_pid_kp(pid);
+            x[P_KD] = rp_pid_kd(pid);
+            x[P_DELAY] = delay & 0x0000FFFF;
+            for(k = 0; k < model->n_pt; k++){
+                if(memcmp(model->pt[k].x, x, sizeof(x)) == 0){
+                    break;
+                }
+            }
+            if(k == model->n_pt && k < REPLAY_MAX_POINTS){
+                memcpy(model->pt[k].x, x, sizeof(x));
+                model->n_pt++;
+            }
+            pt = (k < REPLAY_MAX_POINTS) ? &model->pt[k] : NULL;
+        }
+        if(pt == NULL || rec.t_ns < t_run + settle_ns){
+            continue;
+        }
+        pt->n++;
+        pt->s += rec.energy;
+        pt->s2 += (double) rec.energy*rec.energy;
+        if(have_prev){
+            pt->n_lag++;
+            pt->s_a += e_prev;
+            pt->s_b += rec.energy;
+            pt->s_ab += e_prev*rec.energy;
+        }
+        e_prev = rec.energy;
+        have_prev = 1;
+    }
+    munmap(map, st.st_size);
+    
+    // statistics, keeping the settings held long enough
+    n = 0;
+    for(k = 0; k < model->n_pt; k++){
+        pt = &model->pt[k];
+        if(pt->n < REPLAY_MIN_SAMPLES){
+            continue;
+        }
+        pt->mean = pt->s/pt->n;
+        pt->var = fmax((pt->s2 - pt->s*pt->s/pt->n)/(pt->n - 1), 0);
+        pt->rho = 0;
+        if(pt->var > 0 && pt->n_lag > 1){
+            pt->rho = (pt->s_ab/pt->n_lag - (pt->s_a/pt->n_lag)*(pt->s_b/pt->n_lag))/pt->var;
+            pt->rho = fmin(fmax(pt->rho, 0), 0.999);
+        }
+        model->pt[n++] = *pt;
+    }
+    model->n_pt = n;
+    if(n == 0 || n_rec < 2){
+        msg_printf(log, "No settings of channel %d held for %.1f s in %s\n", channel, dwell->settle_s, path);
+        return 1;
+    }
+    model->rate_hz = (n_rec - 1)/((double) (t_last - t_first)/NSEC_PER_SEC);
+    // end function normally
+    return 0;
+}
+
+// Standard normal deviate (xorshift64* and Box-Muller)
+//
+double replay_gauss(struct replay_model *model){
+    double u[2];
+    
+    for(int i = 0; i < 2; i++){
+        model->rng ^= model->rng >> 12;
+        model->rng ^= model->rng << 25;
+        model->rng ^= model->rng >> 27;
+        u[i] = ((model->rng*2685821657736338717ULL >> 11) + 0.5)/9007199254740992.0;
+    }
+    return sqrt(-2*log(u[0]))*cos(2*M_PI*u[1]);
+}
+
+// Energy statistics at x, interpolated from the recorded settings
+//
+// Inverse-distance weighting (power 2) of the REPLAY_NEIGHBOURS nearest
+// settings, in units of 100 counts for k_p/k_d and 50 cycles for the
+// delay; log mean and log variance are interpolated, so energies that
+// span decades stay positive. Outside the recorded settings the
+// response is flat.
+//
+int replay_interp(struct replay_model *model, double x[N_PARAMS], double *mean, double *var, double *rho){
+    const double scale[N_PARAMS] = {100, 100, 50};
+    int near[REPLAY_NEIGHBOURS], n_near = 0, m;
+    double d2[REPLAY_NEIGHBOURS] = {0}, d, w, w_sum = 0, l_mean = 0, l_var = 0, r = 0;
+    
+    for(int k = 0; k < model->n_pt; k++){
+        d = 0;
+        for(int i = 0; i < N_PARAMS; i++){
+            d += pow((x[i] - model->pt[k].x[i])/scale[i], 2);
+        }
+        // insertion into the sorted neighbour list
+        if(n_near < REPLAY_NEIGHBOURS){
+            n_near++;
+        } else if(d >= d2[n_near - 1]){
+            continue;
+        }
+        for(m = n_near - 1; m > 0 && d2[m - 1] > d; m--){
+            d2[m] = d2[m - 1];
+            near[m] = near[m - 1];
+        }
+        d2[m] = d;
+        near[m] = k;
+    }
+    if(d2[0] < 1e-12){
+        *mean = model->pt[near[0]].mean;
+        *var = model->pt[near[0]].var;
+        *rho = model->pt[near[0]].rho;
+        return 0;
+    }
+    for(m = 0; m < n_near; m++){
+        w = 1/d2[m];
+        w_sum += w;
+        l_mean += w*log(fmax(model->pt[near[m]].mean, 1e-3));
+        l_var += w*log(fmax(model->pt[near[m]].var, 1e-6));
+        r += w*model->pt[near[m]].rho;
+    }
+    *mean = exp(l_mean/w_sum);
+    *var = exp(l_var/w_sum);
+    *rho = r/w_sum;
+    // end function normally
+    return 0;
+}
+
+// Replayed energy evaluation (struct energy_eval backend)
+//
+// Rounds the parameters to register values like tuner_apply, then runs
+// the sequential test of the dwell engine on samples drawn at the trace
+// rate, in virtual time: settle_s, then DWELL_POLL_US of samples per
+// test until it resolves or max_dwell_s. The transient prediction is
+// not emulated (the replayed response settles at once).
+//
+int replay_eval(void *ctx, double param[N_PARAMS], struct dwell_result *prev, struct dwell_result *res){
+    struct replay_model *model = (struct replay_model *) ctx;
+    struct dwell_config *cfg = model->dwell;
+    struct welford w = {0, 0, 0};
+    short int reg[N_PARAMS];
+    double lo[N_PARAMS] = {-8191, -8191, 0};
+    double hi[N_PARAMS] = {8191, 8191, 500};
+    double x[N_PARAMS], mean, var, rho, sd, a, e, e_prev = 0, sdd = 0, w_var = 0, elapsed_s = 0;
+    long int n_poll = lround(fmax(1, model->rate_hz*DWELL_POLL_US*1e-6));
+    
+    clamp_params(param, lo, hi, reg);
+    for(int i = 0; i < N_PARAMS; i++){
+        x[i] = reg[i];
+    }
+    replay_interp(model, x, &mean, &var, &rho);
+    sd = sqrt(var);
+    a = sqrt(1 - rho*rho);
+    res->resolved = 0;
+    res->predicted = 0;
+    res->tau = 0;
+    for(;;){
+        for(long int k = 0; k < n_poll; k++){
+            model->z = rho*model->z + a*replay_gauss(model);
+            e = fmax(mean + sd*model->z, 0);
+            if(w.n > 0){
+                sdd += (e - e_prev)*(e - e_prev);
+            }
+            e_prev = e;
+            welford_update(&w, e);
+        }
+        elapsed_s += n_poll/model->rate_hz;
+        w_var = welford_var(&w)*lag1_inflation(welford_var(&w), sdd, w.n);
+        if(elapsed_s >= cfg->min_dwell_s && w.n >= 2 && dwell_resolved(cfg, w.mean, w_var/w.n, prev)){
+            res->resolved = 1;
+            break;
+        }
+        if(elapsed_s >= cfg->max_dwell_s){
+            break;
+        }
+    }
+    res->mean = w.mean;
+    res->var = w_var;
+    res->n = w.n;
+    res->dwell_s = cfg->settle_s + elapsed_s;
+    model->n_eval++;
+    model->dwell_total += res->dwell_s;
+    // end function normally
+    return 0;
+}
+
+// Compare tuners on a replayed trace
+//
+// Runs every tuner in the comma-separated list runs times from the
+// first recorded setting, run r with noise and tuner random numbers
+// seeded from seed + r, so the results are the same on every machine
+// (for a given build). Reports evaluations to converge, the
+// noise-free energy of the final parameters and the virtual dwell time.
+// The table goes to log; with one run, so does the tuners' progress.
+//
+int replay_compare(struct replay_model *model, struct tuner *t, char *tuners, int runs, unsigned int seed, FILE *log){
+    const char *names[] = {"none", "mlauto", "spsa", "bo", "delay", "es", "schedule", "sweep"};
+    struct energy_eval ev = {replay_eval, model};
+    struct dwell_result res;
+    double theta0[N_PARAMS], theta[N_PARAMS], x[N_PARAMS], energy, var, rho, best = INFINITY;
+    double eval_sum, eval_min, eval_max, e_sum, e_min, e_max, dwell_sum;
+    long int n_total = 0;
+    int kind, i_best = 0;
+    uint64_t t_start = monotonic_ns();
+    short int reg[N_PARAMS];
+    double lo[N_PARAMS] = {-8191, -8191, 0};
+    double hi[N_PARAMS] = {8191, 8191, 500};
+    
+    for(int k = 0; k < model->n_pt; k++){
+        if(model->pt[k].mean < best){
+            best = model->pt[k].mean;
+            i_best = k;
+        }
+    }
+    memcpy(theta0, model->pt[0].x, sizeof(theta0));
+    msg_printf(log, "------------------------\n");
+    msg_printf(log, "Replay: %d settings at %.0f Hz, starting from k_p = %.0f, k_d = %.0f, delay = %.0f\n",
+           model->n_pt, model->rate_hz, theta0[P_KP], theta0[P_KD], theta0[P_DELAY]);
+    msg_printf(log, "Lowest recorded energy: %.1f at k_p = %.0f, k_d = %.0f, delay = %.0f\n", best,
+           model->pt[i_best].x[P_KP], model->pt[i_best].x[P_KD], model->pt[i_best].x[P_DELAY]);
+    msg_printf(log, "Dwell: settle %.2f s, min %.2f s, max %.2f s, z %.2f, resolution %.1f; %d runs, seed %u\n",
+           model->dwell->settle_s, model->dwell->min_dwell_s, model->dwell->max_dwell_s, model->dwell->z,
+           model->dwell->resolution, runs, seed);
+    msg_printf(log, "------------------------\n");
+    t->log = (runs > 1) ? NULL : log;
+    msg_printf(log, "tuner       evaluations (mean min max)    final energy (mean min max)      dwell (s, mean)\n");
+    
+    for(char *name = strtok(tuners, ","); name != NULL; name = strtok(NULL, ",")){
+        for(kind = TUNER_MLAUTO; kind <= TUNER_SWEEP; kind++){
+            if(0 == strcmp(name, names[kind]) && kind != TUNER_ES && kind != TUNER_SCHED){
+                break;
+            }
+        }
+        if(kind > TUNER_SWEEP){
+            msg_printf(log, "%-10s  unknown tuner (mlauto, spsa, bo, delay or sweep)\n", name);
+            continue;
+        }
+        eval_sum = 0;
+        eval_min = INFINITY;
+        eval_max = 0;
+        e_sum = 0;
+        e_min = INFINITY;
+        e_max = 0;
+        dwell_sum = 0;
+        for(int r = 0; r < runs; r++){
+            srand(seed + r);
+            model->rng = 0x9E3779B97F4A7C15ULL*(seed + r + 1);
+            model->z = 0;
+            model->n_eval = 0;
+            model->dwell_total = 0;
+            memcpy(theta, theta0, sizeof(theta));
+            if(tuner_init(t, kind, theta) == 0){
+                while(!tuner_ask(t, t->param)){
+                    ev.eval(ev.ctx, t->param, t->have_last ? &t->last : NULL, &res);
+                    tuner_tell(t, &res);
+                    t->last = res;
+                    t->have_last = 1;
+                }
+                tuner_result(t, theta);
+            }
+            // noise-free energy at the final register values
+            clamp_params(theta, lo, hi, reg);
+            for(int i = 0; i < N_PARAMS; i++){
+                x[i] = reg[i];
+            }
+            replay_interp(model, x, &energy, &var, &rho);
+            eval_sum += model->n_eval;
+            eval_min = fmin(eval_min, model->n_eval);
+            eval_max = fmax(eval_max, model->n_eval);
+            e_sum += energy;
+            e_min = fmin(e_min, energy);
+            e_max = fmax(e_max, energy);
+            dwell_sum += model->dwell_total;
+            n_total += model->n_eval;
+        }
+        msg_printf(log, "%-10s  %8.1f %6.0f %6.0f          %9.1f %9.1f %9.1f      %8.1f\n", name, eval_sum/runs, eval_min, eval_max,
+               e_sum/runs, e_min, e_max, dwell_sum/runs);
+    }
+    msg_printf(log, "------------------------\n");
+    msg_printf(log, "%ld evaluations in %.2f s\n", n_total, (double) (monotonic_ns() - t_start)/NSEC_PER_SEC);
+    // end function normally
+    return 0;
+}
+
+// Extremum-seeking controller
+//
+// Superimposes sinusoidal dithers on the parameters with nonzero
+// amplitude, each at its own frequency, high-passes the energy stream
+// and demodulates it against every dither. For a slow dither the
+// demodulated signal is amp/2 times the energy gradient, so
+// 2 demod/E is the relative energy change per dither amplitude; the
+// dither center moves against it at gain amplitudes per second,
+// limited to max_rate amplitudes per second and to the bounds.
+//
+int es_init(struct es_state *es, struct rp_regs *regs, struct energy_sampler *sampler, struct es_config *cfg, double theta[N_PARAMS]){
+    double ratio[N_PARAMS] = ES_FREQ_RATIO;
+    
+    es->cfg = *cfg;
+    es->regs = regs;
+    es->sampler = sampler;
+    for(int i = 0; i < N_PARAMS; i++){
+        es->theta[i] = theta[i];
+        es->demod[i] = 0;
+        es->w[i] = 2*M_PI*cfg->freq_hz*ratio[i];
+    }
+    es->e_mean = -1;
+    es->t0 = monotonic_ns();
+    es->t_last = es->t0;
+    es->cursor = atomic_load_explicit(&sampler->ring.head, memory_order_acquire);
+    es->deadline = es->t0;
+    es->n_samples = 0;
+    es->threaded = 0;
+    atomic_store(&es->running, 1);
+    // end function normally
+    return 0;
+}
+
+// One extremum-seeking update (non-blocking)
+//
+// Consumes the new sampler readings, moves the dither center and writes
+// the dithered parameters. The next update is due at es->deadline.
+// Returns 1 if the controller had to stop (watchdog trip).
+//
+int es_step(struct es_state *es){
+    struct es_config *cfg = &es->cfg;
+    struct energy_ring *ring = &es->sampler->ring;
+    struct energy_sample sample;
+    uint64_t t_now = monotonic_ns(), head;
+    double t, dt, a_hp, a_lp, hp, phase = cfg->phase_deg*M_PI/180, rate, lo, hi;
+    double param[N_PARAMS];
+    short int reg[N_PARAMS];
+    double reg_lo[N_PARAMS] = {-8191, -8191, 0};
+    double reg_hi[N_PARAMS] = {8191, 8191, 500};
+    
+    // demodulate new samples
+    head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if(head - es->cursor > ENERGY_RING_SIZE){
+        es->cursor = head - ENERGY_RING_SIZE;
+    }
+    for(; es->cursor < head; es->cursor++){
+        if(energy_ring_read(ring, es->cursor, &sample) != 0 || sample.t_ns <= es->t_last){
+            continue;
+        }
+        dt = (double) (sample.t_ns - es->t_last)/NSEC_PER_SEC;
+        t = (double) (sample.t_ns - es->t0)/NSEC_PER_SEC;
+        es->t_last = sample.t_ns;
+        if(es->e_mean < 0){
+            es->e_mean = sample.energy;
+        }
+        // high-pass over one dither period, demodulation low-pass over two
+        a_hp = fmin(1, dt*cfg->freq_hz);
+        a_lp = fmin(1, 0.5*dt*cfg->freq_hz);
+        es->e_mean += a_hp*(sample.energy - es->e_mean);
+        hp = sample.energy - es->e_mean;
+        for(int i = 0; i < N_PARAMS; i++){
+            if(cfg->amp[i] > 0){
+                es->demod[i] += a_lp*(hp*sin(es->w[i]*t - phase) - es->demod[i]);
+            }
+        }
+        es->n_samples++;
+    }
+    
+    // move the dither center (after the filters have settled)
+    dt = cfg->period_s;
+    t = (double) (t_now - es->t0)/NSEC_PER_SEC;
+    if(t*cfg->freq_hz > ES_WARMUP_PERIODS && es->e_mean > 0){
+        for(int i = 0; i < N_PARAMS; i++){
+            if(cfg->amp[i] <= 0){
+                continue;
+            }
+            rate = -cfg->gain*cfg->amp[i]*2*es->demod[i]/fmax(es->e_mean, 1);
+            rate = fmax(fmin(rate, cfg->max_rate*cfg->amp[i]), -cfg->max_rate*cfg->amp[i]);
+            es->theta[i] += rate*dt;
+            lo = cfg->lo[i] + cfg->amp[i];
+            hi = cfg->hi[i] - cfg->amp[i];
+            es->theta[i] = (lo > hi) ? 0.5*(lo + hi) : fmax(fmin(es->theta[i], hi), lo);
+        }
+    }
+    
+    // dithered parameters
+    for(int i = 0; i < N_PARAMS; i++){
+        param[i] = es->theta[i] + cfg->amp[i]*sin(es->w[i]*t);
+    }
+    clamp_params(param, reg_lo, reg_hi, reg);
+    regs_set_all(es->regs, reg[P_KP], reg[P_KD], reg[P_DELAY]);
+    telemetry_tuner(es->regs->tel, TUNER_ES, (uint32_t) (t*cfg->freq_hz), 1);
+    if(watchdog_tripped(es->regs->wd)){
+        atomic_store(&es->running, 0);
+        telemetry_tuner(es->regs->tel, TUNER_ES, (uint32_t) (t*cfg->freq_hz), 0);
+        return 1;
+    }
+    
+    // next update
+    es->deadline += (uint64_t) (cfg->period_s*NSEC_PER_SEC);
+    if(es->deadline < t_now){
+        es->deadline = t_now;
+    }
+    return 0;
+}
+
+// Extremum-seeking thread (rpf_es_start)
+//
+void *es_thread(void *arg){
+    struct es_state *es = (struct es_state *) arg;
+    
+    metrics_thread("es", es->regs->index);
+    while(atomic_load_explicit(&es->running, memory_order_relaxed)){
+        if(es_step(es) != 0){
+            break;
+        }
+        sleep_until_ns(es->deadline);
+    }
+    return NULL;
+}
+
+// Start extremum seeking on its own thread
+//
+int es_start(struct es_state *es, struct rp_regs *regs, struct energy_sampler *sampler, struct es_config *cfg, double theta[N_PARAMS]){
+    es_init(es, regs, sampler, cfg, theta);
+    es->threaded = 1;
+    if(pthread_create(&es->thread, NULL, es_thread, es) != 0){
+        atomic_store(&es->running, 0);
+        es->threaded = 0;
+        msg_printf(regs->log, "Could not start extremum seeking\n");
+        // error exit
+        return 1;
+    }
+    // end function normally
+    return 0;
+}
+
+// Stop extremum seeking and leave the parameters at the dither center
+//
+int es_stop(struct es_state *es){
+    double reg_lo[N_PARAMS] = {-8191, -8191, 0};
+    double reg_hi[N_PARAMS] = {8191, 8191, 500};
+    short int reg[N_PARAMS];
+    int was_running = atomic_exchange(&es->running, 0);
+    
+    if(es->threaded){
+        pthread_join(es->thread, NULL);
+        es->threaded = 0;
+    }
+    if(was_running && !watchdog_tripped(es->regs->wd)){
+        clamp_params(es->theta, reg_lo, reg_hi, reg);
+        regs_set_all(es->regs, reg[P_KP], reg[P_KD], reg[P_DELAY]);
+    }
+    if(was_running){
+        telemetry_tuner(es->regs->tel, TUNER_ES, 0, 0);
+    }
+    // end function normally
+    return 0;
+}
+
+// Load a gain-schedule table
+//
+// One regime per line: energy threshold, k_p, k_d and delay, with
+// thresholds strictly increasing; '#' starts a comment. The first
+// regime also applies below its threshold. Gains and delays are
+// saturated here, once, and packed for the channel of regs, so the
+// scheduler writes prepacked words. Problems go to the channel's log.
+//
+int sched_load(struct schedule *sched, struct rp_regs *regs, const char *path){
+    FILE *f = fopen(path, "r");
+    char line[256], *comment;
+    long int threshold, k_p, k_d, delay;
+    struct sched_entry *e;
+    int n = 0, n_line = 0, n_fields;
+    
+    if(f == NULL){
+        msg_printf(regs->log, "Could not open %s: %s\n", path, strerror(errno));
+        // error exit
+        return 1;
+    }
+    while(fgets(line, sizeof(line), f) != NULL){
+        n_line++;
+        if((comment = strchr(line, '#')) != NULL){
+            *comment = '\0';
+        }
+        n_fields = sscanf(line, "%ld %ld %ld %ld", &threshold, &k_p, &k_d, &delay);
+        if(n_fields <= 0){
+            continue;
+        }
+        if(n_fields != 4 || threshold < 0 || threshold > ENERGY_RAIL){
+            msg_printf(regs->log, "%s:%d: expected energy threshold (0-%d), k_p, k_d and delay\n", path, n_line, ENERGY_RAIL);
+            fclose(f);
+            return 1;
+        }
+        if(n == SCHED_MAX_ENTRIES){
+            msg_printf(regs->log, "%s:%d: more than %d regimes\n", path, n_line, SCHED_MAX_ENTRIES);
+            fclose(f);
+            return 1;
+        }
+        if(n > 0 && threshold <= sched->entry[n - 1].threshold){
+            msg_printf(regs->log, "%s:%d: thresholds must increase\n", path, n_line);
+            fclose(f);
+            return 1;
+        }
+        e = &sched->entry[n];
+        e->threshold = (uint32_t) threshold;
+        sat_gain(k_p, &e->k_p);
+        sat_gain(k_d, &e->k_d);
+        sat_delay(delay, &e->delay);
+        if(e->k_p != k_p || e->k_d != k_d || e->delay != delay){
+            msg_printf(regs->log, "%s:%d: saturated to k_p = %d, k_d = %d, delay = %d\n", path, n_line, e->k_p, e->k_d, e->delay);
+        }
+        e->pid = rp_channel_pack(&regs->ch, e->k_p, e->k_d);
+        n++;
+    }
+    fclose(f);
+    if(n == 0){
+        msg_printf(regs->log, "%s: no regimes\n", path);
+        // error exit
+        return 1;
+    }
+    sched->n = n;
+    // end function normally
+    return 0;
+}
+
+// Regime for an energy reading, with hysteresis
+//
+// Moves up as soon as the energy reaches a higher threshold, and down
+// only once it is below the current threshold by the hysteresis
+//
+int sched_regime(struct schedule *sched, uint32_t energy, int current){
+    int j = 0;
+    
+    while(j + 1 < sched->n && energy >= sched->entry[j + 1].threshold){
+        j++;
+    }
+    if(current < 0 || j > current){
+        return j;
+    }
+    if(j < current && energy < sched->entry[current].threshold*(1 - sched->cfg.hysteresis)){
+        return j;
+    }
+    return current;
+}
+
+// Gain-scheduler thread
+//
+// Polls the energy register at rate_hz; a regime change that persists
+// for debounce polls is written within the same poll, under the
+// register lock (the control thread reads the shadows meanwhile). Stops
+// on the first poll after a watchdog trip, in any regime.
+//
+void *sched_thread(void *arg){
+    struct schedule *sched = (struct schedule *) arg;
+    struct rp_regs *regs = sched->regs;
+    struct sched_transition *tr;
+    uint64_t t_ns, deadline, period, n_log;
+    uint32_t energy;
+    int regime = -1, target, candidate = -1, n_same = 0, err;
+    
+    period = NSEC_PER_SEC/sched->cfg.rate_hz;
+    metrics_thread("schedule", regs->index);
+    deadline = monotonic_ns();
+    while(atomic_load_explicit(&sched->running, memory_order_relaxed)){
+        // a trip ends the schedule, whatever the regime
+        if(watchdog_tripped(regs->wd)){
+            break;
+        }
+        t_ns = monotonic_ns();
+        energy = regs_energy(regs);
+        target = sched_regime(sched, energy, regime);
+        n_same = (target == candidate) ? n_same + 1 : 1;
+        candidate = target;
+        
+        if(target != regime && (regime < 0 || n_same >= sched->cfg.debounce)){
+            // words were validated at load: stage them as they are
+            pthread_mutex_lock(&regs->lock);
+            regs->next_delay = (uint32_t) sched->entry[target].delay;
+            regs->next_pid = sched->entry[target].pid;
+            regs->staged_delay = regs->staged_pid = 1;
+            err = regs_commit(regs);
+            pthread_mutex_unlock(&regs->lock);
+            if(err != 0 && watchdog_tripped(regs->wd)){
+                break;
+            }
+            n_log = atomic_load_explicit(&sched->n_log, memory_order_relaxed);
+            tr = &sched->log[n_log % SCHED_LOG];
+            tr->t_ns = t_ns;
+            tr->energy = energy;
+            tr->from = regime;
+            tr->to = target;
+            atomic_store_explicit(&sched->n_log, n_log + 1, memory_order_release);
+            atomic_store_explicit(&sched->regime, target, memory_order_relaxed);
+            telemetry_tuner(regs->tel, TUNER_SCHED, (uint32_t) target, 1);
+            regime = target;
+        }
+        
+        // next deadline, skipping missed ones
+        deadline += period;
+        t_ns = monotonic_ns();
+        if(deadline < t_ns){
+            deadline = t_ns;
+            continue;
+        }
+        sleep_until_ns(deadline);
+    }
+    atomic_store(&sched->running, 0);
+    telemetry_tuner(regs->tel, TUNER_SCHED, (uint32_t) (regime > 0 ? regime : 0), 0);
+    return NULL;
+}
+
+// Start gain scheduling with the loaded table
+//
+int sched_start(struct schedule *sched, struct rp_regs *regs, struct sched_config *cfg){
+    sched->regs = regs;
+    sched->cfg = *cfg;
+    sched->reported = 0;
+    atomic_store(&sched->n_log, 0);
+    atomic_store(&sched->regime, -1);
+    atomic_store(&sched->running, 1);
+    if(pthread_create(&sched->thread, NULL, sched_thread, sched) != 0){
+        atomic_store(&sched->running, 0);
+        sched->regs = NULL;
+        msg_printf(regs->log, "Could not start gain scheduling\n");
+        // error exit
+        return 1;
+    }
+    // end function normally
+    return 0;
+}
+
+// Stop gain scheduling, leaving the registers of the last regime
+//
+int sched_stop(struct schedule *sched){
+    if(sched->regs != NULL){
+        atomic_store(&sched->running, 0);
+        pthread_join(sched->thread, NULL);
+        sched->regs = NULL;
+    }
+    // end function normally
+    return 0;
+}
+
+// Report the transitions logged since the last one to log
+//
+// Called from the control thread. Returns the number reported.
+//
+int sched_report(struct schedule *sched, FILE *log){
+    uint64_t n_log = atomic_load_explicit(&sched->n_log, memory_order_acquire);
+    struct sched_transition *tr;
+    struct sched_entry *e;
+    const char *name = (sched->regs != NULL) ? sched->regs->ch.name : ""; // (registers released once stopped)
+    int n = 0;
+    
+    if(n_log - sched->reported > SCHED_LOG){
+        msg_printf(log, "(%llu transitions not shown)\n", (unsigned long long) (n_log - sched->reported - SCHED_LOG));
+        sched->reported = n_log - SCHED_LOG;
+    }
+    for(; sched->reported < n_log; sched->reported++, n++){
+        tr = &sched->log[sched->reported % SCHED_LOG];
+        e = &sched->entry[tr->to];
+        msg_printf(log, "Gain schedule%s%s: energy %u, regime %d -> %d (k_p = %d, k_d = %d, delay = %d)\n",
+               name[0] ? " on " : "", name, tr->energy, tr->from, tr->to, e->k_p, e->k_d, e->delay);
+    }
+    return n;
+}
+
+// Open channel c of the map and start its sampler (and watchdog)
+//
+// On failure, whatever was started is stopped and closed again.
+//
+// tel_file (may be NULL) is the shared recorder, filter_s[] the filter
+// output periods, wd_cfg (NULL: off) the watchdog limits and log the
+// stream for the channel's messages (NULL: quiet)
+//
+int channel_start(struct channel *ch, struct rp_map *map, int c, const char *sim_file, int verify,
+                  struct telemetry_file *tel_file, int n_filter, double filter_s[], struct watchdog_config *wd_cfg, FILE *log){
+    struct rp_regs *regs = &ch->regs;
+    
+    regs->log = log;
+    if(regs_open(regs, sim_file, map, c) != 0){
+        return 1; // return error in opening
+    }
+    regs->verify = verify;
+    regs->writes = regs->coalesced = regs->mismatches = 0;
+    regs->tel = NULL;
+    regs->wd = &ch->wd;
+    
+    // record every energy sample with the settings it was taken at
+    ch->sampler.tel = NULL;
+    if(tel_file != NULL){
+        telemetry_attach(&ch->tel, tel_file, c);
+        regs->tel = &ch->tel;
+        ch->sampler.tel = &ch->tel;
+    }
+    
+    // filtered energy at several time constants, fed by the sampler
+    pthread_mutex_init(&ch->fb.lock, NULL);
+    filterbank_config(&ch->fb, SAMPLER_DEFAULT_RATE, n_filter, filter_s, log);
+    ch->sampler.fb = &ch->fb;
+    
+    // poll the energy register in the background
+    if(energy_sampler_start(&ch->sampler, regs, SAMPLER_DEFAULT_RATE) != 0){
+        filterbank_config(&ch->fb, SAMPLER_DEFAULT_RATE, 0, NULL, NULL);
+        pthread_mutex_destroy(&ch->fb.lock);
+        regs_close(regs);
+        return 1; // return error in starting
+    }
+    
+    // watch the energy for runaways, from the current register values
+    regs_sync(regs);
+    if(wd_cfg != NULL && watchdog_start(&ch->wd, regs, wd_cfg) != 0){
+        energy_sampler_stop(&ch->sampler);
+        filterbank_config(&ch->fb, SAMPLER_DEFAULT_RATE, 0, NULL, NULL);
+        pthread_mutex_destroy(&ch->fb.lock);
+        regs_close(regs);
+        return 1; // return error in starting
+    }
+    // end function normally
+    return 0;
+}
+
+// Stop all threads of a channel, free its filter bank and close its
+// registers
+//
+int channel_stop(struct channel *ch){
+    es_stop(&ch->es);
+    sched_stop(&ch->sched);
+    watchdog_stop(&ch->wd);
+    energy_sampler_stop(&ch->sampler);
+    filterbank_config(&ch->fb, SAMPLER_DEFAULT_RATE, 0, NULL, NULL);
+    pthread_mutex_destroy(&ch->fb.lock);
+    regs_close(&ch->regs);
+    // end function normally
+    return 0;
+}
+
+// Discretize the trap model with zero-order hold
+//
+// A = exp(Ac dt), B = int_0^dt exp(Ac t) dt Bc, by Taylor series on
+// dt/2^s followed by s squarings. Only the first column of B is used,
+// so that B and R fit the 2x2 kernels.
+//
+int lqr_discretize(struct lqr_model *m, double A[2][2], double B[2][2]){
+    double w0 = 2*M_PI*m->f0;
+    double Ac[2][2] = {{0, 1}, {-w0*w0, -m->gamma}};
+    double Bc[2][2] = {{0, 0}, {m->b, 0}};
+    double I[2][2] = {{1, 0}, {0, 1}};
+    double S[2][2], term[2][2], Ah[2][2], tmp[2][2];
+    double h = 1/m->fs, norm;
+    int squarings = 0;
+    
+    // scale step so that |Ac| h < 0.5
+    norm = fabs(Ac[1][0]) + fabs(Ac[1][1]) + 1;
+    while(norm*h > 0.5){
+        h /= 2;
+        squarings++;
+    }
+    
+    // S = sum_k Ac^k h^(k+1)/(k+1)!
+    term[0][0] = h; term[0][1] = 0;
+    term[1][0] = 0; term[1][1] = h;
+    S[0][0] = h; S[0][1] = 0;
+    S[1][0] = 0; S[1][1] = h;
+    for(int k = 2; k <= 12; k++){
+        matrix_product(term, Ac, term);
+        m_mult_scalar(term, h/k);
+        matrix_addition(S, term, S);
+    }
+    matrix_product(Ac, S, Ah);
+    matrix_addition(I, Ah, Ah);
+    matrix_product(S, Bc, B);
+    
+    // A(2h) = A(h)^2, B(2h) = (A(h) + I) B(h)
+    for(int k = 0; k < squarings; k++){
+        matrix_addition(Ah, I, tmp);
+        matrix_product(tmp, B, B);
+        matrix_product(Ah, Ah, Ah);
+    }
+    for(int i = 0; i < 2; i++){
+        for(int j = 0; j < 2; j++){
+            A[i][j] = Ah[i][j];
+        }
+    }
+    // end function normally
+    return 0;
+}
+
+// Solve the discrete algebraic Riccati equation
+//
+// P = A'PA - A'PB (R + B'PB)^-1 B'PA + Q, iterated with the doubling
+// algorithm: each iteration doubles the Riccati horizon, so convergence
+// takes tens of iterations even when the sample rate is far above the
+// trap frequency.
+//
+int lqr_dare(double A[2][2], double B[2][2], double Q[2][2], double R[2][2], double P[2][2], int *iterations){
+    double Ak[2][2], G[2][2], H[2][2], W[2][2], Winv[2][2], At[2][2], Bt[2][2], Rinv[2][2];
+    double T1[2][2], T2[2][2], Hn[2][2];
+    double I[2][2] = {{1, 0}, {0, 1}};
+    double diff, scale;
+    
+    // A0 = A, G0 = B R^-1 B', H0 = Q
+    matrix_transpose(B, Bt);
+    if(matrix_inverse(R, Rinv) != 0){
+        return 1;
+    }
+    matrix_product(B, Rinv, G);
+    matrix_product(G, Bt, G);
+    for(int i = 0; i < 2; i++){
+        for(int j = 0; j < 2; j++){
+            Ak[i][j] = A[i][j];
+            H[i][j] = Q[i][j];
+        }
+    }
+    
+    for(int k = 0; k < LQR_MAX_ITER; k++){
+        // W = (I + G H)^-1
+        matrix_product(G, H, W);
+        matrix_addition(I, W, W);
+        if(matrix_inverse(W, Winv) != 0){
+            return 1;
+        }
+        matrix_transpose(Ak, At);
+        
+        // H <- H + A' H W A
+        matrix_product(H, Winv, T1);
+        matrix_product(T1, Ak, T1);
+        matrix_product(At, T1, T1);
+        matrix_addition(H, T1, Hn);
+        // G <- G + A W G A'
+        matrix_product(Ak, Winv, T2);
+        matrix_product(T2, G, T1);
+        matrix_product(T1, At, T1);
+        matrix_addition(G, T1, G);
+        // A <- A W A
+        matrix_product(T2, Ak, Ak);
+        
+        diff = 0;
+        scale = 0;
+        for(int i = 0; i < 2; i++){
+            for(int j = 0; j < 2; j++){
+                diff = fmax(diff, fabs(Hn[i][j] - H[i][j]));
+                scale = fmax(scale, fabs(Hn[i][j]));
+                H[i][j] = Hn[i][j];
+            }
+        }
+        *iterations = k + 1;
+        if(diff <= LQR_TOL*scale){
+            for(int i = 0; i < 2; i++){
+                for(int j = 0; j < 2; j++){
+                    P[i][j] = H[i][j];
+                }
+            }
+            // end function normally
+            return 0;
+        }
+    }
+    // error exit: no convergence
+    return 1;
+}
+
+// Solve the LQR problem and map the gains to the FPGA registers
+//
+// The FPGA force is k_p x(t - t1) + k_d x(t - t2), with t1 the loop delay
+// and t2 = t1 + delay register. The delay register is set to a quarter
+// period minus the loop delay, and (k_p, k_d) are found so that, for
+// oscillation at f0, the force matches -K [x, v]:
+//   k_p cos(w t1) + k_d cos(w t2) = -K_x
+//   k_p sin(w t1) + k_d sin(w t2) = w K_v
+// A model without a solution is reported to log (NULL: quiet).
+//
+int lqr_solve(struct lqr_model *m, struct lqr_result *res, FILE *log){
+    double A[2][2], B[2][2], Bt[2][2], M[2][2], Minv[2][2], T[2][2], K2[2][2];
+    double Q[2][2] = {{m->q_x, 0}, {0, m->q_v}};
+    double R[2][2] = {{m->r, 0}, {0, 1}};
+    double w0 = 2*M_PI*m->f0, t1, t2, tr, det, disc;
+    long int delay_long;
+    
+    if(m->f0 <= 0 || m->fs <= 0 || m->r <= 0 || m->q_x < 0 || m->q_v < 0){
+        msg_printf(log, "Invalid model parameters\n");
+        // error exit
+        return 1;
+    }
+    lqr_discretize(m, A, B);
+    if(lqr_dare(A, B, Q, R, res->P, &res->iterations) != 0){
+        msg_printf(log, "Riccati iteration did not converge\n");
+        // error exit
+        return 1;
+    }
+    
+    // K = (R + B'PB)^-1 B'PA (first row)
+    matrix_transpose(B, Bt);
+    matrix_product(Bt, res->P, T);
+    matrix_product(T, B, M);
+    matrix_addition(M, R, M);
+    if(matrix_inverse(M, Minv) != 0){
+        msg_printf(log, "Singular input weight\n");
+        // error exit
+        return 1;
+    }
+    matrix_product(T, A, K2);
+    matrix_product(Minv, K2, K2);
+    res->K[0] = K2[0][0];
+    res->K[1] = K2[0][1];
+    
+    // closed-loop spectral radius of A - B K
+    T[0][0] = A[0][0] - B[0][0]*res->K[0];
+    T[0][1] = A[0][1] - B[0][0]*res->K[1];
+    T[1][0] = A[1][0] - B[1][0]*res->K[0];
+    T[1][1] = A[1][1] - B[1][0]*res->K[1];
+    tr = T[0][0] + T[1][1];
+    det = T[0][0]*T[1][1] - T[0][1]*T[1][0];
+    disc = tr*tr/4 - det;
+    res->rho = (disc < 0) ? sqrt(det) : fabs(tr/2) + sqrt(disc);
+    
+    // delay register: quarter period minus loop delay
+    delay_long = lround(FPGA_CLOCK_HZ/(4*m->f0) - m->loop_delay);
+    sat_delay(delay_long, &res->delay);
+    t1 = m->loop_delay/FPGA_CLOCK_HZ;
+    t2 = (m->loop_delay + res->delay)/FPGA_CLOCK_HZ;
+    
+    // register gains from the delayed taps
+    M[0][0] = cos(w0*t1); M[0][1] = cos(w0*t2);
+    M[1][0] = sin(w0*t1); M[1][1] = sin(w0*t2);
+    if(matrix_inverse(M, Minv) != 0){
+        msg_printf(log, "Delay taps cannot represent velocity feedback\n");
+        // error exit
+        return 1;
+    }
+    res->kp = -Minv[0][0]*res->K[0] + Minv[0][1]*w0*res->K[1];
+    res->kd = -Minv[1][0]*res->K[0] + Minv[1][1]*w0*res->K[1];
+    
+    // quantize: round to nearest count, saturate at +-8191
+    sat_gain(lround(fmax(fmin(res->kp, 1e9), -1e9)), &res->k_p);
+    sat_gain(lround(fmax(fmin(res->kd, 1e9), -1e9)), &res->k_d);
+    res->saturated = (fabs(res->kp) > 8191.5) || (fabs(res->kd) > 8191.5);
+    // end function normally
+    return 0;
+}
+
+// Daemon run flag, cleared by SIGINT/SIGTERM or the 'shutdown' command
+static volatile sig_atomic_t daemon_running = 1;
+
+// Stop the daemon on signal
+//
+void daemon_stop_handler(int sig){
+    (void) sig;
+    daemon_running = 0;
+}
+
+// 1 if a tuner, extremum seeking or the gain schedule owns the registers
+//
+int tuner_busy(struct tuner *t){
+    return t->active || atomic_load(&t->es->running) || atomic_load(&t->sched->running);
+}
+
+// Execute one control socket command
+//
+// Commands are single text lines; every command gets a one-line reply
+// starting with "ok" or "err". Gains and delay cannot be changed while
+// a tuner is running. Returns 1 if the client asked to disconnect.
+//
+int daemon_command(struct tuner *t, char *line, char *reply, size_t size){
+    char cmd[32] = "", arg[32] = "";
+    long int a1, a2;
+    short int k_p, k_d, delay, reg_kp, reg_kd, reg_delay;
+    long int n_samples;
+    double energy_mean, energy_var;
+    double theta[N_PARAMS];
+    int n_args;
+    const char *names[] = {"none", "mlauto", "spsa", "bo", "delay", "es", "schedule", "sweep"};
+    enum tuner_kind kind;
+    char path[DAEMON_LINE_MAX];
+    struct sched_config sched_new;
+    struct sweep_config sweep_new, *sweep_cfg;
+    double value, region[4];
+    int len;
+    double cond[PROFILE_CONDITIONS], dist = 0;
+    struct profile *prof;
+    int i_prof, n_prof;
+    
+    n_args = sscanf(line, "%31s %ld %ld", cmd, &a1, &a2);
+    regs_get(t->regs, &k_p, &k_d, &delay);
+    
+    if(0 == strcmp(cmd, "get")){
+        snprintf(reply, size, "ok %d %d %d\n", k_p, k_d, delay);
+    } else if(0 == strcmp(cmd, "set")){
+        if(tuner_busy(t)){
+            snprintf(reply, size, "err busy\n");
+        } else if(n_args != 3){
+            snprintf(reply, size, "err usage: set k_p k_d\n");
+        } else {
+            sat_gain(a1, &reg_kp);
+            sat_gain(a2, &reg_kd);
+            if(regs_set_pid(t->regs, reg_kp, reg_kd) != 0){
+                snprintf(reply, size, watchdog_tripped(t->regs->wd) ? "err watchdog tripped\n" : "err write failed\n");
+            } else {
+                snprintf(reply, size, "ok %d %d\n", reg_kp, reg_kd);
+            }
+        }
+    } else if(0 == strcmp(cmd, "delay")){
+        if(tuner_busy(t)){
+            snprintf(reply, size, "err busy\n");
+        } else if(n_args != 2){
+            snprintf(reply, size, "err usage: delay cycles\n");
+        } else {
+            sat_delay(a1, &reg_delay);
+            if(regs_set_delay(t->regs, reg_delay) != 0){
+                snprintf(reply, size, watchdog_tripped(t->regs->wd) ? "err watchdog tripped\n" : "err write failed\n");
+            } else {
+                snprintf(reply, size, "ok %d\n", reg_delay);
+            }
+        }
+    } else if(0 == strcmp(cmd, "energy")){
+        // latest register value, or statistics over a window (ms)
+        if(n_args < 2){
+            snprintf(reply, size, "ok %u\n", regs_energy(t->regs));
+        } else {
+            if(a1 < 1){
+                a1 = 1;
+            }
+            energy_ring_stats(&t->sampler->ring, monotonic_ns() - (uint64_t) a1*1000000, &n_samples, &energy_mean, &energy_var);
+            snprintf(reply, size, "ok %.3f %.3f %ld\n", energy_mean, energy_var, n_samples);
+        }
+    } else if(0 == strcmp(cmd, "filtered")){
+        // period (ms), energy and saturated samples of every filter output
+        int len = snprintf(reply, size, "ok");
+        struct filter_output out;
+        for(int k = 0; k < t->sampler->fb->n_stages && len < (int) size; k++){
+            filterbank_read(t->sampler->fb, k, &out);
+            len += snprintf(reply + len, size - len, " %.1f %.3f %u", t->sampler->fb->period_s[k]*1e3, out.energy, out.saturated);
+        }
+        if(len < (int) size){
+            snprintf(reply + len, size - len, "\n");
+        }
+    } else if(0 == strcmp(cmd, "tune")){
+        sscanf(line, "%*s %31s", arg);
+        theta[P_KP] = k_p;
+        theta[P_KD] = k_d;
+        theta[P_DELAY] = delay;
+        if(tuner_busy(t)){
+            snprintf(reply, size, "err busy\n");
+        } else if(watchdog_tripped(t->regs->wd)){
+            snprintf(reply, size, "err watchdog tripped\n");
+        } else {
+            kind = TUNER_NONE;
+            for(int k = TUNER_MLAUTO; k <= TUNER_DELAY; k++){
+                if(0 == strcmp(arg, names[k])){
+                    kind = (enum tuner_kind) k;
+                }
+            }
+            if(kind == TUNER_NONE){
+                snprintf(reply, size, "err usage: tune mlauto|spsa|bo|delay\n");
+            } else if(tuner_start(t, kind, theta) != 0){
+                snprintf(reply, size, "err could not start\n");
+            } else {
+                snprintf(reply, size, "ok tuning %s\n", names[kind]);
+            }
+        }
+    } else if(0 == strcmp(cmd, "status")){
+        if(atomic_load(&t->es->running)){
+            snprintf(reply, size, "ok tuning es %.1f %.1f %.1f\n", t->es->theta[P_KP], t->es->theta[P_KD], t->es->theta[P_DELAY]);
+        } else if(atomic_load(&t->sched->running)){
+            snprintf(reply, size, "ok scheduling %d %d %d %d\n", atomic_load(&t->sched->regime), k_p, k_d, delay);
+        } else {
+            snprintf(reply, size, "ok %s %s %d %d %d\n", t->active ? "tuning" : "idle", names[t->kind], k_p, k_d, delay);
+        }
+    } else if(0 == strcmp(cmd, "es")){
+        // continuous extremum seeking from the current registers
+        sscanf(line, "%*s %31s", arg);
+        if(0 == strcmp(arg, "stop")){
+            es_stop(t->es);
+            snprintf(reply, size, "ok\n");
+        } else if(0 != strcmp(arg, "start")){
+            snprintf(reply, size, "err usage: es start|stop\n");
+        } else if(tuner_busy(t)){
+            snprintf(reply, size, "err busy\n");
+        } else if(watchdog_tripped(t->regs->wd)){
+            snprintf(reply, size, "err watchdog tripped\n");
+        } else {
+            theta[P_KP] = k_p;
+            theta[P_KD] = k_d;
+            theta[P_DELAY] = delay;
+            es_init(t->es, t->regs, t->sampler, t->es_cfg, theta);
+            snprintf(reply, size, "ok\n");
+        }
+    } else if(0 == strcmp(cmd, "schedule")){
+        // gain scheduling from a table file
+        sched_new = *t->sched_cfg;
+        n_args = sscanf(line, "%*s %31s %255s %lf", arg, path, &sched_new.hysteresis);
+        if(0 == strcmp(arg, "stop")){
+            sched_stop(t->sched);
+            snprintf(reply, size, "ok\n");
+        } else if(0 != strcmp(arg, "start") || n_args < 2 || sched_new.hysteresis < 0 || sched_new.hysteresis >= 1){
+            snprintf(reply, size, "err usage: schedule start file [hysteresis] | schedule stop\n");
+        } else if(tuner_busy(t)){
+            snprintf(reply, size, "err busy\n");
+        } else if(watchdog_tripped(t->regs->wd)){
+            snprintf(reply, size, "err watchdog tripped\n");
+        } else if(sched_stop(t->sched) != 0 || sched_load(t->sched, t->regs, path) != 0){
+            snprintf(reply, size, "err invalid table\n");
+        } else if(sched_start(t->sched, t->regs, &sched_new) != 0){
+            snprintf(reply, size, "err could not start\n");
+        } else {
+            snprintf(reply, size, "ok %d\n", t->sched->n);
+        }
+    } else if(0 == strcmp(cmd, "sweep")){
+        // energy landscape over (k_p, k_d), written to a CSV file
+        sweep_new = *t->sweep_cfg;
+        sweep_new.path[0] = '\0';
+        sweep_new.n_delay = 0;
+        n_args = 0;
+        if(sscanf(line, "%*s %255s%n", sweep_new.path, &len) == 1){
+            // region (k_p range, k_d range), then delay slices
+            for(char *s = line + len; sscanf(s, "%lf%n", &value, &len) == 1; s += len, n_args++){
+                if(n_args < 4){
+                    region[n_args] = value;
+                } else if(sweep_new.n_delay < SWEEP_MAX_DELAYS){
+                    sweep_new.delay[sweep_new.n_delay++] = value;
+                }
+            }
+            if(n_args >= 4){
+                sweep_new.lo[0] = region[0];
+                sweep_new.hi[0] = region[1];
+                sweep_new.lo[1] = region[2];
+                sweep_new.hi[1] = region[3];
+            }
+        }
+        theta[P_KP] = k_p;
+        theta[P_KD] = k_d;
+        theta[P_DELAY] = delay;
+        if(sweep_new.path[0] == '\0' || (n_args != 0 && n_args < 4) || sweep_check(&sweep_new) != 0){
+            snprintf(reply, size, "err usage: sweep file [kp_lo kp_hi kd_lo kd_hi [delay ...]]\n");
+        } else if(tuner_busy(t)){
+            snprintf(reply, size, "err busy\n");
+        } else if(watchdog_tripped(t->regs->wd)){
+            snprintf(reply, size, "err watchdog tripped\n");
+        } else {
+            // the shared settings stay as defaults for the other channels
+            sweep_cfg = t->sweep_cfg;
+            t->sweep_cfg = &sweep_new;
+            n_args = tuner_start(t, TUNER_SWEEP, theta);
+            t->sweep_cfg = sweep_cfg;
+            if(n_args != 0){
+                snprintf(reply, size, "err could not start\n");
+            } else {
+                snprintf(reply, size, "ok sweeping %d slice%s\n", (sweep_new.n_delay > 0) ? sweep_new.n_delay : 1,
+                         (sweep_new.n_delay > 1) ? "s" : "");
+            }
+        }
+    } else if(0 == strcmp(cmd, "conditions")){
+        // trap conditions the profiles are saved and looked up at
+        if(t->profiles == NULL){
+            snprintf(reply, size, "err no profile store\n");
+        } else if(sscanf(line, "%*s %lf %lf %lf", &cond[0], &cond[1], &cond[2]) != PROFILE_CONDITIONS
+                  || cond[0] < 0 || cond[1] < 0 || cond[2] < 0){
+            snprintf(reply, size, "err usage: conditions f0 pressure power (0: unknown)\n");
+        } else {
+            memcpy(t->profiles->cond, cond, sizeof(cond));
+            snprintf(reply, size, "ok %g %g %g\n", cond[0], cond[1], cond[2]);
+        }
+    } else if(0 == strcmp(cmd, "profile")){
+        // profiles of this channel, or load the nearest / save the current settings
+        sscanf(line, "%*s %31s", arg);
+        i_prof = (t->profiles != NULL) ? profile_nearest(t->profiles, t->regs->ch.name, &dist) : -1;
+        if(t->profiles == NULL){
+            snprintf(reply, size, "err no profile store\n");
+        } else if(arg[0] == '\0'){
+            n_prof = 0;
+            for(int i = 0; i < t->profiles->n; i++){
+                n_prof += (0 == strcmp(t->profiles->p[i].channel, t->regs->ch.name));
+            }
+            snprintf(reply, size, "ok %d %d\n", n_prof, t->seeded);
+        } else if(0 != strcmp(arg, "load") && 0 != strcmp(arg, "save")){
+            snprintf(reply, size, "err usage: profile [load|save]\n");
+        } else if(tuner_busy(t)){
+            snprintf(reply, size, "err busy\n");
+        } else if(0 == strcmp(arg, "save")){
+            if(profile_save_recent(t->profiles, t->regs, t->sampler, &t->seed) != 0){
+                snprintf(reply, size, "err could not save\n");
+            } else {
+                t->seeded = 1;
+                snprintf(reply, size, "ok %d %d %d %.1f\n", t->seed.k_p, t->seed.k_d, t->seed.delay, t->seed.energy);
+            }
+        } else if(i_prof < 0){
+            snprintf(reply, size, "err no profile\n");
+        } else if(watchdog_tripped(t->regs->wd)){
+            snprintf(reply, size, "err watchdog tripped\n");
+        } else {
+            prof = &t->profiles->p[i_prof];
+            regs_set_all(t->regs, prof->k_p, prof->k_d, prof->delay);
+            t->seed = *prof;
+            t->seeded = 1;
+            snprintf(reply, size, "ok %d %d %d %.2f\n", prof->k_p, prof->k_d, prof->delay, dist);
+        }
+    } else if(0 == strcmp(cmd, "stop")){
+        t->active = 0;
+        es_stop(t->es);
+        sched_stop(t->sched);
+        telemetry_tuner(t->regs->tel, t->kind, t->n_eval, 0);
+        snprintf(reply, size, "ok\n");
+    } else if(0 == strcmp(cmd, "kill")){
+        // stop tuning and set kp, kd to zero
+        t->active = 0;
+        es_stop(t->es);
+        sched_stop(t->sched);
+        telemetry_tuner(t->regs->tel, t->kind, t->n_eval, 0);
+        regs_set_pid(t->regs, 0, 0);
+        snprintf(reply, size, "ok\n");
+    } else if(0 == strcmp(cmd, "watchdog")){
+        // state, then the limits or the trip snapshot
+        if(!atomic_load(&t->regs->wd->running)){
+            snprintf(reply, size, "ok off\n");
+        } else if(!atomic_load_explicit(&t->regs->wd->snap_ready, memory_order_acquire)){
+            snprintf(reply, size, "ok armed %u %.1f\n", t->regs->wd->cfg.threshold, t->regs->wd->cfg.slope_max);
+        } else {
+            regs_unpack_pid(t->regs, t->regs->wd->snap.pid, &reg_kp, &reg_kd);
+            snprintf(reply, size, "ok tripped %s %u %.1f %d %d %.3f\n",
+                     (t->regs->wd->snap.reason == WD_REASON_ENERGY) ? "energy" : "slope", t->regs->wd->snap.energy,
+                     t->regs->wd->snap.slope, reg_kp, reg_kd,
+                     t->regs->wd->snap.latency_ns/1e3);
+        }
+    } else if(0 == strcmp(cmd, "arm")){
+        if(!atomic_load(&t->regs->wd->running)){
+            snprintf(reply, size, "err watchdog off\n");
+        } else {
+            watchdog_arm(t->regs->wd, t->regs);
+            snprintf(reply, size, "ok\n");
+        }
+    } else if(0 == strcmp(cmd, "quit")){
+        snprintf(reply, size, "ok\n");
+        return 1;
+    } else if(0 == strcmp(cmd, "shutdown")){
+        daemon_running = 0;
+        snprintf(reply, size, "ok\n");
+    } else {
+        snprintf(reply, size, "err unknown command\n");
+    }
+    // end function normally
+    return 0;
+}
+
+// Route one control socket command to its channel
+//
+// "@name cmd ..." or "@index cmd ..." addresses a channel of the map,
+// plain commands go to channel 0. "channels" lists the map.
+//
+int daemon_dispatch(struct channel *ch, int n_ch, char *line, char *reply, size_t size){
+    char target[RP_NAME_MAX + 1] = "";
+    char *end;
+    long int index;
+    int c = 0, len, n = 0;
+    
+    if(line[0] == '@'){
+        // the name must end within RP_NAME_MAX characters
+        if(sscanf(line + 1, "%16s%n", target, &n) != 1 || (line[1 + n] != '\0' && !isspace((unsigned char) line[1 + n]))){
+            snprintf(reply, size, "err unknown channel\n");
+            return 0;
+        }
+        line += 1 + n;
+        index = strtol(target, &end, 10);
+        c = (end != target && *end == '\0') ? (int) index : -1;
+        for(int i = 0; i < n_ch && c < 0; i++){
+            if(0 == strcmp(target, ch[i].regs.ch.name)){
+                c = i;
+            }
+        }
+        if(c < 0 || c >= n_ch){
+            snprintf(reply, size, "err unknown channel\n");
+            return 0;
+        }
+    }
+    if(1 == sscanf(line, "%16s", target) && 0 == strcmp(target, "channels")){
+        // index, name and state of every channel
+        len = snprintf(reply, size, "ok %d", n_ch);
+        for(int i = 0; i < n_ch && len < (int) size; i++){
+            len += snprintf(reply + len, size - len, " %d:%s:%s", i, ch[i].regs.ch.name[0] ? ch[i].regs.ch.name : "-",
+                            tuner_busy(&ch[i].tuner) ? "busy" : "idle");
+        }
+        if(len < (int) size){
+            snprintf(reply + len, size - len, "\n");
+        }
+        return 0;
+    }
+    return daemon_command(&ch[c].tuner, line, reply, size);
+}
+
+// Read from a control socket client and execute complete lines
+//
+// Returns 1 if the client must be closed
+//
+int daemon_client_read(struct channel *ch, int n_ch, struct daemon_client *c){
+    char reply[DAEMON_LINE_MAX];
+    char *nl;
+    size_t used;
+    ssize_t n;
+    
+    n = read(c->fd, c->buf + c->len, sizeof(c->buf) - 1 - c->len);
+    if(n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)){
+        return 1; // return closed connection
+    }
+    if(n < 0){
+        return 0;
+    }
+    c->len += n;
+    c->buf[c->len] = '\0';
+    
+    // execute every complete line
+    while((nl = strchr(c->buf, '\n')) != NULL){
+        *nl = '\0';
+        if(daemon_dispatch(ch, n_ch, c->buf, reply, sizeof(reply)) != 0){
+            send(c->fd, reply, strlen(reply), MSG_NOSIGNAL);
+            return 1;
+        }
+        if(send(c->fd, reply, strlen(reply), MSG_NOSIGNAL) < 0){
+            return 1; // return error in writing
+        }
+        used = nl + 1 - c->buf;
+        memmove(c->buf, nl + 1, c->len - used + 1);
+        c->len -= used;
+    }
+    if(c->len == sizeof(c->buf) - 1){
+        snprintf(reply, sizeof(reply), "err line too long\n");
+        send(c->fd, reply, strlen(reply), MSG_NOSIGNAL);
+        return 1;
+    }
+    // end function normally
+    return 0;
+}
+
+// Serve the control socket until shutdown
+//
+// Single-threaded event loop: poll() waits on the listening socket and
+// the clients, with a timeout set by the earliest dwell poll of the
+// running tuners, so tuning keeps going on every channel while commands
+// are served. Messages go to log (NULL: quiet).
+//
+int daemon_run(struct channel *ch, int n_ch, const char *path, FILE *log){
+    struct sockaddr_un addr;
+    struct daemon_client clients[DAEMON_MAX_CLIENTS];
+    struct pollfd fds[DAEMON_MAX_CLIENTS + 1];
+    struct tuner *t;
+    int listen_fd, fd, n_fds, timeout_ms, t_wait;
+    uint64_t t_now;
+    
+    // listening socket
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(addr.sun_path)){
+        msg_printf(log, "Socket path too long: %s\n", path);
+        return 1; // return error in socket path
+    }
+    strcpy(addr.sun_path, path);
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(listen_fd < 0){
+        msg_printf(log, "Could not create the control socket: %s\n", strerror(errno));
+        return 1; // return error in socket
+    }
+    unlink(path);
+    if(bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(listen_fd, DAEMON_MAX_CLIENTS) != 0){
+        msg_printf(log, "Could not listen on %s: %s\n", path, strerror(errno));
+        close(listen_fd);
+        return 1; // return error in binding
+    }
+    for(int i = 0; i < DAEMON_MAX_CLIENTS; i++){
+        clients[i].fd = -1;
+    }
+    signal(SIGINT, daemon_stop_handler);
+    signal(SIGTERM, daemon_stop_handler);
+    signal(SIGPIPE, SIG_IGN);
+    msg_printf(log, "Daemon listening on %s\n", path);
+    
+    while(daemon_running){
+        // wait for commands or the next dwell poll
+        fds[0].fd = listen_fd;
+        fds[0].events = POLLIN;
+        n_fds = 1;
+        for(int i = 0; i < DAEMON_MAX_CLIENTS; i++){
+            if(clients[i].fd >= 0){
+                fds[n_fds].fd = clients[i].fd;
+                fds[n_fds].events = POLLIN;
+                n_fds++;
+            }
+        }
+        // (every 100 ms at most with a watchdog on, to report trips)
+        timeout_ms = -1;
+        for(int c = 0; c < n_ch; c++){
+            t = &ch[c].tuner;
+            if(atomic_load(&t->regs->wd->running)){
+                timeout_ms = 100;
+            }
+        }
+        for(int c = 0; c < n_ch; c++){
+            t = &ch[c].tuner;
+            if(t->active){
+                t_now = monotonic_ns();
+                t_wait = (t->dwell.deadline > t_now) ? (int) ((t->dwell.deadline - t_now + 999999)/1000000) : 0;
+                if(timeout_ms < 0 || t_wait < timeout_ms){
+                    timeout_ms = t_wait;
+                }
+            }
+            if(atomic_load(&t->es->running)){
+                t_now = monotonic_ns();
+                t_wait = (t->es->deadline > t_now) ? (int) ((t->es->deadline - t_now + 999999)/1000000) : 0;
+                if(timeout_ms < 0 || t_wait < timeout_ms){
+                    timeout_ms = t_wait;
+                }
+            }
+        }
+        if(poll(fds, n_fds, timeout_ms) < 0 && errno != EINTR){
+            msg_printf(log, "Control socket poll failed: %s\n", strerror(errno));
+            break;
+        }
+        
+        // tuners, extremum seeking and watchdogs
+        for(int c = 0; c < n_ch; c++){
+            t = &ch[c].tuner;
+            tuner_poll(t);
+            if(atomic_load(&t->es->running) && monotonic_ns() >= t->es->deadline){
+                es_step(t->es);
+            }
+            watchdog_check(t->regs->wd, t->regs);
+            sched_report(t->sched, t->regs->log);
+        }
+        
+        // clients
+        for(int i = 0, j = 1; i < DAEMON_MAX_CLIENTS; i++){
+            if(clients[i].fd < 0){
+                continue;
+            }
+            if(fds[j].revents & (POLLIN | POLLHUP | POLLERR)){
+                if(daemon_client_read(ch, n_ch, &clients[i]) != 0){
+                    close(clients[i].fd);
+                    clients[i].fd = -1;
+                }
+            }
+            j++;
+        }
+        
+        // new connections
+        if(fds[0].revents & POLLIN){
+            while((fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0){
+                int slot = -1;
+                for(int i = 0; i < DAEMON_MAX_CLIENTS; i++){
+                    if(clients[i].fd < 0){
+                        slot = i;
+                        break;
+                    }
+                }
+                if(slot < 0){
+                    send(fd, "err too many clients\n", 21, MSG_NOSIGNAL);
+                    close(fd);
+                    continue;
+                }
+                clients[slot].fd = fd;
+                clients[slot].len = 0;
+            }
+        }
+    }
+    
+    // close connections and socket
+    for(int i = 0; i < DAEMON_MAX_CLIENTS; i++){
+        if(clients[i].fd >= 0){
+            close(clients[i].fd);
+        }
+    }
+    close(listen_fd);
+    unlink(path);
+    msg_printf(log, "Daemon stopped\n");
+    // end function normally
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////
+// Library API (rp_feedback.h)
+// The keyboard interface (cpu_opt_control.c) is a client like any
+// other and only calls these.
+
+RPF_API int rpf_api_version(void){
+    return RPF_API_VERSION;
+}
+
+RPF_API const char *rpf_strerror(int err){
+    switch(err){
+        case RPF_OK:       return "no error";
+        case RPF_EINVAL:   return "invalid argument";
+        case RPF_EIO:      return "register, map or recorder access failed";
+        case RPF_ENOMEM:   return "out of memory";
+        case RPF_EBUSY:    return "a tuner owns the registers";
+        case RPF_ETRIPPED: return "watchdog tripped";
+        case RPF_ENODATA:  return "no energy samples or nothing to report";
+        default:           return "unknown error";
+    }
+}
+
+// Channel c of dev, NULL if there is none
+//
+static struct channel *rpf_channel(rpf_device *dev, int c){
+    return (dev != NULL && c >= 0 && c < dev->map.n) ? &dev->ch[c] : NULL;
+}
+
+// Pass the messages written to a log stream to the host's callback,
+// one line at a time (longer lines are split). Called with the stream
+// locked, so messages of the channel threads do not mix.
+//
+static ssize_t rpf_log_write(void *cookie, const char *buf, size_t size){
+    struct rpf_log *l = cookie;
+    
+    for(size_t k = 0; k < size; k++){
+        l->line[l->len++] = buf[k];
+        if(buf[k] == '\n' || l->len == RPF_LOG_LINE - 1){
+            l->line[l->len] = '\0';
+            l->fn(l->ctx, l->line);
+            l->len = 0;
+        }
+    }
+    return (ssize_t) size;
+}
+
+// Pass on an unterminated last line when the stream is closed
+//
+static int rpf_log_close(void *cookie){
+    struct rpf_log *l = cookie;
+    
+    if(l->len > 0){
+        l->line[l->len] = '\0';
+        l->fn(l->ctx, l->line);
+        l->len = 0;
+    }
+    return 0;
+}
+
+// Line-buffered stream whose lines go to fn (NULL if it cannot be made)
+//
+static FILE *rpf_log_open(struct rpf_log *l, void (*fn)(void *ctx, const char *line), void *ctx){
+    cookie_io_functions_t log_io = {NULL, rpf_log_write, NULL, rpf_log_close};
+    FILE *log;
+    
+    l->fn = fn;
+    l->ctx = ctx;
+    l->len = 0;
+    log = fopencookie(l, "w", log_io);
+    if(log != NULL){
+        setvbuf(log, NULL, _IOLBF, 0);
+    }
+    return log;
+}
+
+// Copy a dwell measurement out of, or into, the library
+//
+static void rpf_measurement_from(struct dwell_result *res, struct rpf_measurement *m){
+    m->energy = res->mean;
+    m->var = res->var;
+    m->samples = res->n;
+    m->dwell_s = res->dwell_s;
+    m->resolved = res->resolved;
+    m->predicted = res->predicted;
+    m->tau_s = res->tau;
+}
+
+static void rpf_measurement_to(const struct rpf_measurement *m, struct dwell_result *res){
+    res->mean = m->energy;
+    res->var = m->var;
+    res->n = m->samples;
+    res->dwell_s = m->dwell_s;
+    res->resolved = m->resolved;
+    res->predicted = m->predicted;
+    res->tau = m->tau_s;
+}
+
+// Copy a profile out of the library
+//
+static void rpf_profile_from(struct profile *p, struct rpf_profile *out){
+    memset(out, 0, sizeof(*out));
+    strcpy(out->channel, p->channel);
+    memcpy(out->conditions, p->cond, sizeof(out->conditions));
+    out->energy = p->energy;
+    out->t_saved = p->t_saved;
+    out->gains.k_p = p->k_p;
+    out->gains.k_d = p->k_d;
+    out->gains.delay = p->delay;
+}
+
+// Map the registers and start every channel
+//
+// Tuners use the default settings; the watchdog is started when
+// opt->wd_threshold is nonzero and the metrics file written when
+// opt->metrics_file is set. With opt->profile_file, every channel's
+// 'mlauto' starts from its profile nearest to opt->conditions.
+// Messages go to opt->log, through a line-buffered stream. Only the
+// first opt->size bytes of the options are read, so callers built
+// against an older header work.
+//
+RPF_API int rpf_open(const struct rpf_options *opt, rpf_device **dev){
+    struct rpf_options o = {sizeof(struct rpf_options), NULL, NULL, 0, NULL, 0, 0, 0, NULL, 0, NULL, NULL, NULL, {0, 0, 0}};
+    struct watchdog_config wd_cfg = wd_default;
+    int n_filter = sizeof(filter_default_ms)/sizeof(filter_default_ms[0]);
+    double filter_s[FILTER_STAGES];
+    double dist;
+    int i_prof;
+    rpf_device *d;
+    
+    if(dev == NULL){
+        return RPF_EINVAL;
+    }
+    *dev = NULL;
+    if(opt != NULL){
+        memcpy(&o, opt, (opt->size < sizeof(o)) ? opt->size : sizeof(o));
+    }
+    d = calloc(1, sizeof(rpf_device));
+    if(d == NULL){
+        return RPF_ENOMEM;
+    }
+    // messages first, so that every problem below is reported there
+    if(o.log != NULL){
+        d->log = rpf_log_open(&d->sink, o.log, o.log_ctx);
+        if(d->log == NULL){
+            free(d);
+            return RPF_ENOMEM;
+        }
+    }
+    // (on the error exits below no channel is started yet)
+    if(o.map_file == NULL){
+        rp_map_default(&d->map);
+    } else if(rp_map_load(&d->map, o.map_file, d->log) != 0){
+        d->map.n = 0;
+        rpf_close(d);
+        return RPF_EIO;
+    }
+    d->ch = calloc(d->map.n, sizeof(struct channel));
+    if(d->ch == NULL){
+        d->map.n = 0;
+        rpf_close(d);
+        return RPF_ENOMEM;
+    }
+    if(o.record_file != NULL){
+        if(telemetry_open(&d->tel, o.record_file, (o.record_size > 0) ? (uint64_t) o.record_size : TEL_DEFAULT_RECORDS, d->log) != 0){
+            d->map.n = 0;
+            rpf_close(d);
+            return RPF_EIO;
+        }
+        d->recording = 1;
+    }
+    d->dwell = dwell_default;
+    d->spsa = spsa_default;
+    d->bo = bo_default;
+    d->cal = cal_default;
+    d->sweep = sweep_default;
+    d->es = es_default;
+    d->sched = sched_default;
+    wd_cfg.threshold = o.wd_threshold;
+    wd_cfg.slope_max = o.wd_slope;
+    for(int k = 0; k < n_filter; k++){
+        filter_s[k] = filter_default_ms[k]/1e3;
+    }
+    if(o.profile_file != NULL){
+        if(snprintf(d->profile_path, sizeof(d->profile_path), "%s", o.profile_file) >= (int) sizeof(d->profile_path)){
+            d->map.n = 0;
+            rpf_close(d);
+            return RPF_EINVAL;
+        }
+        // (a damaged store is reported and starts empty)
+        profile_load(&d->profiles, d->profile_path, d->log);
+        memcpy(d->profiles.cond, o.conditions, sizeof(d->profiles.cond));
+    }
+    
+    for(int c = 0; c < d->map.n; c++){
+        struct tuner *t = &d->ch[c].tuner;
+        if(channel_start(&d->ch[c], &d->map, c, o.sim_file, o.verify, d->recording ? &d->tel : NULL,
+                         n_filter, filter_s, (o.wd_threshold > 0) ? &wd_cfg : NULL, d->log) != 0){
+            // channel c cleaned up after itself: undo the channels before it
+            d->map.n = c;
+            rpf_close(d);
+            return RPF_EIO;
+        }
+        d->ch[c].n_filter = n_filter;
+        memcpy(d->ch[c].filter_s, filter_s, sizeof(filter_s));
+        d->cursor[c] = atomic_load(&d->ch[c].sampler.ring.head);
+        t->regs = &d->ch[c].regs;
+        t->sampler = &d->ch[c].sampler;
+        t->log = d->log;
+        t->dwell_cfg = &d->dwell;
+        t->spsa_cfg = &d->spsa;
+        t->bo_cfg = &d->bo;
+        t->cal_cfg = &d->cal;
+        t->sweep_cfg = &d->sweep;
+        t->es = &d->ch[c].es;
+        t->es_cfg = &d->es;
+        t->sched = &d->ch[c].sched;
+        t->sched_cfg = &d->sched;
+        t->gp = &d->ch[c].gp;
+        t->profiles = &d->profiles;
+        i_prof = profile_nearest(&d->profiles, d->ch[c].regs.ch.name, &dist);
+        if(i_prof >= 0){
+            t->seed = d->profiles.p[i_prof];
+            t->seeded = 1;
+        }
+    }
+    if(o.metrics_file != NULL){
+        if(metrics_file_start(&d->metrics, o.metrics_file, (o.metrics_period > 0) ? o.metrics_period : METRICS_DEFAULT_PERIOD,
+                              d->log) != 0){
+            rpf_close(d);
+            return RPF_EIO;
+        }
+        d->exporting = 1;
+    }
+    *dev = d;
+    return RPF_OK;
+}
+
+RPF_API void rpf_close(rpf_device *dev){
+    if(dev == NULL){
+        return;
+    }
+    for(int c = 0; c < dev->map.n; c++){
+        dev->ch[c].tuner.active = 0;
+        channel_stop(&dev->ch[c]);
+    }
+    if(dev->exporting){
+        metrics_file_stop(&dev->metrics);
+    }
+    if(dev->recording){
+        telemetry_close(&dev->tel);
+    }
+    if(dev->log != NULL){
+        fclose(dev->log);
+    }
+    free(dev->ch);
+    free(dev);
+}
+
+RPF_API int rpf_channels(rpf_device *dev){
+    return (dev != NULL) ? dev->map.n : RPF_EINVAL;
+}
+
+RPF_API const char *rpf_channel_name(rpf_device *dev, int channel){
+    struct channel *ch = rpf_channel(dev, channel);
+    
+    return (ch != NULL) ? ch->regs.ch.name : NULL;
+}
+
+RPF_API int rpf_get(rpf_device *dev, int channel, struct rpf_gains *gains){
+    struct channel *ch = rpf_channel(dev, channel);
+    short int k_p, k_d, delay;
+    
+    if(ch == NULL || gains == NULL){
+        return RPF_EINVAL;
+    }
+    regs_get(&ch->regs, &k_p, &k_d, &delay);
+    gains->k_p = k_p;
+    gains->k_d = k_d;
+    gains->delay = delay;
+    return RPF_OK;
+}
+
+// Saturate the fields in mask and write them in one commit
+//
+RPF_API int rpf_set(rpf_device *dev, int channel, struct rpf_gains *gains, unsigned int mask){
+    struct channel *ch = rpf_channel(dev, channel);
+    short int k_p, k_d, delay;
+    
+    if(ch == NULL || gains == NULL || (mask & ~RPF_ALL) != 0){
+        return RPF_EINVAL;
+    }
+    if(tuner_busy(&ch->tuner)){
+        return RPF_EBUSY;
+    }
+    regs_get(&ch->regs, &k_p, &k_d, &delay);
+    if(mask & RPF_KP){
+        sat_gain(gains->k_p, &k_p);
+    }
+    if(mask & RPF_KD){
+        sat_gain(gains->k_d, &k_d);
+    }
+    if(mask & RPF_DELAY){
+        sat_delay(gains->delay, &delay);
+    }
+    if(regs_set_all(&ch->regs, k_p, k_d, delay) != 0){
+        return watchdog_tripped(&ch->wd) ? RPF_ETRIPPED : RPF_EIO;
+    }
+    gains->k_p = k_p;
+    gains->k_d = k_d;
+    gains->delay = delay;
+    return RPF_OK;
+}
+
+// Copy the sampler ring from the channel's cursor on
+//
+RPF_API int rpf_energy_read(rpf_device *dev, int channel, struct rpf_sample *buf, size_t max, size_t *n, uint64_t *lost){
+    struct channel *ch = rpf_channel(dev, channel);
+    struct energy_sample sample;
+    uint64_t head, cursor, n_lost = 0;
+    
+    if(ch == NULL || n == NULL || (buf == NULL && max > 0)){
+        return RPF_EINVAL;
+    }
+    head = atomic_load_explicit(&ch->sampler.ring.head, memory_order_acquire);
+    cursor = dev->cursor[channel];
+    if(head - cursor > ENERGY_RING_SIZE){
+        // the sampler has gone round the ring since the last call
+        n_lost = head - ENERGY_RING_SIZE - cursor;
+        cursor = head - ENERGY_RING_SIZE;
+    }
+    for(*n = 0; cursor < head && *n < max; cursor++){
+        if(energy_ring_read(&ch->sampler.ring, cursor, &sample) != 0){
+            n_lost++;
+            continue;
+        }
+        buf[*n].t_ns = sample.t_ns;
+        buf[*n].energy = sample.energy;
+        (*n)++;
+    }
+    dev->cursor[channel] = cursor;
+    if(lost != NULL){
+        *lost += n_lost;
+    }
+    return RPF_OK;
+}
+
+RPF_API int rpf_energy_stats(rpf_device *dev, int channel, double window_ms, double *mean, double *var, long int *n){
+    struct channel *ch = rpf_channel(dev, channel);
+    
+    if(ch == NULL || mean == NULL || var == NULL || n == NULL || window_ms <= 0){
+        return RPF_EINVAL;
+    }
+    if(energy_ring_stats(&ch->sampler.ring, monotonic_ns() - (uint64_t) (window_ms*1e6), n, mean, var) != 0){
+        return RPF_ENODATA;
+    }
+    return RPF_OK;
+}
+
+RPF_API int rpf_settings_get(rpf_device *dev, struct rpf_settings *settings){
+    struct rpf_settings s;
+    
+    if(dev == NULL || settings == NULL){
+        return RPF_EINVAL;
+    }
+    memset(&s, 0, sizeof(s));
+    s.size = sizeof(s);
+    s.settle_s = dev->dwell.settle_s;
+    s.min_dwell_s = dev->dwell.min_dwell_s;
+    s.max_dwell_s = dev->dwell.max_dwell_s;
+    s.z = dev->dwell.z;
+    s.resolution = dev->dwell.resolution;
+    s.predict = dev->dwell.predict;
+    s.spsa_a = dev->spsa.a;
+    s.spsa_c = dev->spsa.c;
+    s.spsa_A = dev->spsa.A;
+    s.spsa_alpha = dev->spsa.alpha;
+    s.spsa_gamma = dev->spsa.gamma;
+    s.spsa_iter = dev->spsa.max_iter;
+    s.bo_length = dev->bo.length;
+    s.bo_noise = dev->bo.noise;
+    s.bo_ei_min = dev->bo.ei_min;
+    s.bo_eval = dev->bo.max_eval;
+    memcpy(s.bo_lo, dev->bo.lo, sizeof(s.bo_lo));
+    memcpy(s.bo_hi, dev->bo.hi, sizeof(s.bo_hi));
+    s.cal_lo = dev->cal.lo;
+    s.cal_hi = dev->cal.hi;
+    s.cal_points = dev->cal.n_coarse;
+    s.cal_tol = dev->cal.tol;
+    s.sweep_kp[0] = dev->sweep.lo[0];
+    s.sweep_kp[1] = dev->sweep.hi[0];
+    s.sweep_kd[0] = dev->sweep.lo[1];
+    s.sweep_kd[1] = dev->sweep.hi[1];
+    s.sweep_grid = dev->sweep.n_grid;
+    s.sweep_levels = dev->sweep.depth;
+    s.sweep_tol = dev->sweep.tol;
+    s.sweep_points = dev->sweep.max_points;
+    s.sweep_delays = dev->sweep.n_delay;
+    memcpy(s.sweep_delay, dev->sweep.delay, sizeof(s.sweep_delay));
+    memcpy(s.sweep_file, dev->sweep.path, sizeof(s.sweep_file));
+    s.es_freq_hz = dev->es.freq_hz;
+    memcpy(s.es_amp, dev->es.amp, sizeof(s.es_amp));
+    s.es_gain = dev->es.gain;
+    s.es_max_rate = dev->es.max_rate;
+    s.es_phase_deg = dev->es.phase_deg;
+    s.sched_hysteresis = dev->sched.hysteresis;
+    s.sched_debounce = dev->sched.debounce;
+    s.sched_rate_hz = dev->sched.rate_hz;
+    memcpy(settings, &s, (settings->size < sizeof(s)) ? settings->size : sizeof(s));
+    return RPF_OK;
+}
+
+// Check and take new settings
+//
+// Same limits as the keyboard interface always had. The tuners copy
+// their settings when they start, so running ones keep the old ones.
+//
+RPF_API int rpf_settings_set(rpf_device *dev, const struct rpf_settings *settings){
+    struct rpf_settings s;
+    struct dwell_config dwell;
+    struct spsa_config spsa;
+    struct bo_config bo;
+    struct caldelay_config cal;
+    struct sweep_config sweep;
+    struct es_config es;
+    struct sched_config sched;
+    
+    if(dev == NULL || settings == NULL){
+        return RPF_EINVAL;
+    }
+    // fields the caller does not know keep their values
+    s.size = sizeof(s);
+    rpf_settings_get(dev, &s);
+    memcpy(&s, settings, (settings->size < sizeof(s)) ? settings->size : sizeof(s));
+    
+    dwell = dev->dwell;
+    dwell.settle_s = s.settle_s;
+    dwell.min_dwell_s = s.min_dwell_s;
+    dwell.max_dwell_s = s.max_dwell_s;
+    dwell.z = s.z;
+    dwell.resolution = s.resolution;
+    dwell.predict = s.predict;
+    if(!(dwell.settle_s >= 0 && dwell.min_dwell_s >= 0 && dwell.max_dwell_s >= dwell.min_dwell_s && dwell.z > 0)){
+        return RPF_EINVAL;
+    }
+    spsa = dev->spsa;
+    spsa.a = s.spsa_a;
+    spsa.c = s.spsa_c;
+    spsa.A = s.spsa_A;
+    spsa.alpha = s.spsa_alpha;
+    spsa.gamma = s.spsa_gamma;
+    spsa.max_iter = s.spsa_iter;
+    if(!(spsa.c > 0 && spsa.max_iter > 0)){
+        return RPF_EINVAL;
+    }
+    bo = dev->bo;
+    bo.length = s.bo_length;
+    bo.noise = s.bo_noise;
+    bo.ei_min = s.bo_ei_min;
+    bo.max_eval = s.bo_eval;
+    memcpy(bo.lo, s.bo_lo, sizeof(bo.lo));
+    memcpy(bo.hi, s.bo_hi, sizeof(bo.hi));
+    if(!(bo.length > 0 && bo.noise > 0 && bo.max_eval > 0 && bo.max_eval <= GP_MAX_POINTS)){
+        return RPF_EINVAL;
+    }
+    for(int i = 0; i < N_PARAMS; i++){
+        if(!(bo.lo[i] < bo.hi[i])){
+            return RPF_EINVAL;
+        }
+    }
+    cal.lo = s.cal_lo;
+    cal.hi = s.cal_hi;
+    cal.n_coarse = s.cal_points;
+    cal.tol = s.cal_tol;
+    if(!(cal.lo >= 0 && cal.hi <= 500 && cal.lo < cal.hi && cal.n_coarse >= 3 && cal.n_coarse <= CAL_MAX_POINTS/2 && cal.tol >= 1)){
+        return RPF_EINVAL;
+    }
+    sweep.lo[0] = s.sweep_kp[0];
+    sweep.hi[0] = s.sweep_kp[1];
+    sweep.lo[1] = s.sweep_kd[0];
+    sweep.hi[1] = s.sweep_kd[1];
+    sweep.n_grid = s.sweep_grid;
+    sweep.depth = s.sweep_levels;
+    sweep.tol = s.sweep_tol;
+    sweep.max_points = s.sweep_points;
+    sweep.n_delay = s.sweep_delays;
+    memcpy(sweep.delay, s.sweep_delay, sizeof(sweep.delay));
+    if(memchr(s.sweep_file, '\0', sizeof(s.sweep_file)) == NULL || sweep_check(&sweep) != 0){
+        return RPF_EINVAL;
+    }
+    memcpy(sweep.path, s.sweep_file, sizeof(sweep.path));
+    es = dev->es;
+    es.freq_hz = s.es_freq_hz;
+    memcpy(es.amp, s.es_amp, sizeof(es.amp));
+    es.gain = s.es_gain;
+    es.max_rate = s.es_max_rate;
+    es.phase_deg = s.es_phase_deg;
+    if(!(es.freq_hz > 0 && es.freq_hz < 0.1/es.period_s && es.amp[P_KP] >= 0 && es.amp[P_KD] >= 0 && es.amp[P_DELAY] >= 0
+         && es.amp[P_KP] <= 500 && es.amp[P_KD] <= 500 && es.amp[P_DELAY] <= 50 && es.gain >= 0 && es.max_rate >= 0)){
+        return RPF_EINVAL;
+    }
+    sched.hysteresis = s.sched_hysteresis;
+    sched.debounce = s.sched_debounce;
+    sched.rate_hz = s.sched_rate_hz;
+    if(!(sched.hysteresis >= 0 && sched.hysteresis < 1 && sched.debounce >= 1 && sched.rate_hz >= 1)){
+        return RPF_EINVAL;
+    }
+    
+    dev->dwell = dwell;
+    dev->spsa = spsa;
+    dev->bo = bo;
+    dev->cal = cal;
+    dev->sweep = sweep;
+    dev->es = es;
+    dev->sched = sched;
+    return RPF_OK;
+}
+
+RPF_API int rpf_measure(rpf_device *dev, int channel, const struct rpf_measurement *prev, struct rpf_measurement *res){
+    struct channel *ch = rpf_channel(dev, channel);
+    struct dwell_result r, r_prev;
+    
+    if(ch == NULL || res == NULL){
+        return RPF_EINVAL;
+    }
+    if(prev != NULL){
+        rpf_measurement_to(prev, &r_prev);
+    }
+    if(dwell_measure(&ch->sampler, &dev->dwell, (prev != NULL) ? &r_prev : NULL, &r, dev->log) != 0){
+        return RPF_ENODATA;
+    }
+    if(watchdog_tripped(&ch->wd)){
+        return RPF_ETRIPPED;
+    }
+    rpf_measurement_from(&r, res);
+    return RPF_OK;
+}
+
+RPF_API int rpf_status(rpf_device *dev, int channel, struct rpf_status *status){
+    struct channel *ch = rpf_channel(dev, channel);
+    struct tuner *t;
+    struct rpf_status s;
+    short int reg[N_PARAMS];
+    double lo[N_PARAMS] = {-8191, -8191, 0};
+    double hi[N_PARAMS] = {8191, 8191, 500};
+    
+    if(ch == NULL || status == NULL){
+        return RPF_EINVAL;
+    }
+    t = &ch->tuner;
+    memset(&s, 0, sizeof(s));
+    s.size = sizeof(s);
+    s.tuner = t->active ? (int) t->kind : 0;
+    s.evaluations = t->n_eval;
+    clamp_params(t->param, lo, hi, reg);
+    s.point.k_p = reg[P_KP];
+    s.point.k_d = reg[P_KD];
+    s.point.delay = reg[P_DELAY];
+    s.measured = t->have_last;
+    if(t->have_last){
+        rpf_measurement_from(&t->last, &s.last);
+    }
+    s.tune_time_s = t->dwell_total;
+    s.seeded = t->seeded;
+    if(t->seeded){
+        s.seed.k_p = t->seed.k_p;
+        s.seed.k_d = t->seed.k_d;
+        s.seed.delay = t->seed.delay;
+    }
+    s.es_running = atomic_load(&ch->es.running);
+    s.es_time_s = (ch->es.t_last - ch->es.t0)/1e9;
+    s.es_samples = ch->es.n_samples;
+    // (the scheduler holds the registers until stopped, even after a trip)
+    s.sched_running = (ch->sched.regs != NULL);
+    s.sched_transitions = atomic_load(&ch->sched.n_log);
+    s.wd_running = atomic_load(&ch->wd.running);
+    s.wd_tripped = watchdog_tripped(&ch->wd);
+    s.rate_hz = atomic_load(&ch->sampler.rate_hz);
+    s.missed = atomic_load(&ch->sampler.missed);
+    s.filter_outputs = ch->fb.n_stages;
+    pthread_mutex_lock(&ch->regs.lock);
+    s.reg_writes = ch->regs.writes;
+    s.reg_coalesced = ch->regs.coalesced;
+    s.reg_mismatches = ch->regs.mismatches;
+    pthread_mutex_unlock(&ch->regs.lock);
+    memcpy(status, &s, (status->size < sizeof(s)) ? status->size : sizeof(s));
+    return RPF_OK;
+}
+
+// Report watchdog trips and gain-schedule transitions of every channel
+//
+RPF_API int rpf_report(rpf_device *dev){
+    int n = 0;
+    
+    if(dev == NULL){
+        return RPF_EINVAL;
+    }
+    for(int c = 0; c < dev->map.n; c++){
+        n += watchdog_check(&dev->ch[c].wd, &dev->ch[c].regs);
+        n += sched_report(&dev->ch[c].sched, dev->log);
+    }
+    return n;
+}
+
+RPF_API int rpf_tune_start(rpf_device *dev, int channel, int tuner){
+    struct channel *ch = rpf_channel(dev, channel);
+    short int k_p, k_d, delay;
+    double theta[N_PARAMS];
+    
+    if(ch == NULL || ((tuner < RPF_TUNER_MLAUTO || tuner > RPF_TUNER_DELAY) && tuner != RPF_TUNER_SWEEP)){
+        return RPF_EINVAL;
+    }
+    if(tuner_busy(&ch->tuner)){
+        return RPF_EBUSY;
+    }
+    if(watchdog_tripped(&ch->wd)){
+        return RPF_ETRIPPED;
+    }
+    regs_get(&ch->regs, &k_p, &k_d, &delay);
+    theta[P_KP] = k_p;
+    theta[P_KD] = k_d;
+    theta[P_DELAY] = delay;
+    if(tuner_start(&ch->tuner, (enum tuner_kind) tuner, theta) != 0){
+        return RPF_EINVAL;
+    }
+    return RPF_OK;
+}
+
+// Poll the tuner; a tuner that stopped without writing its result
+// returns the reason
+//
+RPF_API int rpf_tune_step(rpf_device *dev, int channel, uint64_t *next_ns){
+    struct channel *ch = rpf_channel(dev, channel);
+    int done;
+    
+    if(ch == NULL){
+        return RPF_EINVAL;
+    }
+    done = ch->tuner.active ? tuner_poll(&ch->tuner) : 1;
+    if(done == 0){
+        if(next_ns != NULL){
+            *next_ns = ch->tuner.dwell.deadline;
+        }
+        return 0;
+    }
+    if(watchdog_tripped(&ch->wd)){
+        return RPF_ETRIPPED;
+    }
+    if(done == -1){
+        return RPF_ENODATA;
+    }
+    if(done == -2){
+        return RPF_EIO;
+    }
+    return 1;
+}
+
+RPF_API int rpf_tune_stop(rpf_device *dev, int channel){
+    struct channel *ch = rpf_channel(dev, channel);
+    
+    if(ch == NULL){
+        return RPF_EINVAL;
+    }
+    if(ch->tuner.active){
+        ch->tuner.active = 0;
+        telemetry_tuner(ch->regs.tel, ch->tuner.kind, ch->tuner.n_eval, 0);
+    }
+    return RPF_OK;
+}
+
+RPF_API int rpf_es_start(rpf_device *dev, int channel){
+    struct channel *ch = rpf_channel(dev, channel);
+    short int k_p, k_d, delay;
+    double theta[N_PARAMS];
+    
+    if(ch == NULL){
+        return RPF_EINVAL;
+    }
+    if(tuner_busy(&ch->tuner)){
+        return RPF_EBUSY;
+    }
+    if(watchdog_tripped(&ch->wd)){
+        return RPF_ETRIPPED;
+    }
+    regs_get(&ch->regs, &k_p, &k_d, &delay);
+    theta[P_KP] = k_p;
+    theta[P_KD] = k_d;
+    theta[P_DELAY] = delay;
+    if(es_start(&ch->es, &ch->regs, &ch->sampler, &dev->es, theta) != 0){
+        return RPF_EIO;
+    }
+    return RPF_OK;
+}
+
+RPF_API int rpf_es_stop(rpf_device *dev, int channel){
+    struct channel *ch = rpf_channel(dev, channel);
+    
+    if(ch == NULL){
+        return RPF_EINVAL;
+    }
+    es_stop(&ch->es);
+    return RPF_OK;
+}
+
+// Load the table and start the scheduler (pinned like the samplers in
+// real-time mode)
+//
+RPF_API int rpf_schedule_start(rpf_device *dev, int channel, const char *table_file){
+    struct channel *ch = rpf_channel(dev, channel);
+    struct schedule *sched;
+    
+    if(ch == NULL || table_file == NULL){
+        return RPF_EINVAL;
+    }
+    if(tuner_busy(&ch->tuner)){
+        return RPF_EBUSY;
+    }
+    if(watchdog_tripped(&ch->wd)){
+        return RPF_ETRIPPED;
+    }
+    sched = &ch->sched;
+    sched_stop(sched);
+    if(sched_load(sched, &ch->regs, table_file) != 0){
+        return RPF_EIO;
+    }
+    msg_printf(dev->log, "------------------------\n");
+    for(int i = 0; i < sched->n; i++){
+        msg_printf(dev->log, "Regime %d: energy >= %5u: k_p = %d, k_d = %d, delay = %d\n", i, sched->entry[i].threshold,
+                   sched->entry[i].k_p, sched->entry[i].k_d, sched->entry[i].delay);
+    }
+    msg_printf(dev->log, "------------------------\n");
+    if(sched_start(sched, &ch->regs, &dev->sched) != 0){
+        return RPF_EIO;
+    }
+    if(dev->rt.enabled){
+        rt_setup_thread(sched->thread, dev->rt.cpu, dev->rt.priority, dev->log);
+    }
+    return RPF_OK;
+}
+
+RPF_API int rpf_schedule_stop(rpf_device *dev, int channel){
+    struct channel *ch = rpf_channel(dev, channel);
+    
+    if(ch == NULL){
+        return RPF_EINVAL;
+    }
+    sched_stop(&ch->sched);
+    return RPF_OK;
+}
+
+RPF_API int rpf_solve(rpf_device *dev, const struct rpf_trap_model *model, struct rpf_solution *solution){
+    struct lqr_model m;
+    struct lqr_result res;
+    
+    if(model == NULL || solution == NULL){
+        return RPF_EINVAL;
+    }
+    m.f0 = model->f0;
+    m.gamma = model->gamma;
+    m.fs = model->fs;
+    m.loop_delay = model->loop_delay;
+    m.b = model->b;
+    m.q_x = model->q_x;
+    m.q_v = model->q_v;
+    m.r = model->r;
+    if(lqr_solve(&m, &res, (dev != NULL) ? dev->log : NULL) != 0){
+        return RPF_EINVAL;
+    }
+    solution->gains.k_p = res.k_p;
+    solution->gains.k_d = res.k_d;
+    solution->gains.delay = res.delay;
+    solution->kp = res.kp;
+    solution->kd = res.kd;
+    memcpy(solution->P, res.P, sizeof(solution->P));
+    memcpy(solution->K, res.K, sizeof(solution->K));
+    solution->rho = res.rho;
+    solution->iterations = res.iterations;
+    solution->saturated = res.saturated;
+    return RPF_OK;
+}
+
+RPF_API int rpf_sampler_rate(rpf_device *dev, int channel, uint32_t rate_hz){
+    struct channel *ch = rpf_channel(dev, channel);
+    uint32_t rate;
+    
+    if(ch == NULL){
+        return RPF_EINVAL;
+    }
+    sat_rate((long int) rate_hz, &rate);
+    atomic_store(&ch->sampler.rate_hz, rate);
+    atomic_store(&ch->sampler.missed, 0);
+    // the filter decimations depend on the rate
+    filterbank_config(&ch->fb, rate, ch->n_filter, ch->filter_s, dev->log);
+    return RPF_OK;
+}
+
+// Copy and reset the wake-up latency histogram
+//
+RPF_API int rpf_sampler_jitter(rpf_device *dev, int channel, uint64_t count[RPF_JITTER_BINS], uint64_t *max_ns){
+    struct channel *ch = rpf_channel(dev, channel);
+    
+    if(ch == NULL || count == NULL || max_ns == NULL){
+        return RPF_EINVAL;
+    }
+    for(int b = 0; b < JITTER_BINS; b++){
+        count[b] = atomic_exchange(&ch->sampler.jitter.count[b], 0);
+    }
+    *max_ns = atomic_exchange(&ch->sampler.jitter.max_ns, 0);
+    return RPF_OK;
+}
+
+RPF_API int rpf_filter_config(rpf_device *dev, int channel, int n, const double period_s[]){
+    struct channel *ch = rpf_channel(dev, channel);
+    
+    if(ch == NULL || n < 0 || n > FILTER_STAGES || (period_s == NULL && n > 0)){
+        return RPF_EINVAL;
+    }
+    for(int k = 0; k < n; k++){
+        if(!(period_s[k] > 0) || (k > 0 && !(period_s[k] > period_s[k - 1]))){
+            return RPF_EINVAL;
+        }
+    }
+    ch->n_filter = n;
+    memcpy(ch->filter_s, period_s, n*sizeof(double));
+    if(filterbank_config(&ch->fb, atomic_load(&ch->sampler.rate_hz), ch->n_filter, ch->filter_s, dev->log) != 0){
+        return RPF_EINVAL;
+    }
+    return RPF_OK;
+}
+
+RPF_API int rpf_filter_read(rpf_device *dev, int channel, int k, struct rpf_filtered *out){
+    struct channel *ch = rpf_channel(dev, channel);
+    struct filter_output res;
+    
+    if(ch == NULL || out == NULL || k < 0 || k >= ch->fb.n_stages){
+        return RPF_EINVAL;
+    }
+    memset(out, 0, sizeof(*out));
+    out->period_s = ch->fb.period_s[k];
+    if(filterbank_read(&ch->fb, k, &res) != 0){
+        return RPF_ENODATA;
+    }
+    out->energy = res.energy;
+    out->t_ns = res.t_ns;
+    out->saturated = res.saturated;
+    return RPF_OK;
+}
+
+RPF_API int rpf_watchdog_get(rpf_device *dev, int channel, struct rpf_watchdog *cfg){
+    struct channel *ch = rpf_channel(dev, channel);
+    // (the limits of the last start, kept while stopped)
+    const struct watchdog_config *wd_cfg;
+    
+    if(ch == NULL || cfg == NULL){
+        return RPF_EINVAL;
+    }
+    wd_cfg = (ch->wd.regs != NULL) ? &ch->wd.cfg : &wd_default;
+    cfg->threshold = wd_cfg->threshold;
+    cfg->slope_max = wd_cfg->slope_max;
+    cfg->slope_window_s = wd_cfg->slope_window_s;
+    cfg->debounce = wd_cfg->debounce;
+    cfg->rate_hz = wd_cfg->rate_hz;
+    return RPF_OK;
+}
+
+// Restart the watchdog from the registers as they are (a trip zeroed
+// the PID word behind the shadows)
+//
+RPF_API int rpf_watchdog_start(rpf_device *dev, int channel, const struct rpf_watchdog *cfg){
+    struct channel *ch = rpf_channel(dev, channel);
+    struct watchdog_config wd_cfg;
+    
+    if(ch == NULL || cfg == NULL){
+        return RPF_EINVAL;
+    }
+    wd_cfg.threshold = cfg->threshold;
+    wd_cfg.slope_max = cfg->slope_max;
+    wd_cfg.slope_window_s = cfg->slope_window_s;
+    wd_cfg.debounce = cfg->debounce;
+    wd_cfg.rate_hz = cfg->rate_hz;
+    if(!(wd_cfg.slope_max >= 0 && wd_cfg.slope_window_s > 0 && wd_cfg.debounce > 0 && wd_cfg.rate_hz >= 1)){
+        return RPF_EINVAL;
+    }
+    if(tuner_busy(&ch->tuner)){
+        return RPF_EBUSY;
+    }
+    watchdog_stop(&ch->wd);
+    regs_sync(&ch->regs);
+    if(watchdog_start(&ch->wd, &ch->regs, &wd_cfg) != 0){
+        return RPF_EIO;
+    }
+    return RPF_OK;
+}
+
+RPF_API int rpf_watchdog_stop(rpf_device *dev, int channel){
+    struct channel *ch = rpf_channel(dev, channel);
+    
+    if(ch == NULL){
+        return RPF_EINVAL;
+    }
+    if(tuner_busy(&ch->tuner)){
+        return RPF_EBUSY;
+    }
+    watchdog_stop(&ch->wd);
+    atomic_store(&ch->wd.tripped, 0);
+    regs_sync(&ch->regs);
+    return RPF_OK;
+}
+
+RPF_API int rpf_watchdog_arm(rpf_device *dev, int channel){
+    struct channel *ch = rpf_channel(dev, channel);
+    
+    if(ch == NULL || !atomic_load(&ch->wd.running)){
+        return RPF_EINVAL;
+    }
+    watchdog_arm(&ch->wd, &ch->regs);
+    return RPF_OK;
+}
+
+RPF_API int rpf_watchdog_report(rpf_device *dev, int channel){
+    struct channel *ch = rpf_channel(dev, channel);
+    
+    if(ch == NULL){
+        return RPF_EINVAL;
+    }
+    if(ch->wd.regs == NULL || watchdog_print(&ch->wd) != 0){
+        return RPF_ENODATA;
+    }
+    return RPF_OK;
+}
+
+RPF_API int rpf_profile_conditions(rpf_device *dev, const double conditions[RPF_CONDITIONS]){
+    if(dev == NULL || dev->profiles.path == NULL || conditions == NULL){
+        return RPF_EINVAL;
+    }
+    for(int k = 0; k < PROFILE_CONDITIONS; k++){
+        if(!(conditions[k] >= 0)){
+            return RPF_EINVAL;
+        }
+    }
+    memcpy(dev->profiles.cond, conditions, sizeof(dev->profiles.cond));
+    return RPF_OK;
+}
+
+RPF_API int rpf_profile_count(rpf_device *dev){
+    if(dev == NULL || dev->profiles.path == NULL){
+        return RPF_EINVAL;
+    }
+    return dev->profiles.n;
+}
+
+RPF_API int rpf_profile_nearest(rpf_device *dev, int channel, struct rpf_profile *profile, double *distance){
+    struct channel *ch = rpf_channel(dev, channel);
+    double dist;
+    int i_prof;
+    
+    if(ch == NULL || dev->profiles.path == NULL || profile == NULL){
+        return RPF_EINVAL;
+    }
+    i_prof = profile_nearest(&dev->profiles, ch->regs.ch.name, &dist);
+    if(i_prof < 0){
+        return RPF_ENODATA;
+    }
+    rpf_profile_from(&dev->profiles.p[i_prof], profile);
+    if(distance != NULL){
+        *distance = dist;
+    }
+    return RPF_OK;
+}
+
+// Write the nearest profile's gains and start 'mlauto' from its k_d
+//
+RPF_API int rpf_profile_load(rpf_device *dev, int channel, struct rpf_profile *profile){
+    struct channel *ch = rpf_channel(dev, channel);
+    struct profile *p;
+    double dist;
+    int i_prof;
+    
+    if(ch == NULL || dev->profiles.path == NULL){
+        return RPF_EINVAL;
+    }
+    i_prof = profile_nearest(&dev->profiles, ch->regs.ch.name, &dist);
+    if(i_prof < 0){
+        return RPF_ENODATA;
+    }
+    if(tuner_busy(&ch->tuner)){
+        return RPF_EBUSY;
+    }
+    if(watchdog_tripped(&ch->wd)){
+        return RPF_ETRIPPED;
+    }
+    p = &dev->profiles.p[i_prof];
+    if(regs_set_all(&ch->regs, p->k_p, p->k_d, p->delay) != 0){
+        return watchdog_tripped(&ch->wd) ? RPF_ETRIPPED : RPF_EIO;
+    }
+    ch->tuner.seed = *p;
+    ch->tuner.seeded = 1;
+    if(profile != NULL){
+        rpf_profile_from(p, profile);
+    }
+    return RPF_OK;
+}
+
+RPF_API int rpf_profile_save(rpf_device *dev, int channel, struct rpf_profile *profile){
+    struct channel *ch = rpf_channel(dev, channel);
+    
+    if(ch == NULL || dev->profiles.path == NULL){
+        return RPF_EINVAL;
+    }
+    if(profile_save_recent(&dev->profiles, &ch->regs, &ch->sampler, &ch->tuner.seed) != 0){
+        return RPF_EIO;
+    }
+    ch->tuner.seeded = 1;
+    if(profile != NULL){
+        rpf_profile_from(&ch->tuner.seed, profile);
+    }
+    return RPF_OK;
+}
+
+// Lock memory, then pin the threads of every channel and the caller
+//
+// Memory is locked first so that nothing pages in later; when that
+// fails the threads are still pinned. Gain schedulers started later
+// are pinned by rpf_schedule_start.
+//
+RPF_API int rpf_realtime(rpf_device *dev, int cpu, int priority){
+    int ok = 1;
+    
+    if(dev == NULL || cpu < 0 || cpu >= CPU_SETSIZE || priority < 2 || priority > 99){
+        return RPF_EINVAL;
+    }
+    rt_setup_process(dev->recording ? &dev->tel : NULL, dev->log);
+    for(int c = 0; c < dev->map.n; c++){
+        struct channel *ch = &dev->ch[c];
+        if(atomic_load(&ch->wd.running)){
+            rt_setup_thread(ch->wd.thread, cpu, (priority < 99) ? priority + 1 : 99, dev->log);
+        }
+        ok &= (rt_setup_thread(ch->sampler.thread, cpu, priority, dev->log) == 0);
+        if(ch->sched.regs != NULL && atomic_load(&ch->sched.running)){
+            rt_setup_thread(ch->sched.thread, cpu, priority, dev->log);
+        }
+    }
+    if(!ok || rt_setup_thread(pthread_self(), cpu, priority - 1, dev->log) != 0){
+        return RPF_EIO;
+    }
+    dev->rt.enabled = 1;
+    dev->rt.cpu = cpu;
+    dev->rt.priority = priority;
+    return RPF_OK;
+}
+
+// Serve the control socket (blocking; the daemon's messages go to the log)
+//
+RPF_API int rpf_serve(rpf_device *dev, const char *socket_path){
+    if(dev == NULL || socket_path == NULL){
+        return RPF_EINVAL;
+    }
+    daemon_running = 1;
+    if(daemon_run(dev->ch, dev->map.n, socket_path, dev->log) != 0){
+        return RPF_EIO;
+    }
+    return RPF_OK;
+}
+
+RPF_API long int rpf_metrics(char *buf, size_t size){
+    char *text;
+    size_t len;
+    FILE *out = open_memstream(&text, &len);
+    
+    if(out == NULL){
+        return RPF_ENOMEM;
+    }
+    metrics_write(out);
+    fclose(out);
+    if(buf != NULL && size > 0){
+        memcpy(buf, text, (len < size) ? len : size - 1);
+        buf[(len < size) ? len : size - 1] = '\0';
+    }
+    free(text);
+    return (long int) len;
+}
+
+// Replay a trace with the default tuner settings (no sweep file)
+//
+// The model, tuner and surrogate are allocated here: several MB, too
+// much for the caller's stack
+//
+RPF_API int rpf_replay(const struct rpf_replay_options *opt){
+    struct rpf_replay_options o = {sizeof(struct rpf_replay_options), NULL, 0, NULL, 0, 0, NULL, NULL};
+    struct dwell_config dwell = dwell_default;
+    struct spsa_config spsa = spsa_default;
+    struct bo_config bo = bo_default;
+    struct caldelay_config cal = cal_default;
+    struct sweep_config sweep = sweep_default;
+    char tuners[DAEMON_LINE_MAX];
+    struct replay_model *model;
+    struct tuner *t;
+    struct gp *gp;
+    struct rpf_log sink;
+    FILE *log = NULL;
+    int err = RPF_OK;
+    
+    if(opt != NULL){
+        memcpy(&o, opt, (opt->size < sizeof(o)) ? opt->size : sizeof(o));
+    }
+    if(o.trace_file == NULL || o.runs < 0
+       || snprintf(tuners, sizeof(tuners), "%s", (o.tuners != NULL) ? o.tuners : REPLAY_DEFAULT_TUNERS) >= (int) sizeof(tuners)){
+        return RPF_EINVAL;
+    }
+    model = calloc(1, sizeof(struct replay_model));
+    t = calloc(1, sizeof(struct tuner));
+    gp = calloc(1, sizeof(struct gp));
+    if(o.log != NULL){
+        log = rpf_log_open(&sink, o.log, o.log_ctx);
+    }
+    if(model == NULL || t == NULL || gp == NULL || (o.log != NULL && log == NULL)){
+        err = RPF_ENOMEM;
+    } else if(replay_load(model, o.trace_file, o.channel, &dwell, log) != 0){
+        err = RPF_EIO;
+    } else {
+        sweep.path[0] = '\0';
+        t->spsa_cfg = &spsa;
+        t->bo_cfg = &bo;
+        t->cal_cfg = &cal;
+        t->sweep_cfg = &sweep;
+        t->gp = gp;
+        replay_compare(model, t, tuners, (o.runs > 0) ? o.runs : REPLAY_DEFAULT_RUNS, o.seed, log);
+    }
+    if(log != NULL){
+        fclose(log);
+    }
+    free(gp);
+    free(t);
+    free(model);
+    return err;
+}
@@ -0,0 +1,400 @@
+/* *********************************************************************
+ * librpfeedback: C API of the feedback control program
+ * *********************************************************************
+ * COMMENTS:
+ * Register access, energy streaming, the tuners, extremum seeking,
+ * gain scheduling, the watchdog and the daemon of the feedback
+ * control, for calling in-process from sequencers and analysis code
+ * instead of driving the program through a terminal or the daemon
+ * socket. The core is rp_feedback.c; the keyboard interface
+ * (cpu_opt_control.c) is one client of it. Build the library with
+ *     gcc -O2 -shared -fPIC -fvisibility=hidden rp_feedback.c
+ *         -o librpfeedback.so -lm -lpthread
+ * and only the functions below are exported. Link with -lrpfeedback.
+ *
+ * All functions return RPF_OK (0) or a negative RPF_E* code (see
+ * rpf_strerror). A device is used from one thread at a time; each
+ * channel keeps its own energy sampler thread in the background. The
+ * library prints nothing: messages (problems opening the map, the
+ * registers or the recorder, refused gain writes, tuner progress) go
+ * to the log callback of the options, if any.
+ * Compatibility: within an API version, functions are only added and
+ * option structures only grow at the end (their size field tells the
+ * library which fields the caller knows).
+ * *********************************************************************
+ */
+
+#ifndef RP_FEEDBACK_H
+#define RP_FEEDBACK_H
+
+#include <stddef.h>      // size_t
+#include <stdint.h>      // more integer lengths
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+////////////////////////////////////////////////////////////////////////
+// Version and visibility
+#define RPF_API_VERSION     1
+#define RPF_API             __attribute__((visibility("default")))
+
+////////////////////////////////////////////////////////////////////////
+// Error codes
+#define RPF_OK              0
+#define RPF_EINVAL          -1          // invalid argument (channel, tuner, option)
+#define RPF_EIO             -2          // registers, map or recorder could not be opened, or a register write failed
+#define RPF_ENOMEM          -3          // out of memory
+#define RPF_EBUSY           -4          // a tuner owns the registers of the channel
+#define RPF_ETRIPPED        -5          // the watchdog killed the feedback (re-arm to go on)
+#define RPF_ENODATA         -6          // no energy samples, or nothing to report
+
+////////////////////////////////////////////////////////////////////////
+// Fields of rpf_set
+#define RPF_KP              0x1
+#define RPF_KD              0x2
+#define RPF_DELAY           0x4
+#define RPF_ALL             (RPF_KP | RPF_KD | RPF_DELAY)
+
+////////////////////////////////////////////////////////////////////////
+// Tuners (same numbers as the tuner word of telemetry records)
+#define RPF_TUNER_MLAUTO    1           // secant iteration on k_d
+#define RPF_TUNER_SPSA      2           // joint k_p, k_d, delay (SPSA)
+#define RPF_TUNER_BO        3           // joint k_p, k_d, delay (Bayesian optimization)
+#define RPF_TUNER_DELAY     4           // delay calibration at fixed k_p, k_d
+#define RPF_TUNER_SWEEP     7           // energy landscape over (k_p, k_d), to a CSV file
+
+////////////////////////////////////////////////////////////////////////
+// Sizes
+#define RPF_FILTER_STAGES   4           // max filtered energy outputs
+#define RPF_JITTER_BINS     32          // sampler wake-up latency bins (powers of 2 ns)
+#define RPF_SWEEP_DELAYS    8           // max delay slices of a sweep
+#define RPF_CONDITIONS      3           // trap conditions: f0, pressure, laser power
+
+////////////////////////////////////////////////////////////////////////
+// Types
+
+// Opaque device: the register map and every channel's registers,
+// sampler, watchdog and tuner
+typedef struct rpf_device rpf_device;
+
+// Device options (NULL: /dev/mem, one channel at the default addresses)
+struct rpf_options {
+    size_t size;                // sizeof(struct rpf_options)
+    const char *sim_file;       // simulated register file (NULL: /dev/mem)
+    const char *map_file;       // register map (NULL: one channel, default addresses)
+    int verify;                 // 1: read registers back after every write
+    const char *record_file;    // telemetry file (NULL: no recording)
+    long int record_size;       // telemetry ring capacity (records, 0: default)
+    uint32_t wd_threshold;      // watchdog energy threshold (0: no watchdog)
+    double wd_slope;            // watchdog energy slope limit (1/s, 0: off)
+    const char *metrics_file;   // Prometheus metrics file (NULL: none)
+    double metrics_period;      // metrics file rewrite period (s, 0: 1 s)
+    void (*log)(void *ctx, const char *line);   // messages, one line per call, possibly from
+                                // the channel threads (NULL: discarded)
+    void *log_ctx;              // first argument of log
+    const char *profile_file;   // store of tuned gains by trap conditions (NULL: none)
+    double conditions[RPF_CONDITIONS]; // f0 (Hz), pressure (mbar), laser power (mW); 0 unknown
+};
+
+// Gains and delay of a channel (register values)
+struct rpf_gains {
+    int32_t k_p;                // -8191 to 8191
+    int32_t k_d;                // -8191 to 8191
+    int32_t delay;              // 0 to 500 cycles
+};
+
+// One energy register read
+struct rpf_sample {
+    uint64_t t_ns;              // CLOCK_MONOTONIC time of the read (ns)
+    uint32_t energy;            // energy field
+};
+
+// One filtered energy output
+struct rpf_filtered {
+    double period_s;            // output period (s)
+    double energy;              // filtered energy
+    uint64_t t_ns;              // time of its last input sample (ns)
+    uint32_t saturated;         // saturated or wrapped raw samples in its window
+};
+
+// Settings of the tuners, extremum seeking and gain scheduling, shared
+// by the channels of a device
+struct rpf_settings {
+    size_t size;                // sizeof(struct rpf_settings)
+    // dwell engine (every energy measurement of the tuners)
+    double settle_s;            // wait after a gain change before sampling (s)
+    double min_dwell_s;         // minimum sampling time (s)
+    double max_dwell_s;         // hard maximum sampling time (s)
+    double z;                   // two-sided confidence bound (e.g. 2.58 for 99%)
+    double resolution;          // energy difference treated as zero
+    int predict;                // 1: predict the steady state from the transient
+    // SPSA
+    double spsa_a, spsa_c, spsa_A, spsa_alpha, spsa_gamma; // gain sequences (a = 0: automatic)
+    int spsa_iter;              // iterations
+    // Bayesian optimization
+    double bo_length;           // kernel length scale (normalized units)
+    double bo_noise;            // relative noise variance
+    double bo_ei_min;           // stop when the expected improvement is below (energy units)
+    int bo_eval;                // max energy evaluations (1-64)
+    double bo_lo[3], bo_hi[3];  // bounds of k_p, k_d and delay
+    // delay calibration
+    double cal_lo, cal_hi;      // delays scanned (cycles)
+    int cal_points;             // points of the coarse scan (3-32)
+    double cal_tol;             // final bracket width (cycles)
+    // energy-landscape sweep
+    double sweep_kp[2];         // k_p region
+    double sweep_kd[2];         // k_d region
+    int sweep_grid;             // coarse grid points per axis
+    int sweep_levels;           // refinement levels
+    double sweep_tol;           // log-energy change across a cell that refines it
+    int sweep_points;           // measurement budget (all slices)
+    int sweep_delays;           // delay slices (0: current delay)
+    double sweep_delay[RPF_SWEEP_DELAYS];
+    char sweep_file[256];       // CSV surface ("": not written)
+    // extremum seeking
+    double es_freq_hz;          // dither frequency of k_d
+    double es_amp[3];           // dither amplitudes of k_p, k_d and delay (0: fixed)
+    double es_gain;             // adaptation gain
+    double es_max_rate;         // max drift of the center (amplitudes/s)
+    double es_phase_deg;        // demodulation phase lag (deg)
+    // gain scheduling
+    double sched_hysteresis;    // leave a regime below threshold*(1 - hysteresis)
+    int sched_debounce;         // consecutive polls in the new regime before switching
+    uint32_t sched_rate_hz;     // energy polling rate (Hz)
+};
+
+// Watchdog limits of a channel
+struct rpf_watchdog {
+    uint32_t threshold;         // trip when the energy exceeds this (counts)
+    double slope_max;           // trip when the energy rises faster (counts/s, 0: off)
+    double slope_window_s;      // time constant of the slope estimate (s)
+    int debounce;               // consecutive samples over a limit needed to trip
+    uint32_t rate_hz;           // polling rate (Hz)
+};
+
+// One energy measurement of the dwell engine
+struct rpf_measurement {
+    double energy;              // mean energy (or the predicted steady state)
+    double var;                 // variance, such that var/samples is the squared standard error
+    long int samples;           // samples
+    double dwell_s;             // time, settling included (s)
+    int resolved;               // 1 if stopped by the sequential test, 0 at the max dwell
+    int predicted;              // 1 if energy is the steady state predicted from the transient
+    double tau_s;               // fitted relaxation time if predicted (s)
+};
+
+// State of a channel
+struct rpf_status {
+    size_t size;                // sizeof(struct rpf_status)
+    int tuner;                  // RPF_TUNER_* running (0: none)
+    uint32_t evaluations;       // points written by the tuner running or run last
+    struct rpf_gains point;     // point being measured
+    int measured;               // 1 if last holds a measurement
+    struct rpf_measurement last; // last measurement of the tuner (its result, once finished)
+    double tune_time_s;         // time of all its measurements (s)
+    int seeded;                 // 1 if 'mlauto' starts from the k_d of seed
+    struct rpf_gains seed;      // gains of the profile loaded or saved last
+    int es_running;             // 1 while extremum seeking runs
+    double es_time_s;           // time extremum seeking has run (s)
+    long int es_samples;        // energy samples it used
+    int sched_running;          // 1 while gain scheduling runs
+    uint64_t sched_transitions; // regime changes so far
+    int wd_running;             // 1 while the watchdog runs
+    int wd_tripped;             // 1 after a trip, until re-armed
+    uint32_t rate_hz;           // energy sampling rate (Hz)
+    uint64_t missed;            // sampler deadlines missed
+    int filter_outputs;         // filtered energy outputs configured
+    uint64_t reg_writes;        // register words written
+    uint64_t reg_coalesced;     // writes skipped because the word was unchanged
+    uint64_t reg_mismatches;    // read-back mismatches
+};
+
+// Trap model and weights of the LQR design
+struct rpf_trap_model {
+    double f0;                  // trap frequency (Hz)
+    double gamma;               // damping rate (1/s)
+    double fs;                  // controller sample rate (Hz)
+    double loop_delay;          // loop delay, excluding the delay register (FPGA cycles)
+    double b;                   // acceleration per register count and unit x (1/s^2)
+    double q_x, q_v;            // state weights (position, velocity)
+    double r;                   // input weight
+};
+
+// LQR design of a trap model
+struct rpf_solution {
+    struct rpf_gains gains;     // register values
+    double kp, kd;              // unquantized gains
+    double P[2][2];             // Riccati solution
+    double K[2];                // optimal state feedback u = -K [x, v]
+    double rho;                 // closed-loop spectral radius
+    int iterations;             // doubling iterations
+    int saturated;              // 1 if a gain hit +-8191
+};
+
+// Tuned gains saved for a channel at some trap conditions
+struct rpf_profile {
+    char channel[16];           // channel name ("" with the default map)
+    double conditions[RPF_CONDITIONS]; // f0 (Hz), pressure (mbar), laser power (mW); 0 unknown
+    double energy;              // mean energy at these gains
+    int64_t t_saved;            // time saved (s since the epoch)
+    struct rpf_gains gains;     // register values
+};
+
+// Offline replay of a recorded trace
+struct rpf_replay_options {
+    size_t size;                // sizeof(struct rpf_replay_options)
+    const char *trace_file;     // telemetry file recorded while tuning
+    int channel;                // channel of the trace replayed
+    const char *tuners;         // comma-separated tuners (NULL: mlauto,spsa,bo,delay)
+    int runs;                   // runs per tuner (0: 20)
+    unsigned int seed;          // random seed of the first run
+    void (*log)(void *ctx, const char *line);   // the comparison table, one line per call
+    void *log_ctx;              // first argument of log
+};
+
+////////////////////////////////////////////////////////////////////////
+// Functions
+
+// API version the library was built with (compare with RPF_API_VERSION)
+RPF_API int rpf_api_version(void);
+
+// Message for an error code
+RPF_API const char *rpf_strerror(int err);
+
+// Map the registers and start the samplers (and watchdogs) of every channel
+RPF_API int rpf_open(const struct rpf_options *opt, rpf_device **dev);
+
+// Stop tuners, samplers and watchdogs and unmap the registers
+RPF_API void rpf_close(rpf_device *dev);
+
+// Number of channels, and the name of one ("" without a map file)
+RPF_API int rpf_channels(rpf_device *dev);
+RPF_API const char *rpf_channel_name(rpf_device *dev, int channel);
+
+// Gains and delay written last
+RPF_API int rpf_get(rpf_device *dev, int channel, struct rpf_gains *gains);
+
+// Write the fields in mask in one register commit; gains gets the
+// saturated values written
+RPF_API int rpf_set(rpf_device *dev, int channel, struct rpf_gains *gains, unsigned int mask);
+
+// Energy samples since the previous call (or since rpf_open), oldest
+// first, at most max; *n gets the number copied and *lost (may be NULL)
+// adds the samples overwritten before they could be read
+RPF_API int rpf_energy_read(rpf_device *dev, int channel, struct rpf_sample *buf, size_t max, size_t *n, uint64_t *lost);
+
+// Mean and variance of the energy over the last window_ms milliseconds
+RPF_API int rpf_energy_stats(rpf_device *dev, int channel, double window_ms, double *mean, double *var, long int *n);
+
+// Tuner settings (rpf_open starts with the defaults of the control
+// program); invalid settings are refused with RPF_EINVAL as a whole
+RPF_API int rpf_settings_get(rpf_device *dev, struct rpf_settings *settings);
+RPF_API int rpf_settings_set(rpf_device *dev, const struct rpf_settings *settings);
+
+// Measure the energy at the current gains with the dwell engine
+// (blocking; prev, may be NULL, is the measurement to resolve against)
+RPF_API int rpf_measure(rpf_device *dev, int channel, const struct rpf_measurement *prev, struct rpf_measurement *res);
+
+// State of a channel: tuner progress, extremum seeking, gain
+// scheduling, watchdog, sampler and register counters
+RPF_API int rpf_status(rpf_device *dev, int channel, struct rpf_status *status);
+
+// Report watchdog trips and gain-schedule transitions since the last
+// call to the log; returns how many were reported
+RPF_API int rpf_report(rpf_device *dev);
+
+// Start a tuner from the current gains and delay (RPF_TUNER_*, with the
+// settings of rpf_settings_set)
+RPF_API int rpf_tune_start(rpf_device *dev, int channel, int tuner);
+
+// Advance the tuner without blocking: returns 1 when it has finished
+// (the result is then written, see rpf_get), 0 while running, with
+// *next_ns (may be NULL) the CLOCK_MONOTONIC time of the next step due.
+// A tuner that stopped without writing its result returns
+// RPF_ETRIPPED, RPF_ENODATA (no energy samples or no result) or RPF_EIO
+// (read-back mismatch).
+RPF_API int rpf_tune_step(rpf_device *dev, int channel, uint64_t *next_ns);
+
+// Stop the tuner, keeping the registers as they are
+RPF_API int rpf_tune_stop(rpf_device *dev, int channel);
+
+// Continuous extremum seeking around the current gains, on its own
+// thread, until stopped (the gains it reached are kept)
+RPF_API int rpf_es_start(rpf_device *dev, int channel);
+RPF_API int rpf_es_stop(rpf_device *dev, int channel);
+
+// Gain scheduling by energy regime from a table file (lines: energy
+// threshold, k_p, k_d, delay, thresholds increasing), on its own
+// thread, until stopped. The regimes loaded go to the log.
+RPF_API int rpf_schedule_start(rpf_device *dev, int channel, const char *table_file);
+RPF_API int rpf_schedule_stop(rpf_device *dev, int channel);
+
+// LQR gains and delay for a trap model; nothing is written. dev (may be
+// NULL) gets the reason a model has no solution in its log.
+RPF_API int rpf_solve(rpf_device *dev, const struct rpf_trap_model *model, struct rpf_solution *solution);
+
+// Energy sampling rate (saturated to 1-100000 Hz); the filtered outputs
+// are reconfigured for it, those out of range disabled
+RPF_API int rpf_sampler_rate(rpf_device *dev, int channel, uint32_t rate_hz);
+
+// Sampler wake-up latency histogram since the last call: count[b]
+// latencies from 2^(b-1) to 2^b ns, and the largest one
+RPF_API int rpf_sampler_jitter(rpf_device *dev, int channel, uint64_t count[RPF_JITTER_BINS], uint64_t *max_ns);
+
+// Filtered energy outputs, periods increasing (up to RPF_FILTER_STAGES;
+// each one is rounded to a whole number of the previous)
+RPF_API int rpf_filter_config(rpf_device *dev, int channel, int n, const double period_s[]);
+
+// Latest value of filtered output k (RPF_ENODATA before the first,
+// with period_s set)
+RPF_API int rpf_filter_read(rpf_device *dev, int channel, int k, struct rpf_filtered *out);
+
+// Watchdog limits of a channel (the defaults if it never ran)
+RPF_API int rpf_watchdog_get(rpf_device *dev, int channel, struct rpf_watchdog *cfg);
+
+// (Re)start the watchdog with new limits from the current gains, or
+// stop it, clearing a trip
+RPF_API int rpf_watchdog_start(rpf_device *dev, int channel, const struct rpf_watchdog *cfg);
+RPF_API int rpf_watchdog_stop(rpf_device *dev, int channel);
+
+// Re-arm the watchdog of a channel after a trip
+RPF_API int rpf_watchdog_arm(rpf_device *dev, int channel);
+
+// Post-mortem snapshot of the last trip to the log (RPF_ENODATA: none)
+RPF_API int rpf_watchdog_report(rpf_device *dev, int channel);
+
+// Profile store (needs opt->profile_file): the trap conditions, the
+// number of profiles, the profile of a channel nearest to the
+// conditions (RPF_ENODATA: none, distance may be NULL), loading it
+// (writes its gains, 'mlauto' then starts from its k_d) and saving the
+// current gains with the recent mean energy
+RPF_API int rpf_profile_conditions(rpf_device *dev, const double conditions[RPF_CONDITIONS]);
+RPF_API int rpf_profile_count(rpf_device *dev);
+RPF_API int rpf_profile_nearest(rpf_device *dev, int channel, struct rpf_profile *profile, double *distance);
+RPF_API int rpf_profile_load(rpf_device *dev, int channel, struct rpf_profile *profile);
+RPF_API int rpf_profile_save(rpf_device *dev, int channel, struct rpf_profile *profile);
+
+// Real-time mode: lock memory (the telemetry ring stays unlocked), pin
+// the samplers, watchdogs, gain schedulers and the calling thread to
+// one core with SCHED_FIFO (watchdogs one priority above the samplers,
+// the caller one below); RPF_EIO if the scheduling could not be set
+RPF_API int rpf_realtime(rpf_device *dev, int cpu, int priority);
+
+// Serve the control socket of the daemon until SIGINT or SIGTERM
+RPF_API int rpf_serve(rpf_device *dev, const char *socket_path);
+
+// Compare the tuners offline on a recorded trace, without a device
+RPF_API int rpf_replay(const struct rpf_replay_options *opt);
+
+// Counters and latency histograms of every thread of the process in the
+// Prometheus text format, into buf (NUL-terminated, truncated to size);
+// returns the length of the whole text, so it can be fetched again with
+// a larger buffer
+RPF_API long int rpf_metrics(char *buf, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,246 @@
+/* *********************************************************************
+ * FPGA register layout of the feedback bitstream
+ * *********************************************************************
+ * COMMENTS:
+ * Shared by the control program and the simulated register backend
+ * (plant_sim.c), so both agree on where every word lives. A rig with
+ * several feedback channels (axes or boards) is described by a map
+ * file, one channel per line:
+ *     name delay_addr energy_addr pid_addr [energy_shift kp_shift kd_shift]
+ * with physical byte addresses (hex with 0x) and the bit positions of
+ * the 16-bit fields (default 0, 0 and 16, the single-channel layout).
+ * *********************************************************************
+ */
+
+#ifndef RP_REGS_H
+#define RP_REGS_H
+
+#include <errno.h>       // error codes
+#include <stdarg.h>      // variable arguments (messages)
+#include <stdint.h>      // more integer lengths
+#include <stdio.h>       // map file
+#include <stdlib.h>      // strtoul
+#include <string.h>      // strings package
+
+////////////////////////////////////////////////////////////////////////
+// Physical addresses (/dev/mem backend)
+#define RP_GPIO_BASE        0x41200000  // AXI GPIO: delay and energy
+#define RP_PID_BASE         0x42000000  // AXI GPIO: packed k_p/k_d
+
+////////////////////////////////////////////////////////////////////////
+// Offsets inside each block (bytes)
+#define RP_DELAY_OFFSET     0           // delay word, 16 lowest bits
+#define RP_ENERGY_OFFSET    8           // energy word, 16 lowest bits
+#define RP_PID_OFFSET       0           // k_d in 16 highest bits, k_p in 16 lowest
+
+////////////////////////////////////////////////////////////////////////
+// Simulated backend
+// The shared-memory file holds one page per distinct register page of
+// the map, in order of first use (channel by channel: delay, energy,
+// PID word). For the default map, page 0 mirrors the GPIO block and
+// page 1 the PID block.
+#define RP_SIM_FILE         "/dev/shm/rp_feedback_regs"
+
+////////////////////////////////////////////////////////////////////////
+// Register map
+#define RP_MAX_CHANNELS     8           // channels in a map file
+#define RP_NAME_MAX         16          // channel name length (terminator included)
+
+// Registers of one feedback channel
+// Delay and k_p/k_d words are written whole, so no two channels may
+// share them; an energy word may hold the fields of several channels.
+struct rp_channel {
+    char name[RP_NAME_MAX];     // channel name (empty for the default map)
+    uint32_t delay_addr;        // delay word, 16 lowest bits
+    uint32_t energy_addr;       // energy word
+    uint32_t pid_addr;          // packed k_p/k_d word
+    int energy_shift;           // bit position of the 16-bit energy field
+    int kp_shift;               // bit position of k_p in the PID word
+    int kd_shift;               // bit position of k_d in the PID word
+};
+
+// Register map of a rig
+struct rp_map {
+    int n;                                  // channels
+    struct rp_channel ch[RP_MAX_CHANNELS];
+};
+
+////////////////////////////////////////////////////////////////////////
+// Register packing
+
+// Pack k_p, k_d into the PID word
+static inline uint32_t rp_pack_pid(int16_t k_p, int16_t k_d){
+    return ((uint32_t) (uint16_t) k_d << 16) | (uint16_t) k_p;
+}
+
+// k_p from the PID word
+static inline int16_t rp_pid_kp(uint32_t reg){
+    return (int16_t) (reg & 0x0000FFFF);
+}
+
+// k_d from the PID word
+static inline int16_t rp_pid_kd(uint32_t reg){
+    return (int16_t) (reg >> 16);
+}
+
+// Pack k_p, k_d into the PID word of a channel
+static inline uint32_t rp_channel_pack(const struct rp_channel *ch, int16_t k_p, int16_t k_d){
+    return ((uint32_t) (uint16_t) k_p << ch->kp_shift) | ((uint32_t) (uint16_t) k_d << ch->kd_shift);
+}
+
+// 16-bit field at bit position shift of a word
+static inline uint16_t rp_field(uint32_t reg, int shift){
+    return (uint16_t) (reg >> shift);
+}
+
+////////////////////////////////////////////////////////////////////////
+// Map files
+
+// Single channel at the default addresses
+static inline void rp_map_default(struct rp_map *map){
+    struct rp_channel ch = {"", RP_GPIO_BASE + RP_DELAY_OFFSET, RP_GPIO_BASE + RP_ENERGY_OFFSET,
+                            RP_PID_BASE + RP_PID_OFFSET, 0, 0, 16};
+    map->n = 1;
+    map->ch[0] = ch;
+}
+
+// Report a map file problem to log (NULL: quiet)
+static inline void rp_map_report(FILE *log, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+static inline void rp_map_report(FILE *log, const char *fmt, ...){
+    va_list args;
+
+    if(log != NULL){
+        va_start(args, fmt);
+        vfprintf(log, fmt, args);
+        va_end(args);
+    }
+}
+
+// Load a map file; reports the problem to log (NULL: quiet) and returns
+// 1 if it is invalid
+static inline int rp_map_load(struct rp_map *map, const char *path, FILE *log){
+    FILE *f = fopen(path, "r");
+    char line[256], addr[3][32], *comment, *end;
+    unsigned long value[3];
+    struct rp_channel line_ch, *ch = &line_ch, *o;
+    int n_fields, n_line = 0, err = 0;
+
+    if(f == NULL){
+        rp_map_report(log, "Could not open %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    map->n = 0;
+    while(!err && fgets(line, sizeof(line), f) != NULL){
+        n_line++;
+        if((comment = strchr(line, '#')) != NULL){
+            *comment = '\0';
+        }
+        ch->energy_shift = 0;
+        ch->kp_shift = 0;
+        ch->kd_shift = 16;
+        n_fields = sscanf(line, "%15s %31s %31s %31s %d %d %d", ch->name, addr[0], addr[1], addr[2],
+                          &ch->energy_shift, &ch->kp_shift, &ch->kd_shift);
+        if(n_fields <= 0){
+            continue;
+        }
+        if(map->n == RP_MAX_CHANNELS){
+            rp_map_report(log, "%s:%d: more than %d channels\n", path, n_line, RP_MAX_CHANNELS);
+            err = 1;
+            break;
+        }
+        if(n_fields != 4 && n_fields != 7){
+            rp_map_report(log, "%s:%d: expected name, delay, energy and PID addresses [energy, k_p and k_d bit positions]\n", path, n_line);
+            err = 1;
+            break;
+        }
+        for(int k = 0; k < 3 && !err; k++){
+            value[k] = strtoul(addr[k], &end, 0);
+            if(*end != '\0' || value[k] > 0xFFFFFFFCUL || (value[k] & 3) != 0){
+                rp_map_report(log, "%s:%d: invalid address %s (32-bit aligned)\n", path, n_line, addr[k]);
+                err = 1;
+            }
+        }
+        if(!err && (ch->energy_shift < 0 || ch->energy_shift > 16 || ch->kp_shift < 0 || ch->kp_shift > 16 ||
+                    ch->kd_shift < 0 || ch->kd_shift > 16 || abs(ch->kp_shift - ch->kd_shift) < 16)){
+            rp_map_report(log, "%s:%d: fields must be 16 bits inside the word, k_p and k_d must not overlap\n", path, n_line);
+            err = 1;
+        }
+        if(err){
+            break;
+        }
+        ch->delay_addr = (uint32_t) value[0];
+        ch->energy_addr = (uint32_t) value[1];
+        ch->pid_addr = (uint32_t) value[2];
+        if(ch->delay_addr == ch->pid_addr || ch->energy_addr == ch->delay_addr || ch->energy_addr == ch->pid_addr){
+            rp_map_report(log, "%s:%d: delay, energy and PID words must differ\n", path, n_line);
+            err = 1;
+        }
+        for(int c = 0; c < map->n && !err; c++){
+            o = &map->ch[c];
+            if(0 == strcmp(o->name, ch->name)){
+                rp_map_report(log, "%s:%d: channel %s defined twice\n", path, n_line, ch->name);
+                err = 1;
+            } else if(ch->delay_addr == o->delay_addr || ch->delay_addr == o->pid_addr || ch->delay_addr == o->energy_addr ||
+                      ch->pid_addr == o->delay_addr || ch->pid_addr == o->pid_addr || ch->pid_addr == o->energy_addr ||
+                      ch->energy_addr == o->delay_addr || ch->energy_addr == o->pid_addr){
+                rp_map_report(log, "%s:%d: channel %s shares a written word with channel %s\n", path, n_line, ch->name, o->name);
+                err = 1;
+            }
+        }
+        if(!err){
+            map->ch[map->n++] = *ch;
+        }
+    }
+    fclose(f);
+    if(!err && map->n == 0){
+        rp_map_report(log, "%s: no channels\n", path);
+        err = 1;
+    }
+    return err;
+}
+
+// Index of the page holding addr among the distinct pages of the map,
+// in order of first use (the page layout of the simulated backend)
+static inline int rp_map_page(const struct rp_map *map, uint32_t addr, size_t page){
+    uint64_t seen[3*RP_MAX_CHANNELS], p;
+    int n = 0, known;
+
+    for(int c = 0; c < map->n; c++){
+        uint32_t words[3] = {map->ch[c].delay_addr, map->ch[c].energy_addr, map->ch[c].pid_addr};
+        for(int k = 0; k < 3; k++){
+            p = words[k]/page;
+            known = 0;
+            for(int i = 0; i < n; i++){
+                if(seen[i] == p){
+                    known = 1;
+                    if(p == addr/page){
+                        return i;
+                    }
+                }
+            }
+            if(!known){
+                if(p == addr/page){
+                    return n;
+                }
+                seen[n++] = p;
+            }
+        }
+    }
+    return n;
+}
+
+// Number of distinct register pages of the map
+static inline int rp_map_pages(const struct rp_map *map, size_t page){
+    int n = 0;
+
+    for(int c = 0; c < map->n; c++){
+        uint32_t words[3] = {map->ch[c].delay_addr, map->ch[c].energy_addr, map->ch[c].pid_addr};
+        for(int k = 0; k < 3; k++){
+            // a page seen for the first time gets the next index
+            n += (rp_map_page(map, words[k], page) == n);
+        }
+    }
+    return n;
+}
+
+#endif
@@ -0,0 +1,57 @@
+/* *********************************************************************
+ * Binary telemetry file layout
+ * *********************************************************************
+ * COMMENTS:
+ * Shared by the recorder in the control program (--record) and the
+ * reader tool (telemetry_dump.c). The file is preallocated: one header
+ * page followed by a ring of fixed-size records. Record i (counting
+ * from 0 since the start of the run) lives in slot i % capacity and is
+ * valid when its seq field equals the low 32 bits of i + 1; head in the
+ * header is the number of records ever claimed. With several channels,
+ * each has its own sampler thread claiming records from the same ring.
+ * *********************************************************************
+ */
+
+#ifndef RP_TELEMETRY_H
+#define RP_TELEMETRY_H
+
+#include <stdint.h>      // more integer lengths
+#include <stdatomic.h>   // head shared with live readers
+
+////////////////////////////////////////////////////////////////////////
+// File layout
+#define RP_TEL_MAGIC        "RPTEL001"  // 8 bytes, no terminator stored
+#define RP_TEL_VERSION      2           // 2: channel field, head counts claimed records
+#define RP_TEL_HEADER_SIZE  4096        // records start at this offset
+
+////////////////////////////////////////////////////////////////////////
+// Tuner word of a record
+#define RP_TEL_TUNER_ACTIVE 0x8000      // set while the tuner is running
+#define RP_TEL_TUNER_KIND   0x00FF      // 0 none, 1 mlauto, 2 spsa, 3 bo, 4 delay, 5 es, 6 schedule, 7 sweep
+
+////////////////////////////////////////////////////////////////////////
+// Types
+
+// File header (first page)
+struct rp_tel_header {
+    char magic[8];              // RP_TEL_MAGIC
+    uint32_t version;           // RP_TEL_VERSION
+    uint32_t record_size;       // sizeof(struct rp_tel_record)
+    uint64_t capacity;          // records in the ring
+    uint64_t t_start_ns;        // CLOCK_MONOTONIC time the file was created (ns)
+    _Atomic uint64_t head;      // records ever claimed
+};
+
+// One energy sample with the settings it was taken at (32 bytes)
+struct rp_tel_record {
+    uint64_t t_ns;              // CLOCK_MONOTONIC time of the read (ns)
+    uint32_t seq;               // low 32 bits of record index + 1
+    uint32_t energy;            // raw energy word
+    uint32_t pid;               // packed k_p/k_d word
+    uint32_t delay;             // delay word
+    uint32_t iter;              // tuner evaluation index
+    uint16_t tuner;             // tuner kind | RP_TEL_TUNER_ACTIVE
+    uint16_t channel;           // channel index in the register map (0 without --map)
+};
+
+#endif
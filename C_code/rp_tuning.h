@@ -0,0 +1,78 @@
+/* *********************************************************************
+ * Tuning steps shared by the control program and the simulators
+ * *********************************************************************
+ * COMMENTS:
+ * The 'ml'/'mlauto' secant update and start points live here so that
+ * mc_sim.c and the step-by-step 'ml' routine of the keyboard interface
+ * drive exactly the same update as the tuner of rp_feedback.c.
+ * *********************************************************************
+ */
+
+#ifndef RP_TUNING_H
+#define RP_TUNING_H
+
+#include <math.h>        // math functions
+
+////////////////////////////////////////////////////////////////////////
+// ML routine settings
+#define ML_K0               -1          // first k_d of the routine
+#define ML_K1               -5          // second k_d of the routine
+#define ML_KD_MIN           -1000       // lowest k_d the routine may use
+#define ML_KD_MAX           0           // highest k_d the routine may use
+#define ML_ENERGY_TOL       1           // 'mlauto' stops when |energy1 - energy0| <= tol
+
+////////////////////////////////////////////////////////////////////////
+// Functions
+
+// Gradient descent (secant) step of the ML routines
+//
+// k0, k1 are the previous and current k_d, energy0, energy1 the energies
+// measured at them. On return k0 holds the current k_d and k1 the next one.
+//
+static inline int ml_secant_step(float *k0, float *k1, float energy0, float energy1){
+    float k_tmp = *k1;
+    float dif_k = *k1 - *k0;
+    if(dif_k == 0){
+        dif_k = 1;
+    }
+    *k1 = *k1 - 0.2*(energy1 - energy0)/(dif_k);
+    *k0 = k_tmp;
+    // end function normally
+    return 0;
+}
+
+// Clamp k_d of the ML routines, just in case k1 is too large
+//
+static inline int ml_clamp_kd(float *k1){
+    if(*k1 > ML_KD_MAX){
+        *k1 = ML_KD_MAX;
+    } else if(*k1 < ML_KD_MIN){
+        *k1 = ML_KD_MIN;
+    }
+    // end function normally
+    return 0;
+}
+
+// First two k_d of the ML routines, from k_start (ML_K0, or the k_d
+// of a saved profile so that a retune starts near the last optimum)
+//
+static inline int ml_start_kd(float k_start, float *k0, float *k1){
+    *k0 = k_start;
+    *k1 = *k0 + (ML_K1 - ML_K0);
+    ml_clamp_kd(k0);
+    ml_clamp_kd(k1);
+    if(*k1 == *k0){
+        // start at the k_d limit: step the other way
+        *k1 = *k0 - (ML_K1 - ML_K0);
+    }
+    // end function normally
+    return 0;
+}
+
+// Stop criterion of 'mlauto'
+//
+static inline int ml_converged(float energy0, float energy1){
+    return fabs(energy1 - energy0) <= ML_ENERGY_TOL;
+}
+
+#endif
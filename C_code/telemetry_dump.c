@@ -0,0 +1,207 @@
+/* *********************************************************************
+ * Reader for the binary telemetry files
+ * *********************************************************************
+ * COMMENTS:
+ * Exports a file written by
+ *     ./cpu_opt_control.o --record file [records]
+ * to CSV (default, to standard output or --csv out) or to a NumPy .npy
+ * file (--npy out) holding a structured array with the raw record
+ * fields. k_p/k_d are always in the single-channel packing, whatever the
+ * register map; the channel column is the channel index in the map.
+ * Records are written oldest first; records overwritten or
+ * being written while the file is read are skipped. The file may be
+ * read while the control program is still recording.
+ *
+ * Compile with
+ *     gcc telemetry_dump.c -o telemetry_dump.o
+ * *********************************************************************
+ */
+
+////////////////////////////////////////////////////////////////////////
+// Libraries
+#include <stdlib.h>      // general functions and variable types
+#include <stdio.h>       // standard input/output
+#include <stdint.h>      // more integer lengths
+#include <unistd.h>      // symbolic constants/types
+#include <sys/mman.h>    // memory management
+#include <sys/stat.h>    // file size
+#include <fcntl.h>       // file control (open...)
+#include <string.h>      // strings package
+#include "rp_regs.h"     // FPGA register layout
+#include "rp_telemetry.h" // telemetry file layout
+
+////////////////////////////////////////////////////////////////////////
+// Settings
+#define NPY_HEADER_MAX      512         // .npy header buffer (bytes)
+
+////////////////////////////////////////////////////////////////////////
+// Functions
+
+// Write the .npy header (format version 1.0) for n records
+//
+// The dtype mirrors struct rp_tel_record field by field (no padding).
+// The count is printed at a fixed width, so the header has the same
+// size for any n and can be rewritten once the records are written.
+//
+int npy_header(FILE *out, uint64_t n){
+    char header[NPY_HEADER_MAX];
+    int len;
+    size_t size;
+
+    len = snprintf(header + 10, sizeof(header) - 10,
+                   "{'descr': [('t_ns', '<u8'), ('seq', '<u4'), ('energy', '<u4'), ('pid', '<u4'), "
+                   "('delay', '<u4'), ('iter', '<u4'), ('tuner', '<u2'), ('channel', '<u2')], "
+                   "'fortran_order': False, 'shape': (%20llu,), }", (unsigned long long) n);
+    // magic, length, dictionary and newline, space-padded to 64 bytes
+    size = (10 + len + 1 + 63) & ~(size_t) 63;
+    memcpy(header, "\x93NUMPY\x01\x00", 8);
+    header[8] = (size - 10) & 0xFF;
+    header[9] = (size - 10) >> 8;
+    memset(header + 10 + len, ' ', size - 10 - len);
+    header[size - 1] = '\n';
+    fwrite(header, 1, size, out);
+    // end function normally
+    return 0;
+}
+
+// Copy record i out of the ring; returns 1 if it is not valid
+//
+int read_record(struct rp_tel_record *ring, uint64_t capacity, uint64_t i, struct rp_tel_record *rec){
+    volatile struct rp_tel_record *slot = &ring[i % capacity];
+
+    if(slot->seq != (uint32_t) (i + 1)){
+        return 1;
+    }
+    atomic_thread_fence(memory_order_acquire);
+    rec->t_ns = slot->t_ns;
+    rec->seq = slot->seq;
+    rec->energy = slot->energy;
+    rec->pid = slot->pid;
+    rec->delay = slot->delay;
+    rec->iter = slot->iter;
+    rec->tuner = slot->tuner;
+    rec->channel = slot->channel;
+    atomic_thread_fence(memory_order_acquire);
+    // overwritten while copying
+    return slot->seq != (uint32_t) (i + 1);
+}
+
+////////////////////////////////////////////////////////////////////////
+// Main loop
+//
+int main(int argc, char **argv){
+
+    ////////////////////////////////////////////////////////////////////
+    // Program variables
+    const char *in_file = NULL; // telemetry file
+    const char *out_file = NULL; // output file (NULL: standard output)
+    int npy = 0; // 1: NumPy output, 0: CSV
+    int fd; // file identifier
+    struct stat st;
+    void *map;
+    struct rp_tel_header *hdr;
+    struct rp_tel_record *ring, rec;
+    uint64_t head, first, n_valid;
+    FILE *out;
+    const char *tuners[] = {"none", "mlauto", "spsa", "bo", "delay", "es", "schedule", "sweep"};
+
+    ////////////////////////////////////////////////////////////////////
+    // Parse arguments
+    for(int i = 1; i < argc; i++){
+        if(0 == strcmp(argv[i], "--csv") && i + 1 < argc){
+            out_file = argv[++i];
+            npy = 0;
+        } else if(0 == strcmp(argv[i], "--npy") && i + 1 < argc){
+            out_file = argv[++i];
+            npy = 1;
+        } else if(argv[i][0] != '-' && in_file == NULL){
+            in_file = argv[i];
+        } else {
+            in_file = NULL;
+            break;
+        }
+    }
+    if(in_file == NULL || (npy && out_file == NULL)){
+        printf("Usage: %s file [--csv out.csv | --npy out.npy]\n", argv[0]);
+        return 1;
+    }
+
+    ////////////////////////////////////////////////////////////////////
+    // Map telemetry file
+    fd = open(in_file, O_RDONLY);
+    if(fd < 0 || fstat(fd, &st) != 0){
+        perror("open");
+        return 1;
+    }
+    if((size_t) st.st_size < RP_TEL_HEADER_SIZE){
+        printf("%s is not a telemetry file\n", in_file);
+        return 1;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if(map == MAP_FAILED){
+        perror("mmap");
+        return 1;
+    }
+    hdr = (struct rp_tel_header *) map;
+    if(memcmp(hdr->magic, RP_TEL_MAGIC, sizeof(hdr->magic)) != 0 || hdr->version != RP_TEL_VERSION ||
+       hdr->record_size != sizeof(struct rp_tel_record) || hdr->capacity == 0 ||
+       RP_TEL_HEADER_SIZE + hdr->capacity*sizeof(struct rp_tel_record) > (uint64_t) st.st_size){
+        printf("%s is not a telemetry file (or has another version)\n", in_file);
+        return 1;
+    }
+    ring = (struct rp_tel_record *) ((char *) map + RP_TEL_HEADER_SIZE);
+
+    // oldest record still in the ring
+    head = atomic_load_explicit(&hdr->head, memory_order_acquire);
+    first = (head > hdr->capacity) ? head - hdr->capacity : 0;
+
+    ////////////////////////////////////////////////////////////////////
+    // Export
+    out = (out_file != NULL) ? fopen(out_file, npy ? "wb" : "w") : stdout;
+    if(out == NULL){
+        perror("fopen");
+        return 1;
+    }
+    n_valid = 0;
+    if(npy){
+        // a single pass over the ring (records may be overwritten while
+        // it is read), then the header is rewritten with the real count
+        npy_header(out, 0);
+        for(uint64_t i = first; i < head; i++){
+            if(read_record(ring, hdr->capacity, i, &rec) == 0){
+                fwrite(&rec, sizeof(rec), 1, out);
+                n_valid++;
+            }
+        }
+        if(fseek(out, 0, SEEK_SET) != 0){
+            perror("fseek");
+            return 1;
+        }
+        npy_header(out, n_valid);
+    } else {
+        fprintf(out, "t_s,energy,k_p,k_d,delay,tuner,active,iter,channel\n");
+        for(uint64_t i = first; i < head; i++){
+            if(read_record(ring, hdr->capacity, i, &rec) != 0){
+                continue;
+            }
+            fprintf(out, "%.6f,%u,%d,%d,%u,%s,%d,%u,%u\n",
+                    (double) (int64_t) (rec.t_ns - hdr->t_start_ns)*1e-9, rec.energy,
+                    rp_pid_kp(rec.pid), rp_pid_kd(rec.pid), rec.delay & 0x0000FFFF,
+                    tuners[(rec.tuner & RP_TEL_TUNER_KIND) <= 7 ? (rec.tuner & RP_TEL_TUNER_KIND) : 0],
+                    (rec.tuner & RP_TEL_TUNER_ACTIVE) != 0, rec.iter, rec.channel);
+            n_valid++;
+        }
+    }
+    fprintf(stderr, "%llu records exported (%llu written, %llu kept)\n", (unsigned long long) n_valid,
+            (unsigned long long) head, (unsigned long long) (head - first));
+
+    ////////////////////////////////////////////////////////////////////
+    // End routine
+    if(out != stdout){
+        fclose(out);
+    }
+    munmap(map, st.st_size);
+    close(fd);
+    // End routine normally
+    return 0;
+}
@@ -0,0 +1,86 @@
+/* *********************************************************************
+ * Tests of the register map parser (rp_regs.h)
+ * *********************************************************************
+ * COMMENTS:
+ * Writes small map files to a temporary directory and checks that
+ * rp_map_load accepts or rejects them. Prints one line per case and
+ * exits with 1 if any case fails.
+ *
+ * Compile and run with
+ *     gcc test_rp_map.c -o test_rp_map.o && ./test_rp_map.o
+ * *********************************************************************
+ */
+
+////////////////////////////////////////////////////////////////////////
+// Libraries
+#include <stdlib.h>      // general functions and variable types
+#include <stdio.h>       // standard input/output
+#include <unistd.h>      // symbolic constants/types
+#include <string.h>      // strings package
+#include "rp_regs.h"     // FPGA register layout
+
+////////////////////////////////////////////////////////////////////////
+// Functions
+
+// Write n channel lines (each with its own words) and a trailer to path
+//
+int write_map(const char *path, int n, const char *trailer){
+    FILE *f = fopen(path, "w");
+
+    if(f == NULL){
+        perror("fopen");
+        return 1;
+    }
+    fprintf(f, "# name delay energy pid\n");
+    for(int c = 0; c < n; c++){
+        fprintf(f, "ch%d 0x%X 0x%X 0x%X\n", c, 0x41200000 + 16*c, 0x41200008 + 16*c, 0x42000000 + 16*c);
+    }
+    fputs(trailer, f);
+    fclose(f);
+    // end function normally
+    return 0;
+}
+
+// Load a map written by write_map; returns 1 if the outcome is not the
+// expected one (err: 1 if the map must be rejected, else n_expected
+// channels)
+//
+int check_map(const char *dir, const char *name, int n, const char *trailer, int err, int n_expected){
+    char path[512];
+    struct rp_map map;
+    int got;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    if(write_map(path, n, trailer) != 0){
+        return 1;
+    }
+    got = rp_map_load(&map, path, stdout);
+    unlink(path);
+    if(got != err || (!err && map.n != n_expected)){
+        printf("FAIL %s: returned %d with %d channels, expected %d with %d\n", name, got, map.n, err, n_expected);
+        return 1;
+    }
+    printf("ok   %s\n", name);
+    // end function normally
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////
+// Main
+//
+int main(void){
+    char dir[] = "/tmp/test_rp_map.XXXXXX";
+    int failed = 0;
+
+    if(mkdtemp(dir) == NULL){
+        perror("mkdtemp");
+        return 1;
+    }
+    failed += check_map(dir, "eight_channels", RP_MAX_CHANNELS, "", 0, RP_MAX_CHANNELS);
+    failed += check_map(dir, "eight_channels_trailing_comment", RP_MAX_CHANNELS, "# spare axes\n\n", 0, RP_MAX_CHANNELS);
+    failed += check_map(dir, "too_many_channels", RP_MAX_CHANNELS + 1, "", 1, 0);
+    failed += check_map(dir, "no_channels", 0, "# nothing\n", 1, 0);
+    rmdir(dir);
+    printf("%d case%s failed\n", failed, (failed == 1) ? "" : "s");
+    return (failed > 0);
+}